@@ -6,13 +6,425 @@
 */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
+#include <stdio.h>
+
 #include "platform.h"
 #include "bloblist.h"
 
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+
+/* Shared blobs
+ * ***************************************************************** */
+
+/* A shared blob is a header immediately followed by the data; the pointer
+   handed out points to the data.  The header size is rounded up so that the
+   data are as well aligned as with malloc .
+
+   The header and the data of a heap blob are one malloc allocation.  A
+   file-backed blob is a mapping of three parts: one anonymous page ending
+   with the header, the file mapped read-only, and one more anonymous page,
+   so that the data are followed by zeroes like those of heap blobs. */
+struct shared_blob_header {
+    size_t reference_count;
+    size_t size;
+    char *file_path;                    /* NULL unless file-backed */
+    void *mapping;                      /* NULL unless mapped */
+    size_t mapping_size;
+};
+union shared_blob_alignment {
+    long double ld;
+    long long ll;
+    void *p;
+    void (*f)(void);
+};
+#define SHARED_BLOB_HEADER_SIZE                                         \
+    ((sizeof(struct shared_blob_header)                                 \
+      + sizeof(union shared_blob_alignment) - 1)                        \
+     / sizeof(union shared_blob_alignment)                              \
+     * sizeof(union shared_blob_alignment))
+#define SHARED_BLOB_HEADER(blob)                                        \
+    ((struct shared_blob_header *) ((char *) (blob)                     \
+                                    - SHARED_BLOB_HEADER_SIZE))
+
+/* Protects every reference count.  Reference counts change seldom compared to
+   the work done with the data, so one lock for all of them is enough. */
+static pEp_mutex_t shared_blob_mutex = PEP_MUTEX_INITIALIZER;
+
+DYNAMIC_API char *new_shared_blob(size_t size)
+{
+    char *allocation = calloc(1, SHARED_BLOB_HEADER_SIZE + size + 1);
+    if (allocation == NULL)
+        return NULL;
+
+    char *blob = allocation + SHARED_BLOB_HEADER_SIZE;
+    SHARED_BLOB_HEADER(blob)->reference_count = 1;
+    SHARED_BLOB_HEADER(blob)->size = size;
+    return blob;
+}
+
+DYNAMIC_API void release_shared_blob(char *blob)
+{
+    if (blob == NULL)
+        return;
+
+    struct shared_blob_header *header = SHARED_BLOB_HEADER(blob);
+    pEp_mutex_lock(& shared_blob_mutex);
+    assert(header->reference_count > 0);
+    bool last = (-- header->reference_count == 0);
+    pEp_mutex_unlock(& shared_blob_mutex);
+    if (! last)
+        return;
+
+    free(header->file_path);
+#ifndef WIN32
+    if (header->mapping != NULL) {
+        munmap(header->mapping, header->mapping_size);
+        return;
+    }
+#endif
+    free(header);
+}
+
+/**
+ * @internal
+ * @brief Take one more reference to a shared blob, and return it.
+ */
+static char *reference_shared_blob(char *blob)
+{
+    pEp_mutex_lock(& shared_blob_mutex);
+    SHARED_BLOB_HEADER(blob)->reference_count ++;
+    pEp_mutex_unlock(& shared_blob_mutex);
+    return blob;
+}
+
+size_t shared_blob_reference_count(const char *blob)
+{
+    if (blob == NULL)
+        return 0;
+
+    pEp_mutex_lock(& shared_blob_mutex);
+    size_t result = SHARED_BLOB_HEADER(blob)->reference_count;
+    pEp_mutex_unlock(& shared_blob_mutex);
+    return result;
+}
+
+DYNAMIC_API bool bloblist_is_shared(const bloblist_t *blob)
+{
+    return (blob != NULL && blob->value != NULL
+            && blob->release_value == release_shared_blob);
+}
+
+/**
+ * @internal
+ * @brief Release the blob of a bloblist element, in whatever way it needs.
+ */
+static void release_blob_value(bloblist_t *blob)
+{
+    if (blob->release_value)
+        blob->release_value(blob->value);
+    else
+        free(blob->value);
+}
+
+DYNAMIC_API PEP_STATUS bloblist_share(bloblist_t *bloblist)
+{
+    bloblist_t *curr;
+    for (curr = bloblist; curr != NULL; curr = curr->next) {
+        if (curr->value == NULL || bloblist_is_shared(curr))
+            continue;
+
+        char *shared = new_shared_blob(curr->size);
+        if (shared == NULL)
+            return PEP_OUT_OF_MEMORY;
+        memcpy(shared, curr->value, curr->size);
+        release_blob_value(curr);
+        curr->value = shared;
+        curr->release_value = release_shared_blob;
+    }
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API char *bloblist_writable_value(bloblist_t *blob)
+{
+    if (blob == NULL || blob->value == NULL)
+        return NULL;
+    if (! bloblist_is_shared(blob)
+        || (shared_blob_reference_count(blob->value) == 1
+            && SHARED_BLOB_HEADER(blob->value)->mapping == NULL))
+        return blob->value;
+
+    /* Somebody else refers to the same data, or they are mapped read-only:
+       copy on write. */
+    char *copy = malloc(blob->size + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, blob->value, blob->size);
+    copy[blob->size] = '\0';
+    release_shared_blob(blob->value);
+    blob->value = copy;
+    blob->release_value = NULL;
+    return copy;
+}
+
+
+/* File-backed blobs
+ * ***************************************************************** */
+
+/**
+ * @internal
+ * @brief Get the size of an open file.  This does not go through ftell ,
+ *        whose long result cannot hold sizes of 2 GB and more on Windows and
+ *        on 32-bit systems.
+ *
+ * @retval PEP_STATUS_OK        success
+ * @retval PEP_ILLEGAL_VALUE    the size cannot be read
+ * @retval PEP_OUT_OF_MEMORY    the file is too large for the address space
+ */
+static PEP_STATUS get_file_size(FILE *file, size_t *size)
+{
+#ifdef WIN32
+    struct __stat64 file_status;
+    if (_fstat64(_fileno(file), & file_status) != 0
+        || file_status.st_size < 0)
+        return PEP_ILLEGAL_VALUE;
+#else
+    struct stat file_status;
+    if (fstat(fileno(file), & file_status) != 0
+        || file_status.st_size < 0)
+        return PEP_ILLEGAL_VALUE;
+#endif
+    /* No address space has room for more, and this leaves room for headers
+       and guard pages without overflow. */
+    if ((uintmax_t) file_status.st_size > SIZE_MAX / 2)
+        return PEP_OUT_OF_MEMORY;
+
+    * size = (size_t) file_status.st_size;
+    return PEP_STATUS_OK;
+}
+
+/**
+ * @internal
+ * @brief Read the whole file into a new heap shared blob; this is the fallback
+ *        where files cannot be mapped.
+ */
+static PEP_STATUS read_file_blob(FILE *file, size_t size, char **blob)
+{
+    char *data = new_shared_blob(size);
+    if (data == NULL)
+        return PEP_OUT_OF_MEMORY;
+    if (size > 0 && fread(data, 1, size, file) != size) {
+        release_shared_blob(data);
+        return PEP_ILLEGAL_VALUE;
+    }
+    * blob = data;
+    return PEP_STATUS_OK;
+}
+
+#ifndef WIN32
+/**
+ * @internal
+ * @brief Map size bytes of the open file as a shared blob.
+ */
+static PEP_STATUS map_file_descriptor(int fd, size_t size, char **blob)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t data_size = (size + page_size - 1) / page_size * page_size;
+    size_t mapping_size = page_size + data_size + page_size;
+
+    char *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return PEP_OUT_OF_MEMORY;
+    char *data = mmap(mapping + page_size, size, PROT_READ,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (data == MAP_FAILED) {
+        munmap(mapping, mapping_size);
+        return PEP_OUT_OF_MEMORY;
+    }
+
+    struct shared_blob_header *header = SHARED_BLOB_HEADER(data);
+    header->reference_count = 1;
+    header->size = size;
+    header->file_path = NULL;
+    header->mapping = mapping;
+    header->mapping_size = mapping_size;
+    * blob = data;
+    return PEP_STATUS_OK;
+}
+#endif
+
+DYNAMIC_API PEP_STATUS map_file_blob(const char *path, char **blob,
+                                     size_t *size)
+{
+    if (! (path && blob && size))
+        return PEP_ILLEGAL_VALUE;
+    * blob = NULL;
+    * size = 0;
+
+    char *file_path = strdup(path);
+    if (file_path == NULL)
+        return PEP_OUT_OF_MEMORY;
+
+    PEP_STATUS status;
+    char *data = NULL;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        status = PEP_ILLEGAL_VALUE;
+        goto end;
+    }
+    size_t length;
+    status = get_file_size(file, & length);
+    if (status != PEP_STATUS_OK)
+        goto end;
+
+#ifndef WIN32
+    /* Empty files cannot be mapped. */
+    if (length > 0)
+        status = map_file_descriptor(fileno(file), length, & data);
+    else
+#endif
+        status = read_file_blob(file, length, & data);
+    if (status != PEP_STATUS_OK)
+        goto end;
+
+    SHARED_BLOB_HEADER(data)->file_path = file_path;
+    file_path = NULL;
+    * blob = data;
+    * size = length;
+
+ end:
+    if (file != NULL)
+        fclose(file);
+    free(file_path);
+    return status;
+}
+
+DYNAMIC_API const char *blob_file_path(const bloblist_t *blob)
+{
+    if (! bloblist_is_shared(blob))
+        return NULL;
+    return SHARED_BLOB_HEADER(blob->value)->file_path;
+}
+
+/**
+ * @internal
+ * @brief Write a blob into a new file with a unique name in the given
+ *        directory, returning a malloc-allocated copy of its path.
+ */
+static PEP_STATUS write_blob_file(const char *directory, const char *data,
+                                  size_t size, char **path)
+{
+    static const char template_name[] = "pEp.XXXXXX";
+    size_t directory_length = strlen(directory);
+    char *file_path = malloc(directory_length + 1 + sizeof(template_name));
+    if (file_path == NULL)
+        return PEP_OUT_OF_MEMORY;
+    memcpy(file_path, directory, directory_length);
+#ifdef WIN32
+    file_path[directory_length] = '\\';
+#else
+    file_path[directory_length] = '/';
+#endif
+    memcpy(file_path + directory_length + 1, template_name,
+           sizeof(template_name));
+
+    /* mkstemp makes files only the user can read, as befits plaintext. */
+    int fd = mkstemp(file_path);
+    if (fd < 0) {
+        free(file_path);
+        return PEP_CANNOT_CREATE_TEMP_FILE;
+    }
+#ifdef WIN32
+    _setmode(fd, _O_BINARY);
+    FILE *file = _fdopen(fd, "wb");
+#else
+    FILE *file = fdopen(fd, "wb");
+#endif
+    bool written = (file != NULL
+                    && fwrite(data, 1, size, file) == size);
+    if (file != NULL)
+        written = (fclose(file) == 0) && written;
+    if (! written) {
+        remove(file_path);
+        free(file_path);
+        return PEP_CANNOT_CREATE_TEMP_FILE;
+    }
+
+    * path = file_path;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS bloblist_store_in_directory(bloblist_t *bloblist,
+                                                   const char *directory,
+                                                   size_t min_size)
+{
+    if (directory == NULL || directory[0] == '\0')
+        return PEP_ILLEGAL_VALUE;
+
+    bloblist_t *curr;
+    for (curr = bloblist; curr != NULL; curr = curr->next) {
+        if (curr->value == NULL || curr->size < min_size
+            || blob_file_path(curr) != NULL)
+            continue;
+
+        char *path = NULL;
+        PEP_STATUS status = write_blob_file(directory, curr->value,
+                                            curr->size, & path);
+        if (status != PEP_STATUS_OK)
+            return status;
+        char *mapped = NULL;
+        size_t size = 0;
+        status = map_file_blob(path, & mapped, & size);
+        if (status != PEP_STATUS_OK) {
+            remove(path);
+            free(path);
+            return status;
+        }
+        free(path);
+
+        release_blob_value(curr);
+        curr->value = mapped;
+        curr->release_value = release_shared_blob;
+    }
+    return PEP_STATUS_OK;
+}
+
+char *bloblist_value_dup(const bloblist_t *blob,
+                         void (**release_value)(char *))
+{
+    assert(blob && release_value);
+
+    if (bloblist_is_shared(blob)) {
+        * release_value = release_shared_blob;
+        return reference_shared_blob(blob->value);
+    }
+
+    * release_value = NULL;
+    char *copy = malloc(blob->size);
+    if (copy != NULL && blob->size > 0)
+        memcpy(copy, blob->value, blob->size);
+    return copy;
+}
+
+
+/* Bloblists
+ * ***************************************************************** */
+
 /**
  * @internal
  * @brief TODO
@@ -79,10 +491,7 @@ DYNAMIC_API void free_bloblist(bloblist_t *bloblist)
 
     while (curr) {
         bloblist_t *next = curr->next;
-        if (curr->release_value)
-            curr->release_value(curr->value);
-        else
-            free(curr->value);
+        release_blob_value(curr);
         free(curr->mime_type);
         free(curr->filename);
         free(curr);
@@ -102,20 +511,20 @@ DYNAMIC_API bloblist_t *bloblist_dup(const bloblist_t *src)
     const bloblist_t* src_curr = src;
 
     char* blob2 = NULL;
+    void (*release_value)(char *) = NULL;
 
     for ( ; src_curr; src_curr = src_curr->next, dst_curr_ptr = &((*dst_curr_ptr)->next)) {
-        blob2 = malloc(src_curr->size);
+        // Shared blobs get another reference, all others are copied
+        blob2 = bloblist_value_dup(src_curr, &release_value);
 
         assert(blob2);
         if (blob2 == NULL)
             goto enomem;
 
-        // This is why we don't calloc
-        memcpy(blob2, src_curr->value, src_curr->size);
-
         *dst_curr_ptr = new_bloblist(blob2, src_curr->size, src_curr->mime_type, src_curr->filename);
         if (*dst_curr_ptr == NULL)
             goto enomem;
+        (*dst_curr_ptr)->release_value = release_value;
     }
 
     if (!head_ptr)
@@ -124,7 +533,10 @@ DYNAMIC_API bloblist_t *bloblist_dup(const bloblist_t *src)
     return head_ptr;
 
 enomem:
-    free(blob2);
+    if (release_value)
+        release_value(blob2);
+    else
+        free(blob2);
     free_bloblist(head_ptr);
     return NULL;
 }
@@ -154,6 +566,9 @@ DYNAMIC_API bloblist_t *bloblist_add(bloblist_t *bloblist, char *blob, size_t si
 
     bloblist_t* list_curr = bloblist;
     void (*release_value)(char *) = list_curr->release_value;
+    // Being shared is a property of one blob, not of the whole list
+    if (release_value == release_shared_blob)
+        release_value = NULL;
 
     while (list_curr->next)
         list_curr = list_curr->next;
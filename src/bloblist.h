@@ -9,7 +9,9 @@
 #define BLOBLIST_H
 
 #include <stddef.h> 
+#include <stdbool.h>
 
+#include "pEpEngine.h"
 #include "dynamic_api.h"
 #include "stringpair.h"
 
@@ -101,7 +103,8 @@ DYNAMIC_API void free_bloblist(bloblist_t *bloblist);
  *  
  *  @retval pointer to a new bloblist_t or NULL if out of memory
  *  
- *  @warning this is an expensive operation because all blobs are copied
+ *  @warning this is an expensive operation because all blobs are copied,
+ *           except shared blobs, which get another reference instead
  *  
  */
 
@@ -187,6 +190,211 @@ DYNAMIC_API void set_blob_disposition(bloblist_t* blob,
  */
 DYNAMIC_API bloblist_t* bloblist_join(bloblist_t* first, bloblist_t* second);
 
+
+/* Shared blobs
+ * ***************************************************************** */
+
+/* A shared blob is immutable, reference-counted blob storage: duplicating a
+   bloblist element holding a shared blob takes another reference instead of
+   copying the data, so that one large attachment is held in memory once
+   however many messages refer to it.  A shared blob is released with
+   release_shared_blob , which is what release_value is set to in every
+   bloblist element holding one; it is freed when its last reference goes.
+
+   Shared blobs must not be modified in place: code which wants to change the
+   data gets a private copy first, with bloblist_writable_value .  The
+   reference count is safe to use from several threads. */
+
+/**
+ *  <!--       new_shared_blob()       -->
+ *
+ *  @brief Allocate zero-filled shared blob storage, with one reference
+ *
+ *  @param[in]   size         size of the blob
+ *
+ *  @retval pointer to the blob data, which are followed by a terminating 0
+ *  @retval NULL if out of memory
+ *
+ *  @ownership the caller owns the one reference; it is usually given to a
+ *             bloblist element together with release_value set to
+ *             release_shared_blob
+ *
+ */
+
+DYNAMIC_API char *new_shared_blob(size_t size);
+
+
+/**
+ *  <!--       release_shared_blob()       -->
+ *
+ *  @brief Drop one reference to a shared blob, freeing it after the last one
+ *
+ *  @param[in]   blob         shared blob data or NULL
+ *
+ */
+
+DYNAMIC_API void release_shared_blob(char *blob);
+
+
+/**
+ *  <!--       bloblist_share()       -->
+ *
+ *  @brief Turn every blob in bloblist into a shared blob, so that later
+ *         duplications do not copy it
+ *
+ *  @param[in,out]   bloblist     bloblist to change
+ *
+ *  @retval PEP_STATUS_OK       success
+ *  @retval PEP_OUT_OF_MEMORY   out of memory; the elements done before stay
+ *                              shared
+ *
+ *  @note Each blob which is not shared yet is copied once and its original
+ *        released; data allocated with new_shared_blob in the first place
+ *        are never copied.
+ *
+ */
+
+DYNAMIC_API PEP_STATUS bloblist_share(bloblist_t *bloblist);
+
+
+/**
+ *  <!--       bloblist_is_shared()       -->
+ *
+ *  @brief Tell whether a bloblist element holds a shared blob
+ *
+ *  @param[in]   blob         bloblist element
+ *
+ */
+
+DYNAMIC_API bool bloblist_is_shared(const bloblist_t *blob);
+
+
+/**
+ *  <!--       bloblist_writable_value()       -->
+ *
+ *  @brief Get the blob of a bloblist element for modifying it: a shared blob
+ *         also referred to elsewhere is copied first ("copy on write"), and
+ *         the element gets the private copy
+ *
+ *  @param[in,out]   blob         bloblist element
+ *
+ *  @retval pointer to the blob data, which may be modified in place
+ *  @retval NULL if out of memory or blob holds no data
+ *
+ */
+
+DYNAMIC_API char *bloblist_writable_value(bloblist_t *blob);
+
+
+
+/* File-backed blobs
+ * ***************************************************************** */
+
+/* A file-backed blob is a shared blob whose data are a read-only memory
+   mapping of a file, so that even a very large attachment does not take up
+   heap memory: pages are read from the file when used, and may be dropped
+   again by the system.  Everything which works on shared blobs works on
+   file-backed blobs, including encryption, MIME encoding and bloblist_dup ;
+   bloblist_writable_value always gives a heap copy.
+
+   The file must not be truncated or modified while it is mapped.  Where
+   mapping is not available the file is read into a heap shared blob. */
+
+/**
+ *  <!--       map_file_blob()       -->
+ *
+ *  @brief Make a file-backed shared blob of the file at the given path
+ *
+ *  @param[in]   path         path of the file
+ *  @param[out]  blob         the blob data, followed by a terminating 0
+ *  @param[out]  size         size of the blob
+ *
+ *  @retval PEP_STATUS_OK       success
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values, or the file cannot
+ *                              be read
+ *  @retval PEP_OUT_OF_MEMORY   out of memory or address space
+ *
+ *  @ownership the caller owns the one reference; it is usually given to a
+ *             bloblist element together with release_value set to
+ *             release_shared_blob .  The file itself is never deleted.
+ *
+ */
+
+DYNAMIC_API PEP_STATUS map_file_blob(const char *path, char **blob,
+                                     size_t *size);
+
+
+/**
+ *  <!--       blob_file_path()       -->
+ *
+ *  @brief Return the path of the file backing a bloblist element
+ *
+ *  @param[in]   blob         bloblist element
+ *
+ *  @retval the path, or NULL if the blob is not file-backed
+ *
+ *  @ownership the path belongs to the blob
+ *
+ */
+
+DYNAMIC_API const char *blob_file_path(const bloblist_t *blob);
+
+
+/**
+ *  <!--       bloblist_store_in_directory()       -->
+ *
+ *  @brief Move every blob of at least the given size out of memory, into a
+ *         new file in the given directory, and replace it with a
+ *         file-backed blob of that file
+ *
+ *  @param[in,out]   bloblist     bloblist to change
+ *  @param[in]       directory    existing directory for the new files
+ *  @param[in]       min_size     smaller blobs stay where they are
+ *
+ *  @retval PEP_STATUS_OK                   success
+ *  @retval PEP_ILLEGAL_VALUE               illegal parameter values
+ *  @retval PEP_CANNOT_CREATE_TEMP_FILE     a file cannot be written; the
+ *                                          blobs done before are file-backed
+ *  @retval PEP_OUT_OF_MEMORY               out of memory
+ *
+ *  @note The files get unique names, unrelated to the filename field, and
+ *        can only be read by the user.  They are never deleted by the
+ *        engine: the caller finds them with blob_file_path .
+ *
+ */
+
+DYNAMIC_API PEP_STATUS bloblist_store_in_directory(bloblist_t *bloblist,
+                                                   const char *directory,
+                                                   size_t min_size);
+
+
+/**
+ *  @internal
+ *  <!--       bloblist_value_dup()       -->
+ *
+ *  @brief Duplicate the blob of a bloblist element, taking a new reference
+ *         for a shared blob and copying any other blob
+ *
+ *  @param[in]   blob           bloblist element
+ *  @param[out]  release_value  the release function to set in the element
+ *                              which gets the duplicate
+ *
+ *  @retval the duplicate, or NULL if out of memory
+ */
+char *bloblist_value_dup(const bloblist_t *blob,
+                         void (**release_value)(char *));
+
+
+/**
+ *  @internal
+ *  <!--       shared_blob_reference_count()       -->
+ *
+ *  @brief Return the number of references to a shared blob, for tests and
+ *         debugging
+ */
+size_t shared_blob_reference_count(const char *blob);
+
+
 /**
  * <!-- find_blob_by_URI() -->
  * @brief Search bloblist for member with member->filename == uri
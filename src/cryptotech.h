@@ -220,6 +220,50 @@ typedef PEP_STATUS (*find_private_keys_t)(
     PEP_SESSION session, const char *pattern, stringlist_t **keylist
 );
 
+/**
+ *  @enum    PEP_key_status_fields
+ *
+ *  @brief   Which fields of a PEP_key_status a caller needs
+ *
+ */
+typedef enum _PEP_key_status_fields {
+    PEP_key_status_private = 0x01,      ///< has_private
+    PEP_key_status_rating = 0x02,       ///< comm_type
+    PEP_key_status_revoked = 0x04,      ///< revoked
+    PEP_key_status_expired = 0x08,      ///< expired
+    PEP_key_status_created = 0x10,      ///< created
+    PEP_key_status_all = 0x1f
+} PEP_key_status_fields;
+
+/**
+ *  @struct    PEP_key_status
+ *
+ *  @brief     What the engine needs to know about one key, as found by one
+ *             lookup in the key store
+ *
+ */
+typedef struct _PEP_key_status {
+    bool has_private;           ///< as for contains_priv_key()
+    PEP_comm_type comm_type;    ///< as for get_key_rating() ; PEP_ct_unknown
+                                ///< if the rating is not available
+    bool revoked;               ///< as for key_revoked()
+    bool expired;               ///< as for key_expired() at the given time;
+                                ///< false if revoked was found to be true
+    time_t created;             ///< as for key_created()
+} PEP_key_status;
+
+/**
+ *  @brief Signature for crypto drivers to implement for get_key_status()
+ *
+ *  Drivers fill every field of key_status looking the key up once, and
+ *  return PEP_KEY_NOT_FOUND if there is no such key.  This is optional: for a
+ *  driver without it the engine calls the single-field functions.
+ *
+ *  @see get_key_status()
+ */
+typedef PEP_STATUS (*get_key_status_t)(PEP_SESSION session, const char *fpr,
+        time_t when, PEP_key_status *key_status);
+
 /**
  *  @brief Signature for crypto drivers to implement for config_cipher_suite()
  *  @copydoc config_cipher_suite()
@@ -262,6 +306,7 @@ typedef struct _PEP_cryptotech_t {
     contains_priv_key_t contains_priv_key;
     find_private_keys_t find_private_keys;
     config_cipher_suite_t config_cipher_suite;
+    get_key_status_t get_key_status;    ///< optional, may be NULL
 } PEP_cryptotech_t;
 
 extern PEP_cryptotech_t cryptotech[PEP_crypt__count]; ///< array of all supported cryptotech drivers/interfaces (?)
@@ -0,0 +1,417 @@
+/**
+ * @file    decrypt_cache.c
+ * @brief   Decrypt result cache: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#define _EXPORT_PEP_ENGINE_DLL
+#include "decrypt_cache.h"
+
+#include "pEp_internal.h"
+#include "engine_sql.h"
+#include "pEp_metrics.h"
+#include "pEp_rmd160.h"
+#include "pEp_arena.h"
+
+#include <string.h>
+#include <time.h>
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/* One cached decryption result. */
+struct decrypt_cache_entry {
+    unsigned char digest[20];
+    char *message_id;
+
+    /* The process change generation in which the result was valid, and when
+       the entry was made. */
+    uint64_t generation;
+    time_t creation_time;
+
+    /* An estimate of the memory held by this entry. */
+    size_t size;
+
+    /* The decryption result.  dst is only read: it lives in dst_arena, which
+       is cheaper to make and to free than a heap copy and has an exact
+       size. */
+    PEP_STATUS status;
+    pEp_arena *dst_arena;
+    message *dst;
+    stringlist_t *keylist;
+    PEP_decrypt_flags_t flags;
+    PEP_rating src_rating;
+
+    /* The next entry in the same hash bucket. */
+    struct decrypt_cache_entry *bucket_next;
+
+    /* Neighbours in the list of every entry, from the most to the least
+       recently used. */
+    struct decrypt_cache_entry *more_recent;
+    struct decrypt_cache_entry *less_recent;
+};
+
+#define DECRYPT_CACHE_BUCKET_NO 1024
+
+/* The cache, shared by every session in the process.  Everything is protected
+   by the mutex.  Statically initialised as disabled and empty. */
+static pEp_mutex_t decrypt_cache_mutex = PEP_MUTEX_INITIALIZER;
+static struct decrypt_cache {
+    size_t size_budget;                 /* 0 when disabled */
+    unsigned int ttl_in_seconds;        /* 0 for no limit */
+    size_t used_size;
+    struct decrypt_cache_entry *buckets[DECRYPT_CACHE_BUCKET_NO];
+    struct decrypt_cache_entry *most_recent;
+    struct decrypt_cache_entry *least_recent;
+} decrypt_cache;
+
+
+/* Entries
+ * ***************************************************************** */
+
+static void free_decrypt_cache_entry(struct decrypt_cache_entry *entry)
+{
+    if (entry == NULL)
+        return;
+
+    free(entry->message_id);
+    pEp_arena_free(entry->dst_arena);
+    free_stringlist(entry->keylist);
+    free(entry);
+}
+
+static size_t decrypt_cache_bucket_index(const unsigned char *digest)
+{
+    return (digest[0] | (digest[1] << 8)) % DECRYPT_CACHE_BUCKET_NO;
+}
+
+/* The functions in this section expect the mutex to be held. */
+
+static struct decrypt_cache_entry *decrypt_cache_find(
+        const unsigned char *digest, const char *message_id)
+{
+    struct decrypt_cache_entry *entry;
+    for (entry = decrypt_cache.buckets[decrypt_cache_bucket_index(digest)];
+         entry != NULL; entry = entry->bucket_next)
+        if (memcmp(entry->digest, digest, sizeof(entry->digest)) == 0
+            && strcmp(entry->message_id, message_id) == 0)
+            return entry;
+    return NULL;
+}
+
+/* Unlink the given entry from its bucket and from the recency list. */
+static void decrypt_cache_unlink(struct decrypt_cache_entry *entry)
+{
+    struct decrypt_cache_entry **p
+        = decrypt_cache.buckets + decrypt_cache_bucket_index(entry->digest);
+    while (* p != entry)
+        p = & (* p)->bucket_next;
+    * p = entry->bucket_next;
+
+    if (entry->more_recent == NULL)
+        decrypt_cache.most_recent = entry->less_recent;
+    else
+        entry->more_recent->less_recent = entry->less_recent;
+    if (entry->less_recent == NULL)
+        decrypt_cache.least_recent = entry->more_recent;
+    else
+        entry->less_recent->more_recent = entry->more_recent;
+
+    decrypt_cache.used_size -= entry->size;
+}
+
+/* Link the given entry in its bucket and as the most recent. */
+static void decrypt_cache_link(struct decrypt_cache_entry *entry)
+{
+    struct decrypt_cache_entry **bucket
+        = decrypt_cache.buckets + decrypt_cache_bucket_index(entry->digest);
+    entry->bucket_next = * bucket;
+    * bucket = entry;
+
+    entry->more_recent = NULL;
+    entry->less_recent = decrypt_cache.most_recent;
+    if (decrypt_cache.most_recent == NULL)
+        decrypt_cache.least_recent = entry;
+    else
+        decrypt_cache.most_recent->more_recent = entry;
+    decrypt_cache.most_recent = entry;
+
+    decrypt_cache.used_size += entry->size;
+}
+
+static void decrypt_cache_remove(struct decrypt_cache_entry *entry)
+{
+    decrypt_cache_unlink(entry);
+    free_decrypt_cache_entry(entry);
+}
+
+/* Remove the least recently used entries until the budget is respected. */
+static void decrypt_cache_shrink(void)
+{
+    while (decrypt_cache.used_size > decrypt_cache.size_budget)
+        decrypt_cache_remove(decrypt_cache.least_recent);
+}
+
+static bool decrypt_cache_expired(const struct decrypt_cache_entry *entry,
+                                  time_t now)
+{
+    return (decrypt_cache.ttl_in_seconds != 0
+            && now - entry->creation_time
+               > (time_t) decrypt_cache.ttl_in_seconds);
+}
+
+
+/* Keys
+ * ***************************************************************** */
+
+/* Fold the tagged given data into the digest.  Hashing each field separately
+   and chaining the results avoids copying the message into one buffer. */
+static void decrypt_cache_digest_add(unsigned char *digest, char tag,
+                                     const void *data, size_t size)
+{
+    unsigned char buffer[20 + 1 + 20];
+    memcpy(buffer, digest, 20);
+    buffer[20] = (unsigned char) tag;
+    if (data != NULL && size > 0)
+        pEp_rmd160(buffer + 21, data, size);
+    else
+        memset(buffer + 21, 0, 20);
+    pEp_rmd160(digest, buffer, sizeof(buffer));
+}
+
+static void decrypt_cache_digest_add_string(unsigned char *digest, char tag,
+                                            const char *s)
+{
+    decrypt_cache_digest_add(digest, tag, s, (s == NULL) ? 0 : strlen(s));
+}
+
+/* Fold the addresses of the given recipient list into the digest. */
+static void decrypt_cache_digest_add_identities(unsigned char *digest,
+                                                char tag,
+                                                const identity_list *il)
+{
+    for (; il != NULL; il = il->next)
+        decrypt_cache_digest_add_string(digest, tag,
+                                        il->ident ? il->ident->address : NULL);
+}
+
+/* Compute the digest of everything in the source message which can affect
+   decryption, with the input flags and the session configuration.  The
+   configuration is part of the key since the cache is shared by every session
+   in the process. */
+static void decrypt_cache_digest(PEP_SESSION session, const message *src,
+                                 PEP_decrypt_flags_t flags_in,
+                                 unsigned char *digest)
+{
+    memset(digest, 0, 20);
+    decrypt_cache_digest_add(digest, 'f', & flags_in, sizeof(flags_in));
+    unsigned char config[2] = {
+        session->passive_mode, session->unencrypted_subject
+    };
+    decrypt_cache_digest_add(digest, 'c', config, sizeof(config));
+    /* Attachments are stored before caching, and hits share their files: see
+       decrypt_message_2 . */
+    decrypt_cache_digest_add_string(digest, 'd',
+                                    session->decrypted_attachment_directory);
+    if (session->decrypted_attachment_directory != NULL)
+        decrypt_cache_digest_add(digest, 'z',
+                                 & session->decrypted_attachment_min_size,
+                                 sizeof(session->decrypted_attachment_min_size));
+    decrypt_cache_digest_add_string(digest, 'F',
+                                    src->from ? src->from->address : NULL);
+    decrypt_cache_digest_add_string(digest, 'R',
+                                    src->recv_by ? src->recv_by->address : NULL);
+    decrypt_cache_digest_add_identities(digest, 't', src->to);
+    decrypt_cache_digest_add_identities(digest, 'C', src->cc);
+    decrypt_cache_digest_add_identities(digest, 'B', src->bcc);
+    const stringpair_list_t *o;
+    for (o = src->opt_fields; o != NULL; o = o->next)
+        if (o->value != NULL) {
+            decrypt_cache_digest_add_string(digest, 'k', o->value->key);
+            decrypt_cache_digest_add_string(digest, 'v', o->value->value);
+        }
+    decrypt_cache_digest_add_string(digest, 's', src->shortmsg);
+    decrypt_cache_digest_add_string(digest, 'l', src->longmsg);
+    decrypt_cache_digest_add_string(digest, 'h', src->longmsg_formatted);
+    const bloblist_t *b;
+    for (b = src->attachments; b != NULL; b = b->next) {
+        decrypt_cache_digest_add_string(digest, 'm', b->mime_type);
+        decrypt_cache_digest_add(digest, 'a', b->value, b->size);
+    }
+}
+
+
+/* API
+ * ***************************************************************** */
+
+DYNAMIC_API PEP_STATUS config_decrypt_cache(PEP_SESSION session,
+                                            size_t size_budget,
+                                            unsigned int ttl_in_seconds)
+{
+    PEP_REQUIRE(session);
+
+    pEp_mutex_lock(& decrypt_cache_mutex);
+    decrypt_cache.size_budget = size_budget;
+    decrypt_cache.ttl_in_seconds = ttl_in_seconds;
+    decrypt_cache_shrink();
+    pEp_mutex_unlock(& decrypt_cache_mutex);
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS purge_decrypt_cache(PEP_SESSION session)
+{
+    PEP_REQUIRE(session);
+
+    pEp_mutex_lock(& decrypt_cache_mutex);
+    while (decrypt_cache.least_recent != NULL)
+        decrypt_cache_remove(decrypt_cache.least_recent);
+    pEp_mutex_unlock(& decrypt_cache_mutex);
+    return PEP_STATUS_OK;
+}
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+bool pEp_decrypt_cache_lookup(PEP_SESSION session, message *src,
+                              PEP_decrypt_flags_t flags_in,
+                              message **dst, stringlist_t **keylist,
+                              PEP_decrypt_flags_t *flags, PEP_STATUS *status,
+                              pEp_decrypt_cache_ticket *ticket)
+{
+    PEP_REQUIRE_ORELSE(session && src && dst && keylist && flags && status
+                       && ticket,
+                       { return false; });
+    ticket->usable = false;
+
+    pEp_mutex_lock(& decrypt_cache_mutex);
+    bool enabled = (decrypt_cache.size_budget > 0);
+    pEp_mutex_unlock(& decrypt_cache_mutex);
+    if (! enabled || EMPTYSTR(src->id))
+        return false;
+
+    /* Without a generation nothing can be validated: do not use the cache
+       for this message. */
+    uint64_t generation;
+    if (pEp_sql_get_process_change_generation(session, & generation)
+        != PEP_STATUS_OK)
+        return false;
+    decrypt_cache_digest(session, src, flags_in, ticket->digest);
+    ticket->process_generation = generation;
+    ticket->session_generation = session->trust_generation;
+    ticket->usable = true;
+
+    bool hit = false;
+    message *dst_copy = NULL;
+    stringlist_t *keylist_copy = NULL;
+    pEp_mutex_lock(& decrypt_cache_mutex);
+    struct decrypt_cache_entry *entry = decrypt_cache_find(ticket->digest,
+                                                           src->id);
+    if (entry != NULL
+        && (entry->generation != generation
+            || decrypt_cache_expired(entry, time(NULL)))) {
+        decrypt_cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        dst_copy = message_dup(entry->dst);
+        keylist_copy = stringlist_dup(entry->keylist);
+        if (dst_copy != NULL
+            && (keylist_copy != NULL || entry->keylist == NULL)) {
+            hit = true;
+            * flags = entry->flags;
+            * status = entry->status;
+            src->rating = entry->src_rating;
+            decrypt_cache_unlink(entry);
+            decrypt_cache_link(entry);
+        }
+    }
+    pEp_mutex_unlock(& decrypt_cache_mutex);
+
+    pEp_metrics_count_decrypt_cache_lookup(session, hit);
+    if (! hit) {
+        /* Out of memory while copying counts as a miss. */
+        free_message(dst_copy);
+        free_stringlist(keylist_copy);
+        return false;
+    }
+    LOG_TRACE("decrypt cache hit for %s", src->id);
+    * dst = dst_copy;
+    * keylist = keylist_copy;
+    return true;
+}
+
+void pEp_decrypt_cache_store(PEP_SESSION session,
+                             const pEp_decrypt_cache_ticket *ticket,
+                             const message *src, PEP_STATUS status,
+                             const message *dst, const stringlist_t *keylist,
+                             PEP_decrypt_flags_t flags)
+{
+    PEP_REQUIRE_ORELSE(session && ticket && src, { return; });
+
+    /* Only remember actual decryptions which did not change the source. */
+    if (! ticket->usable || dst == NULL
+        || (flags & PEP_decrypt_flag_src_modified)
+        || ! (status == PEP_STATUS_OK || status == PEP_DECRYPTED
+              || status == PEP_DECRYPTED_AND_VERIFIED))
+        return;
+
+    /* Decrypting usually changes identities and keys, which is fine: the
+       result remains valid in the state after decryption.  But if anything
+       else changed in the meantime, here or elsewhere, the result may
+       already be stale. */
+    uint64_t generation;
+    if (pEp_sql_get_process_change_generation(session, & generation)
+        != PEP_STATUS_OK)
+        return;
+    if (generation - ticket->process_generation
+        != session->trust_generation - ticket->session_generation) {
+        LOG_TRACE("concurrent changes: not caching %s", src->id);
+        return;
+    }
+
+    struct decrypt_cache_entry *entry
+        = calloc(1, sizeof(struct decrypt_cache_entry));
+    if (entry == NULL)
+        return;
+    memcpy(entry->digest, ticket->digest, sizeof(entry->digest));
+    entry->message_id = strdup(src->id);
+    entry->dst_arena = pEp_arena_new(0);
+    if (entry->dst_arena != NULL)
+        entry->dst = message_dup_in_arena(entry->dst_arena, dst);
+    entry->keylist = stringlist_dup(keylist);
+    if (entry->message_id == NULL || entry->dst == NULL
+        || (entry->keylist == NULL && keylist != NULL)) {
+        free_decrypt_cache_entry(entry);
+        return;
+    }
+    entry->generation = generation;
+    entry->creation_time = time(NULL);
+    entry->status = status;
+    entry->flags = flags;
+    entry->src_rating = src->rating;
+    entry->size = (sizeof(struct decrypt_cache_entry)
+                   + strlen(entry->message_id) + 1
+                   + pEp_arena_size(entry->dst_arena));
+    const stringlist_t *k;
+    for (k = keylist; k != NULL; k = k->next)
+        entry->size += sizeof(stringlist_t)
+                       + ((k->value == NULL) ? 0 : strlen(k->value) + 1);
+
+    pEp_mutex_lock(& decrypt_cache_mutex);
+    struct decrypt_cache_entry *old = decrypt_cache_find(entry->digest,
+                                                         entry->message_id);
+    if (old != NULL)
+        decrypt_cache_remove(old);
+    if (entry->size <= decrypt_cache.size_budget) {
+        decrypt_cache_link(entry);
+        entry = NULL;
+        decrypt_cache_shrink();
+    }
+    pEp_mutex_unlock(& decrypt_cache_mutex);
+
+    /* Not linked if the cache was disabled meanwhile, or the entry alone
+       exceeds the budget. */
+    free_decrypt_cache_entry(entry);
+}
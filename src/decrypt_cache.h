@@ -0,0 +1,163 @@
+/**
+ * @file    decrypt_cache.h
+ * @brief   Decrypt result cache: a per-process memory of recent decryption
+ *          results, answering for duplicate deliveries of the same message
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef DECRYPT_CACHE_H
+#define DECRYPT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pEpEngine.h"
+#include "message_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* Mail stores deliver the same message more than once: after an IMAP resync,
+   from more than one folder, or as a notification followed by the full
+   message.  Without a cache decrypt_message_2 does all of its work for every
+   copy, including decryption, key imports and database writes.
+
+   When enabled, the decrypt result cache remembers the result of each
+   successful decryption, keyed by the Message-ID, by a digest of the
+   addresses, header fields and encrypted content, and by the session settings
+   which affect decryption (passive mode and unencrypted subject).  A later
+   decrypt_message_2 call on the same message, from any session of the
+   process, returns a copy of the same decrypted message, key list, flags and
+   rating without decrypting again -- as long as no identity, trust or key
+   information changed in the meantime, in the management database or, in
+   this process, in the key store; otherwise the cached result is discarded
+   and the message is decrypted normally.  Changes to the key store made by
+   other processes alone are not detected: the time to live bounds how long
+   a result can stay stale after those.
+
+   The cache has a size budget, and entries expire after a time to live.
+   Decrypted messages are only ever held in memory: the cache never writes
+   plaintext to disk.  The cache is disabled by default.
+
+   Messages whose decryption modified the source (see
+   PEP_decrypt_flag_src_modified) and failed decryptions are not cached. */
+
+
+/* API
+ * ***************************************************************** */
+
+/**
+ *  <!--       config_decrypt_cache()       -->
+ *
+ *  @brief Enable, disable or resize the decrypt result cache for the whole
+ *         process.  Entries exceeding the new budget are dropped at once.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   size_budget        approximate memory budget in bytes; 0
+ *                                  disables the cache and empties it
+ *  @param[in]   ttl_in_seconds     entries older than this are never used;
+ *                                  0 means no limit
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ */
+DYNAMIC_API PEP_STATUS config_decrypt_cache(PEP_SESSION session,
+                                            size_t size_budget,
+                                            unsigned int ttl_in_seconds);
+
+/**
+ *  <!--       purge_decrypt_cache()       -->
+ *
+ *  @brief Drop every entry from the decrypt result cache, freeing the
+ *         decrypted messages it holds.  The configuration is unchanged.
+ *
+ *  @param[in]   session            session handle
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ */
+DYNAMIC_API PEP_STATUS purge_decrypt_cache(PEP_SESSION session);
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+/* These are used by decrypt_message_2 and are not meant for applications.
+   A lookup which misses fills a ticket, to be passed to the store call after
+   decrypting: the ticket remembers the key and the generations seen before
+   decrypting, so that a result is only stored if nothing but this very
+   decryption changed in the meantime. */
+
+/**
+ *  @internal
+ *  @struct    pEp_decrypt_cache_ticket
+ *
+ *  @brief     What a lookup tells a later store.
+ *
+ */
+typedef struct _pEp_decrypt_cache_ticket {
+    bool usable;                    ///< false if the result must not be stored
+    unsigned char digest[20];
+    uint64_t process_generation;
+    uint64_t session_generation;
+} pEp_decrypt_cache_ticket;
+
+/**
+ *  @internal
+ *  <!--       pEp_decrypt_cache_lookup()       -->
+ *
+ *  @brief     Look for a valid cached result for the given source message.
+ *             On a hit set the output parameters like decrypt_message_2
+ *             would, including src->rating , and return true.
+ *
+ *  @param[in]    session       session handle
+ *  @param[inout] src           the message to decrypt
+ *  @param[in]    flags_in      the input flags of decrypt_message_2
+ *  @param[out]   dst           as for decrypt_message_2 , only set on hits
+ *  @param[out]   keylist       as for decrypt_message_2 , only set on hits
+ *  @param[out]   flags         as for decrypt_message_2 , only set on hits
+ *  @param[out]   status        the result of decrypt_message_2 , only set on
+ *                              hits
+ *  @param[out]   ticket        to be passed to pEp_decrypt_cache_store
+ */
+bool pEp_decrypt_cache_lookup(PEP_SESSION session, message *src,
+                              PEP_decrypt_flags_t flags_in,
+                              message **dst, stringlist_t **keylist,
+                              PEP_decrypt_flags_t *flags, PEP_STATUS *status,
+                              pEp_decrypt_cache_ticket *ticket);
+
+/**
+ *  @internal
+ *  <!--       pEp_decrypt_cache_store()       -->
+ *
+ *  @brief     Remember a copy of the given decryption result, if it is
+ *             cacheable and nothing else changed since the lookup.  Failures
+ *             are ignored.
+ *
+ *  @param[in]    session       session handle
+ *  @param[in]    ticket        filled by the missed lookup
+ *  @param[in]    src           the source message, after decryption
+ *  @param[in]    status        the result of decrypt_message_2
+ *  @param[in]    dst           as returned by decrypt_message_2
+ *  @param[in]    keylist       as returned by decrypt_message_2
+ *  @param[in]    flags         as returned by decrypt_message_2
+ */
+void pEp_decrypt_cache_store(PEP_SESSION session,
+                             const pEp_decrypt_cache_ticket *ticket,
+                             const message *src, PEP_STATUS status,
+                             const message *dst, const stringlist_t *keylist,
+                             PEP_decrypt_flags_t flags);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef DECRYPT_CACHE_H */
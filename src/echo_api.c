@@ -552,9 +552,13 @@ PEP_STATUS handle_pong(PEP_SESSION session,
         if (own_identity_copy == NULL || partner_identity_copy == NULL)
             goto fail;
         LOG_EVENT("SYNC_NOTIFY_OUTGOING_RATING_CHANGE");
-        return session->notifyHandshake(own_identity_copy,
-                                        partner_identity_copy,
-                                        SYNC_NOTIFY_OUTGOING_RATING_CHANGE);
+        PEP_TRACE_SPAN(span);
+        PEP_TRACE_BEGIN(span, "callback.notifyHandshake");
+        status = session->notifyHandshake(own_identity_copy,
+                                          partner_identity_copy,
+                                          SYNC_NOTIFY_OUTGOING_RATING_CHANGE);
+        PEP_TRACE_END(span, status);
+        return status;
     fail:
         free(own_identity_copy);
         free(partner_identity_copy);
@@ -678,7 +682,7 @@ static PEP_STATUS send_ping_or_pong(PEP_SESSION session,
     _add_auto_consume(m);
 
     /* Send it. */
-    status = session->messageToSend(m);
+    status = queue_message_to_send(session, m);
     if (status != PEP_STATUS_OK) {
         LOG_NONOK_STATUS_WARNING;
         free_message(m);
@@ -926,3 +930,12 @@ PEP_STATUS send_ping_to_unknown_pEp_identities_in_outgoing_message(PEP_SESSION s
 
     return PEP_STATUS_OK;
 }
+
+PEP_STATUS send_ping_to_unknown_pEp_identity(PEP_SESSION session,
+                                             const pEp_identity *from_identity,
+                                             const pEp_identity *to_identity)
+{
+    PEP_REQUIRE(session && from_identity && to_identity);
+    send_ping_if_unknown(session, from_identity, to_identity, true);
+    return PEP_STATUS_OK;
+}
@@ -193,6 +193,26 @@ PEP_STATUS send_ping_to_unknown_pEp_identities_in_incoming_message(PEP_SESSION s
 PEP_STATUS send_ping_to_unknown_pEp_identities_in_outgoing_message(PEP_SESSION session,
                                                                    const message *msg);
 
+/**
+ *  <!--       send_ping_to_unknown_pEp_identity()       -->
+ *
+ *  @brief Like send_ping_to_unknown_pEp_identities_in_outgoing_message , for
+ *         one recipient only.
+ *         Rationale: this is useful for rating previews updated one recipient
+ *                    at a time.
+ *
+ *  @param[in]   session          session
+ *  @param[in]   from_identity    the own identity sending the Ping
+ *  @param[in]   to_identity      the potentially unknown recipient
+ *
+ *  @retval PEP_STATUS_OK            success, even if no Ping was sent
+ *  @retval PEP_ILLEGAL_VALUE        any argument NULL
+ *
+ */
+PEP_STATUS send_ping_to_unknown_pEp_identity(PEP_SESSION session,
+                                             const pEp_identity *from_identity,
+                                             const pEp_identity *to_identity);
+
 
 /* Tuning parameters.
  * ***************************************************************** */
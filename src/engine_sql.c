@@ -11,6 +11,7 @@
 
 #include "pEp_internal.h"
 #include "engine_sql.h"
+#include "wal_checkpoint.h"
 #include "echo_api.h"  /* for echo_finalize and echo_initialize ,
                           needed by pEp_refresh_database_connections . */
 
@@ -706,6 +707,7 @@ static PEP_STATUS _create_core_tables(PEP_SESSION session) {
             "   pEp_version_minor integer default 0,\n"
             "   enc_format integer default 0,\n"
             "   timestamp integer default (datetime('now')),\n"
+            "   last_contact integer default 0,\n"
             "   primary key (address, user_id)\n"
             ");\n"
             "create index if not exists identity_userid on identity (user_id);\n"
@@ -833,6 +835,18 @@ static PEP_STATUS _create_supplementary_key_tables(PEP_SESSION session) {
             "   timestamp integer default (datetime('now')),\n"
             "   PRIMARY KEY(fpr, own_address, contact_id)\n"
             ");\n"
+            // digests of recently imported key data, see
+            // import_key_with_fpr_return_deduplicated
+            "create table if not exists key_import_digest (\n"
+            "   digest blob not null,\n"
+            "   fpr text not null,\n"
+            "   timestamp integer not null,\n"
+            "   PRIMARY KEY(digest, fpr)\n"
+            ");\n"
+            "create index if not exists key_import_digest_fpr\n"
+            "   on key_import_digest (fpr);\n"
+            "create index if not exists key_import_digest_timestamp\n"
+            "   on key_import_digest (timestamp);\n"
             ,
             NULL,
             NULL,
@@ -844,6 +858,25 @@ static PEP_STATUS _create_supplementary_key_tables(PEP_SESSION session) {
     return PEP_STATUS_OK;
 }
 
+/* The identity.last_contact column only exists since version 21: older
+   databases get this index when upgrading. */
+static PEP_STATUS _create_identity_last_contact_index(PEP_SESSION session) {
+    int int_result = SQLITE_OK;
+    PEP_SQL_BEGIN_LOOP(int_result);
+    int_result = sqlite3_exec(
+            session->db,
+            "create index if not exists identity_last_contact\n"
+            "   on identity (last_contact);\n",
+            NULL,
+            NULL,
+            NULL
+    );
+    PEP_SQL_END_LOOP();
+    PEP_WEAK_ASSERT_ORELSE_RETURN(int_result == SQLITE_OK, PEP_UNKNOWN_DB_ERROR);
+
+    return PEP_STATUS_OK;
+}
+
 static PEP_STATUS _create_misc_admin_tables(PEP_SESSION session) {
     int int_result = SQLITE_OK;
     PEP_SQL_BEGIN_LOOP(int_result);
@@ -897,6 +930,12 @@ PEP_STATUS create_tables(PEP_SESSION session) {
     if (status != PEP_STATUS_OK)
         return status;
 
+    if (table_contains_column(session, "identity", "last_contact") > 0) {
+        status = _create_identity_last_contact_index(session);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+
     status = _create_misc_admin_tables(session);
 
     return status;
@@ -1563,6 +1602,107 @@ static PEP_STATUS _upgrade_DB_to_ver_19(PEP_SESSION session) {
     return PEP_STATUS_OK;
 }
 
+static PEP_STATUS _upgrade_DB_to_ver_20(PEP_SESSION session) {
+    return _create_supplementary_key_tables(session);
+}
+
+static PEP_STATUS _upgrade_DB_to_ver_21(PEP_SESSION session) {
+    int int_result = SQLITE_OK;
+    PEP_SQL_BEGIN_LOOP(int_result);
+    int_result = sqlite3_exec(
+            session->db,
+            /* The last contact time as seconds since the epoch, which unlike
+               timestamp can be compared through an index. */
+            "alter table identity\n"
+            "   add column last_contact integer default 0;\n"
+            "update identity\n"
+            "   set last_contact = ifnull(strftime('%s', timestamp), 0);\n",
+            NULL,
+            NULL,
+            NULL
+    );
+    PEP_SQL_END_LOOP();
+    PEP_WEAK_ASSERT_ORELSE_RETURN(int_result == SQLITE_OK, PEP_UNKNOWN_DB_ERROR);
+
+    return _create_identity_last_contact_index(session);
+}
+
+/* Fingerprints are stored in canonical form since version 22, see
+   pEp_sql_canonical_fpr .  Most were already canonicalised in SQL, but not
+   those set through some statements: convert the rest.  Where two spellings
+   of the same key collide on a primary key the canonical row wins, except
+   that the flags of colliding pgp_keypair rows are or-ed into it: they mark
+   own and mistrusted keys, which must not be forgotten.  Foreign keys are
+   not checked meanwhile, as the referenced rows change too. */
+#define CANONICAL_FPR(column) "upper(replace(" column ",' ',''))"
+#define CANONICALISE_FPR_KEY(table, column)                            \
+    "update or ignore " table "\n"                                     \
+    "   set " column " = " CANONICAL_FPR(column) "\n"                  \
+    "   where " column " != " CANONICAL_FPR(column) ";\n"              \
+    "delete from " table "\n"                                          \
+    "   where " column " != " CANONICAL_FPR(column) ";\n"
+/* SQLite has no bitwise or aggregate: add up the bits set in any of the
+   pgp_keypair rows left with a non-canonical spelling of the given row's
+   key. */
+#define COLLIDING_KEYPAIR_FLAGS                                        \
+    "(with recursive bit (b) as (select 1 union all\n"                 \
+    "                            select b * 2 from bit\n"              \
+    "                               where b < 1073741824)\n"           \
+    "    select ifnull(sum(b), 0) from bit\n"                          \
+    "       where exists (select 1 from pgp_keypair as other\n"        \
+    "                        where other.fpr\n"                        \
+    "                              != " CANONICAL_FPR("other.fpr") "\n" \
+    "                          and " CANONICAL_FPR("other.fpr") "\n"   \
+    "                              = pgp_keypair.fpr\n"                \
+    "                          and other.flags & b))"
+#define CANONICALISE_KEYPAIR_FPR                                       \
+    "update or ignore pgp_keypair\n"                                   \
+    "   set fpr = " CANONICAL_FPR("fpr") "\n"                          \
+    "   where fpr != " CANONICAL_FPR("fpr") ";\n"                      \
+    "update pgp_keypair\n"                                             \
+    "   set flags = ifnull(flags, 0) | " COLLIDING_KEYPAIR_FLAGS "\n"  \
+    "   where fpr in (select " CANONICAL_FPR("fpr") "\n"               \
+    "                    from pgp_keypair\n"                           \
+    "                    where fpr != " CANONICAL_FPR("fpr") ");\n"    \
+    "delete from pgp_keypair\n"                                        \
+    "   where fpr != " CANONICAL_FPR("fpr") ";\n"
+#define CANONICALISE_FPR(table, column)                                \
+    "update " table "\n"                                               \
+    "   set " column " = " CANONICAL_FPR(column) "\n"                  \
+    "   where " column " != " CANONICAL_FPR(column) ";\n"
+static PEP_STATUS _upgrade_DB_to_ver_22(PEP_SESSION session) {
+    int int_result = SQLITE_OK;
+    PEP_SQL_BEGIN_LOOP(int_result);
+    int_result = sqlite3_exec(
+            session->db,
+            "PRAGMA foreign_keys=off;\n"
+            "BEGIN TRANSACTION;\n"
+            CANONICALISE_KEYPAIR_FPR
+            CANONICALISE_FPR_KEY("trust", "pgp_keypair_fpr")
+            CANONICALISE_FPR_KEY("mistrusted_keys", "fpr")
+            CANONICALISE_FPR_KEY("revoked_keys", "revoked_fpr")
+            CANONICALISE_FPR("revoked_keys", "replacement_fpr")
+            CANONICALISE_FPR_KEY("revocation_contact_list", "fpr")
+            CANONICALISE_FPR_KEY("key_import_digest", "fpr")
+            CANONICALISE_FPR("identity", "main_key_id")
+            CANONICALISE_FPR("person", "main_key_id")
+            "COMMIT;\n"
+            "PRAGMA foreign_keys=on;\n",
+            NULL,
+            NULL,
+            NULL
+    );
+    PEP_SQL_END_LOOP();
+    PEP_WEAK_ASSERT_ORELSE_RETURN(int_result == SQLITE_OK, PEP_UNKNOWN_DB_ERROR);
+
+    return PEP_STATUS_OK;
+}
+#undef CANONICALISE_FPR
+#undef CANONICALISE_KEYPAIR_FPR
+#undef COLLIDING_KEYPAIR_FLAGS
+#undef CANONICALISE_FPR_KEY
+#undef CANONICAL_FPR
+
 // Honestly, the upgrades should be redone in a transaction IMHO.
 static PEP_STATUS _check_and_execute_upgrades(PEP_SESSION session, int version) {
     PEP_STATUS status = PEP_STATUS_OK;
@@ -1639,6 +1779,18 @@ static PEP_STATUS _check_and_execute_upgrades(PEP_SESSION session, int version)
             if (status != PEP_STATUS_OK)
                 return status;
         case 19:
+            status = _upgrade_DB_to_ver_20(session);
+            if (status != PEP_STATUS_OK)
+                return status;
+        case 20:
+            status = _upgrade_DB_to_ver_21(session);
+            if (status != PEP_STATUS_OK)
+                return status;
+        case 21:
+            status = _upgrade_DB_to_ver_22(session);
+            if (status != PEP_STATUS_OK)
+                return status;
+        case 22:
             break;
         default:
             return PEP_ILLEGAL_VALUE;
@@ -1646,6 +1798,21 @@ static PEP_STATUS _check_and_execute_upgrades(PEP_SESSION session, int version)
     return PEP_STATUS_OK;
 }
 
+int pEp_sql_create_functions(sqlite3 *db)
+{
+    void (*xFunc_lower)(sqlite3_context *, int, sqlite3_value **) = &_sql_lower;
+    return sqlite3_create_function_v2(
+            db,
+            "lower",
+            1,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL,
+            xFunc_lower,
+            NULL,
+            NULL,
+            NULL);
+}
+
 static int pEp_open_local_database(PEP_SESSION session,
                                    int other_flags) {
     PEP_ASSERT(! EMPTYSTR(LOCAL_DB));
@@ -1662,6 +1829,174 @@ static int pEp_open_local_database(PEP_SESSION session,
 /* Forward declaration. */
 static PEP_STATUS _prepare_sql_stmts(PEP_SESSION session);
 
+/* The process change generation, see pEp_sql_get_process_change_generation .
+   Protected by the mutex. */
+static pEp_mutex_t process_change_mutex = PEP_MUTEX_INITIALIZER;
+static uint64_t process_change_generation = 0;
+
+/* The key store generation, see pEp_sql_note_key_store_change .  Protected by
+   the same mutex. */
+static uint64_t key_store_generation = 0;
+
+/* The key set generations, see pEp_sql_get_key_set_generation .  Protected by
+   the same mutex. */
+static uint64_t key_set_generations[pEp_sql_key_set__count];
+
+/* Count a change to the key sets in the given mask of 1 << pEp_sql_key_set
+   bits. */
+static void pEp_sql_note_key_set_change(unsigned int key_sets)
+{
+    pEp_mutex_lock(& process_change_mutex);
+    int i;
+    for (i = 0; i < pEp_sql_key_set__count; i ++)
+        if (key_sets & (1u << i))
+            key_set_generations[i] ++;
+    pEp_mutex_unlock(& process_change_mutex);
+}
+#define PEP_SQL_ALL_KEY_SETS ((1u << pEp_sql_key_set__count) - 1)
+
+void pEp_sql_note_change(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    session->trust_generation ++;
+    pEp_mutex_lock(& process_change_mutex);
+    process_change_generation ++;
+    pEp_mutex_unlock(& process_change_mutex);
+}
+
+void pEp_sql_note_key_store_change(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    pEp_sql_note_change(session);
+    pEp_mutex_lock(& process_change_mutex);
+    key_store_generation ++;
+    pEp_mutex_unlock(& process_change_mutex);
+}
+
+/* Count a change to the key sets in the given mask made through the session
+   connection.  Another session may load a key set from the old committed
+   state until the change is committed: count the change again then. */
+static void pEp_sql_note_uncommitted_key_set_change(PEP_SESSION session,
+                                                    unsigned int key_sets)
+{
+    pEp_sql_note_key_set_change(key_sets);
+    session->uncommitted_key_set_changes |= key_sets;
+}
+
+/* The own key set is made of the keys in trust rows of users with an own
+   identity (see sql_all_own_key_fprs ).  Rows are reported by rowid only, and
+   the update hook cannot query the database: these triggers, on the session
+   connection only, call pEp_own_key_set_changed for exactly the changes which
+   may affect the set.  Changes made by foreign key actions fire them too. */
+static const char *sql_own_key_set_triggers =
+    "create temp trigger if not exists pEp_own_identity_inserted\n"
+    "    after insert on main.identity when new.is_own = 1\n"
+    "    begin select pEp_own_key_set_changed(); end;\n"
+    "create temp trigger if not exists pEp_own_identity_deleted\n"
+    "    after delete on main.identity when old.is_own = 1\n"
+    "    begin select pEp_own_key_set_changed(); end;\n"
+    "create temp trigger if not exists pEp_own_identity_updated\n"
+    "    after update of user_id, is_own on main.identity\n"
+    "    when old.is_own = 1 or new.is_own = 1\n"
+    "    begin select pEp_own_key_set_changed(); end;\n"
+    "create temp trigger if not exists pEp_own_trust_inserted\n"
+    "    after insert on main.trust\n"
+    "    when exists (select 1 from main.identity\n"
+    "                 where user_id = new.user_id and is_own = 1)\n"
+    "    begin select pEp_own_key_set_changed(); end;\n"
+    "create temp trigger if not exists pEp_own_trust_deleted\n"
+    "    after delete on main.trust\n"
+    "    when exists (select 1 from main.identity\n"
+    "                 where user_id = old.user_id and is_own = 1)\n"
+    "    begin select pEp_own_key_set_changed(); end;\n"
+    "create temp trigger if not exists pEp_own_trust_updated\n"
+    "    after update of user_id, pgp_keypair_fpr on main.trust\n"
+    "    when exists (select 1 from main.identity\n"
+    "                 where user_id in (old.user_id, new.user_id)\n"
+    "                       and is_own = 1)\n"
+    "    begin select pEp_own_key_set_changed(); end;\n";
+
+/* The SQL function called by the triggers above. */
+static void pEp_sql_own_key_set_changed(sqlite3_context *context,
+                                        int argc, sqlite3_value **argv)
+{
+    PEP_SESSION session = sqlite3_user_data(context);
+    pEp_sql_note_uncommitted_key_set_change(session,
+                                            1u << pEp_sql_key_set_own);
+    sqlite3_result_null(context);
+}
+
+/* Called by SQLite for every row changed through the connection.  Notice that
+   SQLite does not report rows deleted by a whole-table "delete from" without
+   a where clause, which we never execute on these tables.  Changes to the own
+   key set are counted by the triggers above. */
+static void pEp_sql_update_hook(void *session_as_void, int operation,
+                                const char *database, const char *table,
+                                sqlite3_int64 rowid)
+{
+    static const struct {
+        const char *table;
+        unsigned int key_sets;
+    } trust_tables[] = {
+        { "identity", 0 },
+        { "person", 0 },
+        { "trust", 0 },
+        { "pgp_keypair", 0 },
+        { "revoked_keys", 1u << pEp_sql_key_set_revoked },
+        { "mistrusted_keys", 1u << pEp_sql_key_set_mistrusted },
+        { "alternate_user_id", 0 },
+        { NULL, 0 }
+    };
+    PEP_SESSION session = session_as_void;
+    int i;
+    for (i = 0; trust_tables[i].table != NULL; i ++)
+        if (strcmp(table, trust_tables[i].table) == 0) {
+            pEp_sql_note_change(session);
+            if (trust_tables[i].key_sets != 0)
+                pEp_sql_note_uncommitted_key_set_change(
+                    session, trust_tables[i].key_sets);
+            return;
+        }
+}
+
+/* Forward declaration. */
+static PEP_STATUS pEp_sql_check_data_version(PEP_SESSION session);
+
+/* Called by SQLite when a transaction is committed. */
+static int pEp_sql_commit_hook(void *session_as_void)
+{
+    PEP_SESSION session = session_as_void;
+
+    /* Account for the commits of other connections seen so far, then for
+       this one, which increments the data version if it writes the main
+       database.  Should the commit fail after all, the next check counts a
+       change which did not happen, which is harmless. */
+    pEp_sql_check_data_version(session);
+    if (session->seen_data_version_valid
+        && sqlite3_txn_state(session->db, "main") == SQLITE_TXN_WRITE)
+        session->seen_data_version ++;
+
+    if (session->uncommitted_key_set_changes != 0) {
+        pEp_sql_note_key_set_change(session->uncommitted_key_set_changes);
+        session->uncommitted_key_set_changes = 0;
+    }
+    return 0; /* go on committing */
+}
+
+/* Called by SQLite when a transaction is rolled back: the changes counted by
+   the update hook are undone, which is a change as well. */
+static void pEp_sql_rollback_hook(void *session_as_void)
+{
+    PEP_SESSION session = session_as_void;
+    pEp_sql_note_change(session);
+    if (session->uncommitted_key_set_changes != 0) {
+        pEp_sql_note_key_set_change(session->uncommitted_key_set_changes);
+        session->uncommitted_key_set_changes = 0;
+    }
+}
+
 PEP_STATUS pEp_sql_init(PEP_SESSION session) {
     PEP_REQUIRE(session);
     PEP_STATUS status = PEP_STATUS_OK;
@@ -1700,17 +2035,7 @@ PEP_STATUS pEp_sql_init(PEP_SESSION session) {
             FAIL(status);
     }
 
-    void (*xFunc_lower)(sqlite3_context *, int, sqlite3_value **) = &_sql_lower;
-    int_result = sqlite3_create_function_v2(
-            session->db,
-            "lower",
-            1,
-            SQLITE_UTF8 | SQLITE_DETERMINISTIC,
-            NULL,
-            xFunc_lower,
-            NULL,
-            NULL,
-            NULL);
+    int_result = pEp_sql_create_functions(session->db);
     PEP_WEAK_ASSERT_ORELSE_RETURN(int_result == SQLITE_OK, PEP_UNKNOWN_DB_ERROR);
 
     /* Update the schema, if needed. */
@@ -1802,9 +2127,7 @@ PEP_STATUS pEp_sql_init(PEP_SESSION session) {
  "PRAGMA foreign_key=ON;\n"
  "PRAGMA synchronous=NORMAL;\n" // not persistent!
  "PRAGMA secure_delete = OFF;\n"
-// "PRAGMA SQLITE_DEFAULT_WAL_AUTOCHECKPOINT = 1;\n" /* checkpoint very often. */
-// "PRAGMA SQLITE_DEFAULT_WAL_AUTOCHECKPOINT = 100000;\n" /* checkpoint very rarely. */
-// "PRAGMA SQLITE_DEFAULT_WAL_AUTOCHECKPOINT = 0;\n" /* do not checkpoint at all.  Probably not what we want. */
+// WAL checkpoints are scheduled by pEp_wal_checkpoint_attach , below.
  "",
            NULL, NULL, NULL);
         if (int_result != SQLITE_OK) {
@@ -1821,6 +2144,37 @@ PEP_STATUS pEp_sql_init(PEP_SESSION session) {
     sqlite3_busy_timeout(session->db, 0);
     //sqlite3_busy_timeout(session->db, 5000);
 
+    /* Track changes for pEp_sql_get_change_stamp .  A new connection has its
+       own data version, unrelated to the previous one. */
+    sqlite3_update_hook(session->db, pEp_sql_update_hook, session);
+    sqlite3_rollback_hook(session->db, pEp_sql_rollback_hook, session);
+    sqlite3_commit_hook(session->db, pEp_sql_commit_hook, session);
+    int_result = sqlite3_create_function_v2(session->db,
+                                            "pEp_own_key_set_changed", 0,
+                                            SQLITE_UTF8, session,
+                                            pEp_sql_own_key_set_changed,
+                                            NULL, NULL, NULL);
+    if (int_result != SQLITE_OK)
+        FAIL(PEP_UNKNOWN_DB_ERROR);
+    PEP_SQL_BEGIN_LOOP(int_result);
+    int_result = sqlite3_exec(session->db, sql_own_key_set_triggers,
+                              NULL, NULL, NULL);
+    PEP_SQL_END_LOOP();
+    if (int_result != SQLITE_OK) {
+        LOG_NONOK("failed making the own key set triggers: %s",
+                  pEp_sql_status_to_status_text(session, int_result));
+        FAIL(PEP_UNKNOWN_DB_ERROR);
+    }
+
+    /* Report commits to the WAL checkpointer, which also takes over the
+       automatic checkpoint. */
+    status = pEp_wal_checkpoint_attach(session);
+    if (status != PEP_STATUS_OK)
+        FAIL(status);
+    session->trust_generation ++;
+    session->seen_data_version_valid = false;
+    session->uncommitted_key_set_changes = 0;
+
     if (session->first_session_at_init_time)
         LOG_TRACE("database schema initialised successfully from the FIRST session");
     else
@@ -1877,6 +2231,10 @@ static PEP_STATUS _prepare_sql_stmts(PEP_SESSION session) {
     PREPARE(db, begin_exclusive_transaction);
     PREPARE(db, commit_transaction);
     PREPARE(db, rollback_transaction);
+    PREPARE(db, begin_savepoint);
+    PREPARE(db, release_savepoint);
+    PREPARE(db, rollback_to_savepoint);
+    PREPARE(db, data_version);
     PREPARE(db, get_identity);
     PREPARE(db, get_identity_without_trust_check);
     PREPARE(db, get_identities_by_address);
@@ -1912,7 +2270,7 @@ static PEP_STATUS _prepare_sql_stmts(PEP_SESSION session) {
     PREPARE(db, get_contacted_ids_from_revoke_fpr);
     PREPARE(db, was_id_for_revoke_contacted);
     PREPARE(db, has_id_contacted_address);
-    PREPARE(db, get_last_contacted);
+    PREPARE(db, get_recent_contacts);
     PREPARE(db, set_pgp_keypair);
     PREPARE(db, set_pgp_keypair_flags);
     PREPARE(db, unset_pgp_keypair_flags);
@@ -1948,6 +2306,7 @@ static PEP_STATUS _prepare_sql_stmts(PEP_SESSION session) {
     // Sequence
     PREPARE(db, sequence_value1);
     PREPARE(db, sequence_value2);
+    PREPARE(db, sequence_value_give_back);
 
     // Revocation tracking
     PREPARE(db, set_revoked);
@@ -1957,6 +2316,17 @@ static PEP_STATUS _prepare_sql_stmts(PEP_SESSION session) {
     PREPARE(db, delete_mistrusted_key);
     PREPARE(db, is_mistrusted_key);
 
+    // Key sets
+    PREPARE(db, all_own_key_fprs);
+    PREPARE(db, all_mistrusted_keys);
+    PREPARE(db, all_revoked_keys);
+
+    // Key import digests
+    PREPARE(db, key_import_digest_lookup);
+    PREPARE(db, key_import_digest_record);
+    PREPARE(db, key_import_digest_forget);
+    PREPARE(db, key_import_digest_prune);
+
     /* Groups */
     PREPARE(db, create_group);
     PREPARE(db, enable_group);
@@ -1996,6 +2366,10 @@ static PEP_STATUS _finalize_sql_stmts(PEP_SESSION session) {
     sqlite3_finalize(session->begin_exclusive_transaction);
     sqlite3_finalize(session->commit_transaction);
     sqlite3_finalize(session->rollback_transaction);
+    sqlite3_finalize(session->begin_savepoint);
+    sqlite3_finalize(session->release_savepoint);
+    sqlite3_finalize(session->rollback_to_savepoint);
+    sqlite3_finalize(session->data_version);
     sqlite3_finalize(session->get_identity);
     sqlite3_finalize(session->get_identity_without_trust_check);
     sqlite3_finalize(session->get_identities_by_address);
@@ -2025,7 +2399,7 @@ static PEP_STATUS _finalize_sql_stmts(PEP_SESSION session) {
     sqlite3_finalize(session->get_contacted_ids_from_revoke_fpr);
     sqlite3_finalize(session->was_id_for_revoke_contacted);
     sqlite3_finalize(session->has_id_contacted_address);
-    sqlite3_finalize(session->get_last_contacted);
+    sqlite3_finalize(session->get_recent_contacts);
     sqlite3_finalize(session->set_pgp_keypair);
     sqlite3_finalize(session->exists_identity_entry);
     sqlite3_finalize(session->set_identity_entry);
@@ -2062,12 +2436,20 @@ static PEP_STATUS _finalize_sql_stmts(PEP_SESSION session) {
     //     sqlite3_finalize(session->set_own_key);
     sqlite3_finalize(session->sequence_value1);
     sqlite3_finalize(session->sequence_value2);
+    sqlite3_finalize(session->sequence_value_give_back);
     sqlite3_finalize(session->set_revoked);
     sqlite3_finalize(session->get_revoked);
     sqlite3_finalize(session->get_replacement_fpr);
     sqlite3_finalize(session->add_mistrusted_key);
     sqlite3_finalize(session->delete_mistrusted_key);
     sqlite3_finalize(session->is_mistrusted_key);
+    sqlite3_finalize(session->all_own_key_fprs);
+    sqlite3_finalize(session->all_mistrusted_keys);
+    sqlite3_finalize(session->all_revoked_keys);
+    sqlite3_finalize(session->key_import_digest_lookup);
+    sqlite3_finalize(session->key_import_digest_record);
+    sqlite3_finalize(session->key_import_digest_forget);
+    sqlite3_finalize(session->key_import_digest_prune);
     sqlite3_finalize(session->create_group);
     sqlite3_finalize(session->enable_group);
     sqlite3_finalize(session->disable_group);
@@ -2126,10 +2508,170 @@ PEP_STATUS pEp_sql_finalize(PEP_SESSION session,
     return status;
 }
 
+/* Read PRAGMA data_version for the session connection. */
+static PEP_STATUS pEp_sql_get_data_version(PEP_SESSION session,
+                                           int64_t *data_version)
+{
+    sql_reset_and_clear_bindings(session->data_version);
+    int sqlite_status = pEp_sqlite3_step_nonbusy(session,
+                                                 session->data_version);
+    PEP_STATUS status = PEP_STATUS_OK;
+    if (sqlite_status == SQLITE_ROW)
+        * data_version = sqlite3_column_int64(session->data_version, 0);
+    else
+        status = PEP_UNKNOWN_DB_ERROR;
+    sql_reset_and_clear_bindings(session->data_version);
+    return status;
+}
+
+PEP_STATUS pEp_sql_get_change_stamp(PEP_SESSION session,
+                                    pEp_sql_change_stamp *stamp)
+{
+    PEP_REQUIRE(session && stamp);
+
+    stamp->trust_generation = session->trust_generation;
+    pEp_mutex_lock(& process_change_mutex);
+    stamp->key_store_generation = key_store_generation;
+    pEp_mutex_unlock(& process_change_mutex);
+    stamp->expiry_period
+        = (int64_t) time(NULL) / PEP_SQL_CHANGE_STAMP_EXPIRY_PERIOD;
+    return pEp_sql_get_data_version(session, & stamp->data_version);
+}
+
+/* Count any commit from other connections seen by this session as a change to
+   everything.  A commit from another connection, which may be in another
+   process, changes the data version of this connection.  We cannot tell
+   whether it touched trust: count it as a change.  The first reading on a
+   connection has nothing to compare to and counts as well.
+
+   Unlike PRAGMA data_version , which costs a statement step, the
+   SQLITE_FCNTL_DATA_VERSION file control reads a counter in memory, updated
+   whenever the connection starts reading after another connection committed.
+   It also grows at the commits of this connection: pEp_sql_commit_hook
+   accounts for those in advance. */
+static PEP_STATUS pEp_sql_check_data_version(PEP_SESSION session)
+{
+    unsigned int data_version = 0;
+    if (sqlite3_file_control(session->db, "main", SQLITE_FCNTL_DATA_VERSION,
+                             & data_version) != SQLITE_OK)
+        return PEP_UNKNOWN_DB_ERROR;
+    if (! session->seen_data_version_valid
+        || data_version != session->seen_data_version) {
+        session->seen_data_version = data_version;
+        session->seen_data_version_valid = true;
+        pEp_sql_note_change(session);
+        pEp_sql_note_key_set_change(PEP_SQL_ALL_KEY_SETS);
+    }
+    return PEP_STATUS_OK;
+}
+
+PEP_STATUS pEp_sql_get_process_change_generation(PEP_SESSION session,
+                                                 uint64_t *generation)
+{
+    PEP_REQUIRE(session && generation);
+
+    PEP_STATUS status = pEp_sql_check_data_version(session);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    pEp_mutex_lock(& process_change_mutex);
+    * generation = process_change_generation;
+    pEp_mutex_unlock(& process_change_mutex);
+    return PEP_STATUS_OK;
+}
+
+PEP_STATUS pEp_sql_get_key_set_generation(PEP_SESSION session,
+                                          pEp_sql_key_set key_set,
+                                          uint64_t *generation)
+{
+    PEP_REQUIRE(session && generation
+                && key_set >= 0 && key_set < pEp_sql_key_set__count);
+
+    PEP_STATUS status = pEp_sql_check_data_version(session);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    pEp_mutex_lock(& process_change_mutex);
+    * generation = key_set_generations[key_set];
+    pEp_mutex_unlock(& process_change_mutex);
+    return PEP_STATUS_OK;
+}
+
+bool pEp_sql_change_stamps_equal(const pEp_sql_change_stamp *a,
+                                 const pEp_sql_change_stamp *b)
+{
+    if (a == NULL || b == NULL)
+        return false;
+
+    return (a->trust_generation == b->trust_generation
+            && a->data_version == b->data_version
+            && a->key_store_generation == b->key_store_generation
+            && a->expiry_period == b->expiry_period);
+}
+
+/* Write the canonical form of the given fingerprint to the given buffer,
+   which must be at least as large as the fingerprint. */
+static void pEp_sql_canonicalise_fpr(char *canonical, const char *fpr)
+{
+    char *q = canonical;
+    const char *p;
+    for (p = fpr; * p != '\0'; p ++)
+        if (* p != ' ')
+            * (q ++) = ((* p >= 'a' && * p <= 'z')
+                        ? (char) (* p - 'a' + 'A') : * p);
+    * q = '\0';
+}
+
+char *pEp_sql_canonical_fpr(const char *fpr)
+{
+    if (fpr == NULL)
+        return NULL;
+
+    char *result = malloc(strlen(fpr) + 1);
+    if (result == NULL)
+        return NULL;
+    pEp_sql_canonicalise_fpr(result, fpr);
+    return result;
+}
+
+/* Room for any real fingerprint, spaces included, with its terminator. */
+#define PEP_SQL_FPR_BUFFER_SIZE 128
+
+int pEp_sql_bind_fpr(sqlite3_stmt *statement, int index, const char *fpr)
+{
+    if (fpr == NULL)
+        return sqlite3_bind_null(statement, index);
+
+    /* Fingerprints from the database and the key store are canonical
+       already: bind those as they are, with no copy. */
+    const char *p;
+    for (p = fpr; * p != '\0'; p ++)
+        if (* p == ' ' || (* p >= 'a' && * p <= 'z'))
+            break;
+    if (* p == '\0')
+        return sqlite3_bind_text(statement, index, fpr, -1, SQLITE_STATIC);
+
+    /* SQLite copies the buffer into its own per-connection memory. */
+    size_t length = p - fpr + strlen(p);
+    if (length < PEP_SQL_FPR_BUFFER_SIZE) {
+        char canonical[PEP_SQL_FPR_BUFFER_SIZE];
+        pEp_sql_canonicalise_fpr(canonical, fpr);
+        return sqlite3_bind_text(statement, index, canonical, -1,
+                                 SQLITE_TRANSIENT);
+    }
+
+    /* Not a real fingerprint, but still bound as the others. */
+    char *canonical = pEp_sql_canonical_fpr(fpr);
+    if (canonical == NULL)
+        return SQLITE_NOMEM;
+    return sqlite3_bind_text(statement, index, canonical, -1, free);
+}
+
 PEP_STATUS pEp_refresh_database_connections(PEP_SESSION session)
 {
     PEP_REQUIRE(session && session->can_refresh_database_connections);
     LOG_EVENT();
+    pEp_metrics_count_connection_refresh(session);
 
 #define CHECK                         \
     do {                              \
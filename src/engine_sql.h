@@ -14,6 +14,10 @@ PEP_STATUS pEp_sql_init(PEP_SESSION session);
 PEP_STATUS pEp_sql_finalize(PEP_SESSION session,
                             bool is_this_the_last_session);
 
+/* Define the SQL functions the statements rely on, overriding lower , in the
+   given management database connection.  Return the SQLite status. */
+int pEp_sql_create_functions(sqlite3 *db);
+
 /* In order to guarantee that concurrent accesses to the management database,
    possibly from multiple threads, happen correctly and without having failures
    inside transactions, we surround SQL statements with
@@ -36,6 +40,181 @@ PEP_STATUS pEp_sql_finalize(PEP_SESSION session,
 PEP_STATUS pEp_refresh_database_connections(PEP_SESSION session);
 
 
+/* Change detection
+ * ***************************************************************** */
+
+/* Caches of information derived from identities, trust and keys in the
+   management database need to know when it changes.  A change stamp
+   identifies the state of the database as seen from one session: two stamps
+   taken from the same session are equal only if, in between, no identity,
+   person, trust or key row was changed through the session, no change at
+   all was committed through other connections, no key was changed in the key
+   store by any session of the process, and no more than
+   PEP_SQL_CHANGE_STAMP_EXPIRY_PERIOD seconds passed, so that keys expiring
+   are noticed.  Changes to the key store made by other processes are not
+   detected. */
+typedef struct _pEp_sql_change_stamp {
+    uint64_t trust_generation;  /* see the session field */
+    int64_t data_version;       /* see PRAGMA data_version */
+    uint64_t key_store_generation;  /* see pEp_sql_note_key_store_change */
+    int64_t expiry_period;      /* the current time, divided by
+                                   PEP_SQL_CHANGE_STAMP_EXPIRY_PERIOD */
+} pEp_sql_change_stamp;
+
+/* How late, in seconds, a cache keyed on a change stamp may notice a key
+   expiring. */
+#define PEP_SQL_CHANGE_STAMP_EXPIRY_PERIOD 60
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_get_change_stamp()       -->
+ *
+ *  @brief     Take a change stamp for the current state of the management
+ *             database.
+ *
+ *  @param[in]   session        session handle
+ *  @param[out]  stamp          the stamp
+ *
+ *  @retval     PEP_STATUS_OK         success
+ *  @retval     PEP_UNKNOWN_DB_ERROR  the data version could not be read
+ *  @retval     PEP_ILLEGAL_VALUE     NULL arguments
+ */
+PEP_STATUS pEp_sql_get_change_stamp(PEP_SESSION session,
+                                    pEp_sql_change_stamp *stamp);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_change_stamps_equal()       -->
+ *
+ *  @brief     Return true iff the two stamps, taken from the same session,
+ *             denote the same state.
+ */
+bool pEp_sql_change_stamps_equal(const pEp_sql_change_stamp *a,
+                                 const pEp_sql_change_stamp *b);
+
+/* Caches shared by every session in the process use a coarser counter, the
+   process change generation, which grows at every change to identity, person,
+   trust or key rows made by any session in the process, and whenever a
+   session sees a commit from another connection. */
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_get_process_change_generation()       -->
+ *
+ *  @brief     Return the current process change generation, after counting
+ *             any commit from other connections seen by this session.
+ *
+ *  @param[in]   session        session handle
+ *  @param[out]  generation     the generation
+ *
+ *  @retval     PEP_STATUS_OK         success
+ *  @retval     PEP_UNKNOWN_DB_ERROR  the data version could not be read
+ *  @retval     PEP_ILLEGAL_VALUE     NULL arguments
+ */
+PEP_STATUS pEp_sql_get_process_change_generation(PEP_SESSION session,
+                                                 uint64_t *generation);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_note_change()       -->
+ *
+ *  @brief     Count a change to trust information made through the given
+ *             session, in both the session and the process generations.
+ *             Changes through SQL are counted automatically.
+ *
+ *  @param[in]   session        session handle
+ */
+void pEp_sql_note_change(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_note_key_store_change()       -->
+ *
+ *  @brief     Count a change to the key store of the cryptotech made through
+ *             the given session, such as a key import, generation, renewal,
+ *             revocation or deletion: this is a change to trust information
+ *             as for pEp_sql_note_change , and it also changes the change
+ *             stamps of every session in the process.
+ *
+ *  @param[in]   session        session handle
+ */
+void pEp_sql_note_key_store_change(PEP_SESSION session);
+
+/* The small sets of own, mistrusted and revoked keys are cached for the whole
+   process (see key_sets.h), each with its own generation counter: this grows
+   at every change to the rows the set is made of, made by any session in the
+   process, at every commit or rollback of such a change, and whenever a
+   session sees a commit from another connection. */
+typedef enum _pEp_sql_key_set {
+    pEp_sql_key_set_own,            /* own identities and their trust */
+    pEp_sql_key_set_mistrusted,     /* mistrusted_keys */
+    pEp_sql_key_set_revoked,        /* revoked_keys */
+    pEp_sql_key_set__count
+} pEp_sql_key_set;
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_get_key_set_generation()       -->
+ *
+ *  @brief     Return the current generation of the given key set, after
+ *             counting any commit from other connections seen by this
+ *             session.  This only reads memory: a commit from another
+ *             connection is seen once this session has run a statement
+ *             after it.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   key_set        the key set
+ *  @param[out]  generation     the generation
+ *
+ *  @retval     PEP_STATUS_OK         success
+ *  @retval     PEP_UNKNOWN_DB_ERROR  the data version could not be read
+ *  @retval     PEP_ILLEGAL_VALUE     illegal parameter values
+ */
+PEP_STATUS pEp_sql_get_key_set_generation(PEP_SESSION session,
+                                          pEp_sql_key_set key_set,
+                                          uint64_t *generation);
+
+
+/* Fingerprints
+ * ***************************************************************** */
+
+/* Fingerprints are stored in canonical form, without spaces and with ASCII
+   letters in upper case, so that the fpr columns compare bytewise and the
+   queries can use their indices with no per-row conversion.  Every fingerprint
+   bound to a statement must be canonicalised first. */
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_canonical_fpr()       -->
+ *
+ *  @brief     Return a malloc'd copy of the given fingerprint in canonical
+ *             form, or NULL if out of memory.
+ *
+ *  @param[in]   fpr            the fingerprint, in any case and spacing
+ */
+char *pEp_sql_canonical_fpr(const char *fpr);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_bind_fpr()       -->
+ *
+ *  @brief     Like sqlite3_bind_text , binding the canonical form of the given
+ *             fingerprint; bind NULL if fpr is NULL.  A fingerprint already
+ *             in canonical form, as most are, is bound with no copy, like
+ *             SQLITE_STATIC text: it must stay valid until the statement is
+ *             reset.  This makes no allocation of its own for any real
+ *             fingerprint, so that callers may ignore the result as they do
+ *             for the other bindings.
+ *
+ *  @param[in]   statement      the statement
+ *  @param[in]   index          the parameter index
+ *  @param[in]   fpr            the fingerprint, in any case and spacing
+ *
+ *  @retval     the SQLite result code
+ */
+int pEp_sql_bind_fpr(sqlite3_stmt *statement, int index, const char *fpr);
+
+
 /* Debugging
  * ***************************************************************** */
 
@@ -58,7 +237,7 @@ const char *pEp_sql_current_status_text(PEP_SESSION session);
  * ***************************************************************** */
 
 // increment this when patching DDL
-#define _DDL_USER_VERSION "19"
+#define _DDL_USER_VERSION "22"
 
 /* The strings below are not always all used in a C file, so it is normal that
    a lot of these variables are unused: we do not want warnings, nor complicated
@@ -83,6 +262,14 @@ static const char *sql_commit_transaction MAYBE_UNUSED =
         "COMMIT TRANSACTION;";
 static const char *sql_rollback_transaction MAYBE_UNUSED =
         "ROLLBACK TRANSACTION;";
+static const char *sql_begin_savepoint MAYBE_UNUSED =
+        "SAVEPOINT pEp_batch;";
+static const char *sql_release_savepoint MAYBE_UNUSED =
+        "RELEASE SAVEPOINT pEp_batch;";
+static const char *sql_rollback_to_savepoint MAYBE_UNUSED =
+        "ROLLBACK TRANSACTION TO SAVEPOINT pEp_batch;";
+static const char *sql_data_version MAYBE_UNUSED =
+        "PRAGMA data_version;";
 
 static const char *sql_log MAYBE_UNUSED =
         "insert into log (title, entity, description, comment)"
@@ -213,7 +400,7 @@ static const char *sql_update_person MAYBE_UNUSED =
         "       main_key_id =  "
         "           (select coalesce( "
         "               (select main_key_id from person where id = ?1), "
-        "                upper(replace(?4,' ',''))))"
+        "                ?4))"
         "   where id = ?1 ;";
 
 // Will cascade.
@@ -270,19 +457,19 @@ static const char *sql_refresh_userid_default_key MAYBE_UNUSED =
 
 static const char *sql_set_pgp_keypair MAYBE_UNUSED =
         "insert or ignore into pgp_keypair (fpr) "
-        "values (upper(replace(?1,' ',''))) ;";
+        "values (?1) ;";
 
 static const char *sql_set_pgp_keypair_flags MAYBE_UNUSED =
         "update pgp_keypair set flags = "
         "    ((?1 & 65535) | (select flags from pgp_keypair "
-        "                     where fpr = (upper(replace(?2,' ',''))))) "
-        "    where fpr = (upper(replace(?2,' ',''))) ;";
+        "                     where fpr = ?2)) "
+        "    where fpr = ?2 ;";
 
 static const char *sql_unset_pgp_keypair_flags MAYBE_UNUSED =
         "update pgp_keypair set flags = "
         "    ( ~(?1 & 65535) & (select flags from pgp_keypair"
-        "                       where fpr = (upper(replace(?2,' ',''))))) "
-        "    where fpr = (upper(replace(?2,' ',''))) ;";
+        "                       where fpr = ?2)) "
+        "    where fpr = ?2 ;";
 
 static const char* sql_exists_identity_entry MAYBE_UNUSED =
         "select count(*) from identity "
@@ -299,26 +486,29 @@ static const char *sql_set_identity_entry MAYBE_UNUSED =
         "       user_id, "
         "       username, "
         "       flags, is_own,"
-        "       pEp_version_major, pEp_version_minor"
+        "       pEp_version_major, pEp_version_minor,"
+        "       last_contact"
         "   ) values ("
         "       ?1,"
-        "       upper(replace(?2,' ','')),"
+        "       ?2,"
         "       ?3,"
         "       ?4,"
         "       ?5,"
         "       ?6,"
         "       ?7,"
-        "       ?8 "
+        "       ?8,"
+        "       strftime('%s','now') "
         "   );";
 
 static const char* sql_update_identity_entry MAYBE_UNUSED =
         "update identity "
-        "   set main_key_id = upper(replace(?2,' ','')), "
+        "   set main_key_id = ?2, "
         "       username = coalesce(username, ?4), "
         "       flags = ?5, "
         "       is_own = ?6, "
         "       pEp_version_major = ?7, "
-        "       pEp_version_minor = ?8 "
+        "       pEp_version_minor = ?8, "
+        "       last_contact = strftime('%s','now') "
         "   where (case when (address = ?1) then (1)"
         "               when (lower(address) = lower(?1)) then (1)"
         "               when (replace(lower(address),'.','') = replace(lower(?1),'.','')) then (1) "
@@ -412,15 +602,15 @@ static const char *sql_upgrade_protocol_version_by_user_id MAYBE_UNUSED =
 
 static const char *sql_set_trust MAYBE_UNUSED =
         "insert into trust (user_id, pgp_keypair_fpr, comm_type) "
-        "values (?1, upper(replace(?2,' ','')), ?3) ;";
+        "values (?1, ?2, ?3) ;";
 
 static const char *sql_update_trust MAYBE_UNUSED =
         "update trust set comm_type = ?3 "
-        "   where user_id = ?1 and pgp_keypair_fpr = upper(replace(?2,' ',''));";
+        "   where user_id = ?1 and pgp_keypair_fpr = ?2;";
 
 static const char *sql_clear_trust_info MAYBE_UNUSED =
         "delete from trust "
-        "   where user_id = ?1 and pgp_keypair_fpr = upper(replace(?2,' ',''));";
+        "   where user_id = ?1 and pgp_keypair_fpr = ?2;";
 
 static const char *sql_update_trust_to_pEp MAYBE_UNUSED =
         "update trust set comm_type = comm_type + 71 "
@@ -432,37 +622,37 @@ static const char *sql_update_trust_to_pEp MAYBE_UNUSED =
 
 static const char* sql_exists_trust_entry MAYBE_UNUSED =
         "select count(*) from trust "
-        "   where user_id = ?1 and pgp_keypair_fpr = upper(replace(?2,' ',''));";
+        "   where user_id = ?1 and pgp_keypair_fpr = ?2;";
 
 static const char *sql_update_trust_for_fpr MAYBE_UNUSED =
         "update trust "
         "set comm_type = ?1 "
-        "where pgp_keypair_fpr = upper(replace(?2,' ','')) ;";
+        "where pgp_keypair_fpr = ?2 ;";
 
 static const char *sql_get_trust MAYBE_UNUSED =
         "select comm_type from trust where user_id = ?1 "
-        "and pgp_keypair_fpr = upper(replace(?2,' ','')) ;";
+        "and pgp_keypair_fpr = ?2 ;";
 
 static const char *sql_get_trust_by_userid MAYBE_UNUSED =
         "select pgp_keypair_fpr, comm_type from trust where user_id = ?1 ";
 
 static const char *sql_least_trust MAYBE_UNUSED =
         "select min(comm_type) from trust where"
-        " pgp_keypair_fpr = upper(replace(?1,' ',''))"
+        " pgp_keypair_fpr = ?1"
         " and comm_type != 0;"; // ignores PEP_ct_unknown
 // returns PEP_ct_unknown only when no known trust is recorded
 
 static const char *sql_update_key_sticky_bit_for_user MAYBE_UNUSED =
         "update trust set sticky = ?1 "
-        "   where user_id = ?2 and pgp_keypair_fpr = upper(replace(?3,' ','')) ;";
+        "   where user_id = ?2 and pgp_keypair_fpr = ?3 ;";
 
 static const char *sql_is_key_sticky_for_user MAYBE_UNUSED =
         "select sticky from trust "
-        "    where user_id = ?1 and pgp_keypair_fpr = upper(replace(?2,' ','')) ; ";
+        "    where user_id = ?1 and pgp_keypair_fpr = ?2 ; ";
 
 static const char *sql_mark_compromised MAYBE_UNUSED =
         "update trust not indexed set comm_type = 15"
-        " where pgp_keypair_fpr = upper(replace(?1,' ','')) ;";
+        " where pgp_keypair_fpr = ?1 ;";
 
 static const char *sql_languagelist MAYBE_UNUSED =
         "select i18n_language.lang, name, phrase"
@@ -477,7 +667,7 @@ static const char *sql_own_key_is_listed MAYBE_UNUSED =
         "select count(*) from ("
         "   select pgp_keypair_fpr from trust"
         "      join identity on trust.user_id = identity.user_id"
-        "      where pgp_keypair_fpr = upper(replace(?1,' ',''))"
+        "      where pgp_keypair_fpr = ?1"
         "           and identity.is_own = 1"
         ");";
 
@@ -543,27 +733,31 @@ static const char* sql_get_default_own_userid MAYBE_UNUSED =
 static const char *sql_sequence_value1 MAYBE_UNUSED =
         "insert or replace into sequences (name, value) "
         "values (?1, "
-        "       (select coalesce((select value + 1 from sequences "
-        "           where name = ?1), 1 ))); ";
+        "       (select coalesce((select value + ?2 from sequences "
+        "           where name = ?1), ?2 ))); ";
 
 static const char *sql_sequence_value2 MAYBE_UNUSED =
         "select value from sequences where name = ?1 ;";
 
+/* Give back the values from ?3 + 1 to ?2, unless some other value was
+   reserved after them. */
+static const char *sql_sequence_value_give_back MAYBE_UNUSED =
+        "update sequences set value = ?3 "
+        "   where name = ?1 and value = ?2 ;";
+
 // Revocation tracking
 static const char *sql_set_revoked MAYBE_UNUSED =
         "insert or replace into revoked_keys ("
         "    revoked_fpr, replacement_fpr, revocation_date) "
-        "values (upper(replace(?1,' ','')),"
-        "        upper(replace(?2,' ','')),"
-        "        ?3) ;";
+        "values (?1, ?2, ?3) ;";
 
 static const char *sql_get_revoked MAYBE_UNUSED =
         "select revoked_fpr, revocation_date from revoked_keys"
-        "    where replacement_fpr = upper(replace(?1,' ','')) ;";
+        "    where replacement_fpr = ?1 ;";
 
 static const char *sql_get_replacement_fpr MAYBE_UNUSED =
         "select replacement_fpr, revocation_date from revoked_keys"
-        "    where revoked_fpr = upper(replace(?1,' ','')) ;";
+        "    where revoked_fpr = ?1 ;";
 
 static const char *sql_get_userid_alias_default MAYBE_UNUSED =
         "select default_id from alternate_user_id "
@@ -572,13 +766,44 @@ static const char *sql_get_userid_alias_default MAYBE_UNUSED =
 // Revocation tracking
 static const char *sql_add_mistrusted_key MAYBE_UNUSED =
         "insert or replace into mistrusted_keys (fpr) "
-        "   values (upper(replace(?1,' ',''))) ;";
+        "   values (?1) ;";
 
 static const char *sql_delete_mistrusted_key MAYBE_UNUSED =
-        "delete from mistrusted_keys where fpr = upper(replace(?1,' ','')) ;";
+        "delete from mistrusted_keys where fpr = ?1 ;";
 
 static const char *sql_is_mistrusted_key MAYBE_UNUSED =
-        "select count(*) from mistrusted_keys where fpr = upper(replace(?1,' ','')) ;";
+        "select count(*) from mistrusted_keys where fpr = ?1 ;";
+
+// Key sets, see key_sets.h
+static const char *sql_all_own_key_fprs MAYBE_UNUSED =
+        "select distinct pgp_keypair_fpr from trust"
+        "   join identity on trust.user_id = identity.user_id"
+        "   where identity.is_own = 1 ;";
+
+static const char *sql_all_mistrusted_keys MAYBE_UNUSED =
+        "select fpr from mistrusted_keys ;";
+
+static const char *sql_all_revoked_keys MAYBE_UNUSED =
+        "select revoked_fpr, replacement_fpr, revocation_date"
+        "    from revoked_keys ;";
+
+// Key import digests
+static const char *sql_key_import_digest_lookup MAYBE_UNUSED =
+        "select fpr from key_import_digest"
+        "    where digest = ?1 and timestamp >= ?2"
+        "    order by rowid ;";
+
+static const char *sql_key_import_digest_record MAYBE_UNUSED =
+        "insert or replace into key_import_digest (digest, fpr, timestamp) "
+        "   values (?1, ?2, ?3) ;";
+
+static const char *sql_key_import_digest_forget MAYBE_UNUSED =
+        "delete from key_import_digest where digest in"
+        "    (select digest from key_import_digest"
+        "         where fpr = ?1) ;";
+
+static const char *sql_key_import_digest_prune MAYBE_UNUSED =
+        "delete from key_import_digest where timestamp < ?1 ;";
 
 static const char *sql_add_userid_alias MAYBE_UNUSED =
         "insert or replace into alternate_user_id (alternate_id, default_id) "
@@ -604,9 +829,17 @@ static const char *sql_has_id_contacted_address MAYBE_UNUSED =
         "select count(*) from social_graph where own_address = ?1 and contact_userid = ?2 ;";
 
 // We only need user_id and address, since in the main usage, we'll call update_identity
-// on this anyway when sending out messages.
-static const char *sql_get_last_contacted MAYBE_UNUSED =
-        "select user_id, address from identity where datetime('now') < datetime(timestamp, '+14 days') ; ";
+// on this anyway when sending out messages.  Pages are seeked through the
+// identity_last_contact index, whose entries are ordered by (last_contact,
+// rowid).
+// ?1, ?2: the last (last_contact, rowid) seen; ?3: the window end; ?4: the page
+// size, negative for no limit
+static const char *sql_get_recent_contacts MAYBE_UNUSED =
+        "select user_id, address, last_contact, rowid from identity"
+        "   where (last_contact, rowid) > (?1, ?2)"
+        "       and last_contact <= ?3"
+        "   order by last_contact, rowid"
+        "   limit ?4 ;";
 
 static const char *sql_create_group MAYBE_UNUSED =
         "insert into groups (group_id, group_address, manager_userid, manager_address) "
@@ -168,7 +168,7 @@ static PEP_STATUS _create_and_send_managed_group_message(PEP_SESSION session,
     _add_auto_consume(enc_msg);
 
     // insert into queue
-    status = session->messageToSend(enc_msg);
+    status = queue_message_to_send(session, enc_msg);
 
     if (status != PEP_STATUS_OK)
         goto pEp_error;
@@ -232,9 +232,16 @@ static PEP_STATUS _send_managed_group_message_to_list(PEP_SESSION session,
     keycopyblob = new_bloblist(key_material_priv, key_material_size,
                                "application/pgp-keys",
                                "file://pEpkey_group_priv.asc");
+    if (!keycopyblob)
+        goto enomem;
+    key_material_priv = NULL; // owned by keycopyblob now
+
+    // Every member's message refers to the same key blob instead of a copy
+    status = bloblist_share(keycopyblob);
+    if (status != PEP_STATUS_OK)
+        goto pEp_error;
 
     // Ok, for every member in the member list, send away.
-    // (We'll copy in for now. It's small and quick.)
     member_list* curr_member = NULL;
 
 
@@ -254,6 +261,10 @@ static PEP_STATUS _send_managed_group_message_to_list(PEP_SESSION session,
         memcpy(data_copy, _data, _size);
 
         bloblist_t* key_attachment = bloblist_dup(keycopyblob);
+        if (!key_attachment) {
+            free(data_copy);
+            goto enomem;
+        }
 
         // encrypt and send this baby and get out
         status = _create_and_send_managed_group_message(session, group->manager, recip, data_copy, _size, key_attachment);
@@ -262,12 +273,15 @@ static PEP_STATUS _send_managed_group_message_to_list(PEP_SESSION session,
             goto pEp_error;
     }
 
+    free_bloblist(keycopyblob);
+    free(_data);
     return status;
 
 enomem:
     status = PEP_OUT_OF_MEMORY;
 
 pEp_error:
+    free_bloblist(keycopyblob);
     free(key_material_priv);
     free(_data);
     return status;
@@ -1364,7 +1378,10 @@ PEP_STATUS receive_GroupInvite(PEP_SESSION session, message* msg, PEP_rating rat
         // to the returned group. #notmyspec ;)
         pEp_identity* grp = identity_dup(group_identity);
         pEp_identity* mgr = identity_dup(manager);
+        PEP_TRACE_SPAN(span);
+        PEP_TRACE_BEGIN(span, "callback.notifyHandshake");
         status = session->notifyHandshake(grp, mgr, SYNC_NOTIFY_GROUP_INVITATION);
+        PEP_TRACE_END(span, status);
     }
 
 pEp_free:
@@ -0,0 +1,354 @@
+/**
+ * @file    import_contacts.c
+ * @brief   Bulk contact import: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#define _EXPORT_PEP_ENGINE_DLL
+#include "import_contacts.h"
+
+#include "pEp_internal.h"
+#include "pEpEngine_internal.h"
+
+#include <string.h>
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/* A record read from the callback, and what parsing its key data found. */
+struct import_record {
+    pEp_identity *identity;
+    char *key_data;
+    size_t key_size;
+
+    stringlist_t *fprs;         /* imported keys, in order, or NULL */
+    PEP_STATUS status;          /* PEP_STATUS_OK if the record can be
+                                   written */
+};
+
+/* Work for one thread parsing: every record of the chunk with index
+   congruent to first modulo step. */
+struct import_worker {
+    PEP_SESSION session;
+    struct import_record *records;
+    size_t record_no;
+    size_t first;
+    size_t step;
+};
+
+
+/* Parsing
+ * ***************************************************************** */
+
+/* Import the key data of the given record into the key store, and complete
+   the identity from what was imported.  This only uses the key store, and
+   never the management database, so that it can run on worker sessions
+   while the calling session holds the write lock. */
+static void import_record_parse(PEP_SESSION session,
+                                struct import_record *record)
+{
+    pEp_identity *identity = record->identity;
+    if (EMPTYSTR(identity->address)) {
+        record->status = PEP_ILLEGAL_VALUE;
+        return;
+    }
+
+    if (record->key_data != NULL && record->key_size > 0) {
+        identity_list *private_keys = NULL;
+        PEP_STATUS status
+            = import_key_with_fpr_return(session, record->key_data,
+                                         record->key_size, & private_keys,
+                                         & record->fprs, NULL);
+        free_identity_list(private_keys);
+        if (status == PEP_OUT_OF_MEMORY) {
+            record->status = status;
+            return;
+        }
+        if (status != PEP_STATUS_OK && status != PEP_KEY_IMPORTED) {
+            LOG_NONOK("cannot import the key data for %s: %s",
+                      identity->address, pEp_status_to_string(status));
+            record->status = status;
+            return;
+        }
+        if (record->fprs != NULL && record->fprs->value == NULL) {
+            free_stringlist(record->fprs);
+            record->fprs = NULL;
+        }
+    }
+
+    if (EMPTYSTR(identity->fpr) && record->fprs != NULL) {
+        free(identity->fpr);
+        identity->fpr = strdup(record->fprs->value);
+        if (identity->fpr == NULL) {
+            record->status = PEP_OUT_OF_MEMORY;
+            return;
+        }
+    }
+    if (! EMPTYSTR(identity->fpr) && identity->comm_type == PEP_ct_unknown) {
+        PEP_comm_type comm_type = PEP_ct_unknown;
+        if (get_key_rating(session, identity->fpr, & comm_type)
+            == PEP_STATUS_OK)
+            identity->comm_type = comm_type;
+    }
+    record->status = PEP_STATUS_OK;
+}
+
+static void *import_worker_body(void *argument)
+{
+    struct import_worker *w = argument;
+    size_t i;
+    for (i = w->first; i < w->record_no; i += w->step)
+        import_record_parse(w->session, w->records + i);
+    return NULL;
+}
+
+/* Parse the given records using the given sessions, one thread each; the
+   first session is the calling one, and runs in this thread.  A worker
+   thread failing to start leaves its records to this thread. */
+static void import_chunk_parse(PEP_SESSION *sessions,
+                               size_t session_no,
+                               struct import_worker *workers,
+                               pEp_thread_t *threads,
+                               bool *started,
+                               struct import_record *records,
+                               size_t record_no)
+{
+    size_t thread_no = (session_no < record_no) ? session_no : record_no;
+    size_t i;
+    for (i = 0; i < thread_no; i ++) {
+        struct import_worker *w = workers + i;
+        w->session = sessions[i];
+        w->records = records;
+        w->record_no = record_no;
+        w->first = i;
+        w->step = thread_no;
+    }
+    for (i = 1; i < thread_no; i ++)
+        started[i] = (pEp_thread_create(threads + i, import_worker_body,
+                                        workers + i) == 0);
+    import_worker_body(workers + 0);
+    for (i = 1; i < thread_no; i ++) {
+        if (started[i])
+            pEp_thread_join(threads[i]);
+        else {
+            workers[i].session = sessions[0];
+            import_worker_body(workers + i);
+        }
+    }
+}
+
+
+/* Writing
+ * ***************************************************************** */
+
+/* Fill in the defaults for the user id and the username. */
+static PEP_STATUS import_record_complete_identity(pEp_identity *identity)
+{
+    if (EMPTYSTR(identity->user_id)) {
+        size_t size = strlen(identity->address) + 6;
+        free(identity->user_id);
+        identity->user_id = calloc(1, size);
+        if (identity->user_id == NULL)
+            return PEP_OUT_OF_MEMORY;
+        snprintf(identity->user_id, size, "TOFU_%s", identity->address);
+    }
+    if (EMPTYSTR(identity->username)) {
+        free(identity->username);
+        identity->username = strdup(identity->address);
+        if (identity->username == NULL)
+            return PEP_OUT_OF_MEMORY;
+    }
+    return PEP_STATUS_OK;
+}
+
+/* Write the rows for one parsed record.  Return PEP_STATUS_OK also when only
+   the record failed, which is then counted in the stats. */
+static PEP_STATUS import_record_write(PEP_SESSION session,
+                                      struct import_record *record,
+                                      PEP_import_contacts_stats *stats)
+{
+    PEP_STATUS status = record->status;
+    if (status == PEP_OUT_OF_MEMORY)
+        return status;
+    stats->imported_key_no += stringlist_length(record->fprs);
+    if (status != PEP_STATUS_OK) {
+        stats->failed_no ++;
+        return PEP_STATUS_OK;
+    }
+
+    status = import_record_complete_identity(record->identity);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    /* set_identity adds the pgp_keypair row of the default key; add the
+       others here. */
+    const stringlist_t *sl;
+    for (sl = record->fprs; sl != NULL && sl->value != NULL; sl = sl->next) {
+        status = set_pgp_keypair(session, sl->value);
+        if (status != PEP_STATUS_OK)
+            break;
+    }
+    if (status == PEP_STATUS_OK)
+        status = set_identity(session, record->identity);
+    if (status == PEP_OUT_OF_MEMORY)
+        return status;
+    if (status != PEP_STATUS_OK) {
+        LOG_NONOK("cannot write the contact %s: %s",
+                  record->identity->address, pEp_status_to_string(status));
+        stats->failed_no ++;
+    }
+    return PEP_STATUS_OK;
+}
+
+static void import_record_clear(struct import_record *record)
+{
+    free_identity(record->identity);
+    free(record->key_data);
+    free_stringlist(record->fprs);
+    memset(record, 0, sizeof (struct import_record));
+}
+
+
+/* API
+ * ***************************************************************** */
+
+DYNAMIC_API PEP_STATUS import_contacts_bulk(
+        PEP_SESSION session,
+        import_contacts_next_t next,
+        import_contacts_progress_t progress,
+        void *context,
+        unsigned int thread_no,
+        PEP_import_contacts_stats *stats
+    )
+{
+    PEP_REQUIRE(session && next);
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    PEP_import_contacts_stats _stats = { 0, 0, 0 };
+    struct import_record *records = NULL;
+    PEP_SESSION *sessions = NULL;
+    struct import_worker *workers = NULL;
+    pEp_thread_t *threads = NULL;
+    bool *started = NULL;
+    size_t session_no = 0;
+    size_t record_no = 0;
+    size_t i;
+    bool batch_begun = false;
+    bool over = false;
+
+#define FAIL(the_status)        \
+    do {                        \
+        status = (the_status);  \
+        goto end;               \
+    } while (false)
+
+    if (stats != NULL)
+        memset(stats, 0, sizeof (PEP_import_contacts_stats));
+
+    /* Join the caller batch, or else make our own. */
+    bool own_batch = ! session->application_batch;
+    if (own_batch && session->transaction_in_progress_no > 0) {
+        LOG_ERROR("cannot import contacts within a transaction");
+        return PEP_ILLEGAL_VALUE;
+    }
+
+    /* Within a batch the calling session already holds the write lock, and
+       opening a session needs the database. */
+    if (thread_no < 1 || ! own_batch)
+        thread_no = 1;
+    records = calloc(PEP_IMPORT_CONTACTS_CHUNK_SIZE,
+                     sizeof (struct import_record));
+    sessions = calloc(thread_no, sizeof (PEP_SESSION));
+    workers = calloc(thread_no, sizeof (struct import_worker));
+    threads = calloc(thread_no, sizeof (pEp_thread_t));
+    started = calloc(thread_no, sizeof (bool));
+    if (records == NULL || sessions == NULL || workers == NULL
+        || threads == NULL || started == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+
+    /* Open the worker sessions before taking the lock; go on with fewer
+       threads if some fail. */
+    sessions[session_no ++] = session;
+    for (i = 1; i < thread_no; i ++) {
+        PEP_SESSION worker = pEp_new_worker_session(session);
+        if (worker != NULL)
+            sessions[session_no ++] = worker;
+    }
+
+    if (own_batch) {
+        status = pEp_begin_batch(session);
+        if (status != PEP_STATUS_OK)
+            goto end;
+        batch_begun = true;
+    }
+
+    while (! over) {
+        /* Read a chunk. */
+        record_no = 0;
+        while (record_no < PEP_IMPORT_CONTACTS_CHUNK_SIZE) {
+            struct import_record *record = records + record_no;
+            status = next(context, & record->identity, & record->key_data,
+                          & record->key_size);
+            if (status != PEP_STATUS_OK) {
+                LOG_NONOK("the record callback failed: %s",
+                          pEp_status_to_string(status));
+                import_record_clear(record);
+                goto end;
+            }
+            if (record->identity == NULL) {
+                free(record->key_data);
+                record->key_data = NULL;
+                over = true;
+                break;
+            }
+            record_no ++;
+        }
+        if (record_no == 0)
+            break;
+        _stats.record_no += record_no;
+
+        /* Parse it in parallel, then write it here. */
+        import_chunk_parse(sessions, session_no, workers, threads, started,
+                           records, record_no);
+        for (i = 0; i < record_no; i ++) {
+            status = import_record_write(session, records + i, & _stats);
+            if (status != PEP_STATUS_OK)
+                goto end;
+        }
+        for (i = 0; i < record_no; i ++)
+            import_record_clear(records + i);
+        record_no = 0;
+
+        if (progress != NULL)
+            progress(context, & _stats);
+    }
+
+ end:
+    if (batch_begun) {
+        PEP_STATUS end_status = pEp_end_batch(session,
+                                              status == PEP_STATUS_OK);
+        if (status == PEP_STATUS_OK)
+            status = end_status;
+    }
+    for (i = 1; i < session_no; i ++)
+        release(sessions[i]);
+    if (records != NULL)
+        for (i = 0; i < record_no; i ++)
+            import_record_clear(records + i);
+    free(records);
+    free(sessions);
+    free(workers);
+    free(threads);
+    free(started);
+
+    if (stats != NULL)
+        * stats = _stats;
+    if (status == PEP_STATUS_OK)
+        LOG_EVENT("imported %li contacts with %li keys, %li failed",
+                  (long) _stats.record_no, (long) _stats.imported_key_no,
+                  (long) _stats.failed_no);
+    LOG_NONOK_STATUS_NONOK;
+    return status;
+#undef FAIL
+}
@@ -0,0 +1,158 @@
+/**
+ * @file    import_contacts.h
+ * @brief   Bulk contact import: many contacts and their keys at once, for
+ *          example when migrating an address book
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef IMPORT_CONTACTS_H
+#define IMPORT_CONTACTS_H
+
+#include <stddef.h>
+
+#include "pEpEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* Importing contacts one at a time with import_key_with_fpr_return and
+   set_identity costs a key parse and a committed transaction for each, and
+   the management database lock is taken and released every time.
+
+   import_contacts_bulk instead reads records from a callback, a chunk of
+   PEP_IMPORT_CONTACTS_CHUNK_SIZE records at a time.  The keys of each chunk
+   are parsed and stored into the key store in parallel by several threads;
+   then the calling thread writes the pgp_keypair, person, identity and trust
+   rows of the chunk, reusing the same prepared statements, and every chunk
+   goes into one transaction which is committed at the end. */
+
+/// how many records are read, then parsed, then written at a time
+#define PEP_IMPORT_CONTACTS_CHUNK_SIZE 512
+
+
+/* API
+ * ***************************************************************** */
+
+/**
+ *  @typedef    import_contacts_next_t
+ *
+ *  @brief      Callback supplying the next record to import_contacts_bulk .
+ *
+ *  @param[in]  context     the pointer supplied to import_contacts_bulk
+ *  @param[out] identity    the contact identity, or NULL at the end of the
+ *                          records; the address is required, and:
+ *                          - an empty user_id stands for "TOFU_" followed
+ *                            by the address, as for an unknown partner;
+ *                          - an empty username stands for the address;
+ *                          - an empty fpr stands for the first key imported
+ *                            from key_data, if any;
+ *                          - a comm_type of PEP_ct_unknown stands for the
+ *                            rating of the key in fpr
+ *  @param[out] key_data    ASCII armored or binary key data for the contact,
+ *                          or NULL
+ *  @param[out] key_size    the size of key_data
+ *
+ *  @retval PEP_STATUS_OK   a record was returned, or the records are over
+ *  @retval any other value stop importing, and fail with this status
+ *
+ *  @ownership  identity and key_data go to the Engine; key_data must be
+ *              allocated with malloc
+ *
+ *  @warning    this is called from the calling thread of
+ *              import_contacts_bulk ; it must not call into the Engine with
+ *              the session given to it
+ *
+ */
+typedef PEP_STATUS (*import_contacts_next_t)(void *context,
+                                             pEp_identity **identity,
+                                             char **key_data,
+                                             size_t *key_size);
+
+/**
+ *  @struct     PEP_import_contacts_stats
+ *
+ *  @brief      Counts of what import_contacts_bulk has done so far.
+ *
+ */
+typedef struct _PEP_import_contacts_stats {
+    size_t record_no;           ///< records read
+    size_t imported_key_no;     ///< keys imported into the key store
+    size_t failed_no;           ///< records not written, because their key
+                                ///< data could not be imported or their
+                                ///< identity was not valid
+} PEP_import_contacts_stats;
+
+/**
+ *  @typedef    import_contacts_progress_t
+ *
+ *  @brief      Callback notified by import_contacts_bulk after each chunk of
+ *              records has been written, before they are committed.
+ *
+ *  @param[in]  context     the pointer supplied to import_contacts_bulk
+ *  @param[in]  stats       the counts so far
+ *
+ *  @warning    this is called from the calling thread of
+ *              import_contacts_bulk ; it must not call into the Engine with
+ *              the session given to it
+ *
+ */
+typedef void (*import_contacts_progress_t)(
+        void *context, const PEP_import_contacts_stats *stats);
+
+/**
+ *  <!--       import_contacts_bulk()       -->
+ *
+ *  @brief Import contacts and their keys, as import_key_with_fpr_return
+ *         followed by set_identity would for each, in one transaction.
+ *
+ *         Keys are parsed on worker sessions opened for the purpose, with
+ *         the same callbacks and passphrase as the given session.  If the
+ *         given session is in a batch (see pEp_begin_batch) the contacts are
+ *         written within it and left uncommitted, and keys are parsed on the
+ *         given session only; otherwise the whole import is committed at the
+ *         end, or rolled back on failure.  Keys already stored into the key
+ *         store are not removed on rollback.
+ *
+ *         A record failing on its own, because of its key data or identity,
+ *         is counted in the failures and skipped; any other error stops the
+ *         import.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   next           called for each record
+ *  @param[in]   progress       called after each chunk; may be NULL
+ *  @param[in]   context        passed to next and progress as is
+ *  @param[in]   thread_no      number of threads parsing keys, counting the
+ *                              calling one; 0 and 1 mean only the calling
+ *                              thread
+ *  @param[out]  stats          the final counts; may be NULL
+ *
+ *  @retval PEP_STATUS_OK           every record has been processed
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values, or a
+ *                                  transaction other than a batch is in
+ *                                  progress
+ *  @retval PEP_OUT_OF_MEMORY       out of memory
+ *  @retval PEP_WOULD_BLOCK         in non-blocking mode, the management
+ *                                  database is locked
+ *  @retval any other value         returned by next
+ *
+ */
+DYNAMIC_API PEP_STATUS import_contacts_bulk(
+        PEP_SESSION session,
+        import_contacts_next_t next,
+        import_contacts_progress_t progress,
+        void *context,
+        unsigned int thread_no,
+        PEP_import_contacts_stats *stats
+    );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef IMPORT_CONTACTS_H */
@@ -12,6 +12,7 @@
    --positron, 2022-10 */
 
 #include "pEp_internal.h"
+#include "engine_sql.h"
 #include "dynamic_api.h"
 #include "message_api.h"
 #include "key_reset.h"
@@ -396,8 +397,7 @@ PEP_STATUS has_key_reset_been_sent(
     }
     
     sql_reset_and_clear_bindings(session->was_id_for_revoke_contacted);
-    sqlite3_bind_text(session->was_id_for_revoke_contacted, 1, revoked_fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->was_id_for_revoke_contacted, 1, revoked_fpr);
     sqlite3_bind_text(session->was_id_for_revoke_contacted, 2, from_addr, -1,
             SQLITE_STATIC);        
     sqlite3_bind_text(session->was_id_for_revoke_contacted, 3, user_id, -1,
@@ -432,8 +432,7 @@ PEP_STATUS set_reset_contact_notified(
 
     PEP_STATUS status = PEP_STATUS_OK;
     sql_reset_and_clear_bindings(session->set_revoke_contact_as_notified);
-    sqlite3_bind_text(session->set_revoke_contact_as_notified, 1, revoke_fpr, -1, 
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->set_revoke_contact_as_notified, 1, revoke_fpr);
     sqlite3_bind_text(session->set_revoke_contact_as_notified, 2, own_address, -1, 
             SQLITE_STATIC);            
     sqlite3_bind_text(session->set_revoke_contact_as_notified, 3, contact_id, -1,
@@ -908,8 +907,7 @@ static PEP_STATUS send_key_reset_to_active_group_members(PEP_SESSION session,
     identity_list* reset_ident_list = NULL;
     message* outmsg = NULL;
 
-    messageToSend_t send_cb = session->messageToSend;
-    if (!send_cb)
+    if (!session->messageToSend)
         return PEP_SYNC_NO_MESSAGE_SEND_CALLBACK;
 
     // Get active group member list
@@ -985,7 +983,7 @@ static PEP_STATUS send_key_reset_to_active_group_members(PEP_SESSION session,
             _add_auto_consume(enc_msg);
 
             // insert into queue
-            status = send_cb(enc_msg);
+            status = queue_message_to_send(session, enc_msg);
 
             if (status != PEP_STATUS_OK) // FIXME: Do we still own enc_msg on failure?
                 goto pEp_free;
@@ -1004,6 +1002,40 @@ pEp_free:
     return status;
 }
 
+#define KEY_RESET_RECENTS_PAGE_SIZE 64
+
+/**
+ *  @internal
+ *
+ *  <!--       _next_recent_contact()       -->
+ *
+ *  @brief      Move to the next recent contact, fetching the next page when
+ *              the current one is over.  At the end of the walk, or on
+ *              error, *curr is set to NULL.
+ *
+ *  @param[in]      session     session handle
+ *  @param[inout]   cursor      the walk
+ *  @param[inout]   page        the current page, replaced by the next one
+ *  @param[inout]   curr        the current contact in the page
+ *
+ */
+static PEP_STATUS _next_recent_contact(PEP_SESSION session,
+                                       pEp_recent_contacts_cursor* cursor,
+                                       identity_list** page,
+                                       identity_list** curr) {
+    if ((*curr)->next) {
+        *curr = (*curr)->next;
+        return PEP_STATUS_OK;
+    }
+
+    free_identity_list(*page);
+    *page = NULL;
+    PEP_STATUS status = get_recent_contacts(session, cursor,
+                                            KEY_RESET_RECENTS_PAGE_SIZE, page);
+    *curr = *page;
+    return status;
+}
+
 PEP_STATUS send_key_reset_to_recents(PEP_SESSION session,
                                      pEp_identity* from_ident,
                                      const char* old_fpr, 
@@ -1014,8 +1046,7 @@ PEP_STATUS send_key_reset_to_recents(PEP_SESSION session,
                 && ! EMPTYSTR(old_fpr) && ! EMPTYSTR(new_fpr));
 //    assert(session->messageToSend); NO. Don't assert this, FFS.
 
-    messageToSend_t send_cb = session->messageToSend;
-    if (!send_cb)
+    if (!session->messageToSend)
         return PEP_SYNC_NO_MESSAGE_SEND_CALLBACK;
 
     bool is_group_ident = (from_ident->flags & PEP_idf_group_ident);
@@ -1023,14 +1054,24 @@ PEP_STATUS send_key_reset_to_recents(PEP_SESSION session,
     identity_list* recent_contacts = NULL;
     message* reset_msg = NULL;
 
-    PEP_STATUS status = get_last_contacted(session, &recent_contacts);
+    // Walk through the recent contacts one page at a time, rather than
+    // holding all of them in memory.
+    pEp_recent_contacts_cursor cursor;
+    start_recent_contacts(session, PEP_RECENT_CONTACTS_DEFAULT_WINDOW, &cursor);
+    PEP_STATUS status = get_recent_contacts(session, &cursor,
+                                            KEY_RESET_RECENTS_PAGE_SIZE,
+                                            &recent_contacts);
+    if (status == PEP_STATUS_OK && !recent_contacts)
+        status = PEP_CANNOT_FIND_IDENTITY;
     
     if (status != PEP_STATUS_OK)
         goto pEp_free;
                     
     identity_list* curr_id_ptr = recent_contacts;
 
-    for (curr_id_ptr = recent_contacts; curr_id_ptr; curr_id_ptr = curr_id_ptr->next) {
+    for (curr_id_ptr = recent_contacts; curr_id_ptr;
+         status = _next_recent_contact(session, &cursor, &recent_contacts,
+                                       &curr_id_ptr)) {
         pEp_identity* curr_id = curr_id_ptr->ident;
         
         if (!curr_id)
@@ -1104,7 +1145,7 @@ PEP_STATUS send_key_reset_to_recents(PEP_SESSION session,
 
         _add_auto_consume(reset_msg);        
         // insert into queue
-        status = send_cb(reset_msg);
+        status = queue_message_to_send(session, reset_msg);
 
         if (status != PEP_STATUS_OK) {
             free(reset_msg);
@@ -1415,8 +1456,7 @@ static PEP_STATUS _key_reset_device_group_for_shared_key(PEP_SESSION session,
                                                          bool grouped_only) {
     PEP_REQUIRE(session && key_idents && ! EMPTYSTR (old_key));
 
-    messageToSend_t send_cb = session->messageToSend;
-    if (!send_cb)
+    if (!session->messageToSend)
         return PEP_SYNC_NO_MESSAGE_SEND_CALLBACK;
 
     PEP_STATUS status = PEP_STATUS_OK;
@@ -1514,7 +1554,7 @@ static PEP_STATUS _key_reset_device_group_for_shared_key(PEP_SESSION session,
             _add_auto_consume(enc_msg);
 
             // insert into queue
-            status = send_cb(enc_msg);
+            status = queue_message_to_send(session, enc_msg);
 
             if (status != PEP_STATUS_OK)
                 goto pEp_error;
@@ -0,0 +1,364 @@
+/**
+ * @file    key_sets.c
+ * @brief   Key sets: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#include "key_sets.h"
+
+#include "pEp_internal.h"
+#include "engine_sql.h"
+
+#include <string.h>
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/* A key in a set.  Only revoked keys have a replacement and a date. */
+struct key_set_entry {
+    char *fpr;                  /* canonical */
+    char *replacement_fpr;
+    uint64_t revocation_date;
+};
+
+#define KEY_SET_BLOOM_BIT_NO 4096
+
+/* A loaded set: an open-addressing hash table, whose size is a power of two
+   kept at least twice the number of entries, and a Bloom filter with three bits
+   per entry. */
+struct key_set {
+    uint64_t generation;
+    size_t entry_no;
+    size_t slot_no;
+    struct key_set_entry *slots;        /* free slots have a NULL fpr */
+    unsigned char bloom[KEY_SET_BLOOM_BIT_NO / 8];
+};
+
+/* The sets, shared by every session in the process.  A NULL pointer means not
+   loaded.  The pointers are protected by the mutex; a set is never modified
+   after being published, and is only freed with the mutex held. */
+static pEp_mutex_t key_sets_mutex = PEP_MUTEX_INITIALIZER;
+static struct key_set *key_sets[pEp_sql_key_set__count];
+
+
+/* Hashing
+ * ***************************************************************** */
+
+/* 64-bit FNV-1a of a canonical fingerprint. */
+static uint64_t key_set_hash(const char *fpr)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    for (p = (const unsigned char *) fpr; * p != '\0'; p ++) {
+        hash ^= * p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* The i-th Bloom filter bit for the given hash, by double hashing. */
+static size_t key_set_bloom_bit(uint64_t hash, int i)
+{
+    uint32_t h1 = (uint32_t) hash;
+    uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+    return (size_t) ((h1 + (uint32_t) i * h2) % KEY_SET_BLOOM_BIT_NO);
+}
+
+
+/* Sets
+ * ***************************************************************** */
+
+static void free_key_set(struct key_set *set)
+{
+    if (set == NULL)
+        return;
+
+    size_t i;
+    for (i = 0; i < set->slot_no; i ++) {
+        free(set->slots[i].fpr);
+        free(set->slots[i].replacement_fpr);
+    }
+    free(set->slots);
+    free(set);
+}
+
+/* Return the slot holding the given canonical fingerprint, or the free slot
+   where it would go. */
+static struct key_set_entry *key_set_slot(const struct key_set *set,
+                                          const char *fpr, uint64_t hash)
+{
+    size_t mask = set->slot_no - 1;
+    size_t i;
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        struct key_set_entry *slot = set->slots + i;
+        if (slot->fpr == NULL || strcmp(slot->fpr, fpr) == 0)
+            return slot;
+    }
+}
+
+/* Make an empty set, or return NULL if out of memory. */
+static struct key_set *new_key_set(uint64_t generation)
+{
+    struct key_set *set = calloc(1, sizeof(struct key_set));
+    if (set == NULL)
+        return NULL;
+    set->generation = generation;
+    set->slot_no = 16;
+    set->slots = calloc(set->slot_no, sizeof(struct key_set_entry));
+    if (set->slots == NULL) {
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+/* Double the number of slots.  Return false if out of memory, leaving the set
+   as it was. */
+static bool key_set_grow(struct key_set *set)
+{
+    struct key_set old = * set;
+    set->slot_no = old.slot_no * 2;
+    set->slots = calloc(set->slot_no, sizeof(struct key_set_entry));
+    if (set->slots == NULL) {
+        * set = old;
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < old.slot_no; i ++)
+        if (old.slots[i].fpr != NULL)
+            * key_set_slot(set, old.slots[i].fpr,
+                           key_set_hash(old.slots[i].fpr)) = old.slots[i];
+    free(old.slots);
+    return true;
+}
+
+/* Add a fingerprint to the set, taking ownership of the replacement.  Return
+   false if out of memory.  A fingerprint already present is not replaced. */
+static bool key_set_add(struct key_set *set, const char *fpr,
+                        char *replacement_fpr, uint64_t revocation_date)
+{
+    /* Keep at least half of the slots free, so that probing stays short and
+       always ends at a free slot. */
+    if ((set->entry_no + 1) * 2 > set->slot_no && ! key_set_grow(set)) {
+        free(replacement_fpr);
+        return false;
+    }
+    char *canonical = pEp_sql_canonical_fpr(fpr);
+    if (canonical == NULL) {
+        free(replacement_fpr);
+        return false;
+    }
+    uint64_t hash = key_set_hash(canonical);
+    struct key_set_entry *slot = key_set_slot(set, canonical, hash);
+    if (slot->fpr != NULL) {
+        free(canonical);
+        free(replacement_fpr);
+        return true;
+    }
+    slot->fpr = canonical;
+    slot->replacement_fpr = replacement_fpr;
+    slot->revocation_date = revocation_date;
+    set->entry_no ++;
+    int i;
+    for (i = 0; i < 3; i ++) {
+        size_t bit = key_set_bloom_bit(hash, i);
+        set->bloom[bit / 8] |= (unsigned char) (1u << (bit % 8));
+    }
+    return true;
+}
+
+/* Return the entry for the given canonical fingerprint, or NULL. */
+static const struct key_set_entry *key_set_find(const struct key_set *set,
+                                                const char *fpr)
+{
+    uint64_t hash = key_set_hash(fpr);
+    int i;
+    for (i = 0; i < 3; i ++) {
+        size_t bit = key_set_bloom_bit(hash, i);
+        if (! (set->bloom[bit / 8] & (1u << (bit % 8))))
+            return NULL;
+    }
+    const struct key_set_entry *slot = key_set_slot(set, fpr, hash);
+    return (slot->fpr == NULL) ? NULL : slot;
+}
+
+
+/* Loading
+ * ***************************************************************** */
+
+/* Return the prepared statement listing the given set: the first column is the
+   fingerprint and, for revoked keys, the second and third are the replacement
+   and the date. */
+static sqlite3_stmt *key_set_statement(PEP_SESSION session,
+                                       pEp_sql_key_set which)
+{
+    switch (which) {
+    case pEp_sql_key_set_own:
+        return session->all_own_key_fprs;
+    case pEp_sql_key_set_mistrusted:
+        return session->all_mistrusted_keys;
+    case pEp_sql_key_set_revoked:
+        return session->all_revoked_keys;
+    default:
+        return NULL;
+    }
+}
+
+/* Read the given set from the database, or return NULL on error. */
+static struct key_set *load_key_set(PEP_SESSION session,
+                                    pEp_sql_key_set which,
+                                    uint64_t generation)
+{
+    sqlite3_stmt *statement = key_set_statement(session, which);
+    if (statement == NULL)
+        return NULL;
+
+    /* The table grows as rows come, in a single pass over the statement. */
+    struct key_set *set = new_key_set(generation);
+    if (set == NULL)
+        return NULL;
+    int result;
+    sql_reset_and_clear_bindings(statement);
+    while ((result = pEp_sqlite3_step_nonbusy(session, statement))
+           == SQLITE_ROW) {
+        const char *fpr = (const char *) sqlite3_column_text(statement, 0);
+        if (EMPTYSTR(fpr))
+            continue;
+        char *replacement_fpr = NULL;
+        uint64_t revocation_date = 0;
+        if (which == pEp_sql_key_set_revoked) {
+            const char *replacement
+                = (const char *) sqlite3_column_text(statement, 1);
+            if (replacement != NULL) {
+                replacement_fpr = strdup(replacement);
+                if (replacement_fpr == NULL)
+                    goto error;
+            }
+            revocation_date = sqlite3_column_int64(statement, 2);
+        }
+        if (! key_set_add(set, fpr, replacement_fpr, revocation_date))
+            goto error;
+    }
+    sql_reset_and_clear_bindings(statement);
+    if (result != SQLITE_DONE) {
+        free_key_set(set);
+        return NULL;
+    }
+    LOG_TRACE("loaded key set %i with %lu keys", (int) which,
+              (unsigned long) set->entry_no);
+    return set;
+
+ error:
+    sql_reset_and_clear_bindings(statement);
+    free_key_set(set);
+    return NULL;
+}
+
+/* Find the given fingerprint in the given set, loading it if needed.  On
+   success return true and set * found and, when found, * entry to a copy of
+   the entry whose replacement belongs to the caller.  Return false when the
+   set cannot be used. */
+static bool key_sets_lookup(PEP_SESSION session, pEp_sql_key_set which,
+                            const char *fpr, bool *found,
+                            struct key_set_entry *entry)
+{
+    /* Our own uncommitted changes are not for the other sessions to see, and
+       our view differs from the committed state: ask the database. */
+    if (session->uncommitted_key_set_changes & (1u << which))
+        return false;
+
+    uint64_t generation;
+    if (pEp_sql_get_key_set_generation(session, which, & generation)
+        != PEP_STATUS_OK)
+        return false;
+
+    char *canonical = pEp_sql_canonical_fpr(fpr);
+    if (canonical == NULL)
+        return false;
+
+    pEp_mutex_lock(& key_sets_mutex);
+    struct key_set *set = key_sets[which];
+    if (set == NULL || set->generation != generation) {
+        /* Load without holding the mutex, as the query may have to wait for
+           the database.  The set is tagged with the generation read before
+           loading: if anything changes meanwhile it will be loaded again. */
+        pEp_mutex_unlock(& key_sets_mutex);
+        struct key_set *new_set = load_key_set(session, which, generation);
+        if (new_set == NULL) {
+            free(canonical);
+            return false;
+        }
+        pEp_mutex_lock(& key_sets_mutex);
+        free_key_set(key_sets[which]);
+        key_sets[which] = set = new_set;
+    }
+
+    bool success = true;
+    const struct key_set_entry *e = key_set_find(set, canonical);
+    * found = (e != NULL);
+    if (e != NULL && entry != NULL) {
+        * entry = * e;
+        entry->fpr = NULL;
+        if (e->replacement_fpr != NULL) {
+            entry->replacement_fpr = strdup(e->replacement_fpr);
+            if (entry->replacement_fpr == NULL)
+                success = false;
+        }
+    }
+    pEp_mutex_unlock(& key_sets_mutex);
+    free(canonical);
+    return success;
+}
+
+
+/* API
+ * ***************************************************************** */
+
+bool pEp_key_sets_is_own_listed(PEP_SESSION session, const char *fpr,
+                                bool *listed)
+{
+    PEP_REQUIRE_ORELSE(session && ! EMPTYSTR(fpr) && listed,
+                       { return false; });
+
+    return key_sets_lookup(session, pEp_sql_key_set_own, fpr, listed, NULL);
+}
+
+bool pEp_key_sets_is_mistrusted(PEP_SESSION session, const char *fpr,
+                                bool *mistrusted)
+{
+    PEP_REQUIRE_ORELSE(session && ! EMPTYSTR(fpr) && mistrusted,
+                       { return false; });
+
+    return key_sets_lookup(session, pEp_sql_key_set_mistrusted, fpr,
+                           mistrusted, NULL);
+}
+
+bool pEp_key_sets_get_replacement(PEP_SESSION session, const char *fpr,
+                                  bool *revoked, char **replacement_fpr,
+                                  uint64_t *revocation_date)
+{
+    PEP_REQUIRE_ORELSE(session && ! EMPTYSTR(fpr) && revoked
+                       && replacement_fpr && revocation_date,
+                       { return false; });
+
+    struct key_set_entry entry;
+    memset(& entry, 0, sizeof(entry));
+    if (! key_sets_lookup(session, pEp_sql_key_set_revoked, fpr, revoked,
+                          & entry))
+        return false;
+    * replacement_fpr = entry.replacement_fpr;
+    * revocation_date = entry.revocation_date;
+    return true;
+}
+
+void pEp_key_sets_drop(void)
+{
+    pEp_mutex_lock(& key_sets_mutex);
+    int i;
+    for (i = 0; i < pEp_sql_key_set__count; i ++) {
+        free_key_set(key_sets[i]);
+        key_sets[i] = NULL;
+    }
+    pEp_mutex_unlock(& key_sets_mutex);
+}
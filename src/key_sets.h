@@ -0,0 +1,112 @@
+/**
+ * @file    key_sets.h
+ * @brief   Key sets: process-wide in-memory copies of the own, mistrusted
+ *          and revoked key tables, answering the hot membership checks
+ *          without a database query
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef KEY_SETS_H
+#define KEY_SETS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pEpEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* Checking whether a key is own, mistrusted or revoked happens many times
+   for each message, and used to cost a query each time.  The three tables
+   are small, so the whole process keeps them in memory: a hash set for each,
+   behind a Bloom filter which answers most negative checks, by far the most
+   common, with three bit tests.
+
+   Each set is loaded lazily and is valid for one key set generation (see
+   pEp_sql_get_key_set_generation in engine_sql.h): a change to its tables
+   through any session of the process, or a commit from another connection,
+   makes it reload at its next use.  A session with uncommitted changes to
+   the tables of a set does not use the set, which would not show them.
+
+   Each function returns true if it answered, and false if the caller must
+   ask the database instead, for example because memory was exhausted. */
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+/**
+ *  @internal
+ *  <!--       pEp_key_sets_is_own_listed()       -->
+ *
+ *  @brief     Check whether the given key is listed in trust for an own
+ *             identity, like own_key_is_listed .
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   fpr            the fingerprint, in any case and spacing
+ *  @param[out]  listed         the answer, only set when returning true
+ *
+ *  @retval      true if answered
+ */
+bool pEp_key_sets_is_own_listed(PEP_SESSION session, const char *fpr,
+                                bool *listed);
+
+/**
+ *  @internal
+ *  <!--       pEp_key_sets_is_mistrusted()       -->
+ *
+ *  @brief     Check whether the given key is in mistrusted_keys , like
+ *             is_mistrusted_key .
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   fpr            the fingerprint, in any case and spacing
+ *  @param[out]  mistrusted     the answer, only set when returning true
+ *
+ *  @retval      true if answered
+ */
+bool pEp_key_sets_is_mistrusted(PEP_SESSION session, const char *fpr,
+                                bool *mistrusted);
+
+/**
+ *  @internal
+ *  <!--       pEp_key_sets_get_replacement()       -->
+ *
+ *  @brief     Look for the given key in revoked_keys , like
+ *             get_replacement_fpr .
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   fpr                the fingerprint, in any case and spacing
+ *  @param[out]  revoked            true if the key is revoked; only set when
+ *                                  returning true
+ *  @param[out]  replacement_fpr    a copy of the replacement, owned by the
+ *                                  caller, when revoked ; NULL otherwise
+ *  @param[out]  revocation_date    the revocation date when revoked ; 0
+ *                                  otherwise
+ *
+ *  @retval      true if answered
+ */
+bool pEp_key_sets_get_replacement(PEP_SESSION session, const char *fpr,
+                                  bool *revoked, char **replacement_fpr,
+                                  uint64_t *revocation_date);
+
+/**
+ *  @internal
+ *  <!--       pEp_key_sets_drop()       -->
+ *
+ *  @brief     Free every loaded key set; they will be loaded again when
+ *             needed.
+ */
+void pEp_key_sets_drop(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef KEY_SETS_H */
@@ -18,6 +18,9 @@
 #include "keymanagement_internal.h"
 #include "KeySync_fsm.h"
 #include "media_key.h"
+#include "key_sets.h"
+#include "engine_sql.h"
+#include "sql_read_pool.h"
 
 static bool key_matches_address(PEP_SESSION session, const char* address,
                                 const char* fpr) {
@@ -57,18 +60,33 @@ PEP_STATUS validate_fpr(PEP_SESSION session,
     PEP_STATUS status = PEP_STATUS_OK;
         
     char* fpr = ident->fpr;
-    
-    bool has_private = false;
-    status = contains_priv_key(session, fpr, &has_private);
+
+    // If the driver can tell us everything we need to know about the key in
+    // one lookup, do it now; otherwise ask for each field only where it is
+    // needed, as the rating is only needed when the trust has none.
+    // Should not need to decrypt key material.
+    bool one_lookup
+        = (session->cryptotech[PEP_crypt_OpenPGP].get_key_status != NULL);
+    time_t exp_time = (ident->me ? 
+                       time(NULL) + (7*24*3600) : time(NULL));
+    PEP_key_status key_status;
+    PEP_STATUS key_status_status
+        = get_key_status(session, fpr, exp_time,
+                         one_lookup
+                         ? (PEP_key_status_private | PEP_key_status_rating
+                            | PEP_key_status_revoked | PEP_key_status_expired)
+                         : PEP_key_status_private,
+                         &key_status);
+    if (key_status_status == PEP_OUT_OF_MEMORY)
+        return PEP_OUT_OF_MEMORY;
+
+    bool has_private = key_status.has_private;
     
     // N.B. Will not contain PEP_PASSPHRASE related returns here
     if (ident->me && own_must_contain_private) {
-        if (status != PEP_STATUS_OK || !has_private)
+        if (key_status_status != PEP_STATUS_OK || !has_private)
             return PEP_KEY_UNSUITABLE;
     }
-    else if (status != PEP_STATUS_OK && has_private) { // should never happen
-        has_private = false;
-    }
     
     ident->comm_type = PEP_ct_unknown;
     
@@ -83,21 +101,25 @@ PEP_STATUS validate_fpr(PEP_SESSION session,
 
     PEP_comm_type ct = ident->comm_type;
 
-    if (ct == PEP_ct_unknown) {
-        // If status is bad, it's ok, we get the rating
-        // we should use then (PEP_ct_unknown).
-        // Only one we really care about here is PEP_OUT_OF_MEMORY
-        status = get_key_rating(session, fpr, &ct);
+    if (! one_lookup
+        && (ct == PEP_ct_unknown || ct == PEP_ct_key_expired
+            || ct == PEP_ct_key_expired_but_confirmed)) {
+        PEP_key_status rating_status;
+        status = get_key_status(session, fpr, exp_time, PEP_key_status_rating,
+                                &rating_status);
         if (status == PEP_OUT_OF_MEMORY)
             return PEP_OUT_OF_MEMORY;
+        key_status.comm_type = rating_status.comm_type;
+    }
 
+    if (ct == PEP_ct_unknown) {
+        // If we could not get the rating, it's ok, we get the rating
+        // we should use then (PEP_ct_unknown).
+        ct = key_status.comm_type;
         ident->comm_type = ct;
     }
     else if (ct == PEP_ct_key_expired || ct == PEP_ct_key_expired_but_confirmed) {
-        PEP_comm_type ct_expire_check = PEP_ct_unknown;
-        status = get_key_rating(session, fpr, &ct_expire_check);
-        if (status == PEP_OUT_OF_MEMORY)
-            return PEP_OUT_OF_MEMORY;
+        PEP_comm_type ct_expire_check = key_status.comm_type;
 
         if (ct_expire_check >= PEP_ct_strong_but_unconfirmed) {
             ident->comm_type = ct_expire_check;
@@ -128,26 +150,22 @@ PEP_STATUS validate_fpr(PEP_SESSION session,
         }
     }
     
-    bool revoked, expired;
-
-    // Should not need to decrypt key material
-    status = key_revoked(session, fpr, &revoked);    
-        
-    if (status != PEP_STATUS_OK) {
-        return status;
+    if (! one_lookup) {
+        PEP_key_status validity_status;
+        key_status_status
+            = get_key_status(session, fpr, exp_time,
+                             PEP_key_status_revoked | PEP_key_status_expired,
+                             &validity_status);
+        key_status.revoked = validity_status.revoked;
+        key_status.expired = validity_status.expired;
     }
-    
-    if (!revoked) {
-        time_t exp_time = (ident->me ? 
-                           time(NULL) + (7*24*3600) : time(NULL));
 
-        // Should not need to decrypt key material                           
-        status = key_expired(session, fpr, 
-                             exp_time,
-                             &expired);
-        
-        PEP_WEAK_ASSERT_ORELSE_RETURN(status == PEP_STATUS_OK, status);
-    }
+    // We cannot tell whether the key is revoked or expired
+    if (key_status_status != PEP_STATUS_OK)
+        return key_status_status;
+
+    bool revoked = key_status.revoked;
+    bool expired = key_status.expired;
             
     // Renew key if it's expired, our own, has a private part,
     // isn't too weak, and we didn't say "DON'T DO THIS"
@@ -656,7 +674,7 @@ static PEP_STATUS prepare_updated_identity(PEP_SESSION session,
 
 // Should not return PASSPHRASE errors because we force 
 // calls that can cause key renewal not to.
-DYNAMIC_API PEP_STATUS update_identity(
+static PEP_STATUS _update_identity(
         PEP_SESSION session, pEp_identity * identity
     )
 {
@@ -930,6 +948,27 @@ pEp_free:
     return status;
 }
 
+DYNAMIC_API PEP_STATUS update_identity(
+        PEP_SESSION session, pEp_identity * identity
+    )
+{
+    PEP_REQUIRE(session && identity && !EMPTYSTR(identity->address));
+
+    /* In non-blocking mode do the whole work in one transaction, or fail
+       immediately.  See config_nonblocking_sql . */
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "api.update_identity");
+    bool transaction_begun;
+    PEP_STATUS status = pEp_sql_begin_nonblocking_call(session,
+                                                       & transaction_begun);
+    if (status == PEP_STATUS_OK) {
+        status = _update_identity(session, identity);
+        pEp_sql_end_nonblocking_call(session, transaction_begun);
+    }
+    PEP_TRACE_END(span, status);
+    return status;
+}
+
 /**
  *  @internal
  *  
@@ -979,13 +1018,15 @@ PEP_STATUS elect_ownkey(
             
             if (is_own)
             {
-                PEP_comm_type _comm_type_key;
+                PEP_key_status key_status;
                 
-                status = get_key_rating(session, _keylist->value, &_comm_type_key);
+                status = get_key_status(session, _keylist->value, time(NULL),
+                                        PEP_key_status_rating, &key_status);
                 PEP_WEAK_ASSERT_ORELSE(status != PEP_OUT_OF_MEMORY, {
                     free_stringlist(keylist);
                     return PEP_OUT_OF_MEMORY;
                 });
+                PEP_comm_type _comm_type_key = key_status.comm_type;
                 
                 if (_comm_type_key != PEP_ct_compromised &&
                     _comm_type_key != PEP_ct_unknown)
@@ -1262,7 +1303,11 @@ pEp_free:
 DYNAMIC_API PEP_STATUS myself(PEP_SESSION session, pEp_identity * identity)
 {
     PEP_REQUIRE(session && identity && ! EMPTYSTR(identity->address));
-    return _myself(session, identity, true, true, false, false);
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "api.myself");
+    PEP_STATUS status = _myself(session, identity, true, true, false, false);
+    PEP_TRACE_END(span, status);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS key_mistrusted(
@@ -1596,9 +1641,12 @@ DYNAMIC_API PEP_STATUS own_key_is_listed(
     int count;
     
     *listed = false;
-    
+
+    if (pEp_key_sets_is_own_listed(session, fpr, listed))
+        return PEP_STATUS_OK;
+
     sql_reset_and_clear_bindings(session->own_key_is_listed);
-    sqlite3_bind_text(session->own_key_is_listed, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->own_key_is_listed, 1, fpr);
     
     int result;
     
@@ -1628,11 +1676,16 @@ PEP_STATUS _own_identities_retrieve(
     
     PEP_STATUS status = PEP_STATUS_OK;
     *own_identities = NULL;
+    pEp_sql_read_begin(session);
+    sqlite3_stmt *statement
+        = pEp_sql_read_statement(session,
+                                 pEp_sql_read_own_identities_retrieve,
+                                 session->own_identities_retrieve);
     identity_list *_own_identities = new_identity_list(NULL);
     if (_own_identities == NULL)
         goto enomem;
     
-    sql_reset_and_clear_bindings(session->own_identities_retrieve);
+    sql_reset_and_clear_bindings(statement);
     
     int result;
     // address, fpr, username, user_id, comm_type, lang, flags
@@ -1646,25 +1699,25 @@ PEP_STATUS _own_identities_retrieve(
     
     identity_list *_bl = _own_identities;
 
-    sqlite3_bind_int(session->own_identities_retrieve, 1, excluded_flags);
+    sqlite3_bind_int(statement, 1, excluded_flags);
 
     do {
-        result = pEp_sqlite3_step_nonbusy(session, session->own_identities_retrieve);
+        result = pEp_sql_read_step(session, statement);
         switch (result) {
             case SQLITE_ROW:
                 address = (const char *)
-                    sqlite3_column_text(session->own_identities_retrieve, 0);
+                    sqlite3_column_text(statement, 0);
                 fpr = (const char *)
-                    sqlite3_column_text(session->own_identities_retrieve, 1);
+                    sqlite3_column_text(statement, 1);
                 user_id = (const char *)
-                    sqlite3_column_text(session->own_identities_retrieve, 2);
+                    sqlite3_column_text(statement, 2);
                 username = (const char *)
-                    sqlite3_column_text(session->own_identities_retrieve, 3);
+                    sqlite3_column_text(statement, 3);
                 comm_type = PEP_ct_pEp;
                 lang = (const char *)
-                    sqlite3_column_text(session->own_identities_retrieve, 4);
+                    sqlite3_column_text(statement, 4);
                 flags = (unsigned int)
-                    sqlite3_column_int(session->own_identities_retrieve, 5);
+                    sqlite3_column_int(statement, 5);
 
                 pEp_identity *ident = new_identity(address, fpr, user_id, username);
                 if (!ident)
@@ -1695,7 +1748,7 @@ PEP_STATUS _own_identities_retrieve(
         }
     } while (result != SQLITE_DONE);
     
-    sql_reset_and_clear_bindings(session->own_identities_retrieve);
+    sql_reset_and_clear_bindings(statement);
     if (status == PEP_STATUS_OK)
         *own_identities = _own_identities;
     else
@@ -1704,10 +1757,12 @@ PEP_STATUS _own_identities_retrieve(
     goto the_end;
     
 enomem:
+    sql_reset_and_clear_bindings(statement);
     free_identity_list(_own_identities);
     status = PEP_OUT_OF_MEMORY;
     
 the_end:
+    pEp_sql_read_end(session);
     return status;
 }
 
@@ -1818,8 +1873,7 @@ PEP_STATUS update_key_sticky_bit_for_user(PEP_SESSION session,
     sqlite3_bind_int(session->update_key_sticky_bit_for_user, 1, sticky);
     sqlite3_bind_text(session->update_key_sticky_bit_for_user, 2, ident->user_id, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(session->update_key_sticky_bit_for_user, 3, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->update_key_sticky_bit_for_user, 3, fpr);
     int result = pEp_sqlite3_step_nonbusy(session, session->update_key_sticky_bit_for_user);
     sql_reset_and_clear_bindings(session->update_key_sticky_bit_for_user);
     if (result != SQLITE_DONE) {
@@ -1842,8 +1896,7 @@ PEP_STATUS get_key_sticky_bit_for_user(PEP_SESSION session,
     sql_reset_and_clear_bindings(session->is_key_sticky_for_user);
     sqlite3_bind_text(session->is_key_sticky_for_user, 1, user_id, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(session->is_key_sticky_for_user, 2, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->is_key_sticky_for_user, 2, fpr);
 
     int result = pEp_sqlite3_step_nonbusy(session, session->is_key_sticky_for_user);
     switch (result) {
@@ -1960,6 +2013,61 @@ PEP_STATUS contains_priv_key(PEP_SESSION session, const char *fpr,
     return session->cryptotech[PEP_crypt_OpenPGP].contains_priv_key(session, fpr, has_private);
 }
 
+PEP_STATUS get_key_status(PEP_SESSION session, const char *fpr, time_t when,
+                          unsigned int fields, PEP_key_status *key_status) {
+    PEP_REQUIRE(session && ! EMPTYSTR(fpr) && key_status);
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    memset(key_status, 0, sizeof(PEP_key_status));
+    key_status->comm_type = PEP_ct_unknown;
+
+    // The driver can tell us everything at once
+    get_key_status_t driver_get_key_status
+        = session->cryptotech[PEP_crypt_OpenPGP].get_key_status;
+    if (driver_get_key_status) {
+        status = driver_get_key_status(session, fpr, when, key_status);
+        // Like contains_priv_key and get_key_rating, which do not fail
+        // for the callers of this function
+        if (status == PEP_KEY_NOT_FOUND
+            && (fields & ~(PEP_key_status_private | PEP_key_status_rating)) == 0)
+            status = PEP_STATUS_OK;
+        return status;
+    }
+
+    // Otherwise ask for each field in turn
+    if (fields & PEP_key_status_private) {
+        status = contains_priv_key(session, fpr, &key_status->has_private);
+        if (status == PEP_OUT_OF_MEMORY)
+            return status;
+        if (status != PEP_STATUS_OK)
+            key_status->has_private = false;
+    }
+    if (fields & PEP_key_status_rating) {
+        status = get_key_rating(session, fpr, &key_status->comm_type);
+        if (status == PEP_OUT_OF_MEMORY)
+            return status;
+        if (status != PEP_STATUS_OK)
+            key_status->comm_type = PEP_ct_unknown;
+    }
+    status = PEP_STATUS_OK;
+    if (fields & PEP_key_status_revoked) {
+        status = key_revoked(session, fpr, &key_status->revoked);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+    if ((fields & PEP_key_status_expired) && ! key_status->revoked) {
+        status = key_expired(session, fpr, when, &key_status->expired);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+    if (fields & PEP_key_status_created) {
+        status = key_created(session, fpr, &key_status->created);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+    return status;
+}
+
 PEP_STATUS add_mistrusted_key(PEP_SESSION session, const char* fpr)
 {
     PEP_REQUIRE(session && ! EMPTYSTR(fpr));
@@ -1967,8 +2075,7 @@ PEP_STATUS add_mistrusted_key(PEP_SESSION session, const char* fpr)
     int result;
 
     sql_reset_and_clear_bindings(session->add_mistrusted_key);
-    sqlite3_bind_text(session->add_mistrusted_key, 1, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->add_mistrusted_key, 1, fpr);
 
     result = pEp_sqlite3_step_nonbusy(session, session->add_mistrusted_key);
     sql_reset_and_clear_bindings(session->add_mistrusted_key);
@@ -1985,8 +2092,7 @@ PEP_STATUS delete_mistrusted_key(PEP_SESSION session, const char* fpr)
 
     int result;
     sql_reset_and_clear_bindings(session->delete_mistrusted_key);
-    sqlite3_bind_text(session->delete_mistrusted_key, 1, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->delete_mistrusted_key, 1, fpr);
 
     result = pEp_sqlite3_step_nonbusy(session, session->delete_mistrusted_key);
     sql_reset_and_clear_bindings(session->delete_mistrusted_key);
@@ -2005,8 +2111,11 @@ PEP_STATUS is_mistrusted_key(PEP_SESSION session, const char* fpr,
     PEP_STATUS status = PEP_STATUS_OK;
     *mistrusted = false;
 
+    if (pEp_key_sets_is_mistrusted(session, fpr, mistrusted))
+        return PEP_STATUS_OK;
+
     sql_reset_and_clear_bindings(session->is_mistrusted_key);
-    sqlite3_bind_text(session->is_mistrusted_key, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->is_mistrusted_key, 1, fpr);
 
     int result;
 
@@ -10,6 +10,7 @@
 #define KEYMANAGEMENT_INTERNAL_H
 
 #include "pEpEngine.h"
+#include "cryptotech.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,6 +61,35 @@ PEP_STATUS contains_priv_key(PEP_SESSION session, const char *fpr,
                              bool *has_private);
 
 
+/**
+ * @internal
+ *  <!--       get_key_status()       -->
+ *
+ *  @brief            Find out about a key with one lookup in the key store,
+ *                    instead of one lookup per property.  Only the fields
+ *                    asked for are guaranteed to be set.
+ *
+ *  @param[in]  session       session handle
+ *  @param[in]  fpr           fingerprint of the key
+ *  @param[in]  when          the time at which expiry is considered
+ *  @param[in]  fields        the fields needed, or-ed PEP_key_status_fields
+ *  @param[out] key_status    the result
+ *
+ *  @retval PEP_STATUS_OK
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_KEY_NOT_FOUND   no such key
+ *  @retval PEP_OUT_OF_MEMORY   out of memory
+ *  @retval any other value on error
+ *
+ *  @note   Failing to find out whether the private key is present or what
+ *          the rating is is not an error: has_private is then false and
+ *          comm_type PEP_ct_unknown , as with contains_priv_key() and
+ *          get_key_rating() .
+ */
+PEP_STATUS get_key_status(PEP_SESSION session, const char *fpr, time_t when,
+                          unsigned int fields, PEP_key_status *key_status);
+
+
 /**
  * @internal
  *  <!--       get_all_keys_for_user()       -->
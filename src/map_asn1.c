@@ -664,7 +664,9 @@ PBlobList_t *PBlobList_from_bloblist(
             goto enomem;
         rest_blob_size -= l->size;
 
-        if (copy) {
+        // a blob with its own release function, like a shared blob, cannot
+        // be handed over to ASN.1, which frees with free()
+        if (copy || l->release_value) {
             r = OCTET_STRING_fromBuf(&element->value, l->value, l->size);
             if (r)
                 goto enomem;
@@ -25,6 +25,8 @@
 #include "sync_codec.h"
 #include "distribution_codec.h"
 #include "echo_api.h"
+#include "engine_sql.h"
+#include "decrypt_cache.h"
 #include "media_key.h"
 #include "pEp_rmd160.h"
 
@@ -286,6 +288,43 @@ void replace_opt_field(message *msg,
     }
 }
 
+/* mime_encode_message and mime_decode_message do not take a session, and
+   therefore cannot trace themselves: these wrappers add a span around them. */
+static PEP_STATUS traced_mime_encode_message(PEP_SESSION session,
+                                             const message *msg,
+                                             bool omit_fields,
+                                             char **mimetext,
+                                             bool has_pEp_msg_attachment)
+{
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "mime.encode");
+    PEP_STATUS status = mime_encode_message(msg, omit_fields, mimetext,
+                                            has_pEp_msg_attachment);
+    PEP_TRACE_ATTRIBUTES(span,
+                         ((status == PEP_STATUS_OK && * mimetext != NULL)
+                          ? strlen(* mimetext) : 0),
+                         pEp_trace_recipient_count(msg));
+    PEP_TRACE_END(span, status);
+    return status;
+}
+
+static PEP_STATUS traced_mime_decode_message(PEP_SESSION session,
+                                             const char *mimetext,
+                                             size_t size,
+                                             message **msg,
+                                             bool *has_possible_pEp_msg)
+{
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "mime.decode");
+    PEP_STATUS status = mime_decode_message(mimetext, size, msg,
+                                            has_possible_pEp_msg);
+    PEP_TRACE_ATTRIBUTES(span, size,
+                         (status == PEP_STATUS_OK
+                          ? pEp_trace_recipient_count(* msg) : 0));
+    PEP_TRACE_END(span, status);
+    return status;
+}
+
 /**
  *  @internal
  *
@@ -1400,7 +1439,8 @@ static PEP_STATUS wrap_message_as_attachment(
               );
             
     /* Turn message into a MIME-blob */
-    status = mime_encode_message(attachment, false, &message_text, false);
+    status = traced_mime_encode_message(session, attachment, false,
+                                        &message_text, false);
         
     if (status != PEP_STATUS_OK)
         goto pEp_error;
@@ -1607,7 +1647,8 @@ static PEP_STATUS encrypt_PGP_MIME(
     _src->enc_format = PEP_enc_none;
     
     bool wrapped = (wrap_type != PEP_message_unwrapped);
-    status = mime_encode_message(_src, true, &mimetext, wrapped);
+    status = traced_mime_encode_message(session, _src, true, &mimetext,
+                                        wrapped);
     PEP_WEAK_ASSERT_ORELSE_GOTO(status == PEP_STATUS_OK, pEp_error);
 
     if (free_ptext){
@@ -1855,9 +1896,34 @@ static PEP_rating decrypt_rating(PEP_STATUS status)
  *  @param[in]    *fpr        const char
  *
  */
+static PEP_rating key_rating_and_comm_type(PEP_SESSION session,
+                                           const char *fpr,
+                                           PEP_comm_type *bare_comm_type_p);
+
 static PEP_rating key_rating(PEP_SESSION session, const char *fpr)
 {
-    PEP_REQUIRE_ORELSE_RETURN(session && ! EMPTYSTR(fpr),
+    PEP_comm_type bare_comm_type;
+    return key_rating_and_comm_type(session, fpr, & bare_comm_type);
+}
+
+/**
+ *  @internal
+ *
+ *  <!--       key_rating_and_comm_type()       -->
+ *
+ *  @brief      Like key_rating , also returning the comm type of the key
+ *              alone as per get_key_rating , or PEP_ct_unknown on failure.
+ *
+ *  @param[in]    session            PEP_SESSION
+ *  @param[in]    *fpr               const char
+ *  @param[out]   *bare_comm_type_p  PEP_comm_type
+ *
+ */
+static PEP_rating key_rating_and_comm_type(PEP_SESSION session,
+                                           const char *fpr,
+                                           PEP_comm_type *bare_comm_type_p)
+{
+    PEP_REQUIRE_ORELSE_RETURN(session && ! EMPTYSTR(fpr) && bare_comm_type_p,
                               /* positron, 2022-10: this return code is
                                  bizarre, but is not my idea: it was like
                                  this even before my refactoring to introduce
@@ -1866,9 +1932,11 @@ static PEP_rating key_rating(PEP_SESSION session, const char *fpr)
 
     PEP_comm_type bare_comm_type = PEP_ct_unknown;
     PEP_comm_type resulting_comm_type = PEP_ct_unknown;
+    *bare_comm_type_p = PEP_ct_unknown;
     PEP_STATUS status = get_key_rating(session, fpr, &bare_comm_type);
     if (status != PEP_STATUS_OK)
         return PEP_rating_undefined;
+    *bare_comm_type_p = bare_comm_type;
 
     PEP_comm_type least_comm_type = PEP_ct_unknown;
     least_trust(session, fpr, &least_comm_type);
@@ -2231,7 +2299,7 @@ bool import_attached_keys(
                 }
             }
             identity_list *local_private_idents = NULL;
-            PEP_STATUS import_status = import_key_with_fpr_return(
+            PEP_STATUS import_status = import_key_with_fpr_return_deduplicated(
                                                   session, blob_value, blob_size, 
                                                   &local_private_idents,
                                                   &_keylist,
@@ -2319,6 +2387,226 @@ bool import_attached_keys(
 }
 
 
+/* Batch encryption cache
+ * ***************************************************************** */
+
+/* encrypt_messages resolves every distinct sender and recipient, and exports
+   every sender key, once in the calling session before encrypting in
+   parallel.  While encrypting, every session involved finds these results
+   through its encrypt_batch field instead of repeating the same work for
+   each message; the cache is read-only at that point, so it needs no lock.
+   Results are replayed exactly, including failures. */
+
+/* An identity as given in a message, with the result of resolving it. */
+struct encrypt_batch_identity {
+    pEp_identity *input;        /* address, user_id and username as given */
+    bool as_sender;             /* resolved by myself rather than as a
+                                   recipient */
+    pEp_identity *resolved;
+    PEP_STATUS status;
+    bool pEp_user;              /* as per is_pEp_user , for recipients */
+};
+
+/* A sender key, with everything attach_own_key needs. */
+struct encrypt_batch_key {
+    char *fpr;
+    PEP_STATUS probe_status;    /* as per probe_encrypt */
+    char *keydata;              /* as per export_key , or NULL */
+    size_t size;
+    PEP_STATUS export_status;
+    char *revoked_fpr;          /* as per get_revoked , or NULL */
+    uint64_t revocation_date;
+};
+
+struct _encrypt_batch_cache {
+    struct encrypt_batch_identity *identities;  /* sorted */
+    size_t identity_no;
+    struct encrypt_batch_key *keys;             /* sorted by fpr */
+    size_t key_no;
+    /* The social graph edges already added, each as own user id, own address
+       and contact user id separated by newlines; sorted. */
+    char **bindings;
+    size_t binding_no;
+};
+
+/* Compare possibly-NULL strings, with NULL coming first. */
+static int encrypt_batch_strcmp(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return (a != NULL) - (b != NULL);
+    return strcmp(a, b);
+}
+
+static int encrypt_batch_compare_identities(const void *pa, const void *pb)
+{
+    const struct encrypt_batch_identity *a = pa;
+    const struct encrypt_batch_identity *b = pb;
+    int result = (int) a->as_sender - (int) b->as_sender;
+    if (result == 0)
+        result = encrypt_batch_strcmp(a->input->address, b->input->address);
+    if (result == 0)
+        result = encrypt_batch_strcmp(a->input->user_id, b->input->user_id);
+    if (result == 0)
+        result = encrypt_batch_strcmp(a->input->username,
+                                      b->input->username);
+    return result;
+}
+
+static int encrypt_batch_compare_keys(const void *pa, const void *pb)
+{
+    return strcmp(((const struct encrypt_batch_key *) pa)->fpr,
+                  ((const struct encrypt_batch_key *) pb)->fpr);
+}
+
+static int encrypt_batch_compare_bindings(const void *pa, const void *pb)
+{
+    return strcmp(* (char * const *) pa, * (char * const *) pb);
+}
+
+/* Return the cached resolution of the given identity, or NULL.  The cache may
+   be NULL. */
+static const struct encrypt_batch_identity *
+encrypt_batch_find_identity(const struct _encrypt_batch_cache *cache,
+                            const pEp_identity *identity, bool as_sender)
+{
+    if (cache == NULL)
+        return NULL;
+    struct encrypt_batch_identity needle;
+    needle.input = (pEp_identity *) identity;
+    needle.as_sender = as_sender;
+    return bsearch(& needle, cache->identities, cache->identity_no,
+                   sizeof (struct encrypt_batch_identity),
+                   encrypt_batch_compare_identities);
+}
+
+static const struct encrypt_batch_key *
+encrypt_batch_find_key(const struct _encrypt_batch_cache *cache,
+                       const char *fpr)
+{
+    if (cache == NULL || fpr == NULL)
+        return NULL;
+    struct encrypt_batch_key needle;
+    needle.fpr = (char *) fpr;
+    return bsearch(& needle, cache->keys, cache->key_no,
+                   sizeof (struct encrypt_batch_key),
+                   encrypt_batch_compare_keys);
+}
+
+/* Return a new string identifying a social graph edge, or NULL if out of
+   memory. */
+static char *encrypt_batch_binding(const pEp_identity *own,
+                                   const pEp_identity *contact)
+{
+    size_t size = (strlen(own->user_id) + strlen(own->address)
+                   + strlen(contact->user_id) + 3);
+    char *binding = malloc(size);
+    if (binding != NULL)
+        snprintf(binding, size, "%s\n%s\n%s", own->user_id, own->address,
+                 contact->user_id);
+    return binding;
+}
+
+/* Like bind_own_ident_with_contact_ident , doing nothing if the same edge
+   was already added in this batch. */
+static PEP_STATUS encrypt_batch_bind(PEP_SESSION session,
+                                     pEp_identity *own,
+                                     pEp_identity *contact)
+{
+    const struct _encrypt_batch_cache *cache = session->encrypt_batch;
+    if (cache != NULL && ! EMPTYSTR(own->user_id) && ! EMPTYSTR(own->address)
+        && ! EMPTYSTR(contact->user_id)) {
+        char *binding = encrypt_batch_binding(own, contact);
+        if (binding == NULL)
+            return PEP_OUT_OF_MEMORY;
+        bool found = (bsearch(& binding, cache->bindings, cache->binding_no,
+                              sizeof (char *),
+                              encrypt_batch_compare_bindings) != NULL);
+        free(binding);
+        if (found)
+            return PEP_STATUS_OK;
+    }
+    return bind_own_ident_with_contact_ident(session, own, contact);
+}
+
+/* Replace the content of the given identity with a copy of the cached
+   resolution, and return the cached status. */
+static PEP_STATUS encrypt_batch_use_identity(
+        pEp_identity *identity,
+        const struct encrypt_batch_identity *cached)
+{
+    pEp_identity *copy = identity_dup(cached->resolved);
+    if (copy == NULL)
+        return PEP_OUT_OF_MEMORY;
+    pEp_identity old = * identity;
+    * identity = * copy;
+    * copy = old;
+    free_identity(copy);
+    return cached->status;
+}
+
+/* These behave like the functions they are named after, using the cache when
+   possible. */
+
+static PEP_STATUS encrypt_batch_myself(PEP_SESSION session,
+                                       pEp_identity *identity)
+{
+    const struct encrypt_batch_identity *cached
+        = encrypt_batch_find_identity(session->encrypt_batch, identity,
+                                      true);
+    if (cached == NULL)
+        return myself(session, identity);
+    return encrypt_batch_use_identity(identity, cached);
+}
+
+static PEP_STATUS encrypt_batch_probe_encrypt(PEP_SESSION session,
+                                              const char *fpr)
+{
+    const struct encrypt_batch_key *cached
+        = encrypt_batch_find_key(session->encrypt_batch, fpr);
+    if (cached == NULL)
+        return probe_encrypt(session, fpr);
+    return cached->probe_status;
+}
+
+static PEP_STATUS encrypt_batch_export_key(PEP_SESSION session,
+                                           const char *fpr,
+                                           char **keydata, size_t *size)
+{
+    const struct encrypt_batch_key *cached
+        = encrypt_batch_find_key(session->encrypt_batch, fpr);
+    if (cached == NULL || cached->export_status != PEP_STATUS_OK)
+        return ((cached == NULL)
+                ? export_key(session, fpr, keydata, size)
+                : cached->export_status);
+    * keydata = malloc(cached->size + 1);
+    if (* keydata == NULL)
+        return PEP_OUT_OF_MEMORY;
+    memcpy(* keydata, cached->keydata, cached->size);
+    (* keydata)[cached->size] = '\0';
+    * size = cached->size;
+    return PEP_STATUS_OK;
+}
+
+static PEP_STATUS encrypt_batch_get_revoked(PEP_SESSION session,
+                                            const char *fpr,
+                                            char **revoked_fpr,
+                                            uint64_t *revocation_date)
+{
+    const struct encrypt_batch_key *cached
+        = encrypt_batch_find_key(session->encrypt_batch, fpr);
+    if (cached == NULL)
+        return get_revoked(session, fpr, revoked_fpr, revocation_date);
+    * revoked_fpr = NULL;
+    * revocation_date = cached->revocation_date;
+    if (cached->revoked_fpr != NULL) {
+        * revoked_fpr = strdup(cached->revoked_fpr);
+        if (* revoked_fpr == NULL)
+            return PEP_OUT_OF_MEMORY;
+    }
+    return PEP_STATUS_OK;
+}
+
+
 /**
  *  @internal
  *
@@ -2342,7 +2630,7 @@ PEP_STATUS _attach_key(PEP_SESSION session, const char* fpr, message *msg, const
     char *keydata = NULL;
     size_t size = 0;
 
-    PEP_STATUS status = export_key(session, fpr, &keydata, &size);
+    PEP_STATUS status = encrypt_batch_export_key(session, fpr, &keydata, &size);
     PEP_WEAK_ASSERT_ORELSE_RETURN(status == PEP_STATUS_OK, status);
     PEP_ASSERT(size);
 
@@ -2373,8 +2661,8 @@ void attach_own_key(PEP_SESSION session, message *msg)
     char *revoked_fpr = NULL;
     uint64_t revocation_date = 0;
 
-    if(get_revoked(session, msg->from->fpr,
-                   &revoked_fpr, &revocation_date) == PEP_STATUS_OK &&
+    if(encrypt_batch_get_revoked(session, msg->from->fpr,
+                                 &revoked_fpr, &revocation_date) == PEP_STATUS_OK &&
        revoked_fpr != NULL)
     {
         time_t now = time(NULL);
@@ -2576,9 +2864,17 @@ static PEP_STATUS _update_state_for_ident_list(
     for ( ; _il && _il->ident; _il = _il->next) {
 
         PEP_STATUS status = PEP_STATUS_OK;
-        
+
+        /* See encrypt_messages . */
+        const struct encrypt_batch_identity *cached
+            = encrypt_batch_find_identity(session->encrypt_batch, _il->ident,
+                                          false);
+
         if (!is_me(session, _il->ident)) {
-            status = update_identity(session, _il->ident);
+            if (cached != NULL)
+                status = encrypt_batch_use_identity(_il->ident, cached);
+            else
+                status = update_identity(session, _il->ident);
             
             if (status == PEP_CANNOT_FIND_IDENTITY) {
                 _il->ident->comm_type = PEP_ct_key_not_found;
@@ -2592,16 +2888,22 @@ static PEP_STATUS _update_state_for_ident_list(
                                  max_version_major, max_version_minor);
             }
             
-            if (!(*has_pEp_user) && !EMPTYSTR(_il->ident->user_id))
-                is_pEp_user(session, _il->ident, has_pEp_user);
+            if (!(*has_pEp_user) && !EMPTYSTR(_il->ident->user_id)) {
+                if (cached != NULL)
+                    *has_pEp_user = cached->pEp_user;
+                else
+                    is_pEp_user(session, _il->ident, has_pEp_user);
+            }
             if (!suppress_update_for_bcc && from_ident) {
-                status = bind_own_ident_with_contact_ident(session, from_ident, _il->ident);
+                status = encrypt_batch_bind(session, from_ident, _il->ident);
                 if (status != PEP_STATUS_OK) {
                     status = PEP_UNKNOWN_DB_ERROR;
                     goto pEp_done;
                 }
             }        
         }
+        else if (cached != NULL)
+            status = encrypt_batch_use_identity(_il->ident, cached);
         else // myself, but don't gen or renew
             status = _myself(session, _il->ident, false, false, false, true);
         
@@ -2697,7 +2999,7 @@ static PEP_STATUS encrypt_message_possibly_with_media_key(
         }
     }
     
-    status = myself(session, src->from);
+    status = encrypt_batch_myself(session, src->from);
     if (status != PEP_STATUS_OK)
         goto pEp_error;
 
@@ -2712,7 +3014,7 @@ static PEP_STATUS encrypt_message_possibly_with_media_key(
     }
 
     // is a passphrase needed?
-    status = probe_encrypt(session, src->from->fpr);
+    status = encrypt_batch_probe_encrypt(session, src->from->fpr);
     if (failed_test(status))
         return status;
 
@@ -2962,7 +3264,7 @@ pEp_error:
     return status;
 }
 
-DYNAMIC_API PEP_STATUS encrypt_message(
+static PEP_STATUS _encrypt_message(
         PEP_SESSION session,
         message *src,
         stringlist_t * extra,
@@ -3026,6 +3328,433 @@ DYNAMIC_API PEP_STATUS encrypt_message(
     }
 }
 
+DYNAMIC_API PEP_STATUS encrypt_message(
+        PEP_SESSION session,
+        message *src,
+        stringlist_t * extra,
+        message **dst,
+        PEP_enc_format enc_format,
+        PEP_encrypt_flags_t flags
+    )
+{
+    PEP_REQUIRE(session);
+
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "api.encrypt_message");
+    PEP_STATUS status = _encrypt_message(session, src, extra, dst, enc_format,
+                                         flags);
+    PEP_TRACE_ATTRIBUTES(span, pEp_trace_message_size(src),
+                         pEp_trace_recipient_count(src));
+    PEP_TRACE_END(span, status);
+    return status;
+}
+
+static void free_encrypt_batch_cache(struct _encrypt_batch_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    size_t i;
+    for (i = 0; i < cache->identity_no; i ++) {
+        free_identity(cache->identities[i].input);
+        free_identity(cache->identities[i].resolved);
+    }
+    for (i = 0; i < cache->key_no; i ++) {
+        free(cache->keys[i].fpr);
+        free(cache->keys[i].keydata);
+        free(cache->keys[i].revoked_fpr);
+    }
+    for (i = 0; i < cache->binding_no; i ++)
+        free(cache->bindings[i]);
+    free(cache->identities);
+    free(cache->keys);
+    free(cache->bindings);
+    free(cache);
+}
+
+/* Append a copy of the given identity to the cache identities, whose capacity
+   has been computed in advance.  The user id of senders defaults to own_id ,
+   as in encrypt_message . */
+static PEP_STATUS encrypt_batch_collect_identity(
+        struct _encrypt_batch_cache *cache,
+        const pEp_identity *identity,
+        bool as_sender,
+        const char *own_id)
+{
+    pEp_identity *input = identity_dup(identity);
+    if (input == NULL)
+        return PEP_OUT_OF_MEMORY;
+    if (as_sender && EMPTYSTR(input->user_id) && own_id != NULL) {
+        free(input->user_id);
+        input->user_id = strdup(own_id);
+        if (input->user_id == NULL) {
+            free_identity(input);
+            return PEP_OUT_OF_MEMORY;
+        }
+    }
+    struct encrypt_batch_identity *entry
+        = cache->identities + cache->identity_no ++;
+    entry->input = input;
+    entry->as_sender = as_sender;
+    return PEP_STATUS_OK;
+}
+
+/* Resolve the given cache entry, exactly as encrypt_message would. */
+static PEP_STATUS encrypt_batch_resolve(PEP_SESSION session,
+                                        struct encrypt_batch_identity *entry)
+{
+    entry->resolved = identity_dup(entry->input);
+    if (entry->resolved == NULL)
+        return PEP_OUT_OF_MEMORY;
+    if (entry->as_sender)
+        entry->status = myself(session, entry->resolved);
+    else if (is_me(session, entry->resolved))
+        entry->status = _myself(session, entry->resolved, false, false, false,
+                                true);
+    else {
+        entry->status = update_identity(session, entry->resolved);
+        if (! EMPTYSTR(entry->resolved->user_id))
+            is_pEp_user(session, entry->resolved, & entry->pEp_user);
+    }
+    return (entry->status == PEP_OUT_OF_MEMORY
+            ? PEP_OUT_OF_MEMORY : PEP_STATUS_OK);
+}
+
+/* Add to the cache the social graph edges between the sender and the To and
+   Cc recipients of the given message, which encrypt_message would add. */
+static PEP_STATUS encrypt_batch_bind_recipients(
+        PEP_SESSION session,
+        struct _encrypt_batch_cache *cache,
+        size_t *binding_capacity,
+        const struct encrypt_batch_identity *sender,
+        const identity_list *recipients)
+{
+    const identity_list *il;
+    for (il = recipients; il != NULL && il->ident != NULL; il = il->next) {
+        const struct encrypt_batch_identity *contact
+            = encrypt_batch_find_identity(cache, il->ident, false);
+        if (contact == NULL || is_me(session, il->ident)
+            || EMPTYSTR(sender->resolved->user_id)
+            || EMPTYSTR(sender->resolved->address)
+            || EMPTYSTR(contact->resolved->user_id))
+            continue;
+        char *binding = encrypt_batch_binding(sender->resolved,
+                                              contact->resolved);
+        if (binding == NULL)
+            return PEP_OUT_OF_MEMORY;
+        if (bsearch(& binding, cache->bindings, cache->binding_no,
+                    sizeof (char *), encrypt_batch_compare_bindings) != NULL
+            || bind_own_ident_with_contact_ident(session, sender->resolved,
+                                                 contact->resolved)
+               != PEP_STATUS_OK) {
+            free(binding);
+            continue;
+        }
+        if (cache->binding_no == * binding_capacity) {
+            size_t new_capacity = 2 * * binding_capacity + 16;
+            char **new_bindings = realloc(cache->bindings,
+                                          new_capacity * sizeof (char *));
+            if (new_bindings == NULL) {
+                free(binding);
+                return PEP_OUT_OF_MEMORY;
+            }
+            cache->bindings = new_bindings;
+            * binding_capacity = new_capacity;
+        }
+        /* Keep the array sorted by inserting in place. */
+        size_t position = cache->binding_no;
+        while (position > 0
+               && strcmp(cache->bindings[position - 1], binding) > 0) {
+            cache->bindings[position] = cache->bindings[position - 1];
+            position --;
+        }
+        cache->bindings[position] = binding;
+        cache->binding_no ++;
+    }
+    return PEP_STATUS_OK;
+}
+
+/* Fill a new cache with what encrypting the given messages needs. */
+static PEP_STATUS encrypt_batch_prepare(PEP_SESSION session,
+                                        message **src,
+                                        size_t message_no,
+                                        struct _encrypt_batch_cache **cache_p)
+{
+    PEP_STATUS status = PEP_STATUS_OK;
+    char *own_id = NULL;
+    size_t i, j;
+    struct _encrypt_batch_cache *cache
+        = calloc(1, sizeof (struct _encrypt_batch_cache));
+    if (cache == NULL)
+        return PEP_OUT_OF_MEMORY;
+
+#define FAIL(the_status)        \
+    do {                        \
+        status = (the_status);  \
+        goto end;               \
+    } while (false)
+#define TO_DO(msg)  \
+    ((msg) != NULL && (msg)->dir == PEP_dir_outgoing && (msg)->from != NULL)
+
+    get_default_own_userid(session, & own_id);
+
+    /* Collect every sender and recipient, then keep distinct ones only. */
+    size_t identity_capacity = 0;
+    for (i = 0; i < message_no; i ++)
+        if (TO_DO(src[i]))
+            identity_capacity += (1 + identity_list_length(src[i]->to)
+                                  + identity_list_length(src[i]->cc)
+                                  + identity_list_length(src[i]->bcc));
+    cache->identities = calloc(identity_capacity + 1,
+                               sizeof (struct encrypt_batch_identity));
+    if (cache->identities == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    for (i = 0; i < message_no; i ++) {
+        if (! TO_DO(src[i]))
+            continue;
+        status = encrypt_batch_collect_identity(cache, src[i]->from, true,
+                                                own_id);
+        if (status != PEP_STATUS_OK)
+            goto end;
+        const identity_list *lists[3] = { src[i]->to, src[i]->cc,
+                                          src[i]->bcc };
+        for (j = 0; j < 3; j ++) {
+            const identity_list *il;
+            for (il = lists[j]; il != NULL && il->ident != NULL;
+                 il = il->next) {
+                status = encrypt_batch_collect_identity(cache, il->ident,
+                                                        false, NULL);
+                if (status != PEP_STATUS_OK)
+                    goto end;
+            }
+        }
+    }
+    qsort(cache->identities, cache->identity_no,
+          sizeof (struct encrypt_batch_identity),
+          encrypt_batch_compare_identities);
+    size_t distinct_no = 0;
+    for (i = 0; i < cache->identity_no; i ++) {
+        if (distinct_no > 0
+            && encrypt_batch_compare_identities(
+                  cache->identities + distinct_no - 1,
+                  cache->identities + i) == 0)
+            free_identity(cache->identities[i].input);
+        else
+            cache->identities[distinct_no ++] = cache->identities[i];
+    }
+    cache->identity_no = distinct_no;
+
+    /* Resolve each of them once. */
+    size_t key_capacity = 0;
+    for (i = 0; i < cache->identity_no; i ++) {
+        status = encrypt_batch_resolve(session, cache->identities + i);
+        if (status != PEP_STATUS_OK)
+            goto end;
+        if (cache->identities[i].as_sender)
+            key_capacity ++;
+    }
+
+    /* Export each sender key once. */
+    cache->keys = calloc(key_capacity + 1, sizeof (struct encrypt_batch_key));
+    if (cache->keys == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    for (i = 0; i < cache->identity_no; i ++) {
+        const struct encrypt_batch_identity *entry = cache->identities + i;
+        if (! entry->as_sender || entry->status != PEP_STATUS_OK
+            || EMPTYSTR(entry->resolved->fpr)
+            || encrypt_batch_find_key(cache, entry->resolved->fpr) != NULL)
+            continue;
+        struct encrypt_batch_key *key = cache->keys + cache->key_no;
+        key->fpr = strdup(entry->resolved->fpr);
+        if (key->fpr == NULL)
+            FAIL(PEP_OUT_OF_MEMORY);
+        key->probe_status = probe_encrypt(session, key->fpr);
+        key->export_status = export_key(session, key->fpr, & key->keydata,
+                                        & key->size);
+        if (get_revoked(session, key->fpr, & key->revoked_fpr,
+                        & key->revocation_date) != PEP_STATUS_OK) {
+            free(key->revoked_fpr);
+            key->revoked_fpr = NULL;
+        }
+        cache->key_no ++;
+        /* Keep the array sorted, since it is searched while being built. */
+        qsort(cache->keys, cache->key_no, sizeof (struct encrypt_batch_key),
+              encrypt_batch_compare_keys);
+    }
+
+    /* Add each social graph edge once. */
+    size_t binding_capacity = 0;
+    for (i = 0; i < message_no; i ++) {
+        if (! TO_DO(src[i]))
+            continue;
+        pEp_identity *from = identity_dup(src[i]->from);
+        if (from == NULL)
+            FAIL(PEP_OUT_OF_MEMORY);
+        if (EMPTYSTR(from->user_id) && own_id != NULL) {
+            free(from->user_id);
+            from->user_id = strdup(own_id);
+        }
+        const struct encrypt_batch_identity *sender
+            = encrypt_batch_find_identity(cache, from, true);
+        free_identity(from);
+        if (sender == NULL || sender->status != PEP_STATUS_OK)
+            continue;
+        status = encrypt_batch_bind_recipients(session, cache,
+                                               & binding_capacity, sender,
+                                               src[i]->to);
+        if (status == PEP_STATUS_OK)
+            status = encrypt_batch_bind_recipients(session, cache,
+                                                   & binding_capacity, sender,
+                                                   src[i]->cc);
+        if (status != PEP_STATUS_OK)
+            goto end;
+    }
+
+ end:
+    free(own_id);
+    if (status != PEP_STATUS_OK) {
+        free_encrypt_batch_cache(cache);
+        cache = NULL;
+    }
+    * cache_p = cache;
+    return status;
+#undef TO_DO
+#undef FAIL
+}
+
+/* Work for one thread encrypting: every message with index congruent to first
+   modulo step. */
+struct encrypt_batch_worker {
+    PEP_SESSION caller;
+    PEP_SESSION session;              /* NULL to make a new session */
+    struct _encrypt_batch_cache *cache;
+    message **src;
+    message **dst;
+    PEP_STATUS *statuses;
+    size_t message_no;
+    size_t first;
+    size_t step;
+    stringlist_t *extra;
+    PEP_enc_format enc_format;
+    PEP_encrypt_flags_t flags;
+    bool *done;
+};
+
+static void *encrypt_batch_worker_body(void *argument)
+{
+    struct encrypt_batch_worker *w = argument;
+    PEP_SESSION session = w->session;
+    if (session == NULL
+        && (session = pEp_new_worker_session(w->caller)) == NULL)
+        return NULL; /* The calling thread will do our work. */
+    session->encrypt_batch = w->cache;
+    size_t i;
+    for (i = w->first; i < w->message_no; i += w->step) {
+        w->dst[i] = NULL;
+        if (w->src[i] == NULL)
+            w->statuses[i] = PEP_ILLEGAL_VALUE;
+        else
+            w->statuses[i] = encrypt_message(session, w->src[i], w->extra,
+                                             w->dst + i, w->enc_format,
+                                             w->flags);
+        w->done[i] = true;
+    }
+    session->encrypt_batch = NULL;
+    if (w->session == NULL)
+        release(session);
+    return NULL;
+}
+
+DYNAMIC_API PEP_STATUS encrypt_messages(
+        PEP_SESSION session,
+        message **src,
+        size_t message_no,
+        stringlist_t *extra,
+        message **dst,
+        PEP_STATUS *statuses,
+        PEP_enc_format enc_format,
+        PEP_encrypt_flags_t flags,
+        unsigned int thread_no
+    )
+{
+    PEP_REQUIRE(session && ((src && dst && statuses) || message_no == 0)
+                && session->encrypt_batch == NULL);
+
+    PEP_STATUS status;
+    struct _encrypt_batch_cache *cache = NULL;
+    struct encrypt_batch_worker *workers = NULL;
+    pEp_thread_t *threads = NULL;
+    bool *started = NULL;
+    bool *done = NULL;
+    size_t i;
+
+    status = encrypt_batch_prepare(session, src, message_no, & cache);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    /* In a batch transaction the calling session holds the write lock: other
+       sessions would wait for it, while the caller waits for them. */
+    if (thread_no < 1 || session->batch_transaction_open)
+        thread_no = 1;
+    if (thread_no > message_no)
+        thread_no = (message_no > 0) ? message_no : 1;
+    workers = calloc(thread_no, sizeof (struct encrypt_batch_worker));
+    threads = calloc(thread_no, sizeof (pEp_thread_t));
+    started = calloc(thread_no, sizeof (bool));
+    done = calloc(message_no + 1, sizeof (bool));
+    if (workers == NULL || threads == NULL || started == NULL
+        || done == NULL) {
+        status = PEP_OUT_OF_MEMORY;
+        goto end;
+    }
+
+    /* The calling thread uses the calling session; every other thread opens
+       its own. */
+    for (i = 0; i < thread_no; i ++) {
+        struct encrypt_batch_worker *w = workers + i;
+        w->caller = session;
+        w->session = (i == 0) ? session : NULL;
+        w->cache = cache;
+        w->src = src;
+        w->dst = dst;
+        w->statuses = statuses;
+        w->message_no = message_no;
+        w->first = i;
+        w->step = thread_no;
+        w->extra = extra;
+        w->enc_format = enc_format;
+        w->flags = flags;
+        w->done = done;
+    }
+    for (i = 1; i < thread_no; i ++)
+        started[i] = (pEp_thread_create(threads + i,
+                                        encrypt_batch_worker_body,
+                                        workers + i) == 0);
+    encrypt_batch_worker_body(workers + 0);
+    for (i = 1; i < thread_no; i ++)
+        if (started[i])
+            pEp_thread_join(threads[i]);
+
+    /* Do in this thread whatever a failed worker did not do. */
+    session->encrypt_batch = cache;
+    for (i = 0; i < message_no; i ++)
+        if (! done[i]) {
+            dst[i] = NULL;
+            statuses[i] = ((src[i] == NULL)
+                           ? PEP_ILLEGAL_VALUE
+                           : encrypt_message(session, src[i], extra, dst + i,
+                                             enc_format, flags));
+        }
+    session->encrypt_batch = NULL;
+
+ end:
+    free_encrypt_batch_cache(cache);
+    free(workers);
+    free(threads);
+    free(started);
+    free(done);
+    return status;
+}
+
 DYNAMIC_API PEP_STATUS encrypt_message_and_add_priv_key(
         PEP_SESSION session,
         message *src,
@@ -4106,9 +4835,10 @@ static PEP_STATUS _decrypt_in_pieces(PEP_SESSION session,
                 }
             }
             else {
-                char *copy = malloc(_s->size);
+                // shared blobs are not copied but referenced
+                void (*release_value)(char *) = NULL;
+                char *copy = bloblist_value_dup(_s, &release_value);
                 PEP_WEAK_ASSERT_ORELSE_RETURN(copy, PEP_OUT_OF_MEMORY);
-                memcpy(copy, _s->value, _s->size);
 
                 if (!has_uri_prefix && _s->filename)
                     filename_uri = build_uri("file", _s->filename);
@@ -4117,12 +4847,14 @@ static PEP_STATUS _decrypt_in_pieces(PEP_SESSION session,
                         (filename_uri ? filename_uri : _s->filename));
                 if (_m == NULL)
                     return PEP_OUT_OF_MEMORY;
+                _m->release_value = release_value;
             }
         }
         else {
-            char *copy = malloc(_s->size);
+            // shared blobs are not copied but referenced
+            void (*release_value)(char *) = NULL;
+            char *copy = bloblist_value_dup(_s, &release_value);
             PEP_WEAK_ASSERT_ORELSE_RETURN(copy, PEP_OUT_OF_MEMORY);
-            memcpy(copy, _s->value, _s->size);
 
             char* filename_uri = NULL;
 
@@ -4132,6 +4864,7 @@ static PEP_STATUS _decrypt_in_pieces(PEP_SESSION session,
             free(filename_uri);
             if (_m == NULL)
                 return PEP_OUT_OF_MEMORY;
+            _m->release_value = release_value;
         }
     }
 
@@ -4639,7 +5372,7 @@ static bool import_header_keys(PEP_SESSION session, message* src, stringlist_t**
     bloblist_t* the_key = base64_str_to_binary_blob(start_key, length);
     if (!the_key)
         return false;
-    PEP_STATUS status = import_key_with_fpr_return(session, 
+    PEP_STATUS status = import_key_with_fpr_return_deduplicated(session,
                                                     the_key->value, 
                                                     the_key->size, 
                                                     NULL, 
@@ -5402,7 +6135,8 @@ static PEP_STATUS _decrypt_message(
             case PEP_enc_PGP_MIME:
             case PEP_enc_PGP_MIME_Outlook1:
             
-                status = mime_decode_message(ptext, psize, &msg, &has_inner);
+                status = traced_mime_decode_message(session, ptext, psize,
+                                                    &msg, &has_inner);
                 if (status != PEP_STATUS_OK)
                     goto pEp_error;
                                 
@@ -5661,10 +6395,11 @@ static PEP_STATUS _decrypt_message(
                     }        
                 }    
                 if (message_blob) {
-                    status = mime_decode_message(message_blob->value, 
-                                                 message_blob->size, 
-                                                 &inner_message,
-                                                 NULL);
+                    status = traced_mime_decode_message(session,
+                                                        message_blob->value,
+                                                        message_blob->size,
+                                                        &inner_message,
+                                                        NULL);
                     if (status != PEP_STATUS_OK)
                         goto pEp_error;
                                 
@@ -6113,7 +6848,7 @@ static PEP_STATUS _decrypt_message(
 
                                                 // insert into queue
                                                 if (session->messageToSend)
-                                                    status = session->messageToSend(enc_group_reset_msg);
+                                                    status = queue_message_to_send(session, enc_group_reset_msg);
                                                 else
                                                     status = PEP_SYNC_NO_MESSAGE_SEND_CALLBACK;
                                             }
@@ -6144,7 +6879,7 @@ static PEP_STATUS _decrypt_message(
                                         }
                                         // insert into queue
                                         if (session->messageToSend)
-                                            status = session->messageToSend(reset_msg);
+                                            status = queue_message_to_send(session, reset_msg);
                                         else
                                             status = PEP_SYNC_NO_MESSAGE_SEND_CALLBACK;
 
@@ -6335,7 +7070,7 @@ pEp_error:
     return status;
 }
 
-DYNAMIC_API PEP_STATUS decrypt_message_2(
+static PEP_STATUS _decrypt_message_2(
         PEP_SESSION session,
         message *src,
         message **dst,
@@ -6389,6 +7124,12 @@ DYNAMIC_API PEP_STATUS decrypt_message_2(
        result status the value of this field may be meaningful. */
     msg->rating = rating;
 
+    /* In non-blocking mode an update failed because the lock was taken, and
+       this call will fail with PEP_WOULD_BLOCK and be repeated: do not
+       process Distribution and Sync messages or send pings twice. */
+    if (session->sql_would_block)
+        goto end;
+
 //LOG_MESSAGE_TRACE("msg is ", msg);
 /////// BEGIN: "react" HACK
 /* static bool react_sent = false; */
@@ -6497,6 +7238,134 @@ DYNAMIC_API PEP_STATUS decrypt_message_2(
     return status;
 }
 
+DYNAMIC_API PEP_STATUS config_decrypted_attachment_directory(
+        PEP_SESSION session,
+        const char *directory,
+        size_t min_size
+    )
+{
+    PEP_REQUIRE(session);
+
+    char *copy = NULL;
+    if (directory != NULL) {
+        PEP_REQUIRE(directory[0] != '\0');
+        copy = strdup(directory);
+        if (copy == NULL)
+            return PEP_OUT_OF_MEMORY;
+    }
+    free(session->decrypted_attachment_directory);
+    session->decrypted_attachment_directory = copy;
+    session->decrypted_attachment_min_size = min_size;
+    return PEP_STATUS_OK;
+}
+
+/**
+ *  @internal
+ *
+ *  <!--       store_decrypted_attachments()       -->
+ *
+ *  @brief  Move the large attachments of a decrypted message into files, if
+ *          so configured.  See config_decrypted_attachment_directory .
+ *
+ *  @param[in]    session   session handle
+ *  @param[in]    status    the result of decrypt_message_2
+ *  @param[inout] dst       the decrypted message, or NULL
+ */
+static void store_decrypted_attachments(PEP_SESSION session,
+                                        PEP_STATUS status, message *dst)
+{
+    if (session->decrypted_attachment_directory == NULL || dst == NULL)
+        return;
+    if (status != PEP_STATUS_OK && status != PEP_DECRYPTED
+        && status != PEP_DECRYPTED_AND_VERIFIED)
+        return;
+
+    PEP_STATUS store_status
+        = bloblist_store_in_directory(dst->attachments,
+                                      session->decrypted_attachment_directory,
+                                      session->decrypted_attachment_min_size);
+    if (store_status != PEP_STATUS_OK)
+        LOG_WARNING("cannot store attachments in %s: %s 0x%x",
+                    session->decrypted_attachment_directory,
+                    pEp_status_to_string(store_status), (int) store_status);
+}
+
+DYNAMIC_API PEP_STATUS decrypt_message_2(
+        PEP_SESSION session,
+        message *src,
+        message **dst,
+        stringlist_t **keylist,
+        PEP_decrypt_flags_t *flags
+    )
+{
+    PEP_REQUIRE(session && src && dst && keylist && flags);
+
+    /* See config_nonblocking_sql .  Output parameters are left untouched on
+       PEP_WOULD_BLOCK , so that the caller can simply repeat the call. */
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "api.decrypt_message_2");
+
+    /* See config_ingestion_mode . */
+    pEp_ingestion_message_begun(session);
+
+    /* See config_decrypt_cache .  A duplicate of a recently decrypted message
+       needs no work at all. */
+    PEP_STATUS status;
+    PEP_decrypt_flags_t flags_in = * flags;
+    pEp_decrypt_cache_ticket cache_ticket;
+    if (pEp_decrypt_cache_lookup(session, src, flags_in, dst, keylist, flags,
+                                 & status, & cache_ticket)) {
+        PEP_TRACE_ATTRIBUTES(span, pEp_trace_message_size(src),
+                             stringlist_length(* keylist));
+        PEP_TRACE_END(span, status);
+        return status;
+    }
+
+    /* Reads need no lock: the lock is only taken at the first update, and
+       kept until the end so that a PEP_WOULD_BLOCK failure can roll back
+       every update.  Re-encrypting for an untrusted server rewrites src and
+       consumes the input keylist, which could not be restored: such calls
+       take the lock up front, as update_identity does. */
+    bool transaction_begun = false;
+    bool deferred = false;
+    if (flags_in & PEP_decrypt_flag_untrusted_server)
+        status = pEp_sql_begin_nonblocking_call(session, & transaction_begun);
+    else {
+        pEp_sql_begin_deferred_nonblocking_call(session, & deferred);
+        status = PEP_STATUS_OK;
+    }
+    if (status == PEP_STATUS_OK) {
+        PEP_rating src_rating_in = src->rating;
+        status = _decrypt_message_2(session, src, dst, keylist, flags);
+        pEp_sql_end_nonblocking_call(session, transaction_begun);
+        status = pEp_sql_end_deferred_nonblocking_call(session, deferred,
+                                                       status);
+        if (status == PEP_WOULD_BLOCK) {
+            free_message(* dst);
+            * dst = NULL;
+            free_stringlist(* keylist);
+            * keylist = NULL;
+            * flags = flags_in;
+            src->rating = src_rating_in;
+        }
+        else {
+            PEP_TRACE_ATTRIBUTES(span, pEp_trace_message_size(src),
+                                 stringlist_length(* keylist));
+            /* Store attachments first: the cache then shares their files
+               with every hit, instead of each hit writing another copy. */
+            store_decrypted_attachments(session, status, * dst);
+            pEp_decrypt_cache_store(session, & cache_ticket, src, status,
+                                    * dst, * keylist, * flags);
+        }
+    }
+    PEP_TRACE_END(span, status);
+
+    /* See config_ingestion_mode .  A failed checkpoint leaves ingestion mode;
+       the decryption result is still valid. */
+    pEp_ingestion_message_done(session);
+    return status;
+}
+
 /* The API compatibility alternative to decrypt_message_2.  This is, of course,
    just a thin compatibility layer on top of it. */
 DYNAMIC_API PEP_STATUS decrypt_message(
@@ -6528,6 +7397,256 @@ DYNAMIC_API PEP_STATUS decrypt_message(
     return res;
 }
 
+/* Batch decryption
+ * ***************************************************************** */
+
+/* decrypt_messages passes each item through three stages, each a FIFO queue
+   over the item array: a stage can take the item at its own index once the
+   previous stage is done with it.  Threads take work from the latest stage
+   first, to keep the queues short; decoding stops when too many decoded
+   messages are waiting for decryption. */
+
+/* How far an item has gone. */
+enum decrypt_batch_stage {
+    decrypt_batch_stage_none = 0,
+    decrypt_batch_stage_decoded,
+    decrypt_batch_stage_decrypted,
+    decrypt_batch_stage_encoded
+};
+
+/* The state shared by all threads, protected by mutex. */
+struct decrypt_batch {
+    PEP_decrypt_batch_item *items;
+    size_t item_no;
+    unsigned char *stages;            /* one decrypt_batch_stage per item */
+    bool *failed;                     /* failed items skip later stages */
+    size_t next_to_decode;
+    size_t next_to_decrypt;
+    size_t next_to_encode;
+    size_t next_to_deliver;
+    size_t queue_bound;
+    bool delivering;
+    bool decrypt_on_caller_only;
+    decrypt_batch_completion_t completion;
+    void *context;
+    pEp_mutex_t mutex;
+    pEp_cond_t changed;
+};
+
+/* One thread.  Only threads with a session decrypt. */
+struct decrypt_batch_worker {
+    struct decrypt_batch *batch;
+    PEP_SESSION session;
+    bool own_session;
+};
+
+static void decrypt_batch_decode(PEP_decrypt_batch_item *item, bool *failed)
+{
+    if (item->mimetext == NULL) {
+        if (item->src == NULL) {
+            item->status = PEP_ILLEGAL_VALUE;
+            * failed = true;
+        }
+        return;
+    }
+    item->src = NULL;
+    item->status = mime_decode_message(item->mimetext, item->size,
+                                       & item->src, NULL);
+    if (item->status != PEP_STATUS_OK)
+        * failed = true;
+}
+
+static void decrypt_batch_decrypt(PEP_SESSION session,
+                                  PEP_decrypt_batch_item *item)
+{
+    item->dst = NULL;
+    item->status = decrypt_message_2(session, item->src, & item->dst,
+                                     & item->keylist, & item->flags);
+    item->rating = (item->dst != NULL ? item->dst : item->src)->rating;
+}
+
+static void decrypt_batch_encode(PEP_decrypt_batch_item *item)
+{
+    item->dst_mimetext = NULL;
+    if (item->mimetext == NULL || item->dst == NULL)
+        return;
+    PEP_STATUS status = mime_encode_message(item->dst, false,
+                                            & item->dst_mimetext, false);
+    if (status != PEP_STATUS_OK)
+        item->status = status;
+}
+
+/* Deliver every item which is done and has not been delivered yet, in input
+   order, unless another thread is already doing it.  Called and returning
+   with the mutex held, which is released while calling back. */
+static void decrypt_batch_deliver(struct decrypt_batch *b)
+{
+    while (! b->delivering && b->next_to_deliver < b->item_no
+           && b->stages[b->next_to_deliver] == decrypt_batch_stage_encoded) {
+        size_t i = b->next_to_deliver ++;
+        if (b->completion != NULL) {
+            b->delivering = true;
+            pEp_mutex_unlock(& b->mutex);
+            b->completion(b->context, i, b->items + i);
+            pEp_mutex_lock(& b->mutex);
+            b->delivering = false;
+        }
+        pEp_cond_broadcast(& b->changed);
+    }
+}
+
+static void *decrypt_batch_worker_body(void *argument)
+{
+    struct decrypt_batch_worker *w = argument;
+    struct decrypt_batch *b = w->batch;
+
+    pEp_mutex_lock(& b->mutex);
+    while (b->next_to_deliver < b->item_no) {
+        size_t i;
+        if (b->next_to_encode < b->item_no
+            && (b->stages[b->next_to_encode]
+                == decrypt_batch_stage_decrypted)) {
+            i = b->next_to_encode ++;
+            pEp_mutex_unlock(& b->mutex);
+            if (! b->failed[i])
+                decrypt_batch_encode(b->items + i);
+            pEp_mutex_lock(& b->mutex);
+            b->stages[i] = decrypt_batch_stage_encoded;
+        }
+        else if (w->session != NULL && b->next_to_decrypt < b->item_no
+                 && (b->stages[b->next_to_decrypt]
+                     == decrypt_batch_stage_decoded)) {
+            i = b->next_to_decrypt ++;
+            pEp_mutex_unlock(& b->mutex);
+            if (! b->failed[i])
+                decrypt_batch_decrypt(w->session, b->items + i);
+            pEp_mutex_lock(& b->mutex);
+            b->stages[i] = decrypt_batch_stage_decrypted;
+        }
+        else if (b->next_to_decode < b->item_no
+                 && (b->next_to_decode - b->next_to_decrypt
+                     < b->queue_bound)) {
+            i = b->next_to_decode ++;
+            pEp_mutex_unlock(& b->mutex);
+            decrypt_batch_decode(b->items + i, b->failed + i);
+            pEp_mutex_lock(& b->mutex);
+            b->stages[i] = decrypt_batch_stage_decoded;
+        }
+        else {
+            /* Nothing for us to do until some other thread progresses. */
+            pEp_cond_wait(& b->changed, & b->mutex);
+            continue;
+        }
+        pEp_cond_broadcast(& b->changed);
+        decrypt_batch_deliver(b);
+    }
+    pEp_mutex_unlock(& b->mutex);
+    return NULL;
+}
+
+DYNAMIC_API PEP_STATUS decrypt_messages(
+        PEP_SESSION session,
+        PEP_decrypt_batch_item *items,
+        size_t item_no,
+        unsigned int thread_no,
+        decrypt_batch_completion_t completion,
+        void *context
+    )
+{
+    PEP_REQUIRE(session && (items || item_no == 0));
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    struct decrypt_batch b;
+    memset(& b, 0, sizeof (b));
+    struct decrypt_batch_worker *workers = NULL;
+    pEp_thread_t *threads = NULL;
+    bool *started = NULL;
+    size_t i;
+
+    if (thread_no < 1)
+        thread_no = 1;
+    if (thread_no > item_no)
+        thread_no = (item_no > 0) ? item_no : 1;
+
+    b.items = items;
+    b.item_no = item_no;
+    b.stages = calloc(item_no + 1, sizeof (unsigned char));
+    b.failed = calloc(item_no + 1, sizeof (bool));
+    workers = calloc(thread_no, sizeof (struct decrypt_batch_worker));
+    threads = calloc(thread_no, sizeof (pEp_thread_t));
+    started = calloc(thread_no, sizeof (bool));
+    if (b.stages == NULL || b.failed == NULL || workers == NULL
+        || threads == NULL || started == NULL) {
+        status = PEP_OUT_OF_MEMORY;
+        goto end;
+    }
+    b.queue_bound = 2 * thread_no;
+    /* In a batch transaction, as in ingestion mode between checkpoints or
+       within pEp_begin_batch , the calling session holds the write lock:
+       other sessions decrypting would only wait for it.  Decryption cannot
+       be split into a parallel cryptographic stage and a database stage
+       applied here in the caller's transaction: _decrypt_message_2 reads
+       the database between cryptographic steps (the key store to find and
+       unlock the decryption keys, imported keys and the trust computed so
+       far to verify and rate, the identities to decide whether to reencrypt
+       or to handle sync and distribution messages), so a message decrypted
+       apart from the writes of the messages before it would read stale
+       state and could not be rated. */
+    b.decrypt_on_caller_only = session->batch_transaction_open;
+    b.completion = completion;
+    b.context = context;
+    if (pEp_mutex_init(& b.mutex) != 0) {
+        status = PEP_UNKNOWN_ERROR;
+        goto end;
+    }
+    if (pEp_cond_init(& b.changed) != 0) {
+        pEp_mutex_destroy(& b.mutex);
+        status = PEP_UNKNOWN_ERROR;
+        goto end;
+    }
+    for (i = 0; i < item_no; i ++) {
+        items[i].dst = NULL;
+        items[i].dst_mimetext = NULL;
+        items[i].rating = PEP_rating_undefined;
+        items[i].status = PEP_STATUS_OK;
+    }
+
+    /* The calling thread uses the calling session; every other thread opens
+       its own, behaving like the calling one. */
+    for (i = 0; i < thread_no; i ++) {
+        struct decrypt_batch_worker *w = workers + i;
+        w->batch = & b;
+        if (i == 0)
+            w->session = session;
+        else if (! b.decrypt_on_caller_only) {
+            /* On failure the thread will only decode and encode. */
+            w->session = pEp_new_worker_session(session);
+            w->own_session = (w->session != NULL);
+        }
+        if (i > 0)
+            started[i] = (pEp_thread_create(threads + i,
+                                            decrypt_batch_worker_body,
+                                            w) == 0);
+    }
+    decrypt_batch_worker_body(workers + 0);
+    for (i = 1; i < thread_no; i ++)
+        if (started[i])
+            pEp_thread_join(threads[i]);
+    for (i = 1; i < thread_no; i ++)
+        if (workers[i].own_session)
+            release(workers[i].session);
+    pEp_cond_destroy(& b.changed);
+    pEp_mutex_destroy(& b.mutex);
+
+ end:
+    free(b.stages);
+    free(b.failed);
+    free(workers);
+    free(threads);
+    free(started);
+    return status;
+}
+
 DYNAMIC_API PEP_STATUS own_message_private_key_details(
         PEP_SESSION session,
         message *msg,
@@ -6727,6 +7846,235 @@ DYNAMIC_API PEP_STATUS outgoing_message_rating_preview(
     return PEP_STATUS_OK;
 }
 
+
+/* Incremental rating preview
+ * ***************************************************************** */
+
+/* One recipient of a draft, with its cached communication type. */
+struct rating_preview_recipient {
+    pEp_identity *ident;
+    PEP_comm_type comm_type;
+};
+
+/* The recipients are kept in insertion order, since with more than one
+   compromised or mistrusted recipient the first one determines the rating,
+   as in outgoing_message_rating_preview .  In the common case where there is
+   no such recipient the rating depends on the minimum communication type,
+   which we find from a histogram without looking at the recipients. */
+struct _PEP_rating_preview {
+    pEp_identity *from;
+    struct rating_preview_recipient *recipients;
+    size_t recipient_no;
+    size_t recipient_allocated_no;
+
+    /* How many recipients have each communication type. */
+    size_t comm_type_counts[PEP_ct_pEp + 1];
+
+    /* The database state in which the communication types were found. */
+    pEp_sql_change_stamp stamp;
+};
+
+/* Return the communication type of the given recipient, as
+   outgoing_message_rating_preview would see it with no other recipient. */
+static PEP_comm_type rating_preview_comm_type(PEP_SESSION session,
+                                              pEp_identity *ident)
+{
+    return _get_comm_type_preview(session, PEP_ct_pEp, ident);
+}
+
+/* Return true iff the two strings are both NULL or both equal. */
+static bool rating_preview_same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* Look up the communication type of every recipient again, if anything
+   changed since the last lookup. */
+static PEP_STATUS rating_preview_refresh(PEP_SESSION session,
+                                         PEP_rating_preview *preview)
+{
+    pEp_sql_change_stamp stamp;
+    PEP_STATUS status = pEp_sql_get_change_stamp(session, & stamp);
+    if (status != PEP_STATUS_OK)
+        return status;
+    if (pEp_sql_change_stamps_equal(& stamp, & preview->stamp))
+        return PEP_STATUS_OK;
+
+    LOG_TRACE("the database changed: looking up %zu recipients again",
+              preview->recipient_no);
+    memset(preview->comm_type_counts, 0, sizeof(preview->comm_type_counts));
+    size_t i;
+    for (i = 0; i < preview->recipient_no; i ++) {
+        struct rating_preview_recipient *r = preview->recipients + i;
+        r->comm_type = rating_preview_comm_type(session, r->ident);
+        preview->comm_type_counts[r->comm_type] ++;
+    }
+    preview->stamp = stamp;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS new_rating_preview(
+        PEP_SESSION session,
+        const pEp_identity *from,
+        PEP_rating_preview **preview
+    )
+{
+    PEP_REQUIRE(session && from && preview);
+    *preview = NULL;
+
+    PEP_rating_preview *result = calloc(1, sizeof(PEP_rating_preview));
+    if (result == NULL)
+        goto enomem;
+    result->from = identity_dup(from);
+    if (result->from == NULL)
+        goto enomem;
+    PEP_STATUS status = pEp_sql_get_change_stamp(session, & result->stamp);
+    if (status != PEP_STATUS_OK) {
+        free_rating_preview(result);
+        return status;
+    }
+
+    *preview = result;
+    return PEP_STATUS_OK;
+
+ enomem:
+    free_rating_preview(result);
+    return PEP_OUT_OF_MEMORY;
+}
+
+DYNAMIC_API void free_rating_preview(PEP_rating_preview *preview)
+{
+    if (preview == NULL)
+        return;
+
+    size_t i;
+    for (i = 0; i < preview->recipient_no; i ++)
+        free_identity(preview->recipients[i].ident);
+    free(preview->recipients);
+    free_identity(preview->from);
+    free(preview);
+}
+
+DYNAMIC_API PEP_STATUS rating_preview_add_recipient(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        const pEp_identity *ident,
+        bool bcc
+    )
+{
+    PEP_REQUIRE(session && preview && ident);
+
+    /* Bring the other recipients up to date first, so that the new one is
+       looked up in the same state. */
+    PEP_STATUS status = rating_preview_refresh(session, preview);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    if (preview->recipient_no == preview->recipient_allocated_no) {
+        size_t new_allocated_no = (preview->recipient_allocated_no == 0
+                                   ? 8 : preview->recipient_allocated_no * 2);
+        struct rating_preview_recipient *new_recipients
+            = realloc(preview->recipients,
+                      new_allocated_no * sizeof(struct rating_preview_recipient));
+        if (new_recipients == NULL)
+            return PEP_OUT_OF_MEMORY;
+        preview->recipients = new_recipients;
+        preview->recipient_allocated_no = new_allocated_no;
+    }
+    pEp_identity *copy = identity_dup(ident);
+    if (copy == NULL)
+        return PEP_OUT_OF_MEMORY;
+
+    struct rating_preview_recipient *r
+        = preview->recipients + preview->recipient_no;
+    r->ident = copy;
+    r->comm_type = rating_preview_comm_type(session, copy);
+    preview->comm_type_counts[r->comm_type] ++;
+    preview->recipient_no ++;
+
+    /* Do not consider Bcc identities, as in
+       send_ping_to_unknown_pEp_identities_in_outgoing_message .  Sending a
+       Ping updates the echo fields of the recipient identity, which does not
+       affect any communication type: do not count that as a change.  Changes
+       from other connections are still detected by the data version. */
+    if (! bcc && session->enable_echo_in_outgoing_message_rating_preview) {
+        send_ping_to_unknown_pEp_identity(session, preview->from, copy);
+        preview->stamp.trust_generation = session->trust_generation;
+    }
+
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS rating_preview_remove_recipient(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        const pEp_identity *ident
+    )
+{
+    PEP_REQUIRE(session && preview && ident);
+
+    size_t i;
+    for (i = 0; i < preview->recipient_no; i ++) {
+        struct rating_preview_recipient *r = preview->recipients + i;
+        if (rating_preview_same_string(r->ident->address, ident->address)
+            && rating_preview_same_string(r->ident->user_id, ident->user_id))
+            break;
+    }
+    if (i == preview->recipient_no)
+        return PEP_CANNOT_FIND_IDENTITY;
+
+    /* If the communication type is stale it will be recomputed along with
+       all the others at the next refresh, which resets the histogram. */
+    preview->comm_type_counts[preview->recipients[i].comm_type] --;
+    free_identity(preview->recipients[i].ident);
+    memmove(preview->recipients + i, preview->recipients + i + 1,
+            ((preview->recipient_no - i - 1)
+             * sizeof(struct rating_preview_recipient)));
+    preview->recipient_no --;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS rating_preview_get_rating(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        PEP_rating *rating
+    )
+{
+    PEP_REQUIRE(session && preview && rating);
+    *rating = PEP_rating_undefined;
+
+    PEP_STATUS status = rating_preview_refresh(session, preview);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    /* Fold the communication types like _get_comm_type_preview does. */
+    PEP_comm_type aggregate = PEP_ct_pEp;
+    if (preview->comm_type_counts[PEP_ct_compromised] > 0
+        || preview->comm_type_counts[PEP_ct_mistrusted] > 0) {
+        size_t i;
+        for (i = 0; i < preview->recipient_no; i ++) {
+            PEP_comm_type ct = preview->recipients[i].comm_type;
+            if (ct == PEP_ct_compromised || ct == PEP_ct_mistrusted) {
+                aggregate = ct;
+                break;
+            }
+        }
+    }
+    else {
+        int ct;
+        for (ct = 0; ct < PEP_ct_pEp; ct ++)
+            if (preview->comm_type_counts[ct] > 0) {
+                aggregate = ct;
+                break;
+            }
+    }
+
+    *rating = _MAX(_rating(aggregate), PEP_rating_unencrypted);
+    return PEP_STATUS_OK;
+}
+
 // CAN return PASSPHRASE errors on own keys because 
 // of myself. Will not, however, return PASSPHRASE 
 // errors if the incoming ident isn't marked as an own 
@@ -8043,6 +9391,372 @@ pEp_error:
     return status;
 }
 
+/* Bulk rating re-evaluation
+ * ***************************************************************** */
+
+/* re_evaluate_message_ratings resolves each distinct sender once in the
+   calling session, then computes the rating of each distinct key once,
+   possibly in parallel over worker sessions, and finally combines cached
+   results for each item exactly as re_evaluate_message_rating would. */
+
+/* A distinct sender, as identified by address and user id. */
+struct reevaluation_sender {
+    const pEp_identity *from;         /* the first item's, not owned */
+    pEp_identity *resolved;           /* a resolved copy */
+    PEP_STATUS status;
+    /* Trust of the sender for the keys it used, cached.  Senders use very
+       few keys, so a list is fine. */
+    stringlist_t *trusted_fprs;
+    PEP_comm_type *trusted_comm_types;
+    size_t trusted_no;
+};
+
+/* A distinct key fingerprint. */
+struct reevaluation_key {
+    const char *fpr;                  /* not owned */
+    PEP_rating rating;                /* as per key_rating */
+    PEP_comm_type bare_comm_type;     /* as per get_key_rating */
+    bool computed;
+};
+
+/* Compare possibly-NULL strings, with NULL coming first. */
+static int reevaluation_strcmp(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return (a != NULL) - (b != NULL);
+    return strcmp(a, b);
+}
+
+/* An item index along with its sender, for sorting by sender. */
+struct reevaluation_order {
+    const pEp_identity *from;
+    size_t item;
+};
+
+static int reevaluation_compare_senders(const void *pa, const void *pb)
+{
+    const pEp_identity *a = ((const struct reevaluation_order *) pa)->from;
+    const pEp_identity *b = ((const struct reevaluation_order *) pb)->from;
+    int result = reevaluation_strcmp(a->address, b->address);
+    if (result == 0)
+        result = reevaluation_strcmp(a->user_id, b->user_id);
+    return result;
+}
+
+static int reevaluation_compare_keys(const void *pa, const void *pb)
+{
+    return strcmp(((const struct reevaluation_key *) pa)->fpr,
+                  ((const struct reevaluation_key *) pb)->fpr);
+}
+
+/* Work for one thread computing key ratings: every key with index congruent
+   to first modulo step. */
+struct reevaluation_worker {
+    PEP_SESSION caller;
+    PEP_SESSION session;              /* NULL to make a new session */
+    struct reevaluation_key *keys;
+    size_t key_no;
+    size_t first;
+    size_t step;
+};
+
+static void *reevaluation_worker_body(void *argument)
+{
+    struct reevaluation_worker *w = argument;
+    PEP_SESSION session = w->session;
+    if (session == NULL
+        && (session = pEp_new_worker_session(w->caller)) == NULL)
+        return NULL; /* The calling thread will do our work. */
+    size_t i;
+    for (i = w->first; i < w->key_no; i += w->step) {
+        struct reevaluation_key *k = w->keys + i;
+        k->rating = key_rating_and_comm_type(session, k->fpr,
+                                             & k->bare_comm_type);
+        k->computed = true;
+    }
+    if (w->session == NULL)
+        release(session);
+    return NULL;
+}
+
+static struct reevaluation_key *
+reevaluation_find_key(struct reevaluation_key *keys, size_t key_no,
+                      const char *fpr)
+{
+    struct reevaluation_key needle;
+    needle.fpr = fpr;
+    return bsearch(& needle, keys, key_no, sizeof (struct reevaluation_key),
+                   reevaluation_compare_keys);
+}
+
+/* Return the sender comm type for the given key, as
+   amend_rating_according_to_sender_and_recipients computes it, using and
+   filling the cache. */
+static PEP_STATUS reevaluation_sender_comm_type(
+        PEP_SESSION session,
+        struct reevaluation_sender *sender,
+        const char *fpr,
+        const struct reevaluation_key *key,
+        PEP_comm_type *comm_type)
+{
+    size_t i = 0;
+    const stringlist_t *f;
+    for (f = sender->trusted_fprs; f != NULL && f->value != NULL;
+         f = f->next, i ++)
+        if (strcmp(f->value, fpr) == 0) {
+            *comm_type = sender->trusted_comm_types[i];
+            return PEP_STATUS_OK;
+        }
+
+    pEp_identity *_sender = new_identity(sender->resolved->address, fpr,
+                                         sender->resolved->user_id,
+                                         sender->resolved->username);
+    if (_sender == NULL)
+        return PEP_OUT_OF_MEMORY;
+    PEP_STATUS status = get_trust(session, _sender);
+    PEP_comm_type ct = _sender->comm_type;
+    free_identity(_sender);
+    if (status == PEP_CANNOT_FIND_IDENTITY)
+        status = PEP_STATUS_OK;
+    if (status != PEP_STATUS_OK)
+        return status;
+    if (ct == PEP_ct_unknown)
+        ct = key->bare_comm_type;
+
+    PEP_comm_type *new_comm_types
+        = realloc(sender->trusted_comm_types,
+                  (sender->trusted_no + 1) * sizeof (PEP_comm_type));
+    if (new_comm_types == NULL)
+        return PEP_OUT_OF_MEMORY;
+    sender->trusted_comm_types = new_comm_types;
+    stringlist_t *added
+        = ((sender->trusted_fprs == NULL)
+           ? (sender->trusted_fprs = new_stringlist(fpr))
+           : stringlist_add(sender->trusted_fprs, fpr));
+    if (added == NULL)
+        return PEP_OUT_OF_MEMORY;
+    sender->trusted_comm_types[sender->trusted_no ++] = ct;
+    *comm_type = ct;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS re_evaluate_message_ratings(
+        PEP_SESSION session,
+        PEP_rating_reevaluation *items,
+        size_t item_no,
+        unsigned int thread_no
+    )
+{
+    PEP_REQUIRE(session && (items || item_no == 0));
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    struct reevaluation_order *order = NULL;
+    size_t *sender_of_item = NULL;
+    struct reevaluation_sender *senders = NULL;
+    size_t sender_no = 0;
+    struct reevaluation_key *keys = NULL;
+    size_t key_no = 0;
+    struct reevaluation_worker *workers = NULL;
+    pEp_thread_t *threads = NULL;
+    size_t i;
+
+#define FAIL(the_status)        \
+    do {                        \
+        status = (the_status);  \
+        goto end;               \
+    } while (false)
+
+    /* Validate each item, like re_evaluate_message_rating does with its
+       parameters; mark the ones needing no further work as done. */
+    size_t key_capacity = 0;
+    for (i = 0; i < item_no; i ++) {
+        PEP_rating_reevaluation *item = items + i;
+        item->rating = PEP_rating_undefined;
+        item->status = PEP_STATUS_OK;
+        if (item->from == NULL || item->x_enc_status == PEP_rating_undefined)
+            item->status = PEP_ILLEGAL_VALUE;
+        else if (item->keylist == NULL) {
+            if (item->x_enc_status == PEP_rating_unencrypted)
+                item->rating = PEP_rating_unencrypted;
+            else
+                item->status = PEP_ILLEGAL_VALUE;
+        }
+        else
+            key_capacity += stringlist_length(item->keylist);
+    }
+#define TO_DO(item)  \
+    ((item)->status == PEP_STATUS_OK && (item)->keylist != NULL)
+
+    /* Group items by sender, and resolve each sender once. */
+    order = calloc(item_no + 1, sizeof (struct reevaluation_order));
+    sender_of_item = calloc(item_no + 1, sizeof (size_t));
+    senders = calloc(item_no + 1, sizeof (struct reevaluation_sender));
+    if (order == NULL || sender_of_item == NULL || senders == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    size_t order_no = 0;
+    for (i = 0; i < item_no; i ++)
+        if (TO_DO(items + i)) {
+            order[order_no].from = items[i].from;
+            order[order_no ++].item = i;
+        }
+    qsort(order, order_no, sizeof (struct reevaluation_order),
+          reevaluation_compare_senders);
+    for (i = 0; i < order_no; i ++) {
+        if (i == 0 || reevaluation_compare_senders(order + i - 1,
+                                                   order + i) != 0) {
+            struct reevaluation_sender *sender = senders + sender_no ++;
+            sender->from = order[i].from;
+            sender->resolved = identity_dup(sender->from);
+            if (sender->resolved == NULL)
+                FAIL(PEP_OUT_OF_MEMORY);
+            if (! is_me(session, sender->resolved))
+                sender->status = update_identity(session, sender->resolved);
+            else
+                sender->status = _myself(session, sender->resolved, false,
+                                         true, false, true);
+            switch (sender->status) {
+            case PEP_KEY_NOT_FOUND:
+            case PEP_KEY_UNSUITABLE:
+            case PEP_CANNOT_FIND_IDENTITY:
+            case PEP_CANNOT_FIND_ALIAS:
+                sender->status = PEP_STATUS_OK;
+            default:
+                break;
+            }
+        }
+        sender_of_item[order[i].item] = sender_no - 1;
+    }
+
+    /* Collect distinct keys, the ones which may affect a rating. */
+    keys = calloc(key_capacity + 1, sizeof (struct reevaluation_key));
+    if (keys == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    for (i = 0; i < item_no; i ++) {
+        const PEP_rating_reevaluation *item = items + i;
+        if (! TO_DO(item) || item->x_enc_status <= PEP_rating_mistrust)
+            continue;
+        const stringlist_t *k;
+        for (k = item->keylist; k != NULL && k->value != NULL; k = k->next)
+            if (k->value[0] != '\0')
+                keys[key_no ++].fpr = k->value;
+    }
+    qsort(keys, key_no, sizeof (struct reevaluation_key),
+          reevaluation_compare_keys);
+    size_t distinct_key_no = 0;
+    for (i = 0; i < key_no; i ++)
+        if (distinct_key_no == 0
+            || strcmp(keys[distinct_key_no - 1].fpr, keys[i].fpr) != 0)
+            keys[distinct_key_no ++] = keys[i];
+    key_no = distinct_key_no;
+
+    /* Rate each distinct key.  The calling session takes the first share;
+       every other thread opens its own session, except in a batch transaction
+       where the calling session holds the write lock. */
+    if (thread_no < 1 || session->batch_transaction_open)
+        thread_no = 1;
+    if (thread_no > key_no)
+        thread_no = (key_no > 0) ? key_no : 1;
+    workers = calloc(thread_no, sizeof (struct reevaluation_worker));
+    threads = calloc(thread_no, sizeof (pEp_thread_t));
+    if (workers == NULL || threads == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    bool *started = (bool *) calloc(thread_no, sizeof (bool));
+    if (started == NULL)
+        FAIL(PEP_OUT_OF_MEMORY);
+    for (i = 0; i < thread_no; i ++) {
+        workers[i].caller = session;
+        workers[i].session = (i == 0) ? session : NULL;
+        workers[i].keys = keys;
+        workers[i].key_no = key_no;
+        workers[i].first = i;
+        workers[i].step = thread_no;
+        if (i > 0)
+            started[i] = (pEp_thread_create(threads + i,
+                                            reevaluation_worker_body,
+                                            workers + i) == 0);
+    }
+    reevaluation_worker_body(workers + 0);
+    for (i = 1; i < thread_no; i ++)
+        if (started[i])
+            pEp_thread_join(threads[i]);
+    free(started);
+    /* Do in this thread whatever a failed worker did not do. */
+    for (i = 0; i < key_no; i ++)
+        if (! keys[i].computed)
+            keys[i].rating
+                = key_rating_and_comm_type(session, keys[i].fpr,
+                                           & keys[i].bare_comm_type);
+
+    /* Combine the cached results for each item, following
+       amend_rating_according_to_sender_and_recipients and
+       keylist_rating . */
+    for (i = 0; i < item_no; i ++) {
+        PEP_rating_reevaluation *item = items + i;
+        if (! TO_DO(item))
+            continue;
+        struct reevaluation_sender *sender = senders + sender_of_item[i];
+        if (sender->status != PEP_STATUS_OK) {
+            item->status = sender->status;
+            continue;
+        }
+        PEP_rating rating = item->x_enc_status;
+        const char *fpr = item->keylist->value;
+        if (rating <= PEP_rating_mistrust)
+            ; /* Keep it. */
+        else if (EMPTYSTR(sender->resolved->user_id) || EMPTYSTR(fpr))
+            rating = PEP_rating_unreliable;
+        else {
+            const struct reevaluation_key *sender_key
+                = reevaluation_find_key(keys, key_no, fpr);
+            PEP_ASSERT(sender_key != NULL);
+            PEP_comm_type ct;
+            item->status = reevaluation_sender_comm_type(session, sender, fpr,
+                                                         sender_key, & ct);
+            if (item->status == PEP_OUT_OF_MEMORY)
+                FAIL(PEP_OUT_OF_MEMORY);
+            if (item->status != PEP_STATUS_OK)
+                continue;
+            if (ct != PEP_ct_unknown) {
+                rating = _rating(ct);
+                const stringlist_t *k;
+                for (k = item->keylist; k != NULL && k->value != NULL;
+                     k = k->next) {
+                    /* Ignore own fpr */
+                    if (_same_fpr(fpr, strlen(fpr),
+                                  k->value, strlen(k->value)))
+                        continue;
+                    const struct reevaluation_key *key
+                        = reevaluation_find_key(keys, key_no, k->value);
+                    PEP_rating _rating_
+                        = (key != NULL) ? key->rating : PEP_rating_undefined;
+                    if (_rating_ <= PEP_rating_mistrust) {
+                        rating = _rating_;
+                        break;
+                    }
+                    rating = worst_rating(rating, _rating_);
+                }
+            }
+        }
+        item->rating = rating;
+    }
+#undef TO_DO
+
+ end:
+    for (i = 0; i < sender_no; i ++) {
+        free_identity(senders[i].resolved);
+        free_stringlist(senders[i].trusted_fprs);
+        free(senders[i].trusted_comm_types);
+    }
+    free(senders);
+    free(sender_of_item);
+    free(order);
+    free(keys);
+    free(workers);
+    free(threads);
+    return status;
+#undef FAIL
+}
+
 DYNAMIC_API PEP_STATUS get_key_rating_for_user(
         PEP_SESSION session,
         const char *user_id,
@@ -111,6 +111,58 @@ DYNAMIC_API PEP_STATUS encrypt_message(
     );
 
 
+/**
+ *  <!--       encrypt_messages()       -->
+ *
+ *  @brief Encrypt many messages at once using several threads, for example
+ *         in a gateway sending to overlapping sets of recipients.  Each
+ *         result is the same as encrypt_message would produce for the same
+ *         message, but each distinct sender and recipient is resolved only
+ *         once, and each sender key is exported only once, for the whole
+ *         batch.
+ *
+ *  @param[in]     session      session handle
+ *  @param[inout]  src          array of messages to encrypt, each as for
+ *                              encrypt_message ; NULL elements are allowed
+ *  @param[in]     message_no   number of elements in src
+ *  @param[in]     extra        as for encrypt_message , for every message
+ *  @param[out]    dst          array of message_no elements, each set as
+ *                              encrypt_message would set its dst
+ *  @param[out]    statuses     array of message_no elements, each set to the
+ *                              result of encrypt_message , or to
+ *                              PEP_ILLEGAL_VALUE for NULL messages
+ *  @param[in]     enc_format   as for encrypt_message
+ *  @param[in]     flags        as for encrypt_message
+ *  @param[in]     thread_no    number of threads encrypting in parallel,
+ *                              counting the calling thread; each thread
+ *                              other than the calling one uses its own
+ *                              session, with the same callbacks, passphrases
+ *                              and configuration as the given session.  0
+ *                              and 1 mean only the calling thread
+ *
+ *  @retval PEP_STATUS_OK           every message has been processed
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY       out of memory
+ *
+ *  @ownership as for encrypt_message ; the arrays remain with the caller
+ *
+ *  @warning messages are modified concurrently, and must not share
+ *           identities or other content with each other
+ *
+ */
+DYNAMIC_API PEP_STATUS encrypt_messages(
+        PEP_SESSION session,
+        message **src,
+        size_t message_no,
+        stringlist_t *extra,
+        message **dst,
+        PEP_STATUS *statuses,
+        PEP_enc_format enc_format,
+        PEP_encrypt_flags_t flags,
+        unsigned int thread_no
+    );
+
+
 /**
  *  <!--       encrypt_message_and_add_priv_key()       -->
  *
@@ -324,6 +376,39 @@ DYNAMIC_API PEP_STATUS decrypt_message_2(
         PEP_decrypt_flags_t *flags
 );
 
+/**
+ *  <!--       config_decrypted_attachment_directory()       -->
+ *
+ *  @brief Make decrypt_message_2 store large attachments of decrypted
+ *         messages in files instead of heap memory.  Each attachment of at
+ *         least min_size bytes is written into a new file in the given
+ *         directory, and comes back as a file-backed blob of that file: see
+ *         bloblist_store_in_directory and blob_file_path in bloblist.h .
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   directory      existing directory, or NULL to keep
+ *                              attachments in memory, which is the default
+ *  @param[in]   min_size       smaller attachments stay in memory
+ *
+ *  @retval PEP_STATUS_OK       success
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY   out of memory
+ *
+ *  @note If an attachment cannot be stored in a file, because of a full disk
+ *        for example, it is returned in memory: decryption does not fail.
+ *  @note The engine never deletes the files: the application takes them
+ *        over, moving or deleting them once it has used the attachment.
+ *  @note With config_decrypt_cache , a cache hit returns blobs backed by the
+ *        files written for the first decryption, and writes no new files;
+ *        the cache keeps these files mapped until its entry goes.
+ */
+
+DYNAMIC_API PEP_STATUS config_decrypted_attachment_directory(
+        PEP_SESSION session,
+        const char *directory,
+        size_t min_size
+);
+
 /**
  *  <!--       decrypt_message()       -->
  *
@@ -344,6 +429,116 @@ DYNAMIC_API PEP_STATUS decrypt_message(
         PEP_decrypt_flags_t *flags
 );
 
+/**
+ *  @struct    PEP_decrypt_batch_item
+ *
+ *  @brief     One message to decrypt with decrypt_messages .  The input is
+ *             either MIME text or an already decoded message.
+ *
+ */
+typedef struct _PEP_decrypt_batch_item {
+    const char *mimetext;       ///< [in] MIME text to decode, or NULL to
+                                ///< decrypt src
+    size_t size;                ///< [in] size of mimetext
+    message *src;               ///< [inout] message to decrypt, as for
+                                ///< decrypt_message_2 ; when mimetext is
+                                ///< given this is set to the decoded message
+    message *dst;               ///< [out] decrypted message, or NULL
+    char *dst_mimetext;         ///< [out] when mimetext is given, dst encoded
+                                ///< as MIME text, or NULL if dst is NULL
+    stringlist_t *keylist;      ///< [inout] as for decrypt_message_2
+    PEP_decrypt_flags_t flags;  ///< [inout] as for decrypt_message_2
+    PEP_rating rating;          ///< [out] rating of dst, or of src if dst is
+                                ///< NULL
+    PEP_STATUS status;          ///< [out] the result for this message
+} PEP_decrypt_batch_item;
+
+/**
+ *  @typedef    decrypt_batch_completion_t
+ *
+ *  @brief      Callback notified of each message decrypted by
+ *              decrypt_messages , in input order.
+ *
+ *  @param[in]  context     the pointer supplied to decrypt_messages
+ *  @param[in]  index       index of the item in the array
+ *  @param[in]  item        the item, with its output fields set; the caller
+ *                          may take ownership of its content here
+ *
+ *  @warning    this is called from any of the threads used by
+ *              decrypt_messages , never concurrently with itself; it must not
+ *              call into the Engine with the session given to
+ *              decrypt_messages
+ *
+ */
+typedef void (*decrypt_batch_completion_t)(void *context, size_t index,
+                                           PEP_decrypt_batch_item *item);
+
+/**
+ *  <!--       decrypt_messages()       -->
+ *
+ *  @brief Decrypt many messages at once using several threads, for example
+ *         when indexing a whole mailbox.  Each message is decrypted as
+ *         decrypt_message_2 would decrypt it.  However messages are decrypted
+ *         concurrently and in no fixed order: when the result for a message
+ *         depends on the effects of decrypting another one, for example a key
+ *         or a trust change carried by an earlier message, it may differ
+ *         from the result of decrypting the messages one by one in order.
+ *
+ *         Each message goes through a pipeline of three stages: MIME
+ *         decoding, decryption (including verification, key import and the
+ *         identity and trust updates), and MIME encoding of the result.
+ *         Threads take the oldest available work from the latest possible
+ *         stage, and at most a bounded number of messages waits between
+ *         two stages.
+ *
+ *         Decryption runs on worker sessions opened for the purpose, with the
+ *         same callbacks, passphrases and configuration as the given session,
+ *         each committing the changes of every message on its own, as
+ *         decrypt_message_2 does.  If the given session is in ingestion mode
+ *         (see config_ingestion_mode) or in a batch (see pEp_begin_batch)
+ *         decryption instead runs on the given session only, one message at a
+ *         time, while decoding and encoding still run in parallel; changes
+ *         are then committed at ingestion checkpoints, or when the batch
+ *         ends.  Decryption cannot run in parallel there and its changes be
+ *         committed in the batch afterwards: decrypting a message reads the
+ *         keys, trust and identities between cryptographic steps, so each
+ *         message must see the changes of the ones decrypted before it on
+ *         the session holding the transaction.
+ *
+ *  @param[in]     session      session handle
+ *  @param[inout]  items        array of messages to decrypt; for each the
+ *                              output fields are set
+ *  @param[in]     item_no      number of elements in items
+ *  @param[in]     thread_no    number of threads, counting the calling one;
+ *                              0 and 1 mean only the calling thread
+ *  @param[in]     completion   called for each item in input order as soon
+ *                              as it and all the previous ones are done; may
+ *                              be NULL
+ *  @param[in]     context      passed to completion as is
+ *
+ *  @retval PEP_STATUS_OK           every item has been processed; each item
+ *                                  status is one of the values
+ *                                  decrypt_message_2 can return, or the error
+ *                                  from decoding or encoding
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY       out of memory
+ *  @retval PEP_UNKNOWN_ERROR       the threads could not be synchronised;
+ *                                  no item has been processed
+ *
+ *  @ownership the output fields of each item go to the caller, as do src
+ *             when decoded from mimetext; the array and the input remain
+ *             with the caller
+ *
+ */
+DYNAMIC_API PEP_STATUS decrypt_messages(
+        PEP_SESSION session,
+        PEP_decrypt_batch_item *items,
+        size_t item_no,
+        unsigned int thread_no,
+        decrypt_batch_completion_t completion,
+        void *context
+    );
+
 /**
  *  <!--       own_message_private_key_details()       -->
  *
@@ -448,6 +643,134 @@ DYNAMIC_API PEP_STATUS outgoing_message_rating_preview(
         PEP_rating *rating
     );
 
+
+/* Incremental rating preview
+ * ***************************************************************** */
+
+/* An application updating the rating preview of a draft at every keystroke in
+   a recipient field would call outgoing_message_rating_preview on the whole
+   message each time, with one database lookup per recipient.  A rating preview
+   object remembers the communication type of each recipient: adding or
+   removing a recipient only costs a lookup for that recipient, and reading the
+   rating costs no lookup as long as identities, trust and keys are unchanged.
+   After a change, for example a key becoming trusted or mistrusted or a new
+   key being imported, the next rating_preview_get_rating call looks up every
+   recipient again.  The rating is the same as what
+   outgoing_message_rating_preview would return for a message with the same
+   recipients, with two exceptions: a key expiring is only noticed within a
+   minute, and changes to the key store made by other processes are only
+   noticed after the next change to the management database.
+
+   A rating preview object belongs to the session which made it, and must be
+   freed before the session is released. */
+
+/**
+ *  @struct    PEP_rating_preview
+ *
+ *  @brief     Opaque state of an incremental rating preview.
+ *
+ */
+typedef struct _PEP_rating_preview PEP_rating_preview;
+
+/**
+ *  <!--       new_rating_preview()       -->
+ *
+ *  @brief Make a rating preview for a draft with the given sender and no
+ *         recipients.
+ *
+ *  @param[in]   session    session handle
+ *  @param[in]   from       the sender, an own identity; copied
+ *  @param[out]  preview    the new rating preview, to be freed with
+ *                          free_rating_preview
+ *
+ *  @retval PEP_STATUS_OK
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY   out of memory
+ *
+ */
+DYNAMIC_API PEP_STATUS new_rating_preview(
+        PEP_SESSION session,
+        const pEp_identity *from,
+        PEP_rating_preview **preview
+    );
+
+/**
+ *  <!--       free_rating_preview()       -->
+ *
+ *  @brief Free the given rating preview.
+ *
+ *  @param[in]   preview    rating preview to free, or NULL
+ *
+ */
+DYNAMIC_API void free_rating_preview(PEP_rating_preview *preview);
+
+/**
+ *  <!--       rating_preview_add_recipient()       -->
+ *
+ *  @brief Add a To, Cc or Bcc recipient to the draft.
+ *
+ *  @param[in]   session    session handle
+ *  @param[in]   preview    rating preview
+ *  @param[in]   ident      the recipient; copied
+ *  @param[in]   bcc        true iff the recipient is in Bcc
+ *
+ *  @retval PEP_STATUS_OK
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY   out of memory
+ *
+ *  @warning when enabled in the configuration a Ping is sent to a non-Bcc
+ *           recipient known to use pEp and without a known key, as
+ *           outgoing_message_rating_preview would
+ *
+ */
+DYNAMIC_API PEP_STATUS rating_preview_add_recipient(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        const pEp_identity *ident,
+        bool bcc
+    );
+
+/**
+ *  <!--       rating_preview_remove_recipient()       -->
+ *
+ *  @brief Remove a recipient from the draft.  If the same recipient was added
+ *         more than once only the first occurrence is removed.
+ *
+ *  @param[in]   session    session handle
+ *  @param[in]   preview    rating preview
+ *  @param[in]   ident      the recipient, matched by address and user_id
+ *
+ *  @retval PEP_STATUS_OK
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_CANNOT_FIND_IDENTITY   no such recipient in the draft
+ *
+ */
+DYNAMIC_API PEP_STATUS rating_preview_remove_recipient(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        const pEp_identity *ident
+    );
+
+/**
+ *  <!--       rating_preview_get_rating()       -->
+ *
+ *  @brief Get the rating preview for the current recipients.
+ *
+ *  @param[in]   session    session handle
+ *  @param[in]   preview    rating preview
+ *  @param[out]  rating     rating preview for the draft
+ *
+ *  @retval PEP_STATUS_OK
+ *  @retval PEP_ILLEGAL_VALUE   illegal parameter values
+ *  @retval PEP_UNKNOWN_DB_ERROR   the database state could not be checked
+ *
+ */
+DYNAMIC_API PEP_STATUS rating_preview_get_rating(
+        PEP_SESSION session,
+        PEP_rating_preview *preview,
+        PEP_rating *rating
+    );
+
 /**
  *  <!--       identity_rating()       -->
  *
@@ -638,6 +961,65 @@ DYNAMIC_API PEP_STATUS re_evaluate_message_rating(
     PEP_rating *rating
 );
 
+/**
+ *  @struct    PEP_rating_reevaluation
+ *
+ *  @brief     One already decrypted message to re-evaluate with
+ *             re_evaluate_message_ratings .
+ *
+ */
+typedef struct _PEP_rating_reevaluation {
+    const pEp_identity *from;   ///< [in] message sender
+    stringlist_t *keylist;      ///< [in] decrypted message recipients keys
+                                ///< fpr, as returned by decrypt_message_2 ;
+                                ///< may be NULL for unencrypted messages
+    PEP_rating x_enc_status;    ///< [in] original rating for the decrypted
+                                ///< message
+    PEP_rating rating;          ///< [out] the new rating
+    PEP_STATUS status;          ///< [out] the result for this message
+} PEP_rating_reevaluation;
+
+/**
+ *  <!--       re_evaluate_message_ratings()       -->
+ *
+ *  @brief Re-evaluate the rating of many already decrypted messages at once,
+ *         for example a whole folder after a trust change.  Each result is
+ *         the same as re_evaluate_message_rating would compute given the same
+ *         sender, keylist and original rating, but each distinct sender is
+ *         resolved and each distinct key is rated only once.
+ *
+ *  @param[in]     session      session handle
+ *  @param[inout]  items        array of messages; for each the rating and
+ *                              status fields are set, in the same order
+ *  @param[in]     item_no      number of elements in items
+ *  @param[in]     thread_no    number of threads rating keys in parallel,
+ *                              counting the calling thread; each thread
+ *                              other than the calling one uses its own
+ *                              session.  0 and 1 mean only the calling
+ *                              thread
+ *
+ *  @retval PEP_STATUS_OK           every item has been processed; each item
+ *                                  status is one of the values
+ *                                  re_evaluate_message_rating can return,
+ *                                  with PEP_ILLEGAL_VALUE if from is NULL,
+ *                                  x_enc_status is PEP_rating_undefined or
+ *                                  keylist is NULL for an encrypted message
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY       out of memory
+ *
+ *  @warning unlike re_evaluate_message_rating this does not read nor change
+ *           any message: the caller is responsible for storing the new
+ *           ratings.  The ownership of items and of their content remains
+ *           with the caller
+ *
+ */
+DYNAMIC_API PEP_STATUS re_evaluate_message_ratings(
+        PEP_SESSION session,
+        PEP_rating_reevaluation *items,
+        size_t item_no,
+        unsigned int thread_no
+    );
+
 /**
  *  <!--       get_key_rating_for_user()       -->
  *
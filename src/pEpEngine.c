@@ -15,6 +15,10 @@
 #include "pEp_log.h"
 #include "status_to_string.h"
 #include "string_utilities.h"
+#include "pEp_rmd160.h"
+#include "key_sets.h"
+#include "sql_read_pool.h"
+#include "wal_checkpoint.h"
 
 #include <time.h>
 #include <stdlib.h>
@@ -29,7 +33,21 @@ sql_reset_and_clear_bindings(sqlite3_stmt *s)
     sqlite3_clear_bindings(s);
 } 
 
-static volatile int init_count = -1;
+/* The number of sessions currently alive in the process, and the mutex
+   protecting it.  The mutex is held for the entire initialisation of the first
+   session and the entire finalisation of the last one, so that subsystems
+   initialised or finalised there (table creation, globals, the cryptotech,
+   the transport system, the path cache) are never seen half-done by sessions
+   being created or released concurrently.  Creating and releasing any other
+   session only holds the mutex while updating the counter. */
+static pEp_mutex_t session_count_mutex = PEP_MUTEX_INITIALIZER;
+static int session_count = 0;
+
+/* Release the given session, which is the last alive in the process iff
+   out_last is true.  In the out_last case the caller must hold
+   session_count_mutex . */
+static void release_session(PEP_SESSION session, bool out_last);
+static void drop_sequence_blocks(PEP_SESSION session, bool give_back);
 
 DYNAMIC_API PEP_STATUS init(
         PEP_SESSION *session,
@@ -40,43 +58,33 @@ DYNAMIC_API PEP_STATUS init(
 {
     PEP_STATUS status = PEP_STATUS_OK;
 
-    // Initialise the path cache.  It is the state of the environment at this
-    // time that determines path names, unless the path cache is explicitly
-    // reset later.
-    status = reset_path_cache ();
-    if (status != PEP_STATUS_OK)
-        return status;
-
-    bool in_first = false;
-
-    // a little race condition - but still a race condition
-    // mitigated by calling caveat (see documentation)
-
-    // this increment is made atomic IN THE ADAPTERS by
-    // guarding the call to init with the appropriate mutex.
-    int _count = ++init_count;
-    if (_count == 0)
-        in_first = true;
-    
-    // Race condition mitigated by calling caveat starts here :
-    // If another call to init() preempts right now, then preemptive call
-    // will have in_first false, will not create SQL tables, and following
-    // calls relying on those tables will fail.
-    //
-    // Therefore, as above, adapters MUST guard init() with a mutex.
-    // 
-    // Therefore, first session
-    // is to be created and last session to be deleted alone, and not
-    // concurently to other sessions creation or deletion.
-    // We expect adapters to enforce this either by implicitely creating a
-    // client session, or by using synchronization primitive to protect
-    // creation/deletion of first/last session from the app.
-
     if (session == NULL)
         return PEP_ILLEGAL_VALUE;
 
     *session = NULL;
 
+    /* Count this session.  If it is the first one keep holding the mutex until
+       the end of initialisation, successful or not: any concurrent init or
+       release call will wait for us. */
+    pEp_mutex_lock(& session_count_mutex);
+    bool in_first = (session_count == 0);
+    session_count ++;
+    if (! in_first)
+        pEp_mutex_unlock(& session_count_mutex);
+
+    // Initialise the path cache.  It is the state of the environment at this
+    // time that determines path names, unless the path cache is explicitly
+    // reset later.  Only the first session does this, since other sessions
+    // may be using the cached paths at the same time.
+    if (in_first) {
+        status = reset_path_cache ();
+        if (status != PEP_STATUS_OK) {
+            session_count --;
+            pEp_mutex_unlock(& session_count_mutex);
+            return status;
+        }
+    }
+
     pEpSession *_session = calloc(1, sizeof(pEpSession));
     assert(_session);
     if (_session == NULL)
@@ -103,7 +111,7 @@ DYNAMIC_API PEP_STATUS init(
 
     status = pEp_log_initialize(_session);
     if (status != PEP_STATUS_OK)
-        return status;
+        goto pEp_error;
 
     /* Database-logging is synchronous by default, unless the environment
        variable PEP_LOG_ASYNC is defined, to any value.  We should set this
@@ -206,15 +214,33 @@ DYNAMIC_API PEP_STATUS init(
     free_stringpair_list(media_key_map);
 #endif
 
+    if (in_first)
+        pEp_mutex_unlock(& session_count_mutex);
     return PEP_STATUS_OK;
 
 enomem:
     status = PEP_OUT_OF_MEMORY;
 
 pEp_error:
-    _LOG_ERROR("failed at init for session %p: 0x%x %i %s", session,
-               (int) status, (int) status, pEp_status_to_string(status));
-    release(_session);
+    if (_session != NULL)
+        _LOG_ERROR("failed at init for session %p: 0x%x %i %s", session,
+                   (int) status, (int) status, pEp_status_to_string(status));
+
+    /* Uncount this session.  If we were the first we still hold the mutex;
+       otherwise, if every other session has been released in the mean time,
+       this is now the last one and must be finalised holding the mutex. */
+    if (! in_first)
+        pEp_mutex_lock(& session_count_mutex);
+    session_count --;
+    bool out_last = (session_count == 0);
+    if (! out_last)
+        pEp_mutex_unlock(& session_count_mutex);
+    if (_session != NULL)
+        release_session(_session, out_last);
+    else if (out_last)
+        clear_path_cache();
+    if (out_last)
+        pEp_mutex_unlock(& session_count_mutex);
     return status;
 #undef _INTERNAL_LOG_WITH_MACRO_NAME
 #undef _LOG_ERROR
@@ -227,30 +253,67 @@ DYNAMIC_API void release(PEP_SESSION session)
 {
     PEP_REQUIRE_ORELSE(session, { return; });
 
+    /* Uncount this session.  If it is the last one keep holding the mutex
+       until the end of finalisation, so that a concurrent init call will wait
+       and then initialise from scratch. */
+    pEp_mutex_lock(& session_count_mutex);
+    if (session_count <= 0)
+        LOG_CRITICAL("session_count is wrong: %i", session_count);
+    session_count --;
+    bool out_last = (session_count <= 0);
+    if (out_last)
+        session_count = 0;
+    else
+        pEp_mutex_unlock(& session_count_mutex);
+
+    release_session(session, out_last);
+
+    if (out_last)
+        pEp_mutex_unlock(& session_count_mutex);
+}
+
+static void release_session(PEP_SESSION session, bool out_last)
+{
     LOG_API("finalising session %p", session);
-    bool out_last = false;
-    int _count = --init_count;
-    if (_count < -1)
-        LOG_CRITICAL("_count is wrong: %i", _count);
-    // a small race condition but still a race condition
-    // mitigated by calling caveat (see documentation)
-    // (release() is to be guarded by a mutex by the caller)
-    if (_count == -1)
-        out_last = true;
+
+    /* Commit what was accumulated in ingestion mode. */
+    if (session->ingestion_mode && session->transaction_in_progress_no == 1) {
+        pEp_sql_end_batch_transaction(session, true);
+        session->ingestion_mode = false;
+    }
+
+    /* Roll back a batch the application never ended. */
+    if (session->application_batch
+        && session->transaction_in_progress_no == 1) {
+        LOG_WARNING("rolling back a batch still open at finalisation time");
+        pEp_sql_end_batch_transaction(session, false);
+        session->application_batch = false;
+    }
 
     if (session->transaction_in_progress_no != 0)
         LOG_CRITICAL("at least an SQL transaction was not closed: there are"
                      " %i nested transactions in progress at finalisation time",
                      (int) session->transaction_in_progress_no);
 
+    /* Return the sequence values reserved and not handed out, unless that
+       would be part of a transaction which was not closed. */
+    drop_sequence_blocks(session, session->transaction_in_progress_no == 0);
+
+    /* Make sure no other thread will try to notify this session. */
+    pEp_sql_cancel_ready_notification(session);
+
     /* Free local data. */
     free(session->sql_status_text);
 
     free_Sync_state(session);
 
     /* Clear the path cache, releasing a little memory. */
-    if (out_last)
+    if (out_last) {
         clear_path_cache();
+        pEp_key_sets_drop();
+        pEp_sql_read_pool_drop();
+        pEp_wal_checkpointer_stop();
+    }
 
     /* Finalise the Echo subsystem, which uses the management database... */
     echo_finalize(session);
@@ -263,6 +326,7 @@ DYNAMIC_API void release(PEP_SESSION session)
         /* In case the following freeing code still uses the field. */
         session->curr_passphrase = NULL;
     }
+    free(session->decrypted_attachment_directory);
 
     release_transport_system(session, out_last);
     release_cryptotech(session, out_last);
@@ -288,6 +352,7 @@ static bool PEP_STATUS_is_valid(PEP_STATUS status)
     case PEP_INIT_CANNOT_OPEN_DB:
     case PEP_INIT_CANNOT_OPEN_SYSTEM_DB:
     case PEP_INIT_DB_DOWNGRADE_VIOLATION:
+    case PEP_WOULD_BLOCK:
     case PEP_UNKNOWN_DB_ERROR:
     case PEP_KEY_NOT_FOUND:
     case PEP_KEY_HAS_AMBIG_NAME:
@@ -422,6 +487,7 @@ DYNAMIC_API bool PEP_STATUS_is_error(PEP_STATUS status)
     case PEP_PASSPHRASE_REQUIRED:               // questionable
     case PEP_PASSPHRASE_FOR_NEW_KEYS_REQUIRED:  // questionable
     case PEP_VERIFY_SIGNER_KEY_REVOKED:
+    case PEP_WOULD_BLOCK:                       // retryable
         return false;
 
     case PEP_INIT_CANNOT_LOAD_CRYPTO_LIB:
@@ -590,6 +656,51 @@ DYNAMIC_API PEP_STATUS config_passphrase(PEP_SESSION session, const char *passph
     return status;
 }
 
+PEP_SESSION pEp_new_worker_session(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE_RETURN(session, NULL);
+
+    PEP_SESSION worker = NULL;
+    if (init(& worker, session->messageToSend, session->inject_sync_event,
+             session->ensure_passphrase) != PEP_STATUS_OK)
+        return NULL;
+
+    /* Copy every per-session setting which can change the result of an
+       operation; the worker must be indistinguishable from the given session
+       except for the database connection. */
+    PEP_STATUS status = PEP_STATUS_OK;
+    if (session->curr_passphrase != NULL)
+        status = config_passphrase(worker, session->curr_passphrase);
+    if (status == PEP_STATUS_OK)
+        status = config_passphrase_for_new_keys(
+                     worker, session->new_key_pass_enable,
+                     session->generation_passphrase);
+    if (status == PEP_STATUS_OK && session->cipher_suite != worker->cipher_suite)
+        status = config_cipher_suite(worker, session->cipher_suite);
+    if (status == PEP_STATUS_OK)
+        status = config_media_keys(worker, session->media_key_map);
+    if (status == PEP_STATUS_OK && session->decrypted_attachment_directory)
+        status = config_decrypted_attachment_directory(
+                     worker, session->decrypted_attachment_directory,
+                     session->decrypted_attachment_min_size);
+    if (status != PEP_STATUS_OK) {
+        release(worker);
+        return NULL;
+    }
+    worker->passive_mode = session->passive_mode;
+    worker->unencrypted_subject = session->unencrypted_subject;
+    worker->service_log = session->service_log;
+    worker->enable_echo_protocol = session->enable_echo_protocol;
+    worker->enable_echo_in_outgoing_message_rating_preview
+        = session->enable_echo_in_outgoing_message_rating_preview;
+    worker->read_pool_disabled = session->read_pool_disabled;
+
+    /* Sync events injected by the worker must reach the same management
+       object as those injected by the given session. */
+    worker->sync_management = session->sync_management;
+    return worker;
+}
+
 DYNAMIC_API PEP_STATUS config_passphrase_for_new_keys(PEP_SESSION session, bool enable, const char *passphrase) {
     PEP_REQUIRE(session);
 
@@ -614,6 +725,192 @@ DYNAMIC_API void config_service_log(PEP_SESSION session, bool enable)
     session->service_log = enable;
 }
 
+DYNAMIC_API PEP_STATUS config_nonblocking_sql(PEP_SESSION session,
+                                              bool enable,
+                                              sql_ready_t ready,
+                                              void *ready_context)
+{
+    PEP_REQUIRE(session);
+
+    /* Forget about any pending notification which was meant for the previous
+       callback. */
+    pEp_sql_cancel_ready_notification(session);
+    session->nonblocking_sql = enable;
+    session->sql_ready = (enable ? ready : NULL);
+    session->sql_ready_context = (enable ? ready_context : NULL);
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS config_ingestion_mode(PEP_SESSION session,
+                                             bool enable,
+                                             unsigned int checkpoint_interval)
+{
+    PEP_REQUIRE(session);
+
+    if (checkpoint_interval == 0)
+        checkpoint_interval = PEP_INGESTION_DEFAULT_CHECKPOINT_INTERVAL;
+    if (session->ingestion_mode == enable) {
+        session->ingestion_checkpoint_interval = checkpoint_interval;
+        return PEP_STATUS_OK;
+    }
+
+    PEP_STATUS status;
+    if (enable) {
+        /* The batch transaction must be the outermost one. */
+        if (session->transaction_in_progress_no != 0) {
+            LOG_ERROR("cannot enter ingestion mode within a transaction");
+            return PEP_ILLEGAL_VALUE;
+        }
+        status = pEp_sql_begin_batch_transaction(session);
+    }
+    else if (session->transaction_in_progress_no == 0)
+        status = PEP_STATUS_OK; /* Pausing: nothing to commit. */
+    else {
+        if (session->transaction_in_progress_no != 1) {
+            LOG_ERROR("cannot leave ingestion mode within a transaction");
+            return PEP_ILLEGAL_VALUE;
+        }
+        status = pEp_sql_end_batch_transaction(session, true);
+    }
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    session->ingestion_mode = enable;
+    session->ingestion_checkpoint_interval = checkpoint_interval;
+    session->ingestion_pending_no = 0;
+    session->ingestion_max_hold_time_us
+        = PEP_INGESTION_MAXIMUM_HOLD_TIME_IN_MS * (uint64_t) 1000;
+    session->ingestion_resume_time_us = 0;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS ingestion_checkpoint(PEP_SESSION session)
+{
+    PEP_REQUIRE(session);
+
+    /* While pausing every write is already committed. */
+    if (! session->ingestion_mode || session->transaction_in_progress_no == 0)
+        return PEP_STATUS_OK;
+    if (session->transaction_in_progress_no != 1) {
+        LOG_ERROR("cannot checkpoint within a transaction");
+        return PEP_ILLEGAL_VALUE;
+    }
+
+    LOG_TRACE("ingestion checkpoint after %u messages",
+              session->ingestion_pending_no);
+    PEP_STATUS status = pEp_sql_end_batch_transaction(session, true);
+    if (status == PEP_STATUS_OK)
+        status = pEp_sql_begin_batch_transaction(session);
+    if (status != PEP_STATUS_OK) {
+        session->ingestion_mode = false;
+        return status;
+    }
+    session->ingestion_pending_no = 0;
+    return PEP_STATUS_OK;
+}
+
+void pEp_ingestion_message_begun(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    if (! session->ingestion_mode || session->transaction_in_progress_no != 0
+        || pEp_monotonic_time_us() < session->ingestion_resume_time_us)
+        return;
+
+    LOG_TRACE("ingestion resumed");
+    if (pEp_sql_begin_batch_transaction(session) != PEP_STATUS_OK) {
+        session->ingestion_mode = false;
+        return;
+    }
+    session->ingestion_pending_no = 0;
+}
+
+void pEp_ingestion_message_done(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    if (! session->ingestion_mode || session->transaction_in_progress_no != 1)
+        return;
+
+    /* Writers waiting for the lock back off for up to
+       PEP_MAXIMUM_BACKOFF_IN_MS between attempts: committing and taking the
+       lock again at once would hardly ever let them in.  Instead leave it
+       free for as long, during which messages are decrypted as outside
+       ingestion mode. */
+    session->ingestion_pending_no ++;
+    if (pEp_monotonic_time_us() - session->transaction_begin_time_us
+        >= session->ingestion_max_hold_time_us) {
+        LOG_TRACE("ingestion pause after %u messages",
+                  session->ingestion_pending_no);
+        if (pEp_sql_end_batch_transaction(session, true) != PEP_STATUS_OK) {
+            session->ingestion_mode = false;
+            return;
+        }
+        session->ingestion_pending_no = 0;
+        session->ingestion_resume_time_us
+            = pEp_monotonic_time_us()
+              + PEP_MAXIMUM_BACKOFF_IN_MS * (uint64_t) 1000;
+    }
+    else if (session->ingestion_pending_no
+             >= session->ingestion_checkpoint_interval)
+        ingestion_checkpoint(session);
+}
+
+DYNAMIC_API PEP_STATUS config_read_pool(PEP_SESSION session, bool enable)
+{
+    PEP_REQUIRE(session);
+
+    session->read_pool_disabled = ! enable;
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS pEp_begin_batch(PEP_SESSION session)
+{
+    PEP_REQUIRE(session);
+
+    /* The batch transaction must be the outermost one; ingestion mode keeps
+       its own, even while pausing. */
+    if (session->transaction_in_progress_no != 0 || session->ingestion_mode) {
+        LOG_ERROR("cannot begin a batch within a transaction");
+        return PEP_ILLEGAL_VALUE;
+    }
+
+    /* In non-blocking mode try to take the lock once; otherwise wait. */
+    bool transaction_begun;
+    PEP_STATUS status = pEp_sql_begin_nonblocking_call(session,
+                                                       & transaction_begun);
+    if (status != PEP_STATUS_OK)
+        return status;
+    if (transaction_begun)
+        session->batch_transaction_open = true;
+    else {
+        status = pEp_sql_begin_batch_transaction(session);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+    session->application_batch = true;
+    LOG_TRACE("batch begun");
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS pEp_end_batch(PEP_SESSION session, bool commit)
+{
+    PEP_REQUIRE(session);
+
+    if (! session->application_batch) {
+        LOG_ERROR("no batch in progress");
+        return PEP_ILLEGAL_VALUE;
+    }
+    if (session->transaction_in_progress_no != 1) {
+        LOG_ERROR("cannot end a batch within a transaction");
+        return PEP_ILLEGAL_VALUE;
+    }
+
+    session->application_batch = false;
+    LOG_TRACE("batch %s", (commit ? "committed" : "rolled back"));
+    return pEp_sql_end_batch_transaction(session, commit);
+}
+
 DYNAMIC_API PEP_STATUS trustword(
             PEP_SESSION session, uint16_t value, const char *lang,
             char **word, size_t *wsize
@@ -902,9 +1199,11 @@ DYNAMIC_API PEP_STATUS set_userid_alias (
     sqlite3_bind_text(session->add_userid_alias, 2, alias_id, -1,
             SQLITE_STATIC);
         
-    result = sqlite3_step(session->add_userid_alias);
+    result = pEp_sqlite3_step_nonbusy(session, session->add_userid_alias);
     PEP_ASSERT(result != SQLITE_LOCKED);
-    PEP_ASSERT(result != SQLITE_BUSY); // we are inside an EXCLUSIVE transaction
+    // we are inside an EXCLUSIVE transaction, unless the lock could not be
+    // taken in non-blocking mode
+    PEP_ASSERT(result != SQLITE_BUSY || session->sql_would_block);
 
     sql_reset_and_clear_bindings(session->add_userid_alias);
     if (result != SQLITE_DONE) {
@@ -931,20 +1230,24 @@ DYNAMIC_API PEP_STATUS get_identity(
     pEp_identity *_identity = NULL;
     *identity = NULL;
 
-    sql_reset_and_clear_bindings(session->get_identity);
-    sqlite3_bind_text(session->get_identity, 1, address, -1, SQLITE_STATIC);
-    sqlite3_bind_text(session->get_identity, 2, user_id, -1, SQLITE_STATIC);
+    pEp_sql_read_begin(session);
+    sqlite3_stmt *statement
+        = pEp_sql_read_statement(session, pEp_sql_read_get_identity,
+                                 session->get_identity);
+    sql_reset_and_clear_bindings(statement);
+    sqlite3_bind_text(statement, 1, address, -1, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 2, user_id, -1, SQLITE_STATIC);
 
-    const int result = pEp_sqlite3_step_nonbusy(session, session->get_identity);
+    const int result = pEp_sql_read_step(session, statement);
     LOG_TRACE("sqlstatus is %s",
               pEp_sql_status_to_status_text(session, result));
     switch (result) {
     case SQLITE_ROW:
         _identity = new_identity(
                 address,
-                (const char *) sqlite3_column_text(session->get_identity, 0),
+                (const char *) sqlite3_column_text(statement, 0),
                 user_id,
-                (const char *) sqlite3_column_text(session->get_identity, 1)
+                (const char *) sqlite3_column_text(statement, 1)
                 );
         PEP_WEAK_ASSERT_ORELSE(_identity, {
             status = PEP_OUT_OF_MEMORY;
@@ -952,9 +1255,9 @@ DYNAMIC_API PEP_STATUS get_identity(
         });
 
         _identity->comm_type = (PEP_comm_type)
-            sqlite3_column_int(session->get_identity, 2);
+            sqlite3_column_int(statement, 2);
         const char* const _lang = (const char *)
-            sqlite3_column_text(session->get_identity, 3);
+            sqlite3_column_text(statement, 3);
         if (_lang && _lang[0]) {
             PEP_ASSERT(_lang[0] >= 'a' && _lang[0] <= 'z');
             PEP_ASSERT(_lang[1] >= 'a' && _lang[1] <= 'z');
@@ -964,15 +1267,15 @@ DYNAMIC_API PEP_STATUS get_identity(
             _identity->lang[2] = 0;
         }
         _identity->flags = (unsigned int)
-            sqlite3_column_int(session->get_identity, 4);
+            sqlite3_column_int(statement, 4);
         _identity->me = (unsigned int)
-            sqlite3_column_int(session->get_identity, 5);
+            sqlite3_column_int(statement, 5);
         _identity->major_ver =
-            sqlite3_column_int(session->get_identity, 6);
+            sqlite3_column_int(statement, 6);
         _identity->minor_ver =
-            sqlite3_column_int(session->get_identity, 7);
+            sqlite3_column_int(statement, 7);
         _identity->enc_format =    
-            sqlite3_column_int(session->get_identity, 8);    
+            sqlite3_column_int(statement, 8);    
         *identity = _identity;
         break;
     default:
@@ -981,7 +1284,8 @@ DYNAMIC_API PEP_STATUS get_identity(
     }
 
  end:
-    sql_reset_and_clear_bindings(session->get_identity);
+    sql_reset_and_clear_bindings(statement);
+    pEp_sql_read_end(session);
 
     LOG_STATUS_TRACE;
     if (status == PEP_STATUS_OK)
@@ -1003,11 +1307,16 @@ PEP_STATUS get_identities_by_userid(
 
     *identities = new_identity_list(NULL);
 
-    sql_reset_and_clear_bindings(session->get_identities_by_userid);
-    sqlite3_bind_text(session->get_identities_by_userid, 1, user_id, -1, SQLITE_STATIC);
+    pEp_sql_read_begin(session);
+    sqlite3_stmt *statement
+        = pEp_sql_read_statement(session,
+                                 pEp_sql_read_get_identities_by_userid,
+                                 session->get_identities_by_userid);
+    sql_reset_and_clear_bindings(statement);
+    sqlite3_bind_text(statement, 1, user_id, -1, SQLITE_STATIC);
 
     int result = -1;
-    while ((result = pEp_sqlite3_step_nonbusy(session, session->get_identities_by_userid)) == SQLITE_ROW) {
+    while ((result = pEp_sql_read_step(session, statement)) == SQLITE_ROW) {
             // "select address, identity.main_key_id, username, comm_type, lang,"
             // "   identity.flags | pgp_keypair.flags,"
             // "   is_own"
@@ -1021,21 +1330,22 @@ PEP_STATUS get_identities_by_userid(
             // "   timestamp desc; ";
 
         ident = new_identity(
-                    (const char *) sqlite3_column_text(session->get_identities_by_userid, 0),
-                    (const char *) sqlite3_column_text(session->get_identities_by_userid, 1),                
+                    (const char *) sqlite3_column_text(statement, 0),
+                    (const char *) sqlite3_column_text(statement, 1),                
                     user_id,
-                    (const char *) sqlite3_column_text(session->get_identities_by_userid, 2)
+                    (const char *) sqlite3_column_text(statement, 2)
                 );
                 
         PEP_WEAK_ASSERT_ORELSE(ident, {
-            sql_reset_and_clear_bindings(session->get_identities_by_userid);
+            sql_reset_and_clear_bindings(statement);
+            pEp_sql_read_end(session);
             return PEP_OUT_OF_MEMORY;
         });
 
         ident->comm_type = (PEP_comm_type)
-            sqlite3_column_int(session->get_identities_by_userid, 3);
+            sqlite3_column_int(statement, 3);
         const char* const _lang = (const char *)
-            sqlite3_column_text(session->get_identities_by_userid, 4);
+            sqlite3_column_text(statement, 4);
         if (_lang && _lang[0]) {
             PEP_ASSERT(_lang[0] >= 'a' && _lang[0] <= 'z');
             PEP_ASSERT(_lang[1] >= 'a' && _lang[1] <= 'z');
@@ -1045,15 +1355,15 @@ PEP_STATUS get_identities_by_userid(
             ident->lang[2] = 0;
         }
         ident->flags = (unsigned int)
-            sqlite3_column_int(session->get_identities_by_userid, 5);
+            sqlite3_column_int(statement, 5);
         ident->me = (unsigned int)
-            sqlite3_column_int(session->get_identities_by_userid, 6);
+            sqlite3_column_int(statement, 6);
         ident->major_ver =
-            sqlite3_column_int(session->get_identities_by_userid, 7);
+            sqlite3_column_int(statement, 7);
         ident->minor_ver =
-            sqlite3_column_int(session->get_identities_by_userid, 8);
+            sqlite3_column_int(statement, 8);
         ident->enc_format =    
-            sqlite3_column_int(session->get_identities_by_userid, 9);    
+            sqlite3_column_int(statement, 9);    
             
     
         identity_list_add(*identities, ident);
@@ -1066,7 +1376,8 @@ PEP_STATUS get_identities_by_userid(
         status = PEP_CANNOT_FIND_IDENTITY;
     }
             
-    sql_reset_and_clear_bindings(session->get_identities_by_userid);
+    sql_reset_and_clear_bindings(statement);
+    pEp_sql_read_end(session);
     LOG_STATUS_TRACE;
     return status;
 }
@@ -1086,7 +1397,7 @@ PEP_STATUS get_identities_by_main_key_id(
     *identities = new_identity_list(NULL);
 
     sql_reset_and_clear_bindings(session->get_identities_by_main_key_id);
-    sqlite3_bind_text(session->get_identities_by_main_key_id, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->get_identities_by_main_key_id, 1, fpr);
 
     int result = -1;
     
@@ -1342,8 +1653,7 @@ PEP_STATUS exists_trust_entry(PEP_SESSION session, pEp_identity* identity,
     sql_reset_and_clear_bindings(session->exists_trust_entry);
     sqlite3_bind_text(session->exists_trust_entry, 1, identity->user_id, -1,
                       SQLITE_STATIC);
-    sqlite3_bind_text(session->exists_trust_entry, 2, identity->fpr, -1,
-                      SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->exists_trust_entry, 2, identity->fpr);
                   
     int result = pEp_sqlite3_step_nonbusy(session, session->exists_trust_entry);
     switch (result) {
@@ -1369,8 +1679,7 @@ PEP_STATUS set_pgp_keypair(PEP_SESSION session, const char* fpr) {
     int result;
     
     sql_reset_and_clear_bindings(session->set_pgp_keypair);
-    sqlite3_bind_text(session->set_pgp_keypair, 1, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->set_pgp_keypair, 1, fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->set_pgp_keypair);
     sql_reset_and_clear_bindings(session->set_pgp_keypair);
 
@@ -1391,8 +1700,7 @@ PEP_STATUS clear_trust_info(PEP_SESSION session,
     sql_reset_and_clear_bindings(session->clear_trust_info);
     sqlite3_bind_text(session->clear_trust_info, 1, user_id, -1,
             SQLITE_STATIC);    
-    sqlite3_bind_text(session->clear_trust_info, 2, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->clear_trust_info, 2, fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->clear_trust_info);
     sql_reset_and_clear_bindings(session->clear_trust_info);
 
@@ -1435,8 +1743,7 @@ static PEP_STATUS _set_or_update_trust(PEP_SESSION session,
     sql_reset_and_clear_bindings(set_or_update);
     sqlite3_bind_text(set_or_update, 1, identity->user_id, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(set_or_update, 2, identity->fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(set_or_update, 2, identity->fpr);
     sqlite3_bind_int(set_or_update, 3, identity->comm_type);
     result = pEp_sqlite3_step_nonbusy(session, set_or_update);
     sql_reset_and_clear_bindings(set_or_update);
@@ -1471,8 +1778,8 @@ static PEP_STATUS _set_or_update_identity_entry(PEP_SESSION session,
     sql_reset_and_clear_bindings(set_or_update);
     sqlite3_bind_text(set_or_update, 1, identity->address, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(set_or_update, 2, EMPTYSTR(identity->fpr) ? NULL : identity->fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(set_or_update, 2,
+                     EMPTYSTR(identity->fpr) ? NULL : identity->fpr);
     sqlite3_bind_text(set_or_update, 3, identity->user_id, -1,
             SQLITE_STATIC);
     sqlite3_bind_text(set_or_update, 4, identity->username, -1,
@@ -1525,8 +1832,8 @@ static PEP_STATUS _set_or_update_person(PEP_SESSION session,
                 SQLITE_STATIC);
     else
         sqlite3_bind_null(set_or_update, 3);
-    sqlite3_bind_text(set_or_update, 4, EMPTYSTR(identity->fpr) ? NULL : identity->fpr, -1,
-                      SQLITE_STATIC);
+    pEp_sql_bind_fpr(set_or_update, 4,
+                     EMPTYSTR(identity->fpr) ? NULL : identity->fpr);
     int result = pEp_sqlite3_step_nonbusy(session, set_or_update);
     sql_reset_and_clear_bindings(set_or_update);
 
@@ -1651,7 +1958,7 @@ PEP_STATUS set_identity_entry(PEP_SESSION session, pEp_identity* identity,
 
 
 // This will NOT call set_as_pEp_user, nor set_protocol_version; you have to do that separately.
-DYNAMIC_API PEP_STATUS set_identity(
+static PEP_STATUS _set_identity(
         PEP_SESSION session, const pEp_identity *identity
     )
 {
@@ -1686,11 +1993,12 @@ DYNAMIC_API PEP_STATUS set_identity(
     sql_reset_and_clear_bindings(session->set_pgp_keypair);
     PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
     if (has_fpr) {
-        sqlite3_bind_text(session->set_pgp_keypair, 1, identity->fpr, -1,
-                          SQLITE_STATIC);
-        result = sqlite3_step(session->set_pgp_keypair);
+        pEp_sql_bind_fpr(session->set_pgp_keypair, 1, identity->fpr);
+        result = pEp_sqlite3_step_nonbusy(session, session->set_pgp_keypair);
         PEP_ASSERT(result != SQLITE_LOCKED);
-        PEP_ASSERT(result != SQLITE_BUSY); // we are inside an EXCLUSIVE transaction
+        // we are inside an EXCLUSIVE transaction, unless the lock could not
+        // be taken in non-blocking mode
+        PEP_ASSERT(result != SQLITE_BUSY || session->sql_would_block);
         if (result != SQLITE_DONE)
             FAIL(PEP_CANNOT_SET_PGP_KEYPAIR);
     }
@@ -1730,6 +2038,25 @@ end:
 #undef FAIL_IF_NEEDED
 }
 
+DYNAMIC_API PEP_STATUS set_identity(
+        PEP_SESSION session, const pEp_identity *identity
+    )
+{
+    PEP_REQUIRE(session && identity && ! EMPTYSTR(identity->address)
+                && ! EMPTYSTR(identity->user_id)
+                && ! EMPTYSTR(identity->username));
+
+    /* See config_nonblocking_sql . */
+    bool transaction_begun;
+    PEP_STATUS status = pEp_sql_begin_nonblocking_call(session,
+                                                       & transaction_begun);
+    if (status != PEP_STATUS_OK)
+        return status;
+    status = _set_identity(session, identity);
+    pEp_sql_end_nonblocking_call(session, transaction_begun);
+    return status;
+}
+
 //static const char* sql_force_set_identity_username =
 //        "update identity "
 //        "   set username = coalesce(username, ?3) "
@@ -2162,8 +2489,7 @@ PEP_STATUS remove_fpr_as_default(PEP_SESSION session,
     PEP_REQUIRE(session && ! EMPTYSTR(fpr));
 
     sql_reset_and_clear_bindings(session->remove_fpr_as_identity_default);
-    sqlite3_bind_text(session->remove_fpr_as_identity_default, 1, fpr, -1,
-                      SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->remove_fpr_as_identity_default, 1, fpr);
 
     int result = pEp_sqlite3_step_nonbusy(session, session->remove_fpr_as_identity_default);
     sql_reset_and_clear_bindings(session->remove_fpr_as_identity_default);
@@ -2172,8 +2498,7 @@ PEP_STATUS remove_fpr_as_default(PEP_SESSION session,
         return PEP_CANNOT_SET_IDENTITY; 
 
     sql_reset_and_clear_bindings(session->remove_fpr_as_user_default);
-    sqlite3_bind_text(session->remove_fpr_as_user_default, 1, fpr, -1,
-                      SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->remove_fpr_as_user_default, 1, fpr);
 
     result = pEp_sqlite3_step_nonbusy(session, session->remove_fpr_as_user_default);
     sql_reset_and_clear_bindings(session->remove_fpr_as_user_default);
@@ -2193,10 +2518,8 @@ PEP_STATUS replace_identities_fpr(PEP_SESSION session,
     PEP_REQUIRE(session && ! EMPTYSTR(old_fpr) && ! EMPTYSTR(new_fpr));
 
     sql_reset_and_clear_bindings(session->replace_identities_fpr);
-    sqlite3_bind_text(session->replace_identities_fpr, 1, new_fpr, -1,
-                      SQLITE_STATIC);
-    sqlite3_bind_text(session->replace_identities_fpr, 2, old_fpr, -1,
-                      SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->replace_identities_fpr, 1, new_fpr);
+    pEp_sql_bind_fpr(session->replace_identities_fpr, 2, old_fpr);
 
     int result = pEp_sqlite3_step_nonbusy(session, session->replace_identities_fpr);
     sql_reset_and_clear_bindings(session->replace_identities_fpr);
@@ -2216,8 +2539,7 @@ PEP_STATUS update_trust_for_fpr(PEP_SESSION session,
 
     sql_reset_and_clear_bindings(session->update_trust_for_fpr);
     sqlite3_bind_int(session->update_trust_for_fpr, 1, comm_type);
-    sqlite3_bind_text(session->update_trust_for_fpr, 2, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->update_trust_for_fpr, 2, fpr);
     int result = pEp_sqlite3_step_nonbusy(session, session->update_trust_for_fpr);
     sql_reset_and_clear_bindings(session->update_trust_for_fpr);
 
@@ -2776,8 +3098,7 @@ PEP_STATUS remove_key(PEP_SESSION session, const char* fpr) {
 
     int result;
     sql_reset_and_clear_bindings(session->delete_key);
-    sqlite3_bind_text(session->delete_key, 1, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->delete_key, 1, fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->delete_key);
     sql_reset_and_clear_bindings(session->delete_key);
     if (result != SQLITE_DONE)
@@ -2808,8 +3129,7 @@ PEP_STATUS replace_main_user_fpr(PEP_SESSION session, const char* user_id,
 
     int result;
     sql_reset_and_clear_bindings(session->replace_main_user_fpr);
-    sqlite3_bind_text(session->replace_main_user_fpr, 1, new_fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->replace_main_user_fpr, 1, new_fpr);
     sqlite3_bind_text(session->replace_main_user_fpr, 2, user_id, -1,
             SQLITE_STATIC);
     result = pEp_sqlite3_step_nonbusy(session, session->replace_main_user_fpr);
@@ -2834,12 +3154,10 @@ PEP_STATUS replace_main_user_fpr_if_equal(PEP_SESSION session, const char* user_
     int result;
 
     sql_reset_and_clear_bindings(session->replace_main_user_fpr_if_equal);
-    sqlite3_bind_text(session->replace_main_user_fpr, 1, new_fpr, -1,
-            SQLITE_STATIC);
     sqlite3_bind_text(session->replace_main_user_fpr_if_equal, 2, user_id, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(session->replace_main_user_fpr_if_equal, 3, compare_fpr, -1,
-            SQLITE_STATIC);            
+    pEp_sql_bind_fpr(session->replace_main_user_fpr_if_equal, 1, new_fpr);
+    pEp_sql_bind_fpr(session->replace_main_user_fpr_if_equal, 3, compare_fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->replace_main_user_fpr_if_equal);
     sql_reset_and_clear_bindings(session->replace_main_user_fpr_if_equal);
     if (result != SQLITE_DONE)
@@ -2904,8 +3222,7 @@ PEP_STATUS set_default_identity_fpr(PEP_SESSION session,
             SQLITE_STATIC);
     sqlite3_bind_text(session->set_default_identity_fpr, 2, address, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(session->set_default_identity_fpr, 3, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->set_default_identity_fpr, 3, fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->set_default_identity_fpr);
     sql_reset_and_clear_bindings(session->set_default_identity_fpr);
 
@@ -2981,8 +3298,7 @@ DYNAMIC_API PEP_STATUS mark_as_compromised(
 
     int result;
     sql_reset_and_clear_bindings(session->mark_compromised);
-    sqlite3_bind_text(session->mark_compromised, 1, fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->mark_compromised, 1, fpr);
     result = pEp_sqlite3_step_nonbusy(session, session->mark_compromised);
     sql_reset_and_clear_bindings(session->mark_compromised);
 
@@ -3012,16 +3328,20 @@ DYNAMIC_API PEP_STATUS get_trust(PEP_SESSION session, pEp_identity *identity)
     PEP_STATUS status = PEP_STATUS_OK;
     int result;
     identity->comm_type = PEP_ct_unknown;
-    sql_reset_and_clear_bindings(session->get_trust);
+    pEp_sql_read_begin(session);
+    sqlite3_stmt *statement
+        = pEp_sql_read_statement(session, pEp_sql_read_get_trust,
+                                 session->get_trust);
+    sql_reset_and_clear_bindings(statement);
 
-    sqlite3_bind_text(session->get_trust, 1, identity->user_id, -1,
+    sqlite3_bind_text(statement, 1, identity->user_id, -1,
             SQLITE_STATIC);
-    sqlite3_bind_text(session->get_trust, 2, identity->fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(statement, 2, identity->fpr);
 
-    result = pEp_sqlite3_step_nonbusy(session, session->get_trust);
+    result = pEp_sql_read_step(session, statement);
     switch (result) {
     case SQLITE_ROW: {
-        int comm_type = (PEP_comm_type) sqlite3_column_int(session->get_trust,
+        int comm_type = (PEP_comm_type) sqlite3_column_int(statement,
                 0);
         identity->comm_type = comm_type;
         break;
@@ -3031,7 +3351,8 @@ DYNAMIC_API PEP_STATUS get_trust(PEP_SESSION session, pEp_identity *identity)
         status = PEP_CANNOT_FIND_IDENTITY;
     }
 
-    sql_reset_and_clear_bindings(session->get_trust);
+    sql_reset_and_clear_bindings(statement);
+    pEp_sql_read_end(session);
     LOG_NONOK_STATUS_NONOK;
     return status;
 }
@@ -3050,13 +3371,17 @@ DYNAMIC_API PEP_STATUS least_trust(
 
     *comm_type = PEP_ct_unknown;
 
-    sql_reset_and_clear_bindings(session->least_trust);
-    sqlite3_bind_text(session->least_trust, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_read_begin(session);
+    sqlite3_stmt *statement
+        = pEp_sql_read_statement(session, pEp_sql_read_least_trust,
+                                 session->least_trust);
+    sql_reset_and_clear_bindings(statement);
+    pEp_sql_bind_fpr(statement, 1, fpr);
 
-    result = pEp_sqlite3_step_nonbusy(session, session->least_trust);
+    result = pEp_sql_read_step(session, statement);
     switch (result) {
         case SQLITE_ROW: {
-            int _comm_type = sqlite3_column_int(session->least_trust, 0);
+            int _comm_type = sqlite3_column_int(statement, 0);
             *comm_type = (PEP_comm_type) _comm_type;
             break;
         }
@@ -3065,7 +3390,8 @@ DYNAMIC_API PEP_STATUS least_trust(
             status = PEP_CANNOT_FIND_IDENTITY;
     }
 
-    sql_reset_and_clear_bindings(session->least_trust);
+    sql_reset_and_clear_bindings(statement);
+    pEp_sql_read_end(session);
     LOG_NONOK_STATUS_NONOK;
     return status;
 }
@@ -3110,9 +3436,14 @@ DYNAMIC_API PEP_STATUS decrypt_and_verify(
     PEP_REQUIRE(session && ctext && csize
                 && ptext && psize && keylist);
 
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.decrypt_and_verify");
     PEP_STATUS status = session->cryptotech[PEP_crypt_OpenPGP].decrypt_and_verify(
             session, ctext, csize, dsigtext, dsigsize, ptext, psize, keylist,
             filename_ptr);
+    PEP_TRACE_ATTRIBUTES(span, csize, (PEP_STATUS_is_error(status)
+                                       ? 0 : stringlist_length(* keylist)));
+    PEP_TRACE_END(span, status);
 
     if (status == PEP_DECRYPT_NO_KEY)
         signal_Sync_event(session, Sync_PR_keysync, CannotDecrypt, NULL);
@@ -3131,8 +3462,14 @@ DYNAMIC_API PEP_STATUS encrypt_and_sign(
     PEP_REQUIRE(session && keylist && ptext && psize
                 && ctext && csize);
 
-    return session->cryptotech[PEP_crypt_OpenPGP].encrypt_and_sign(session,
-            keylist, ptext, psize, ctext, csize);
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.encrypt_and_sign");
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].encrypt_and_sign(session,
+              keylist, ptext, psize, ctext, csize);
+    PEP_TRACE_ATTRIBUTES(span, psize, stringlist_length(keylist));
+    PEP_TRACE_END(span, status);
+    return status;
 }
 
 PEP_STATUS encrypt_only(
@@ -3143,8 +3480,14 @@ PEP_STATUS encrypt_only(
     PEP_REQUIRE(session && keylist && ptext && psize
                 && ctext && csize);
 
-    return session->cryptotech[PEP_crypt_OpenPGP].encrypt_only(session,
-            keylist, ptext, psize, ctext, csize);
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.encrypt_only");
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].encrypt_only(session,
+              keylist, ptext, psize, ctext, csize);
+    PEP_TRACE_ATTRIBUTES(span, psize, stringlist_length(keylist));
+    PEP_TRACE_END(span, status);
+    return status;
 }
 
 PEP_STATUS sign_only(PEP_SESSION session, 
@@ -3156,9 +3499,14 @@ PEP_STATUS sign_only(PEP_SESSION session,
     PEP_REQUIRE(session && data && data_size && ! EMPTYSTR(fpr)
                 && sign && sign_size);
 
-    return session->cryptotech[PEP_crypt_OpenPGP].sign_only(session,
-                                fpr, data, data_size, sign, sign_size);
-                         
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.sign_only");
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].sign_only(session,
+              fpr, data, data_size, sign, sign_size);
+    PEP_TRACE_ATTRIBUTES(span, data_size, 1);
+    PEP_TRACE_END(span, status);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS probe_encrypt(PEP_SESSION session, const char *fpr)
@@ -3185,15 +3533,36 @@ DYNAMIC_API PEP_STATUS verify_text(
 {
     PEP_REQUIRE(session && text && size && signature && sig_size && keylist);
 
-    return session->cryptotech[PEP_crypt_OpenPGP].verify_text(session, text,
-            size, signature, sig_size, keylist);
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.verify_text");
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].verify_text(session, text,
+              size, signature, sig_size, keylist);
+    PEP_TRACE_ATTRIBUTES(span, size, (PEP_STATUS_is_error(status)
+                                      ? 0 : stringlist_length(* keylist)));
+    PEP_TRACE_END(span, status);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS delete_keypair(PEP_SESSION session, const char *fpr)
 {
     PEP_REQUIRE(session && ! EMPTYSTR(fpr));
 
-    return session->cryptotech[PEP_crypt_OpenPGP].delete_keypair(session, fpr);
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].delete_keypair(session, fpr);
+    pEp_sql_note_key_store_change(session);
+
+    /* Importing the same data again must actually import the key. */
+    if (status == PEP_STATUS_OK) {
+        sql_reset_and_clear_bindings(session->key_import_digest_forget);
+        pEp_sql_bind_fpr(session->key_import_digest_forget, 1, fpr);
+        int result = pEp_sqlite3_step_nonbusy(session,
+                                              session->key_import_digest_forget);
+        sql_reset_and_clear_bindings(session->key_import_digest_forget);
+        if (result != SQLITE_DONE)
+            LOG_WARNING("could not forget import digests for %s", fpr);
+    }
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS export_key(
@@ -3292,6 +3661,7 @@ PEP_STATUS _generate_keypair(PEP_SESSION session,
     PEP_STATUS status =
         session->cryptotech[PEP_crypt_OpenPGP].generate_keypair(session,
                 identity);
+    pEp_sql_note_key_store_change(session);
                 
     if (saved_username) {
         free(identity->username);
@@ -3362,15 +3732,220 @@ DYNAMIC_API PEP_STATUS import_key_with_fpr_return(
     if (imported_keys && !*imported_keys && changed_public_keys)
         *changed_public_keys = 0;
 
-    return session->cryptotech[PEP_crypt_OpenPGP].import_key(session, key_data,
-            size, private_keys, imported_keys, changed_public_keys);
+    PEP_TRACE_SPAN(span);
+    PEP_TRACE_BEGIN(span, "crypto.import_key");
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].import_key(session, key_data,
+              size, private_keys, imported_keys, changed_public_keys);
+    if (status != PEP_NO_KEY_IMPORTED)
+        pEp_sql_note_key_store_change(session);
+    PEP_TRACE_ATTRIBUTES(span, size,
+                         (imported_keys != NULL
+                          ? stringlist_length(* imported_keys) : 0));
+    PEP_TRACE_END(span, status);
+    return status;
+}
+
+/* Look for the given digest among the recently imported ones; on a hit set
+   *fprs to a new list of the fingerprints imported from the same data, in
+   order, otherwise to NULL. */
+static PEP_STATUS _lookup_key_import_digest(PEP_SESSION session,
+                                            const unsigned char *digest,
+                                            size_t digest_size,
+                                            stringlist_t **fprs)
+{
+    PEP_REQUIRE(session && digest && fprs);
+    *fprs = NULL;
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    stringlist_t *_fprs = NULL;
+    sqlite3_stmt *s = session->key_import_digest_lookup;
+    sql_reset_and_clear_bindings(s);
+    sqlite3_bind_blob(s, 1, digest, (int) digest_size, SQLITE_STATIC);
+    sqlite3_bind_int64(s, 2, (sqlite3_int64) time(NULL)
+                             - KEY_IMPORT_DIGEST_MAX_AGE);
+    int result;
+    while ((result = pEp_sqlite3_step_nonbusy(session, s)) == SQLITE_ROW) {
+        const char *fpr = (const char *) sqlite3_column_text(s, 0);
+        if (EMPTYSTR(fpr))
+            continue;
+        if (_fprs == NULL)
+            _fprs = new_stringlist(fpr);
+        else if (stringlist_add(_fprs, fpr) == NULL) {
+            free_stringlist(_fprs);
+            _fprs = NULL;
+        }
+        if (_fprs == NULL) {
+            status = PEP_OUT_OF_MEMORY;
+            break;
+        }
+    }
+    if (status == PEP_STATUS_OK && result != SQLITE_DONE)
+        status = PEP_UNKNOWN_DB_ERROR;
+    sql_reset_and_clear_bindings(s);
+
+    if (status == PEP_STATUS_OK)
+        *fprs = _fprs;
+    else
+        free_stringlist(_fprs);
+    return status;
+}
+
+/* Remember that importing data with the given digest yielded the given
+   fingerprints, and forget digests which are too old. */
+static PEP_STATUS _record_key_import_digest(PEP_SESSION session,
+                                            const unsigned char *digest,
+                                            size_t digest_size,
+                                            const stringlist_t *fprs)
+{
+    PEP_REQUIRE(session && digest && fprs);
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    sqlite3_int64 now = (sqlite3_int64) time(NULL);
+    int result;
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    const stringlist_t *f;
+    for (f = fprs; f != NULL && status == PEP_STATUS_OK; f = f->next) {
+        if (EMPTYSTR(f->value))
+            continue;
+        sqlite3_stmt *s = session->key_import_digest_record;
+        sql_reset_and_clear_bindings(s);
+        sqlite3_bind_blob(s, 1, digest, (int) digest_size, SQLITE_STATIC);
+        pEp_sql_bind_fpr(s, 2, f->value);
+        sqlite3_bind_int64(s, 3, now);
+        result = pEp_sqlite3_step_nonbusy(session, s);
+        sql_reset_and_clear_bindings(s);
+        if (result != SQLITE_DONE)
+            status = PEP_UNKNOWN_DB_ERROR;
+    }
+    if (status == PEP_STATUS_OK) {
+        sqlite3_stmt *s = session->key_import_digest_prune;
+        sql_reset_and_clear_bindings(s);
+        sqlite3_bind_int64(s, 1, now - KEY_IMPORT_DIGEST_MAX_AGE);
+        result = pEp_sqlite3_step_nonbusy(session, s);
+        sql_reset_and_clear_bindings(s);
+        if (result != SQLITE_DONE)
+            status = PEP_UNKNOWN_DB_ERROR;
+    }
+    if (status == PEP_STATUS_OK)
+        PEP_SQL_COMMIT_TRANSACTION();
+    else
+        PEP_SQL_ROLLBACK_TRANSACTION();
+    return status;
+}
+
+/* Return true iff every key in the given list is in the key store.  A key
+   recorded with a digest may have been removed since, for example by the
+   application through the cryptotech, without delete_keypair . */
+static bool _keys_still_stored(PEP_SESSION session, const stringlist_t *fprs)
+{
+    const stringlist_t *f;
+    for (f = fprs; f != NULL; f = f->next) {
+        if (EMPTYSTR(f->value))
+            continue;
+        stringlist_t *keylist = NULL;
+        PEP_STATUS status = find_keys(session, f->value, & keylist);
+        bool found = (status == PEP_STATUS_OK && keylist != NULL
+                      && ! EMPTYSTR(keylist->value));
+        free_stringlist(keylist);
+        if (! found)
+            return false;
+    }
+    return true;
+}
+
+PEP_STATUS import_key_with_fpr_return_deduplicated(
+        PEP_SESSION session,
+        const char *key_data,
+        size_t size,
+        identity_list **private_keys,
+        stringlist_t** imported_keys,
+        uint64_t* changed_public_keys
+    )
+{
+    PEP_REQUIRE(session && key_data && size);
+
+    if (private_keys != NULL)
+        * private_keys = NULL;
+    if (imported_keys && !*imported_keys && changed_public_keys)
+        *changed_public_keys = 0;
+
+    /* RIPEMD-160 is fast enough compared to an import, and unlike a
+       non-cryptographic hash makes it impractical to craft different data
+       with a recorded digest in order to suppress its import. */
+    unsigned char digest[20];
+    pEp_rmd160(digest, (const unsigned char *) key_data, size);
+
+    /* Short-circuit the import if we have seen the same bytes.  Failing to
+       read the index is not a reason to fail: just import. */
+    stringlist_t *known_fprs = NULL;
+    PEP_STATUS status = _lookup_key_import_digest(session, digest,
+                                                  sizeof (digest),
+                                                  & known_fprs);
+    if (status == PEP_STATUS_OK && known_fprs != NULL
+        && ! _keys_still_stored(session, known_fprs)) {
+        LOG_TRACE("a key imported from this key data is gone: importing again");
+        free_stringlist(known_fprs);
+        known_fprs = NULL;
+    }
+    if (status == PEP_STATUS_OK && known_fprs != NULL) {
+        /* Nothing changed, so no bit in *changed_public_keys gets set. */
+        if (imported_keys != NULL && * imported_keys == NULL) {
+            * imported_keys = known_fprs;
+            known_fprs = NULL;
+        }
+        else if (imported_keys != NULL
+                 && stringlist_append(* imported_keys, known_fprs) == NULL) {
+            free_stringlist(known_fprs);
+            return PEP_OUT_OF_MEMORY;
+        }
+        free_stringlist(known_fprs);
+        LOG_TRACE("skipped importing already imported key data");
+        return PEP_KEY_IMPORTED;
+    }
+
+    /* Import.  We need the private and imported keys even when the caller
+       does not. */
+    identity_list *_private_keys = NULL;
+    stringlist_t *_imported_keys = NULL;
+    stringlist_t **imported_keys_p
+        = (imported_keys != NULL) ? imported_keys : & _imported_keys;
+    stringlist_t *old_tail = stringlist_get_tail(* imported_keys_p);
+    if (old_tail != NULL && old_tail->value == NULL)
+        old_tail = NULL;
+    status = import_key_with_fpr_return(session, key_data, size,
+                                        & _private_keys, imported_keys_p,
+                                        (imported_keys != NULL
+                                         ? changed_public_keys : NULL));
+
+    /* Remember public-key-only imports; private key imports have side effects
+       the caller may depend on. */
+    if ((status == PEP_STATUS_OK || status == PEP_KEY_IMPORTED)
+        && _private_keys == NULL) {
+        const stringlist_t *new_fprs
+            = (old_tail != NULL) ? old_tail->next : * imported_keys_p;
+        if (new_fprs != NULL && new_fprs->value != NULL
+            && _record_key_import_digest(session, digest, sizeof (digest),
+                                         new_fprs) != PEP_STATUS_OK)
+            LOG_WARNING("could not record import digest");
+    }
+
+    if (private_keys != NULL)
+        * private_keys = _private_keys;
+    else
+        free_identity_list(_private_keys);
+    free_stringlist(_imported_keys);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS recv_key(PEP_SESSION session, const char *pattern)
 {
     PEP_REQUIRE(session && ! EMPTYSTR(pattern));
 
-    return session->cryptotech[PEP_crypt_OpenPGP].recv_key(session, pattern);
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].recv_key(session, pattern);
+    pEp_sql_note_key_store_change(session);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS send_key(PEP_SESSION session, const char *pattern)
@@ -3389,7 +3964,10 @@ DYNAMIC_API PEP_STATUS renew_key(
     PEP_REQUIRE(session && ! EMPTYSTR(fpr)
                 /* ts is allowed to be NULL. */);
 
-    return session->cryptotech[PEP_crypt_OpenPGP].renew_key(session, fpr, ts);
+    PEP_STATUS status
+        = session->cryptotech[PEP_crypt_OpenPGP].renew_key(session, fpr, ts);
+    pEp_sql_note_key_store_change(session);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS revoke_key(
@@ -3410,8 +3988,10 @@ DYNAMIC_API PEP_STATUS revoke_key(
     if (revoked)
         return PEP_STATUS_OK;
 
-    return session->cryptotech[PEP_crypt_OpenPGP].revoke_key(session, fpr,
-            reason);
+    status = session->cryptotech[PEP_crypt_OpenPGP].revoke_key(session, fpr,
+                                                                reason);
+    pEp_sql_note_key_store_change(session);
+    return status;
 }
 
 DYNAMIC_API PEP_STATUS key_expired(
@@ -3742,11 +4322,11 @@ the_end:
  *
  *  <!--       _get_sequence_value()       -->
  *
- *  @brief            TODO
+ *  @brief            Read the latest value reserved from a sequence
  *
  *  @param[in]    session        session handle    
  *  @param[in]    *name        const char
- *  @param[in]    *value        int32_t
+ *  @param[out]   *value        int64_t
  *
  *  @retval     PEP_STATUS_OK
  *  @retval     PEP_RECORD_NOT_FOUND
@@ -3754,7 +4334,7 @@ the_end:
  *
  */
 static PEP_STATUS _get_sequence_value(PEP_SESSION session, const char *name,
-        int32_t *value)
+        int64_t *value)
 {
     PEP_REQUIRE(session && ! EMPTYSTR(name) && value);
 
@@ -3765,8 +4345,8 @@ static PEP_STATUS _get_sequence_value(PEP_SESSION session, const char *name,
     int result = pEp_sqlite3_step_nonbusy(session, session->sequence_value2);
     switch (result) {
         case SQLITE_ROW: {
-            int32_t _value = (int32_t)
-                    sqlite3_column_int(session->sequence_value2, 0);
+            int64_t _value = (int64_t)
+                    sqlite3_column_int64(session->sequence_value2, 0);
             *value = _value;
             break;
         }
@@ -3786,10 +4366,11 @@ static PEP_STATUS _get_sequence_value(PEP_SESSION session, const char *name,
  *
  *  <!--       _increment_sequence_value()       -->
  *
- *  @brief            TODO
+ *  @brief            Reserve the next values of a sequence
  *
  *  @param[in]    session        session handle    
  *  @param[in]    *name        constchar
+ *  @param[in]    increment    how many values to reserve
  *
  *  @retval     PEP_STATUS_OK
  *  @retval     PEP_ILLEGAL_VALUE       illegal parameter value
@@ -3797,12 +4378,13 @@ static PEP_STATUS _get_sequence_value(PEP_SESSION session, const char *name,
  *
  */
 static PEP_STATUS _increment_sequence_value(PEP_SESSION session,
-        const char *name)
+        const char *name, unsigned int increment)
 {
-    PEP_REQUIRE(session && ! EMPTYSTR(name));
+    PEP_REQUIRE(session && ! EMPTYSTR(name) && increment > 0);
 
     sql_reset_and_clear_bindings(session->sequence_value1);
     sqlite3_bind_text(session->sequence_value1, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(session->sequence_value1, 2, increment);
     int result = pEp_sqlite3_step_nonbusy(session, session->sequence_value1);
     sql_reset_and_clear_bindings(session->sequence_value1);
     PEP_WEAK_ASSERT_ORELSE_RETURN(result == SQLITE_DONE,
@@ -3810,6 +4392,66 @@ static PEP_STATUS _increment_sequence_value(PEP_SESSION session,
     return PEP_STATUS_OK;
 }
 
+/* The values of one sequence reserved by a session and not handed out yet,
+   from value to last; the block is empty when value is greater. */
+struct _pEp_sequence_block {
+    char *name;
+    int32_t value;
+    int32_t last;
+    struct _pEp_sequence_block *next;
+};
+
+/* Return the block of the given sequence, adding an empty one if there is
+   none, or NULL if out of memory. */
+static struct _pEp_sequence_block *sequence_block(PEP_SESSION session,
+                                                  const char *name)
+{
+    struct _pEp_sequence_block *block;
+    for (block = session->sequence_blocks; block != NULL; block = block->next)
+        if (strcmp(block->name, name) == 0)
+            return block;
+
+    block = calloc(1, sizeof (struct _pEp_sequence_block));
+    if (block == NULL)
+        return NULL;
+    block->name = strdup(name);
+    if (block->name == NULL) {
+        free(block);
+        return NULL;
+    }
+    block->value = 1;
+    block->last = 0;
+    block->next = session->sequence_blocks;
+    session->sequence_blocks = block;
+    return block;
+}
+
+/* Drop every block.  If give_back is true the values not handed out go back
+   to their sequence when nobody reserved any value after them; otherwise
+   they are just skipped. */
+static void drop_sequence_blocks(PEP_SESSION session, bool give_back)
+{
+    while (session->sequence_blocks != NULL) {
+        struct _pEp_sequence_block *block = session->sequence_blocks;
+        session->sequence_blocks = block->next;
+        if (give_back && block->value <= block->last) {
+            sqlite3_stmt *s = session->sequence_value_give_back;
+            sql_reset_and_clear_bindings(s);
+            sqlite3_bind_text(s, 1, block->name, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(s, 2, block->last);
+            sqlite3_bind_int64(s, 3, (int64_t) block->value - 1);
+            int result = pEp_sqlite3_step_nonbusy(session, s);
+            sql_reset_and_clear_bindings(s);
+            if (result != SQLITE_DONE)
+                LOG_WARNING("cannot give back the values of sequence %s: %s",
+                            block->name,
+                            pEp_sql_status_to_status_text(session, result));
+        }
+        free(block->name);
+        free(block);
+    }
+}
+
 DYNAMIC_API PEP_STATUS sequence_value(
         PEP_SESSION session,
         const char *name,
@@ -3820,17 +4462,44 @@ DYNAMIC_API PEP_STATUS sequence_value(
 
     PEP_STATUS status = PEP_STATUS_OK;
     *value = 0;
+
+    /* Hand out a reserved value if there is one. */
+    struct _pEp_sequence_block *block = NULL;
+    if (session->sequence_block_size > 1) {
+        block = sequence_block(session, name);
+        if (block == NULL)
+            return PEP_OUT_OF_MEMORY;
+        if (block->value <= block->last) {
+            *value = block->value ++;
+            return PEP_STATUS_OK;
+        }
+        /* Within a transaction the reservation could be rolled back, and
+           then other sessions would reserve the same values again: take one
+           value, as if no block were configured. */
+        if (session->transaction_in_progress_no > 0)
+            block = NULL;
+    }
+    unsigned int increment
+        = (block != NULL) ? session->sequence_block_size : 1;
+
+    int64_t last = 0;
     PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
-    status = _increment_sequence_value(session, name);
+    status = _increment_sequence_value(session, name, increment);
     if (status == PEP_STATUS_OK)
-        status = _get_sequence_value(session, name, value);
+        status = _get_sequence_value(session, name, & last);
 
     if (status == PEP_STATUS_OK) {
         PEP_SQL_COMMIT_TRANSACTION();
-        PEP_ASSERT(*value < INT32_MAX);
-        if (*value == INT32_MAX){
+        int64_t first = last - increment + 1;
+        PEP_ASSERT(first < INT32_MAX);
+        if (first >= INT32_MAX){
             return PEP_CANNOT_INCREASE_SEQUENCE;
         }
+        *value = (int32_t) first;
+        if (block != NULL) {
+            block->value = *value + 1;
+            block->last = (int32_t) ((last < INT32_MAX) ? last : INT32_MAX - 1);
+        }
         return status;
     } else {
         PEP_SQL_ROLLBACK_TRANSACTION();
@@ -3840,11 +4509,35 @@ DYNAMIC_API PEP_STATUS sequence_value(
     return status;
 }
 
+DYNAMIC_API PEP_STATUS config_sequence_block_size(PEP_SESSION session,
+                                                  unsigned int block_size)
+{
+    PEP_REQUIRE(session);
+
+    /* A larger block would raise the sequence past any int32_t value on the
+       first reservation. */
+    if (block_size > INT32_MAX) {
+        LOG_ERROR("sequence block size %u is greater than %i", block_size,
+                  (int) INT32_MAX);
+        return PEP_ILLEGAL_VALUE;
+    }
+
+    drop_sequence_blocks(session, true);
+    session->sequence_block_size = block_size;
+    return PEP_STATUS_OK;
+}
+
 PEP_STATUS is_own_key(PEP_SESSION session, const char* fpr, bool* own_key) {
     PEP_REQUIRE (session && ! EMPTYSTR(fpr) && own_key);
 
     *own_key = false;
 
+    /* An own key is always listed: most keys are not, and this check needs
+       no query. */
+    bool listed;
+    if (pEp_key_sets_is_own_listed(session, fpr, & listed) && ! listed)
+        return PEP_STATUS_OK;
+
     char* default_own_userid = NULL;
     pEp_identity* placeholder_ident = NULL;
 
@@ -3891,9 +4584,8 @@ DYNAMIC_API PEP_STATUS set_revoked(
 
     PEP_STATUS status = PEP_STATUS_OK;
     sql_reset_and_clear_bindings(session->set_revoked);
-    sqlite3_bind_text(session->set_revoked, 1, revoked_fpr, -1, SQLITE_STATIC);
-    sqlite3_bind_text(session->set_revoked, 2, replacement_fpr, -1,
-            SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->set_revoked, 1, revoked_fpr);
+    pEp_sql_bind_fpr(session->set_revoked, 2, replacement_fpr);
     sqlite3_bind_int64(session->set_revoked, 3, revocation_date);
 
     int result;
@@ -3927,7 +4619,7 @@ DYNAMIC_API PEP_STATUS get_revoked(
     *revocation_date = 0;
 
     sql_reset_and_clear_bindings(session->get_revoked);
-    sqlite3_bind_text(session->get_revoked, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->get_revoked, 1, fpr);
 
     int result;
     
@@ -3969,8 +4661,18 @@ DYNAMIC_API PEP_STATUS get_replacement_fpr(
     *revoked_fpr = NULL;
     *revocation_date = 0;
 
+    bool revoked;
+    if (pEp_key_sets_get_replacement(session, fpr, & revoked, revoked_fpr,
+                                     revocation_date)) {
+        if (! revoked)
+            return PEP_CANNOT_FIND_IDENTITY;
+        else if (*revoked_fpr != NULL)
+            return PEP_STATUS_OK;
+        /* No replacement: let the query below decide. */
+    }
+
     sql_reset_and_clear_bindings(session->get_replacement_fpr);
-    sqlite3_bind_text(session->get_replacement_fpr, 1, fpr, -1, SQLITE_STATIC);
+    pEp_sql_bind_fpr(session->get_replacement_fpr, 1, fpr);
 
     int result;
     
@@ -3998,43 +4700,89 @@ DYNAMIC_API PEP_STATUS get_replacement_fpr(
     return status;
 }
 
-PEP_STATUS get_last_contacted(
-        PEP_SESSION session,
-        identity_list** id_list
-    )
+void start_recent_contacts(PEP_SESSION session,
+                           unsigned int window_in_seconds,
+                           pEp_recent_contacts_cursor *cursor)
 {
-    PEP_REQUIRE(session && id_list);
+    PEP_REQUIRE_ORELSE(session && cursor, { return; });
 
-    *id_list = NULL;
+    cursor->until = time(NULL);
+    cursor->last_contact = cursor->until - (int64_t) window_in_seconds;
+    /* Before any identity contacted exactly at the window start. */
+    cursor->rowid = INT64_MIN;
+}
+
+PEP_STATUS get_recent_contacts(PEP_SESSION session,
+                               pEp_recent_contacts_cursor *cursor,
+                               unsigned int max_no,
+                               identity_list **contacts)
+{
+    PEP_REQUIRE(session && cursor && contacts);
+
+    *contacts = NULL;
     identity_list* ident_list = NULL;
+    identity_list* last = NULL;
+    PEP_STATUS status = PEP_STATUS_OK;
 
-    sql_reset_and_clear_bindings(session->get_last_contacted);
+    sql_reset_and_clear_bindings(session->get_recent_contacts);
+    sqlite3_bind_int64(session->get_recent_contacts, 1, cursor->last_contact);
+    sqlite3_bind_int64(session->get_recent_contacts, 2, cursor->rowid);
+    sqlite3_bind_int64(session->get_recent_contacts, 3, cursor->until);
+    sqlite3_bind_int64(session->get_recent_contacts, 4,
+                       (max_no == 0) ? -1 : (sqlite3_int64) max_no);
     int result;
 
-    while ((result = pEp_sqlite3_step_nonbusy(session, session->get_last_contacted)) == SQLITE_ROW) {
+    while ((result = pEp_sqlite3_step_nonbusy(session, session->get_recent_contacts)) == SQLITE_ROW) {
         pEp_identity *ident = new_identity(
-                (const char *) sqlite3_column_text(session->get_last_contacted, 1),
+                (const char *) sqlite3_column_text(session->get_recent_contacts, 1),
                 NULL,
-                (const char *) sqlite3_column_text(session->get_last_contacted, 0),
+                (const char *) sqlite3_column_text(session->get_recent_contacts, 0),
                 NULL);
-                
-        PEP_WEAK_ASSERT_ORELSE(ident, {
-            sql_reset_and_clear_bindings(session->get_last_contacted);
-            return PEP_OUT_OF_MEMORY;
-        });
-    
-        if (ident_list)
-            identity_list_add(ident_list, ident);
-        else
-            ident_list = new_identity_list(ident);
+        if (ident == NULL)
+            goto enomem;
+
+        last = identity_list_add(last, ident);
+        if (last == NULL) {
+            free_identity(ident);
+            goto enomem;
+        }
+        if (ident_list == NULL)
+            ident_list = last;
+
+        cursor->last_contact
+            = sqlite3_column_int64(session->get_recent_contacts, 2);
+        cursor->rowid = sqlite3_column_int64(session->get_recent_contacts, 3);
+    }
+    if (result != SQLITE_DONE) {
+        status = PEP_UNKNOWN_DB_ERROR;
+        goto end;
     }
 
-    sql_reset_and_clear_bindings(session->get_last_contacted);
-    
-    *id_list = ident_list;
-    
-    PEP_STATUS status = PEP_STATUS_OK;
-    if (!ident_list)
+    *contacts = ident_list;
+    ident_list = NULL;
+    goto end;
+
+ enomem:
+    status = PEP_OUT_OF_MEMORY;
+ end:
+    sql_reset_and_clear_bindings(session->get_recent_contacts);
+    free_identity_list(ident_list);
+    LOG_NONOK_STATUS_NONOK;
+    return status;
+}
+
+PEP_STATUS get_last_contacted(
+        PEP_SESSION session,
+        identity_list** id_list
+    )
+{
+    PEP_REQUIRE(session && id_list);
+
+    pEp_recent_contacts_cursor cursor;
+    start_recent_contacts(session, PEP_RECENT_CONTACTS_DEFAULT_WINDOW,
+                          & cursor);
+    PEP_STATUS status = get_recent_contacts(session, & cursor, 0, id_list);
+    if (status == PEP_STATUS_OK && *id_list == NULL)
         status = PEP_CANNOT_FIND_IDENTITY;
     LOG_NONOK_STATUS_NONOK;
     return status;
@@ -109,6 +109,10 @@ typedef enum {
     PEP_INIT_CANNOT_OPEN_DB                         = 0x0121,
     PEP_INIT_CANNOT_OPEN_SYSTEM_DB                  = 0x0122,
     PEP_INIT_DB_DOWNGRADE_VIOLATION                 = 0x0123,                        
+
+    // the management database is locked by another writer and the session is
+    // in non-blocking mode: try again later, see config_nonblocking_sql
+    PEP_WOULD_BLOCK                                 = 0x0130,
     PEP_UNKNOWN_DB_ERROR                            = 0x01ff,
     
     PEP_KEY_NOT_FOUND                               = 0x0201,
@@ -405,16 +409,18 @@ typedef PEP_STATUS (*ensure_passphrase_t)(PEP_SESSION session, const char* fpr);
  *  @retval PEP_INIT_CANNOT_OPEN_SYSTEM_DB      if system's management db cannot be
  *                                              opened
  *  
- *  @warning THE CALLER MUST GUARD THIS CALL EXTERNALLY WITH A MUTEX. release()
- *           should be similarly guarded.
+ *  @note    this function is thread-safe: init() and release() may be called
+ *           concurrently from any number of threads.  The first session in
+ *           the process is initialised, and the last one finalised, under an
+ *           internal mutex; concurrent calls wait for that to complete.  If
+ *           the first call fails the next one will again initialise as the
+ *           first.
  * 
  *  @warning the pointer is valid only if the return value is PEP_STATUS_OK
  *           in other case a NULL pointer will be returned; a valid handle must
  *           be released using release() when it's no longer needed
  * 
- *  @warning the caller has to guarantee that the first call to this function
- *           will succeed before further calls can be done
- *           messageToSend can only be null if no transport is application based
+ *  @warning messageToSend can only be null if no transport is application based
  *           if transport system is not used it must not be NULL
  * 
  *  @warning ensure_refresh_key should only be NULL if the 
@@ -439,11 +445,9 @@ DYNAMIC_API PEP_STATUS init(
  *  
  *  @param[in]   session    session handle to release
  *  
- *  @warning THE CALLER MUST GUARD THIS CALL EXTERNALLY WITH A MUTEX. init() should
- *           be similarly guarded.
+ *  @note    this function is thread-safe, see init()
  * 
- *  @warning the last release() can be called only when all other release() calls
- *           are done
+ *  @warning a session must not be used by any thread after being released
  *  
  */
 DYNAMIC_API void release(PEP_SESSION session);
@@ -568,6 +572,246 @@ DYNAMIC_API void config_use_only_own_private_keys(PEP_SESSION session, bool enab
 DYNAMIC_API void config_service_log(PEP_SESSION session, bool enable);
 
 
+/**
+ *  @typedef    sql_ready_t
+ *
+ *  @brief      Callback notifying that the management database write lock,
+ *              which made an earlier call fail with PEP_WOULD_BLOCK , has been
+ *              released.
+ *
+ *              Only commits and rollbacks made by sessions of the same
+ *              process are notified: a lock released by another process is
+ *              never notified, see config_nonblocking_sql .
+ *
+ *  @param[in]  context     the pointer supplied to config_nonblocking_sql
+ *
+ *  @warning    this is called on whatever thread released the lock, possibly
+ *              while that thread is inside an Engine call: the callback must
+ *              not call into the Engine, but only schedule the retry on the
+ *              host's own event loop (for example by writing to an eventfd or
+ *              a pipe)
+ *
+ */
+typedef void (*sql_ready_t)(void *context);
+
+/**
+ *  <!--       config_nonblocking_sql()       -->
+ *
+ *  @brief Enable or disable non-blocking SQL mode.
+ *
+ *         By default, when the management database is locked by another
+ *         writer, the Engine sleeps inside the API call with exponential
+ *         backoff until the lock becomes available.  This is a problem for
+ *         hosts running the Engine from an event loop.  In non-blocking mode
+ *         update_identity and set_identity instead acquire the write lock up
+ *         front without waiting; if it is not available they fail immediately
+ *         with PEP_WOULD_BLOCK , without side effects, and the caller should
+ *         repeat the same call later.  Once the lock is acquired the whole
+ *         call runs in one transaction and will not wait for other writers.
+ *
+ *         decrypt_message_2 does not need the lock to read: it only tries
+ *         to acquire it, without waiting, at its first database update, and
+ *         then keeps it until it returns.  If the lock is not available at
+ *         that point the call fails with PEP_WOULD_BLOCK and its updates are
+ *         rolled back; output parameters are left untouched.  Keys found in
+ *         the message may already have been imported into the key store,
+ *         which is harmless when the call is repeated.  With
+ *         PEP_decrypt_flag_untrusted_server the lock is acquired at entry,
+ *         as for update_identity .
+ *
+ *         Other API functions calling these ones internally may also fail
+ *         with PEP_WOULD_BLOCK in non-blocking mode; it is always safe to
+ *         treat it as retryable.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   enable         flag if enabled or disabled
+ *  @param[in]   ready          called once after a PEP_WOULD_BLOCK failure
+ *                              when the lock is released by another session
+ *                              in the same process, never when it is
+ *                              released by another process; may be NULL
+ *  @param[in]   ready_context  passed to ready as is; ownership remains with
+ *                              the caller
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ *  @warning the lock may also be held by a different process, which cannot
+ *           notify this one: hosts should retry after a short timeout (in the
+ *           order of 100 ms) even when no notification arrives
+ *
+ */
+
+DYNAMIC_API PEP_STATUS config_nonblocking_sql(PEP_SESSION session,
+                                              bool enable,
+                                              sql_ready_t ready,
+                                              void *ready_context);
+
+
+/**
+ *  <!--       config_ingestion_mode()       -->
+ *
+ *  @brief Enable or disable ingestion mode, meant for importing a whole
+ *         mailbox or processing a large backlog of messages.
+ *
+ *         Decrypting a message normally updates identities, trust and keys in
+ *         several short transactions, each waiting for the write lock and
+ *         syncing the database to disk.  In ingestion mode the session instead
+ *         keeps one exclusive transaction open and accumulates those writes,
+ *         committing them every checkpoint_interval messages passed to
+ *         decrypt_message_2 , at every ingestion_checkpoint call, and when
+ *         ingestion mode is disabled or the session is released.  After a
+ *         message which ends more than one second after the transaction
+ *         began, the session also commits and then pauses for one second,
+ *         decrypting as outside ingestion mode, so that other writers get
+ *         the lock.  Each operation keeps its own atomicity: one which fails
+ *         and rolls back does not undo the others.  The database state after
+ *         the final commit is the same as when processing the same messages
+ *         one by one.
+ *
+ *         Callbacks: with the outbound queue enabled (see
+ *         config_outbound_queue in transport.h) messages generated while
+ *         ingesting are handed to messageToSend after the checkpoint which
+ *         commits the changes producing them.  Without the queue, which is
+ *         the default, messageToSend is called at once, before those changes
+ *         are committed and visible to other sessions.  Sync events are
+ *         delivered at once, but the Sync thread cannot write until the next
+ *         checkpoint or pause.
+ *
+ *  @param[in]   session              session handle
+ *  @param[in]   enable               flag if enabled or disabled
+ *  @param[in]   checkpoint_interval  number of messages between automatic
+ *                                    checkpoints; 0 for a default value
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values, or called
+ *                                  while a transaction is in progress
+ *
+ *  @warning between checkpoints this session holds the write lock on the
+ *           management database: other sessions and processes writing it,
+ *           including the Sync thread, wait until the next checkpoint or
+ *           pause, that is for about two seconds at most, plus the time to
+ *           decrypt one message.
+ *
+ */
+
+DYNAMIC_API PEP_STATUS config_ingestion_mode(PEP_SESSION session,
+                                             bool enable,
+                                             unsigned int checkpoint_interval);
+
+
+/**
+ *  <!--       ingestion_checkpoint()       -->
+ *
+ *  @brief Commit the writes accumulated in ingestion mode, making them
+ *         visible to other sessions, and briefly release the write lock.
+ *
+ *  @param[in]   session        session handle
+ *
+ *  @retval PEP_STATUS_OK           success, or not in ingestion mode
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ */
+
+DYNAMIC_API PEP_STATUS ingestion_checkpoint(PEP_SESSION session);
+
+
+/**
+ *  <!--       config_read_pool()       -->
+ *
+ *  @brief Enable or disable the read pool, which is enabled by default.
+ *
+ *         With the read pool, functions which only query the management
+ *         database, such as get_identity , get_trust and
+ *         own_identities_retrieve , use a read-only connection shared by the
+ *         sessions of the process instead of taking the write lock: they run
+ *         concurrently with each other and with writers, each reading one
+ *         consistent snapshot of the committed state.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   enable         flag if enabled or disabled
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ */
+
+DYNAMIC_API PEP_STATUS config_read_pool(PEP_SESSION session, bool enable);
+
+
+/**
+ *  <!--       pEp_begin_batch()       -->
+ *
+ *  @brief Begin a batch: until pEp_end_batch every write to the management
+ *         database made through this session is part of one transaction,
+ *         committed or rolled back as a whole, instead of one transaction
+ *         per call each waiting for the write lock and syncing the database
+ *         to disk.  This is meant for many writes in a row, such as
+ *         set_identity on every address book entry.
+ *
+ *         Within a batch each call keeps its own atomicity: a call which
+ *         fails and rolls back undoes its own changes only, and the batch
+ *         goes on.  Changes are visible to this session at once, and to other
+ *         sessions and processes only after the batch commits.
+ *
+ *         Batch-safe calls, whose database writes join the batch, are the
+ *         ones working on identities, persons and trust, such as
+ *         set_identity , update_identity , set_identity_flags ,
+ *         unset_identity_flags , set_as_pEp_user , trust_personal_key ,
+ *         key_mistrusted , myself , encrypt_message and decrypt_message_2 .
+ *         Changes to the key store of the cryptotech, as made by import_key
+ *         or by key generation in myself , are not part of the batch and are
+ *         not rolled back with it.  encrypt_messages , decrypt_messages and
+ *         re_evaluate_message_ratings run on the calling thread only.
+ *         config_ingestion_mode and pEp_begin_batch fail within a batch.
+ *
+ *         Callbacks: with the outbound queue enabled (see
+ *         config_outbound_queue in transport.h) messages generated within
+ *         the batch are handed to messageToSend after the batch commits, and
+ *         discarded if it is rolled back or if the call generating them
+ *         failed.  Without the queue messageToSend is called at once, even if
+ *         the batch is later rolled back.  Sync events are delivered at once,
+ *         but the Sync thread cannot write until the batch ends.
+ *
+ *  @param[in]   session        session handle
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values, or called
+ *                                  within a batch, in ingestion mode or
+ *                                  while a call on this session has a
+ *                                  transaction open
+ *  @retval PEP_WOULD_BLOCK         in non-blocking mode, when the management
+ *                                  database is locked; see
+ *                                  config_nonblocking_sql
+ *
+ *  @warning during the batch this session holds the write lock on the
+ *           management database: other sessions and processes writing it,
+ *           including the Sync thread, wait until the batch ends.  A batch
+ *           still open when the session is released is rolled back.
+ *
+ */
+
+DYNAMIC_API PEP_STATUS pEp_begin_batch(PEP_SESSION session);
+
+
+/**
+ *  <!--       pEp_end_batch()       -->
+ *
+ *  @brief End the batch begun by pEp_begin_batch , committing or rolling back
+ *         every change made within it.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   commit         true to commit, false to roll back
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values, no batch in
+ *                                  progress, or called while a call on
+ *                                  this session has a transaction open
+ *
+ */
+
+DYNAMIC_API PEP_STATUS pEp_end_batch(PEP_SESSION session, bool commit);
+
+
 /**
  *  @typedef    PEP_CIPHER_SUITE
  *  
@@ -1739,6 +1983,13 @@ DYNAMIC_API PEP_STATUS get_phrase(
  *  <!--       sequence_value()       -->
  *  
  *  @brief Raise the value of a named sequence and retrieve it
+ *
+ *         Values of the same sequence are unique, and each session receives
+ *         them in increasing order.  If sessions reserve values in blocks,
+ *         see config_sequence_block_size , the order of a sequence holds per
+ *         session only: values handed out by different sessions interleave,
+ *         so a session may receive a value lower than one another session
+ *         has already received, and some values may never be handed out.
  *  
  *  @param[in]     session    session handle
  *  @param[in]     name       name of sequence
@@ -1761,6 +2012,37 @@ DYNAMIC_API PEP_STATUS sequence_value(
     );
 
 
+/**
+ *  <!--       config_sequence_block_size()       -->
+ *
+ *  @brief Make sequence_value reserve values in blocks.
+ *
+ *         By default every sequence_value call is a write transaction.  With
+ *         a block size greater than 1, the first call for a sequence name
+ *         reserves that many values in one transaction, and the following
+ *         calls on this session hand them out from memory until the block is
+ *         used up.  Within a transaction, such as a batch (see
+ *         pEp_begin_batch), no new block is reserved.
+ *
+ *         Values reserved and not handed out are given back when the block
+ *         size is configured again and when the session is released, unless
+ *         another session reserved values after them; otherwise, and if the
+ *         process ends without releasing the session, they are skipped.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   block_size     how many values to reserve at a time; 0 and
+ *                              1 mean one value per call; at most INT32_MAX
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       session is NULL, or block_size is greater
+ *                                  than INT32_MAX
+ *
+ */
+
+DYNAMIC_API PEP_STATUS config_sequence_block_size(PEP_SESSION session,
+                                                  unsigned int block_size);
+
+
 /**
  *  <!--       set_revoked()       -->
  *  
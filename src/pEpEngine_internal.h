@@ -286,6 +286,41 @@ PEP_STATUS replace_userid(PEP_SESSION session, const char* old_uid,
  */
 PEP_STATUS remove_key(PEP_SESSION session, const char* fpr);
 
+/**
+ *  @internal
+ *  <!--       import_key_with_fpr_return_deduplicated()       -->
+ *
+ *  @brief      Like import_key_with_fpr_return , but skip importing data
+ *              identical to some already imported in the last
+ *              KEY_IMPORT_DIGEST_MAX_AGE seconds; in that case return
+ *              PEP_KEY_IMPORTED, append the fingerprints imported back then
+ *              to *imported_keys and set no bit in *changed_public_keys .
+ *              Data is recognised by a digest stored in the management
+ *              database, only for imports yielding no private keys.
+ *              Deleting a key with delete_keypair forgets the digests of
+ *              every data it was imported from; data whose keys are no
+ *              longer in the key store for any other reason is imported
+ *              again.
+ *
+ *  @param[in]     session                session handle
+ *  @param[in]     key_data               key data
+ *  @param[in]     size                   amount of data to handle
+ *  @param[out]    private_keys           see import_key_with_fpr_return
+ *  @param[inout]  imported_keys          see import_key_with_fpr_return
+ *  @param[out]    changed_public_keys    see import_key_with_fpr_return
+ *
+ *  @retval     see import_key_with_fpr_return
+ *
+ */
+PEP_STATUS import_key_with_fpr_return_deduplicated(
+        PEP_SESSION session,
+        const char *key_data,
+        size_t size,
+        identity_list **private_keys,
+        stringlist_t** imported_keys,
+        uint64_t* changed_public_keys
+    );
+
 /**
  *  @internal
  *  <!--       remove_fpr_as_default()       -->
@@ -509,18 +544,81 @@ PEP_STATUS bind_own_ident_with_contact_ident(PEP_SESSION session,
                                              pEp_identity* own_ident,
                                              pEp_identity* contact_ident);
 
+/* The window of get_last_contacted , in seconds. */
+#define PEP_RECENT_CONTACTS_DEFAULT_WINDOW (14 * 24 * 60 * 60)
+
+/**
+ *  @internal
+ *  @struct    pEp_recent_contacts_cursor
+ *
+ *  @brief     The position of a walk through the recent contacts, from the
+ *             least to the most recently contacted.  Identities contacted
+ *             again during the walk are skipped if the walk already went
+ *             past them.
+ *
+ */
+typedef struct _pEp_recent_contacts_cursor {
+    int64_t until;          ///< the window end, as seconds since the epoch
+    int64_t last_contact;   ///< of the latest identity returned
+    int64_t rowid;          ///< of the latest identity returned
+} pEp_recent_contacts_cursor;
+
+/**
+ *  @internal
+ *  <!--       start_recent_contacts()       -->
+ *
+ *  @brief     Set the given cursor to the beginning of a walk through the
+ *             identities contacted within the given number of seconds.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   window_in_seconds  how far back to go
+ *  @param[out]  cursor             the cursor
+ *
+ */
+void start_recent_contacts(PEP_SESSION session,
+                           unsigned int window_in_seconds,
+                           pEp_recent_contacts_cursor *cursor);
+
+/**
+ *  @internal
+ *  <!--       get_recent_contacts()       -->
+ *
+ *  @brief     Return the next page of recently contacted identities, with
+ *             only their address and user_id set, and move the cursor past
+ *             them.  The index on identity.last_contact makes each page cost
+ *             its own size, not a scan of the identity table.
+ *
+ *  @param[in]    session       session handle
+ *  @param[inout] cursor        set by start_recent_contacts
+ *  @param[in]    max_no        the page size; 0 for no limit
+ *  @param[out]   contacts      the page; NULL at the end of the walk
+ *
+ *  @retval     PEP_STATUS_OK
+ *  @retval     PEP_ILLEGAL_VALUE           illegal parameter value
+ *  @retval     PEP_UNKNOWN_DB_ERROR        the query failed
+ *  @retval     PEP_OUT_OF_MEMORY           out of memory
+ *
+ */
+PEP_STATUS get_recent_contacts(PEP_SESSION session,
+                               pEp_recent_contacts_cursor *cursor,
+                               unsigned int max_no,
+                               identity_list **contacts);
+
 /**
  *  @internal
  *  <!--       get_last_contacted()       -->
  *
- *  @brief            TODO
+ *  @brief     Return every identity contacted within the last
+ *             PEP_RECENT_CONTACTS_DEFAULT_WINDOW seconds, with only its
+ *             address and user_id set.  Bulk jobs should rather walk through
+ *             pages with get_recent_contacts .
  *
  *  @param[in]  session        session handle
- *  @param[in]  id_list        identity_list**
+ *  @param[out] id_list        the identities
  *
  *  @retval     PEP_STATUS_OK
  *  @retval     PEP_ILLEGAL_VALUE           illegal parameter value
- *  @retval     PEP_CANNOT_FIND_IDENTITY
+ *  @retval     PEP_CANNOT_FIND_IDENTITY    no recent contacts
  *  @retval     PEP_OUT_OF_MEMORY           out of memory
  *
  */
@@ -721,6 +819,52 @@ PEP_STATUS exists_identity_entry(PEP_SESSION session, pEp_identity* identity,
  */
 PEP_STATUS force_set_identity_username(PEP_SESSION session, pEp_identity* identity, const char* username);
 
+/**
+ *  @internal
+ *  <!--       pEp_new_worker_session()       -->
+ *
+ *  @brief     Open a new session behaving like the given one, for use by a
+ *             worker thread: with the same callbacks, passphrases, Sync
+ *             management object and configuration, such as passive mode,
+ *             unencrypted subject, media keys and the decrypted attachment
+ *             directory.  Tracing, non-blocking mode, ingestion mode and the
+ *             outbound queue are not copied.
+ *
+ *  @param[in]     session      session handle
+ *
+ *  @retval        the new session, to be released by the caller, or NULL on
+ *                 failure
+ *
+ *  @warning   opening a session accesses the management database: do not
+ *             call this while the given session holds a write transaction
+ */
+PEP_SESSION pEp_new_worker_session(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_ingestion_message_begun()       -->
+ *
+ *  @brief     In ingestion mode, at the beginning of decrypt_message_2 , take
+ *             the write lock again if the pause after the last hold is
+ *             over.  A failure leaves ingestion mode.
+ *
+ *  @param[in]     session      session handle
+ */
+void pEp_ingestion_message_begun(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_ingestion_message_done()       -->
+ *
+ *  @brief     In ingestion mode, at the end of decrypt_message_2 , commit if
+ *             the write lock has been held for too long, pausing, or if
+ *             enough messages have been decrypted since the last checkpoint.
+ *             A failure leaves ingestion mode.
+ *
+ *  @param[in]     session      session handle
+ */
+void pEp_ingestion_message_done(PEP_SESSION session);
+
 #ifdef __cplusplus
 }
 #endif
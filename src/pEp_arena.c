@@ -0,0 +1,408 @@
+/**
+ * @file    pEp_arena.c
+ * @brief   Arena allocator: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#include "pEp_arena.h"
+
+#include "pEp_internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Arenas
+ * ***************************************************************** */
+
+/* Every allocation is rounded up to a multiple of this, the alignment of the
+   most demanding scalar type. */
+union pEp_arena_alignment {
+    long double ld;
+    long long ll;
+    void *p;
+    void (*f)(void);
+};
+#define PEP_ARENA_ALIGNMENT (sizeof(union pEp_arena_alignment))
+#define PEP_ARENA_ROUND_UP(size) \
+    (((size) + PEP_ARENA_ALIGNMENT - 1) / PEP_ARENA_ALIGNMENT \
+     * PEP_ARENA_ALIGNMENT)
+
+/* Chunk headers come right before the chunk data.  The header size is rounded
+   up so that data are aligned. */
+struct pEp_arena_chunk {
+    struct pEp_arena_chunk *next;
+    size_t size;                        /* of the data */
+    size_t used;
+};
+#define PEP_ARENA_CHUNK_HEADER_SIZE \
+    PEP_ARENA_ROUND_UP(sizeof(struct pEp_arena_chunk))
+#define PEP_ARENA_CHUNK_DATA(chunk) \
+    ((char *) (chunk) + PEP_ARENA_CHUNK_HEADER_SIZE)
+
+/* A shared blob referenced by the arena, released with it.  These live in
+   the arena themselves. */
+struct pEp_arena_shared_blob {
+    struct pEp_arena_shared_blob *next;
+    char *blob;
+};
+
+struct _pEp_arena {
+    /* The chunk being filled comes first. */
+    struct pEp_arena_chunk *chunks;
+    struct pEp_arena_shared_blob *shared_blobs;
+    size_t chunk_size;
+    size_t chunk_no;
+    size_t size;
+};
+
+pEp_arena *pEp_arena_new(size_t chunk_size)
+{
+    pEp_arena *arena = calloc(1, sizeof(pEp_arena));
+    if (arena == NULL)
+        return NULL;
+    arena->chunk_size = (chunk_size == 0
+                         ? PEP_ARENA_DEFAULT_CHUNK_SIZE : chunk_size);
+    return arena;
+}
+
+void pEp_arena_free(pEp_arena *arena)
+{
+    if (arena == NULL)
+        return;
+
+    struct pEp_arena_shared_blob *shared;
+    for (shared = arena->shared_blobs; shared != NULL; shared = shared->next)
+        release_shared_blob(shared->blob);
+
+    struct pEp_arena_chunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct pEp_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/* Add a chunk with at least the given data size, and return it. */
+static struct pEp_arena_chunk *pEp_arena_add_chunk(pEp_arena *arena,
+                                                   size_t size)
+{
+    struct pEp_arena_chunk *chunk
+        = malloc(PEP_ARENA_CHUNK_HEADER_SIZE + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunk_no ++;
+    arena->size += PEP_ARENA_CHUNK_HEADER_SIZE + size;
+
+    /* A large object's chunk is full at once: keep filling the current one,
+       by linking the new chunk second. */
+    if (size > arena->chunk_size && arena->chunks != NULL) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    }
+    else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    return chunk;
+}
+
+void *pEp_arena_alloc(pEp_arena *arena, size_t size)
+{
+    if (arena == NULL)
+        return NULL;
+
+    size = PEP_ARENA_ROUND_UP(size == 0 ? 1 : size);
+    struct pEp_arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = ((size > arena->chunk_size / 4)
+                             ? size : arena->chunk_size);
+        chunk = pEp_arena_add_chunk(arena, chunk_size);
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    char *result = PEP_ARENA_CHUNK_DATA(chunk) + chunk->used;
+    chunk->used += size;
+    memset(result, 0, size);
+    return result;
+}
+
+void *pEp_arena_memdup(pEp_arena *arena, const void *data, size_t size)
+{
+    char *result = pEp_arena_alloc(arena, size + 1);
+    if (result == NULL)
+        return NULL;
+    if (size > 0)
+        memcpy(result, data, size);
+    result[size] = '\0';
+    return result;
+}
+
+char *pEp_arena_strdup(pEp_arena *arena, const char *s)
+{
+    if (s == NULL)
+        return NULL;
+    return pEp_arena_memdup(arena, s, strlen(s));
+}
+
+char *pEp_arena_hold_shared_blob(pEp_arena *arena, const bloblist_t *blob)
+{
+    assert(bloblist_is_shared(blob));
+
+    struct pEp_arena_shared_blob *shared
+        = pEp_arena_alloc(arena, sizeof(struct pEp_arena_shared_blob));
+    if (shared == NULL)
+        return NULL;
+
+    void (*release_value)(char *);
+    shared->blob = bloblist_value_dup(blob, & release_value);
+    if (shared->blob == NULL)
+        return NULL;
+    shared->next = arena->shared_blobs;
+    arena->shared_blobs = shared;
+    return shared->blob;
+}
+
+size_t pEp_arena_chunk_no(const pEp_arena *arena)
+{
+    return (arena == NULL) ? 0 : arena->chunk_no;
+}
+
+size_t pEp_arena_size(const pEp_arena *arena)
+{
+    return (arena == NULL) ? 0 : arena->size;
+}
+
+
+/* Message parts in an arena
+ * ***************************************************************** */
+
+/* Copy a string field, jumping to enomem if the source string is not NULL but
+   the copy is. */
+#define ARENA_STRDUP_OR_GOTO(arena, to, from, label)      \
+    do {                                                  \
+        if ((from) != NULL) {                             \
+            (to) = pEp_arena_strdup((arena), (from));     \
+            if ((to) == NULL)                             \
+                goto label;                               \
+        }                                                 \
+    } while (false)
+
+pEp_identity *pEp_arena_identity_dup(pEp_arena *arena,
+                                     const pEp_identity *src)
+{
+    if (src == NULL)
+        return NULL;
+
+    pEp_identity *result = pEp_arena_alloc(arena, sizeof(pEp_identity));
+    if (result == NULL)
+        return NULL;
+    * result = * src;
+    result->address = result->fpr = result->user_id = result->username = NULL;
+    ARENA_STRDUP_OR_GOTO(arena, result->address, src->address, enomem);
+    ARENA_STRDUP_OR_GOTO(arena, result->fpr, src->fpr, enomem);
+    ARENA_STRDUP_OR_GOTO(arena, result->user_id, src->user_id, enomem);
+    ARENA_STRDUP_OR_GOTO(arena, result->username, src->username, enomem);
+    return result;
+
+ enomem:
+    return NULL;
+}
+
+identity_list *pEp_arena_identity_list_dup(pEp_arena *arena,
+                                           const identity_list *src)
+{
+    identity_list *result = NULL;
+    identity_list **tail = & result;
+    const identity_list *il;
+    for (il = src; il != NULL; il = il->next) {
+        identity_list *element = pEp_arena_alloc(arena, sizeof(identity_list));
+        if (element == NULL)
+            return NULL;
+        if (il->ident != NULL) {
+            element->ident = pEp_arena_identity_dup(arena, il->ident);
+            if (element->ident == NULL)
+                return NULL;
+        }
+        * tail = element;
+        tail = & element->next;
+    }
+    return result;
+}
+
+stringlist_t *pEp_arena_stringlist_dup(pEp_arena *arena,
+                                       const stringlist_t *src)
+{
+    stringlist_t *result = NULL;
+    stringlist_t **tail = & result;
+    const stringlist_t *sl;
+    for (sl = src; sl != NULL; sl = sl->next) {
+        stringlist_t *element = pEp_arena_alloc(arena, sizeof(stringlist_t));
+        if (element == NULL)
+            return NULL;
+        ARENA_STRDUP_OR_GOTO(arena, element->value, sl->value, enomem);
+        * tail = element;
+        tail = & element->next;
+    }
+    return result;
+
+ enomem:
+    return NULL;
+}
+
+stringpair_list_t *pEp_arena_stringpair_list_dup(pEp_arena *arena,
+                                                 const stringpair_list_t *src)
+{
+    stringpair_list_t *result = NULL;
+    stringpair_list_t **tail = & result;
+    const stringpair_list_t *spl;
+    for (spl = src; spl != NULL; spl = spl->next) {
+        stringpair_list_t *element
+            = pEp_arena_alloc(arena, sizeof(stringpair_list_t));
+        if (element == NULL)
+            return NULL;
+        if (spl->value != NULL) {
+            element->value = pEp_arena_alloc(arena, sizeof(stringpair_t));
+            if (element->value == NULL)
+                return NULL;
+            ARENA_STRDUP_OR_GOTO(arena, element->value->key,
+                                 spl->value->key, enomem);
+            ARENA_STRDUP_OR_GOTO(arena, element->value->value,
+                                 spl->value->value, enomem);
+        }
+        * tail = element;
+        tail = & element->next;
+    }
+    return result;
+
+ enomem:
+    return NULL;
+}
+
+bloblist_t *pEp_arena_bloblist_dup(pEp_arena *arena, const bloblist_t *src)
+{
+    bloblist_t *result = NULL;
+    bloblist_t **tail = & result;
+    const bloblist_t *b;
+    for (b = src; b != NULL; b = b->next) {
+        bloblist_t *element = pEp_arena_alloc(arena, sizeof(bloblist_t));
+        if (element == NULL)
+            return NULL;
+        /* A file-backed blob is referenced rather than copied, so that its
+           file goes on backing every copy made from this one.  The arena
+           holds the reference; the release function is only there to mark
+           the blob as shared for bloblist_value_dup , since an arena is never
+           released piecewise.  Any other value belongs to the arena. */
+        if (b->value != NULL && blob_file_path(b) != NULL) {
+            element->value = pEp_arena_hold_shared_blob(arena, b);
+            if (element->value == NULL)
+                return NULL;
+            element->release_value = release_shared_blob;
+        }
+        else if (b->value != NULL) {
+            element->value = pEp_arena_memdup(arena, b->value, b->size);
+            if (element->value == NULL)
+                return NULL;
+        }
+        element->size = b->size;
+        ARENA_STRDUP_OR_GOTO(arena, element->mime_type, b->mime_type, enomem);
+        ARENA_STRDUP_OR_GOTO(arena, element->filename, b->filename, enomem);
+        element->disposition = b->disposition;
+        * tail = element;
+        tail = & element->next;
+    }
+    return result;
+
+ enomem:
+    return NULL;
+}
+
+timestamp *pEp_arena_timestamp_dup(pEp_arena *arena, const timestamp *src)
+{
+    if (src == NULL)
+        return NULL;
+
+    timestamp *result = pEp_arena_alloc(arena, sizeof(timestamp));
+    if (result != NULL)
+        * result = * src;
+    return result;
+}
+
+
+/* Messages in an arena
+ * ***************************************************************** */
+
+message *new_message_in_arena(pEp_arena *arena, PEP_msg_direction dir)
+{
+    message *msg = pEp_arena_alloc(arena, sizeof(message));
+    if (msg != NULL)
+        msg->dir = dir;
+    return msg;
+}
+
+message *message_dup_in_arena(pEp_arena *arena, const message *src)
+{
+    assert(src);
+    if (src == NULL)
+        return NULL;
+
+    message *msg = new_message_in_arena(arena, src->dir);
+    if (msg == NULL)
+        return NULL;
+
+    /* Copy scalars and shared pointees, then replace owned pointees. */
+    * msg = * src;
+
+#define DUP_OR_ENOMEM(field, dup_function)                              \
+    do {                                                                \
+        if (src->field) {                                               \
+            msg->field = dup_function(arena, src->field);               \
+            if (msg->field == NULL)                                     \
+                goto enomem;                                            \
+        }                                                               \
+    } while (false)
+    DUP_OR_ENOMEM(id, pEp_arena_strdup);
+    DUP_OR_ENOMEM(shortmsg, pEp_arena_strdup);
+    DUP_OR_ENOMEM(longmsg, pEp_arena_strdup);
+    DUP_OR_ENOMEM(longmsg_formatted, pEp_arena_strdup);
+    DUP_OR_ENOMEM(attachments, pEp_arena_bloblist_dup);
+    DUP_OR_ENOMEM(sent, pEp_arena_timestamp_dup);
+    DUP_OR_ENOMEM(recv, pEp_arena_timestamp_dup);
+    DUP_OR_ENOMEM(from, pEp_arena_identity_dup);
+    DUP_OR_ENOMEM(recv_by, pEp_arena_identity_dup);
+    DUP_OR_ENOMEM(to, pEp_arena_identity_list_dup);
+    DUP_OR_ENOMEM(cc, pEp_arena_identity_list_dup);
+    DUP_OR_ENOMEM(bcc, pEp_arena_identity_list_dup);
+    DUP_OR_ENOMEM(reply_to, pEp_arena_identity_list_dup);
+    DUP_OR_ENOMEM(in_reply_to, pEp_arena_stringlist_dup);
+    DUP_OR_ENOMEM(references, pEp_arena_stringlist_dup);
+    DUP_OR_ENOMEM(keywords, pEp_arena_stringlist_dup);
+    DUP_OR_ENOMEM(comments, pEp_arena_strdup);
+    DUP_OR_ENOMEM(opt_fields, pEp_arena_stringpair_list_dup);
+    DUP_OR_ENOMEM(_sender_fpr, pEp_arena_strdup);
+#undef DUP_OR_ENOMEM
+
+    /* The list of referring messages is owned, its elements are not. */
+    msg->refered_by = NULL;
+    message_ref_list **tail = & msg->refered_by;
+    const message_ref_list *r;
+    for (r = src->refered_by; r != NULL; r = r->next) {
+        message_ref_list *element = pEp_arena_alloc(arena,
+                                                    sizeof(message_ref_list));
+        if (element == NULL)
+            return NULL;
+        element->msg_ref = r->msg_ref;
+        * tail = element;
+        tail = & element->next;
+    }
+
+    return msg;
+
+ enomem:
+    return NULL;
+}
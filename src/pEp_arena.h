@@ -0,0 +1,206 @@
+/**
+ * @file    pEp_arena.h
+ * @brief   Arena allocator: many small allocations released in one call,
+ *          used for message trees which are built once, read, and freed
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef PEP_ARENA_H
+#define PEP_ARENA_H
+
+#include <stddef.h>
+
+#include "pEpEngine.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* An arena hands out memory from a few large chunks, and frees all of it at
+   once.  Allocating is a pointer increment in the common case; there is no
+   way of freeing a single object.
+
+   A message tree built in an arena (see new_message_in_arena and
+   message_dup_in_arena below) is released with the arena, by the one who
+   made it, with one call per chunk and without visiting the tree; it must
+   never be passed to free_message .  Such a message must be treated as
+   read-only as far as ownership is concerned: its fields must not be freed
+   or replaced with heap-allocated objects.  Engine code builds arena fields
+   with the functions below.  Reading it, for example with
+   mime_encode_message or message_dup , is fine; message_dup returns an
+   ordinary heap message.
+
+   This is internal: applications only ever see heap-allocated messages. */
+
+
+/* Arenas
+ * ***************************************************************** */
+
+typedef struct _pEp_arena pEp_arena;
+
+/* The default chunk size.  Objects larger than a quarter of a chunk get a
+   chunk of their own. */
+#define PEP_ARENA_DEFAULT_CHUNK_SIZE 4096
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_new()       -->
+ *
+ *  @brief     Make a new empty arena.
+ *
+ *  @param[in]   chunk_size     the size of ordinary chunks, or 0 for the
+ *                              default
+ *
+ *  @retval      the new arena, or NULL if out of memory
+ */
+pEp_arena *pEp_arena_new(size_t chunk_size);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_free()       -->
+ *
+ *  @brief     Free the arena with every object allocated in it.
+ *
+ *  @param[in]   arena          the arena, or NULL
+ */
+void pEp_arena_free(pEp_arena *arena);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_alloc()       -->
+ *
+ *  @brief     Allocate zero-filled memory from the arena, aligned for any
+ *             type.
+ *
+ *  @param[in]   arena          the arena
+ *  @param[in]   size           the size in bytes
+ *
+ *  @retval      the new object, or NULL if out of memory
+ */
+void *pEp_arena_alloc(pEp_arena *arena, size_t size);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_memdup()       -->
+ *
+ *  @brief     Copy the given bytes into the arena, adding a '\0' terminator
+ *             after them.
+ *
+ *  @retval      the copy, or NULL if out of memory
+ */
+void *pEp_arena_memdup(pEp_arena *arena, const void *data, size_t size);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_strdup()       -->
+ *
+ *  @brief     Copy the given string into the arena.
+ *
+ *  @retval      the copy, or NULL if s is NULL or out of memory
+ */
+char *pEp_arena_strdup(pEp_arena *arena, const char *s);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_hold_shared_blob()       -->
+ *
+ *  @brief     Take a reference to the shared blob of the given bloblist
+ *             element, released when the arena is freed.
+ *
+ *  @param[in]   arena          the arena
+ *  @param[in]   blob           bloblist element with a shared blob
+ *
+ *  @retval      the shared blob, or NULL if out of memory
+ */
+char *pEp_arena_hold_shared_blob(pEp_arena *arena, const bloblist_t *blob);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_chunk_no()       -->
+ *
+ *  @brief     Return how many chunks, therefore how many calls to malloc ,
+ *             the arena holds.
+ */
+size_t pEp_arena_chunk_no(const pEp_arena *arena);
+
+/**
+ *  @internal
+ *  <!--       pEp_arena_size()       -->
+ *
+ *  @brief     Return the memory held by the arena in bytes, including unused
+ *             space at the end of chunks.
+ */
+size_t pEp_arena_size(const pEp_arena *arena);
+
+
+/* Messages in an arena
+ * ***************************************************************** */
+
+/* The message struct is part of the public ABI and has no room to say whether
+   a message lives in an arena, and free_message must stay as cheap as it was
+   for heap messages.  So the arena is not recorded anywhere: whoever makes a
+   message in an arena keeps the arena, and frees it instead of the
+   message. */
+
+/**
+ *  @internal
+ *  <!--       new_message_in_arena()       -->
+ *
+ *  @brief     Allocate a new empty message in the given arena.
+ *
+ *  @param[in]   arena          the arena
+ *  @param[in]   dir            PEP_dir_incoming or PEP_dir_outgoing
+ *
+ *  @retval      the new message, or NULL if out of memory
+ */
+message *new_message_in_arena(pEp_arena *arena, PEP_msg_direction dir);
+
+/**
+ *  @internal
+ *  <!--       message_dup_in_arena()       -->
+ *
+ *  @brief     Duplicate message (deep copy) into the given arena.  The copy
+ *             has the same contents as one made by message_dup , with one or
+ *             a few allocations in total.
+ *
+ *  @param[in]   arena          the arena
+ *  @param[in]   src            message to duplicate
+ *
+ *  @retval      the copy, or NULL if out of memory; on failure the arena may
+ *               hold part of the copy until it is freed
+ *
+ *  @note  not owned pointees (msg->rawmsg_ref and msg->refering_msg_ref) are
+ *         shared, as in message_dup
+ */
+message *message_dup_in_arena(pEp_arena *arena, const message *src);
+
+
+/* Message parts in an arena
+ * ***************************************************************** */
+
+/* Each of these makes a deep copy of its argument in the arena, returning NULL
+   if the argument is NULL or memory is exhausted.  Shared pointees, like
+   message references, are shared as in message_dup . */
+
+pEp_identity *pEp_arena_identity_dup(pEp_arena *arena,
+                                     const pEp_identity *src);
+identity_list *pEp_arena_identity_list_dup(pEp_arena *arena,
+                                           const identity_list *src);
+stringlist_t *pEp_arena_stringlist_dup(pEp_arena *arena,
+                                       const stringlist_t *src);
+stringpair_list_t *pEp_arena_stringpair_list_dup(pEp_arena *arena,
+                                                 const stringpair_list_t *src);
+bloblist_t *pEp_arena_bloblist_dup(pEp_arena *arena, const bloblist_t *src);
+timestamp *pEp_arena_timestamp_dup(pEp_arena *arena, const timestamp *src);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef PEP_ARENA_H */
@@ -14,6 +14,18 @@
 
 #define KEY_EXPIRE_DELTA (60 * 60 * 24 * 365)
 
+// digests of imported key data are remembered for 30 days, see
+// import_key_with_fpr_return_deduplicated
+#define KEY_IMPORT_DIGEST_MAX_AGE (60 * 60 * 24 * 30)
+
+// messages decrypted between commits in ingestion mode, see
+// config_ingestion_mode
+#define PEP_INGESTION_DEFAULT_CHECKPOINT_INTERVAL 1000
+
+// the longest time ingestion mode holds the write lock before committing and
+// leaving it to other writers for a pause, see config_ingestion_mode
+#define PEP_INGESTION_MAXIMUM_HOLD_TIME_IN_MS 1000
+
 // this is 20 trustwords with 79 chars max
 #define MAX_TRUSTWORDS_SPACE (20 * 80)
 
@@ -110,6 +122,8 @@
 #include "key_reset.h"
 
 #include "pEpEngine_internal.h"
+#include "pEp_metrics.h"
+#include "pEp_trace.h"
 #include "sql_reliability.h"
 #include "key_reset_internal.h"
 #include "group_internal.h"
@@ -481,6 +495,10 @@ struct _pEpSession {
     sqlite3_stmt *begin_exclusive_transaction;
     sqlite3_stmt *commit_transaction;
     sqlite3_stmt *rollback_transaction;
+    sqlite3_stmt *begin_savepoint;
+    sqlite3_stmt *release_savepoint;
+    sqlite3_stmt *rollback_to_savepoint;
+    sqlite3_stmt *data_version;
     sqlite3_stmt *log; /* This uses the management DB, and is obsolete. */
     sqlite3_stmt *get_identity;
     sqlite3_stmt *get_identity_without_trust_check;
@@ -510,7 +528,7 @@ struct _pEpSession {
     sqlite3_stmt *get_contacted_ids_from_revoke_fpr;
     sqlite3_stmt *was_id_for_revoke_contacted;
     sqlite3_stmt *has_id_contacted_address;
-    sqlite3_stmt *get_last_contacted;
+    sqlite3_stmt *get_recent_contacts;
     // sqlite3_stmt *set_device_group;
     // sqlite3_stmt *get_device_group;
     sqlite3_stmt *set_pgp_keypair;
@@ -581,6 +599,7 @@ struct _pEpSession {
     // sequence value
     sqlite3_stmt *sequence_value1;
     sqlite3_stmt *sequence_value2;
+    sqlite3_stmt *sequence_value_give_back;
 
     // revoked keys
     sqlite3_stmt *set_revoked;
@@ -591,6 +610,17 @@ struct _pEpSession {
     sqlite3_stmt* add_mistrusted_key;
     sqlite3_stmt* is_mistrusted_key;    
     sqlite3_stmt* delete_mistrusted_key;
+
+    // key sets
+    sqlite3_stmt *all_own_key_fprs;
+    sqlite3_stmt *all_mistrusted_keys;
+    sqlite3_stmt *all_revoked_keys;
+
+    // key import digests
+    sqlite3_stmt *key_import_digest_lookup;
+    sqlite3_stmt *key_import_digest_record;
+    sqlite3_stmt *key_import_digest_forget;
+    sqlite3_stmt *key_import_digest_prune;
     
     // aliases
     sqlite3_stmt *get_userid_alias_default;
@@ -630,13 +660,127 @@ struct _pEpSession {
     /* An integer counting the number of SQL transactions currently in progress
        within the dynamic extent of this session: transactions can be (properly)
        nested in this C abstraction and pEp_sqlite3_step_nonbusy is defined so
-       as not to nest a new SQL transaction when one is already in progress;
-       however ROLLBACK is only possible at the outermost nesting level.
+       as not to nest a new SQL transaction when one is already in progress.
+       A ROLLBACK at an inner nesting level only marks the whole transaction
+       as rollback-only, see transaction_rollback_only.
        This field is altered by PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION,
        PEP_SQL_COMMIT_TRANSACTION and PEP_SQL_COMMIT_TRANSACTION as defined in
        sql_reliability.h . */
     int transaction_in_progress_no;
 
+    /* True iff a nested transaction has been rolled back: the outermost
+       transaction will then be rolled back instead of committed. */
+    bool transaction_rollback_only;
+
+    /* When the outermost transaction in progress began, as per
+       pEp_monotonic_time_us ; only meaningful when transaction_in_progress_no
+       is positive.  Used for metrics. */
+    uint64_t transaction_begin_time_us;
+
+    /* Counters for this session, see pEp_metrics.h . */
+    PEP_metrics metrics;
+
+    /* Tracing, see pEp_trace.h .  trace_enabled is true iff at least one
+       callback is not NULL; trace_depth is the number of spans currently
+       open; trace_transaction_span is the span for the outermost SQL
+       transaction in progress, if any. */
+    bool trace_enabled;
+    trace_span_t trace_begin;
+    trace_span_t trace_end;
+    void *trace_context;
+    unsigned int trace_depth;
+    pEp_trace_span trace_transaction_span;
+
+    /* Non-blocking SQL mode, see config_nonblocking_sql .  When nonblocking_sql
+       is true the API functions supporting it fail with PEP_WOULD_BLOCK
+       instead of backing off when the management database write lock is held
+       by someone else; sql_ready is then called with sql_ready_context once
+       the lock is released.  sql_ready_armed and sql_ready_next link this
+       session into the process-wide list of sessions waiting for such a
+       notification; they are protected by the mutex in sql_reliability.c . */
+    bool nonblocking_sql;
+    sql_ready_t sql_ready;
+    void *sql_ready_context;
+    bool sql_ready_armed;
+    struct _pEpSession *sql_ready_next;
+
+    /* True during a deferred non-blocking call, see
+       pEp_sql_begin_deferred_nonblocking_call in sql_reliability.h ;
+       sql_would_block becomes true when such a call could not take the write
+       lock, and the call will then fail with PEP_WOULD_BLOCK . */
+    bool sql_deferred_call;
+    bool sql_would_block;
+
+    /* True iff messages generated by the Engine are handed to messageToSend
+       by the outbound queue dispatcher, rather than synchronously.  See
+       config_outbound_queue in transport.h . */
+    bool use_outbound_queue;
+
+    /* Messages generated within the current transaction, to be enqueued when
+       it commits or discarded when it is rolled back.  See transport.c . */
+    struct _outbound_queue_entry *staged_outbound_first;
+    struct _outbound_queue_entry *staged_outbound_last;
+
+    /* The last message staged before the current savepoint began, or NULL.
+       See outbound_queue_savepoint_begun . */
+    struct _outbound_queue_entry *staged_outbound_savepoint_mark;
+
+    /* True iff the outermost transaction in progress is a batch transaction,
+       in which the transactions begun by the Engine run as savepoints.  See
+       pEp_sql_begin_batch_transaction in sql_reliability.h . */
+    bool batch_transaction_open;
+
+    /* Ingestion mode, see config_ingestion_mode .  ingestion_pending_no is
+       the number of messages decrypted since the latest checkpoint.  When no
+       transaction is in progress in ingestion mode the session is pausing,
+       and takes the lock again from ingestion_resume_time_us on. */
+    bool ingestion_mode;
+    unsigned int ingestion_checkpoint_interval;
+    unsigned int ingestion_pending_no;
+    uint64_t ingestion_max_hold_time_us;
+    uint64_t ingestion_resume_time_us;
+
+    /* True iff the batch in progress was begun by pEp_begin_batch . */
+    bool application_batch;
+
+    /* Where decrypt_message_2 stores large attachments, or NULL.  See
+       config_decrypted_attachment_directory . */
+    char *decrypted_attachment_directory;
+    size_t decrypted_attachment_min_size;
+
+    /* Results shared by the sessions encrypting a batch, or NULL.  See
+       encrypt_messages in message_api.c . */
+    struct _encrypt_batch_cache *encrypt_batch;
+
+    /* Incremented at every change to identity, person, trust or key rows
+       made through this session's connection, and when the connection is
+       opened.  See pEp_sql_get_change_stamp in engine_sql.h . */
+    uint64_t trust_generation;
+
+    /* The last SQLITE_FCNTL_DATA_VERSION of the connection accounted for by
+       pEp_sql_get_process_change_generation , if valid; see
+       pEp_sql_check_data_version in engine_sql.c . */
+    unsigned int seen_data_version;
+    bool seen_data_version_valid;
+
+    /* The key sets changed through this session's connection since the
+       latest commit or rollback, as a mask of 1 << pEp_sql_key_set bits.  See
+       pEp_sql_get_key_set_generation in engine_sql.h . */
+    unsigned int uncommitted_key_set_changes;
+
+    /* The read pool, see sql_read_pool.h .  read_pool_disabled is set by
+       config_read_pool ; read_depth is the number of reads in progress and
+       read_connection the pooled connection leased by the outermost one, or
+       NULL if they use this session's connection. */
+    bool read_pool_disabled;
+    unsigned int read_depth;
+    struct _pEp_sql_read_connection *read_connection;
+
+    /* Sequence values reserved in advance, see config_sequence_block_size :
+       one block per sequence name used, in a list. */
+    unsigned int sequence_block_size;
+    struct _pEp_sequence_block *sequence_blocks;
+
     // Session-local internal data
     /* True iff this session is the first one on which init was called.  This is
        useful to avoid performing some redundant initialisation (in particular
@@ -684,6 +828,70 @@ PEP_STATUS init_transport_system(PEP_SESSION session, bool in_first);
  */
 void release_transport_system(PEP_SESSION session, bool out_last);
 
+/**
+ *  @internal
+ *  <!--       queue_message_to_send()       -->
+ *
+ *  @brief            Hand a message generated by the Engine to the
+ *                    application, with the same ownership semantics as
+ *                    messageToSend.  Unless the outbound queue is enabled
+ *                    for the session this simply calls messageToSend;
+ *                    otherwise the message is enqueued, or staged until
+ *                    the current transaction ends.
+ *
+ *  @param[in]  session        session handle
+ *  @param[in]  msg            the message; ownership goes to the callee on
+ *                             success
+ *
+ *  @retval     PEP_STATUS_OK
+ *  @retval     PEP_SEND_FUNCTION_NOT_REGISTERED
+ *  @retval     PEP_OUT_OF_MEMORY
+ *  @retval     any status returned by messageToSend
+ */
+PEP_STATUS queue_message_to_send(PEP_SESSION session, message *msg);
+
+/**
+ *  @internal
+ *  <!--       outbound_queue_transaction_ended()       -->
+ *
+ *  @brief            Enqueue the messages staged by queue_message_to_send
+ *                    during the transaction which just ended, or discard them
+ *                    if it was rolled back.  Only called at the end of the
+ *                    outermost transaction, by
+ *                    PEP_SQL_COMMIT_OR_ROLLBACK_TRANSACTION .
+ *
+ *  @param[in]  session        session handle
+ *  @param[in]  committed      true iff the transaction committed
+ */
+void outbound_queue_transaction_ended(PEP_SESSION session, bool committed);
+
+/**
+ *  @internal
+ *  <!--       outbound_queue_savepoint_begun()       -->
+ *
+ *  @brief            Remember which messages were staged before the
+ *                    savepoint which just began, so that the ones staged
+ *                    within it can be discarded if it is rolled back.  Called
+ *                    by pEp_sql_begin_savepoint .
+ *
+ *  @param[in]  session        session handle
+ */
+void outbound_queue_savepoint_begun(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       outbound_queue_savepoint_ended()       -->
+ *
+ *  @brief            Discard the messages staged within the savepoint which
+ *                    just ended if it was rolled back; otherwise keep them
+ *                    staged until the enclosing transaction ends.  Called by
+ *                    pEp_sql_end_savepoint .
+ *
+ *  @param[in]  session        session handle
+ *  @param[in]  committed      true iff the savepoint was released
+ */
+void outbound_queue_savepoint_ended(PEP_SESSION session, bool committed);
+
 /**
  *  <!--       sql_reset_and_clear_bindings()       -->
  *
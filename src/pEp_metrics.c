@@ -0,0 +1,394 @@
+/**
+ * @file    pEp_metrics.c
+ * @brief   Counters about Engine performance: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+/* Counters are updated very often: do not log function entry here. */
+#define PEP_NO_LOG_FUNCTION_ENTRY 1
+
+#define _EXPORT_PEP_ENGINE_DLL
+#include "pEp_metrics.h"
+
+#include "pEp_internal.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+/* Process-wide counters
+ * ***************************************************************** */
+
+/* The process counters are updated by every session at every SQL statement,
+   so they are not protected by a lock: each field is updated on its own with
+   a relaxed atomic operation.  A snapshot is therefore not taken at one
+   instant, which for counters read by a monitoring system does not matter.
+
+   The counters of a session are only updated by the thread using the session,
+   but may be read by another thread, for example one serving the metrics
+   text: they are written and read with relaxed atomic operations as well,
+   without the cost of an atomic read-modify-write. */
+static PEP_metrics process_metrics;
+
+/* Add the given amount to a session counter. */
+static void session_add(uint64_t *counter, uint64_t amount)
+{
+    pEp_atomic_store_u64(counter, pEp_atomic_load_u64(counter) + amount);
+}
+
+/* Replace a session maximum with the given value, if greater. */
+static void session_max(uint64_t *maximum, uint64_t value)
+{
+    if (value > pEp_atomic_load_u64(maximum))
+        pEp_atomic_store_u64(maximum, value);
+}
+
+/* Expand to a statement adding the given amount to the named field in both the
+   session and the process counters. */
+#define ADD(field, amount)                                        \
+    do {                                                          \
+        uint64_t _add_amount = (amount);                          \
+        session_add(& session->metrics.field, _add_amount);       \
+        pEp_atomic_add_u64(& process_metrics.field, _add_amount); \
+    } while (false)
+
+/* Expand to a statement raising the named field to the given value in both
+   the session and the process counters. */
+#define RAISE(field, value)                                       \
+    do {                                                          \
+        uint64_t _max_value = (value);                            \
+        session_max(& session->metrics.field, _max_value);        \
+        pEp_atomic_max_u64(& process_metrics.field, _max_value);  \
+    } while (false)
+
+void pEp_metrics_count_sql_step(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+    ADD(sql_steps, 1);
+}
+
+void pEp_metrics_count_backoff(PEP_SESSION session, long sleep_time_in_ms)
+{
+    PEP_REQUIRE_ORELSE(session && sleep_time_in_ms >= 0, { return; });
+    ADD(sql_busy_retries, 1);
+    ADD(sql_backoff_time_in_ms, sleep_time_in_ms);
+}
+
+void pEp_metrics_count_would_block(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+    ADD(sql_would_block, 1);
+}
+
+void pEp_metrics_count_connection_refresh(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+    ADD(sql_connection_refreshes, 1);
+}
+
+void pEp_metrics_count_transaction(PEP_SESSION session, bool committed,
+                                   uint64_t duration_us)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+    ADD(sql_transactions, 1);
+    if (! committed)
+        ADD(sql_rollbacks, 1);
+    ADD(sql_transaction_time_us, duration_us);
+    RAISE(sql_transaction_max_time_us, duration_us);
+}
+
+void pEp_metrics_count_decrypt_cache_lookup(PEP_SESSION session, bool hit)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+    if (hit)
+        ADD(decrypt_cache_hits, 1);
+    else
+        ADD(decrypt_cache_misses, 1);
+}
+
+#undef RAISE
+#undef ADD
+
+void pEp_metrics_count_wal_checkpoint(bool complete, uint64_t pages,
+                                      uint64_t duration_us)
+{
+    pEp_atomic_add_u64(& process_metrics.wal_checkpoints, 1);
+    if (! complete)
+        pEp_atomic_add_u64(& process_metrics.wal_checkpoints_incomplete, 1);
+    pEp_atomic_add_u64(& process_metrics.wal_checkpointed_pages, pages);
+    pEp_atomic_add_u64(& process_metrics.wal_checkpoint_time_us, duration_us);
+    pEp_atomic_max_u64(& process_metrics.wal_checkpoint_max_time_us,
+                       duration_us);
+}
+
+void pEp_metrics_count_wal_checkpoint_deferred(void)
+{
+    pEp_atomic_add_u64(& process_metrics.wal_checkpoints_deferred, 1);
+}
+
+void pEp_metrics_set_wal_size(uint64_t size)
+{
+    pEp_atomic_store_u64(& process_metrics.wal_size, size);
+}
+
+
+/* Snapshots
+ * ***************************************************************** */
+
+/* Copy the pointed counters, field by field with atomic loads.  This relies on
+   every field of PEP_metrics being a uint64_t . */
+static void snapshot(PEP_metrics *to, const PEP_metrics *from)
+{
+    const uint64_t *from_fields = (const uint64_t *) from;
+    uint64_t *to_fields = (uint64_t *) to;
+    size_t i;
+    for (i = 0; i < sizeof (PEP_metrics) / sizeof (uint64_t); i ++)
+        to_fields[i] = pEp_atomic_load_u64(from_fields + i);
+}
+
+DYNAMIC_API PEP_STATUS pEp_get_metrics(PEP_SESSION session,
+                                       PEP_metrics *session_metrics,
+                                       PEP_metrics *process_metrics_p)
+{
+    PEP_REQUIRE(session);
+
+    if (session_metrics != NULL)
+        snapshot(session_metrics, & session->metrics);
+    if (process_metrics_p != NULL)
+        snapshot(process_metrics_p, & process_metrics);
+    return PEP_STATUS_OK;
+}
+
+
+/* Text rendering
+ * ***************************************************************** */
+
+/* A simple output buffer, growing by doubling. */
+struct metrics_buffer {
+    char *data;
+    size_t used;
+    size_t allocated;
+    bool out_of_memory;
+};
+
+static void append_format(struct metrics_buffer *b, const char *format, ...)
+{
+    if (b->out_of_memory)
+        return;
+
+    while (true) {
+        va_list ap;
+        va_start(ap, format);
+        int needed = vsnprintf(b->data + b->used, b->allocated - b->used,
+                               format, ap);
+        va_end(ap);
+        if (needed < 0) {
+            b->out_of_memory = true;
+            return;
+        }
+        if (b->used + needed < b->allocated) {
+            b->used += needed;
+            return;
+        }
+        size_t new_allocated = b->allocated * 2;
+        while (new_allocated <= b->used + needed)
+            new_allocated *= 2;
+        char *new_data = realloc(b->data, new_allocated);
+        if (new_data == NULL) {
+            b->out_of_memory = true;
+            return;
+        }
+        b->data = new_data;
+        b->allocated = new_allocated;
+    }
+}
+
+/* Append the given string as the value of a Prometheus label, escaping it.
+   Runs of whitespace, frequent in our SQL, become one space. */
+static void append_label_value(struct metrics_buffer *b, const char *s)
+{
+    bool in_whitespace = false;
+    const char *p;
+    for (p = s; * p != '\0'; p ++)
+        switch (* p) {
+        case ' ': case '\t': case '\n': case '\r':
+            if (! in_whitespace && p != s)
+                append_format(b, " ");
+            in_whitespace = true;
+            break;
+        case '\\':
+            append_format(b, "\\\\");
+            in_whitespace = false;
+            break;
+        case '"':
+            append_format(b, "\\\"");
+            in_whitespace = false;
+            break;
+        default:
+            append_format(b, "%c", * p);
+            in_whitespace = false;
+        }
+}
+
+/* Append the help and type lines and the two samples of one counter. */
+static void append_counter(struct metrics_buffer *b,
+                           const char *name, const char *help,
+                           uint64_t session_value, uint64_t process_value)
+{
+    append_format(b, "# HELP %s %s\n", name, help);
+    append_format(b, "# TYPE %s counter\n", name);
+    append_format(b, "%s{scope=\"session\"} %" PRIu64 "\n",
+                  name, session_value);
+    append_format(b, "%s{scope=\"process\"} %" PRIu64 "\n",
+                  name, process_value);
+}
+
+/* Append the help and type lines and the only sample of a process-wide
+   metric of the given type. */
+static void append_process_metric(struct metrics_buffer *b,
+                                  const char *name, const char *help,
+                                  const char *type, uint64_t process_value)
+{
+    append_format(b, "# HELP %s %s\n", name, help);
+    append_format(b, "# TYPE %s %s\n", name, type);
+    append_format(b, "%s{scope=\"process\"} %" PRIu64 "\n",
+                  name, process_value);
+}
+
+/* Append one sample per prepared statement which has run, for the given
+   sqlite3_stmt_status counter. */
+static void append_statement_counter(struct metrics_buffer *b,
+                                     sqlite3 *db,
+                                     const char *name, const char *help,
+                                     int op)
+{
+    append_format(b, "# HELP %s %s\n", name, help);
+    append_format(b, "# TYPE %s counter\n", name);
+    sqlite3_stmt *statement;
+    for (statement = sqlite3_next_stmt(db, NULL); statement != NULL;
+         statement = sqlite3_next_stmt(db, statement)) {
+        if (sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_RUN, 0) == 0)
+            continue;
+        const char *sql = sqlite3_sql(statement);
+        append_format(b, "%s{statement=\"", name);
+        append_label_value(b, (sql == NULL) ? "" : sql);
+        append_format(b, "\"} %i\n", sqlite3_stmt_status(statement, op, 0));
+    }
+}
+
+DYNAMIC_API PEP_STATUS pEp_get_metrics_text(PEP_SESSION session,
+                                            char **text)
+{
+    PEP_REQUIRE(session && text);
+    * text = NULL;
+
+    PEP_metrics s, p;
+    PEP_STATUS status = pEp_get_metrics(session, & s, & p);
+    if (status != PEP_STATUS_OK)
+        return status;
+
+    struct metrics_buffer b;
+    b.allocated = 4096;
+    b.used = 0;
+    b.out_of_memory = false;
+    b.data = malloc(b.allocated);
+    if (b.data == NULL)
+        return PEP_OUT_OF_MEMORY;
+    b.data[0] = '\0';
+
+#define COUNTER(name, help, field) \
+    append_counter(& b, name, help, s.field, p.field)
+    COUNTER("pep_sql_steps_total",
+            "SQL statements executed in their own transaction if needed.",
+            sql_steps);
+    COUNTER("pep_sql_busy_retries_total",
+            "SQL attempts failed with SQLITE_BUSY and retried.",
+            sql_busy_retries);
+    COUNTER("pep_sql_backoff_milliseconds_total",
+            "Time slept backing off from a busy database.",
+            sql_backoff_time_in_ms);
+    COUNTER("pep_sql_would_block_total",
+            "Calls failed with PEP_WOULD_BLOCK in non-blocking mode.",
+            sql_would_block);
+    COUNTER("pep_sql_connection_refreshes_total",
+            "Database connection refreshes.",
+            sql_connection_refreshes);
+    COUNTER("pep_sql_transactions_total",
+            "Outermost exclusive transactions ended.",
+            sql_transactions);
+    COUNTER("pep_sql_rollbacks_total",
+            "Outermost exclusive transactions rolled back.",
+            sql_rollbacks);
+    COUNTER("pep_sql_transaction_microseconds_total",
+            "Time spent holding the database write lock.",
+            sql_transaction_time_us);
+    COUNTER("pep_decrypt_cache_hits_total",
+            "Decryptions answered from the decrypt result cache.",
+            decrypt_cache_hits);
+    COUNTER("pep_decrypt_cache_misses_total",
+            "Decryptions not found in the decrypt result cache.",
+            decrypt_cache_misses);
+#undef COUNTER
+    append_format(& b, "# HELP pep_sql_transaction_max_microseconds"
+                  " Longest time spent holding the database write lock.\n");
+    append_format(& b, "# TYPE pep_sql_transaction_max_microseconds gauge\n");
+    append_format(& b, "pep_sql_transaction_max_microseconds{scope=\"session\"}"
+                  " %" PRIu64 "\n", s.sql_transaction_max_time_us);
+    append_format(& b, "pep_sql_transaction_max_microseconds{scope=\"process\"}"
+                  " %" PRIu64 "\n", p.sql_transaction_max_time_us);
+
+#define PROCESS_COUNTER(name, help, field) \
+    append_process_metric(& b, name, help, "counter", p.field)
+    PROCESS_COUNTER("pep_wal_checkpoints_total",
+                    "WAL checkpoints run by the checkpointer.",
+                    wal_checkpoints);
+    PROCESS_COUNTER("pep_wal_checkpoints_incomplete_total",
+                    "WAL checkpoints busy or not copying the whole log.",
+                    wal_checkpoints_incomplete);
+    PROCESS_COUNTER("pep_wal_checkpoints_deferred_total",
+                    "WAL checkpoints deferred because writers were active.",
+                    wal_checkpoints_deferred);
+    PROCESS_COUNTER("pep_wal_checkpointed_pages_total",
+                    "Log pages copied into the database by WAL checkpoints.",
+                    wal_checkpointed_pages);
+    PROCESS_COUNTER("pep_wal_checkpoint_microseconds_total",
+                    "Time spent in WAL checkpoints.",
+                    wal_checkpoint_time_us);
+#undef PROCESS_COUNTER
+    append_process_metric(& b, "pep_wal_checkpoint_max_microseconds",
+                          "Longest WAL checkpoint.", "gauge",
+                          p.wal_checkpoint_max_time_us);
+    append_process_metric(& b, "pep_wal_size_bytes",
+                          "Size of the write-ahead log.", "gauge",
+                          p.wal_size);
+
+    if (session->db != NULL) {
+        append_statement_counter(& b, session->db,
+                                 "pep_sql_statement_runs_total",
+                                 "Runs of each prepared statement.",
+                                 SQLITE_STMTSTATUS_RUN);
+        append_statement_counter(& b, session->db,
+                                 "pep_sql_statement_vm_steps_total",
+                                 "Virtual machine steps of each prepared"
+                                 " statement, a measure of its cost.",
+                                 SQLITE_STMTSTATUS_VM_STEP);
+        append_statement_counter(& b, session->db,
+                                 "pep_sql_statement_fullscan_steps_total",
+                                 "Full table scan steps of each prepared"
+                                 " statement.",
+                                 SQLITE_STMTSTATUS_FULLSCAN_STEP);
+        append_statement_counter(& b, session->db,
+                                 "pep_sql_statement_sorts_total",
+                                 "Sort operations of each prepared statement.",
+                                 SQLITE_STMTSTATUS_SORT);
+    }
+
+    if (b.out_of_memory) {
+        free(b.data);
+        return PEP_OUT_OF_MEMORY;
+    }
+    * text = b.data;
+    return PEP_STATUS_OK;
+}
@@ -0,0 +1,252 @@
+/**
+ * @file    pEp_metrics.h
+ * @brief   Counters about Engine performance, in particular SQL contention
+ *          and latency
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef PEP_METRICS_H
+#define PEP_METRICS_H
+
+#include <stdint.h>
+
+#include "pEpEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* The Engine keeps a few counters about its use of the management database,
+   with the purpose of telling whether slowness comes from database locking or
+   from somewhere else.  Every counter is kept twice: once for each session,
+   and once for the whole process, summing over every session including the
+   ones which have already been released.
+
+   Counters only ever grow, and are cheap to update and to read; there is no
+   way of resetting them.  Snapshots can be taken as a C struct with
+   pEp_get_metrics , or as text in the Prometheus exposition format with
+   pEp_get_metrics_text ; the text form also contains per-prepared-statement
+   counters as reported by SQLite. */
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/**
+ *  @struct    PEP_metrics
+ *
+ *  @brief     A snapshot of counters.  All times are in microseconds, except
+ *             backoff times which are in milliseconds like in
+ *             sql_reliability.h .
+ *
+ */
+typedef struct _PEP_metrics {
+    /* SQL statements executed through pEp_sqlite3_step_nonbusy . */
+    uint64_t sql_steps;
+
+    /* Attempts which failed with SQLITE_BUSY and were retried after backing
+       off, and the total time spent sleeping for that. */
+    uint64_t sql_busy_retries;
+    uint64_t sql_backoff_time_in_ms;
+
+    /* Calls which failed with PEP_WOULD_BLOCK in non-blocking mode. */
+    uint64_t sql_would_block;
+
+    /* Database connection refreshes, see pEp_refresh_database_connections in
+       engine_sql.h . */
+    uint64_t sql_connection_refreshes;
+
+    /* Outermost exclusive transactions ended, how many of them were rolled
+       back, and how long they held the lock: in total and at most. */
+    uint64_t sql_transactions;
+    uint64_t sql_rollbacks;
+    uint64_t sql_transaction_time_us;
+    uint64_t sql_transaction_max_time_us;
+
+    /* Lookups in the decrypt result cache, when enabled; see
+       decrypt_cache.h . */
+    uint64_t decrypt_cache_hits;
+    uint64_t decrypt_cache_misses;
+
+    /* Checkpoints run by the WAL checkpointer, see wal_checkpoint.h , how
+       many of them were busy or could not copy the whole log, how many were
+       deferred because writers were active, how many log pages they copied,
+       and how long they took: in total and at most.  The checkpointer
+       belongs to no session, so these are zero in session counters. */
+    uint64_t wal_checkpoints;
+    uint64_t wal_checkpoints_incomplete;
+    uint64_t wal_checkpoints_deferred;
+    uint64_t wal_checkpointed_pages;
+    uint64_t wal_checkpoint_time_us;
+    uint64_t wal_checkpoint_max_time_us;
+
+    /* The size in bytes of the write-ahead log after the latest commit from
+       any session or checkpoint.  This is not a counter and may shrink; it is
+       zero in session counters. */
+    uint64_t wal_size;
+} PEP_metrics;
+
+
+/* API
+ * ***************************************************************** */
+
+/**
+ *  <!--       pEp_get_metrics()       -->
+ *
+ *  @brief Take a snapshot of the counters for the given session and for the
+ *         whole process.
+ *
+ *  @param[in]   session            session handle
+ *  @param[out]  session_metrics    counters for this session; may be NULL
+ *  @param[out]  process_metrics    counters for every session in this process;
+ *                                  may be NULL
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ */
+DYNAMIC_API PEP_STATUS pEp_get_metrics(PEP_SESSION session,
+                                       PEP_metrics *session_metrics,
+                                       PEP_metrics *process_metrics);
+
+/**
+ *  <!--       pEp_get_metrics_text()       -->
+ *
+ *  @brief Render the counters for the given session and for the whole process
+ *         in the Prometheus text exposition format, distinguished by a
+ *         "scope" label.  The text also contains, for every prepared statement
+ *         of the session management database connection which has run at
+ *         least once, the counters reported by sqlite3_stmt_status labelled
+ *         by the statement SQL text.
+ *
+ *  @param[in]   session            session handle
+ *  @param[out]  text               a new '\0'-terminated string
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_OUT_OF_MEMORY       out of memory
+ *
+ *  @ownership   the caller takes ownership of *text, and is responsible to
+ *               free() it (on Windoze use pEp_free())
+ *
+ */
+DYNAMIC_API PEP_STATUS pEp_get_metrics_text(PEP_SESSION session,
+                                            char **text);
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+/* The functions in this section are used by the Engine to update counters;
+   they are not meant for applications.  Each of them updates both the session
+   and the process counters, except for the WAL ones which take no session and
+   only update the process counters, and never fails. */
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_sql_step()       -->
+ *
+ *  @brief     Record one execution of pEp_sqlite3_step_nonbusy .
+ *
+ *  @param[in]   session            session handle
+ */
+void pEp_metrics_count_sql_step(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_backoff()       -->
+ *
+ *  @brief     Record one retry after SQLITE_BUSY , having slept for the given
+ *             time.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   sleep_time_in_ms   time slept before retrying
+ */
+void pEp_metrics_count_backoff(PEP_SESSION session, long sleep_time_in_ms);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_would_block()       -->
+ *
+ *  @brief     Record one PEP_WOULD_BLOCK failure.
+ *
+ *  @param[in]   session            session handle
+ */
+void pEp_metrics_count_would_block(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_connection_refresh()       -->
+ *
+ *  @brief     Record one database connection refresh.
+ *
+ *  @param[in]   session            session handle
+ */
+void pEp_metrics_count_connection_refresh(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_transaction()       -->
+ *
+ *  @brief     Record the end of an outermost exclusive transaction.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   committed          false iff the transaction was rolled back
+ *  @param[in]   duration_us        time from begin to end
+ */
+void pEp_metrics_count_transaction(PEP_SESSION session, bool committed,
+                                   uint64_t duration_us);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_decrypt_cache_lookup()       -->
+ *
+ *  @brief     Record one lookup in the decrypt result cache.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   hit                true iff a valid result was found
+ */
+void pEp_metrics_count_decrypt_cache_lookup(PEP_SESSION session, bool hit);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_wal_checkpoint()       -->
+ *
+ *  @brief     Record one checkpoint run by the WAL checkpointer.
+ *
+ *  @param[in]   complete           false iff the checkpoint was busy or did
+ *                                  not copy the whole log
+ *  @param[in]   pages              log pages copied
+ *  @param[in]   duration_us        time taken
+ */
+void pEp_metrics_count_wal_checkpoint(bool complete, uint64_t pages,
+                                      uint64_t duration_us);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_count_wal_checkpoint_deferred()       -->
+ *
+ *  @brief     Record one checkpoint deferred because writers were active.
+ */
+void pEp_metrics_count_wal_checkpoint_deferred(void);
+
+/**
+ *  @internal
+ *  <!--       pEp_metrics_set_wal_size()       -->
+ *
+ *  @brief     Record the current size of the write-ahead log.
+ *
+ *  @param[in]   size               the size in bytes
+ */
+void pEp_metrics_set_wal_size(uint64_t size);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef PEP_METRICS_H */
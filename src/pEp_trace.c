@@ -0,0 +1,105 @@
+/**
+ * @file    pEp_trace.c
+ * @brief   Tracing hooks: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+/* Spans can be very frequent: do not log function entry here. */
+#define PEP_NO_LOG_FUNCTION_ENTRY 1
+
+#define _EXPORT_PEP_ENGINE_DLL
+#include "pEp_trace.h"
+
+#include "pEp_internal.h"
+#include "identity_list.h"
+#include "bloblist.h"
+
+#include <string.h>
+
+
+/* Configuration
+ * ***************************************************************** */
+
+DYNAMIC_API PEP_STATUS config_trace(PEP_SESSION session,
+                                    trace_span_t begin,
+                                    trace_span_t end,
+                                    void *context)
+{
+    PEP_REQUIRE(session);
+
+    session->trace_begin = begin;
+    session->trace_end = end;
+    session->trace_context = context;
+    session->trace_enabled = (begin != NULL || end != NULL);
+    return PEP_STATUS_OK;
+}
+
+
+/* Spans
+ * ***************************************************************** */
+
+void pEp_trace_begin(PEP_SESSION session, pEp_trace_span *span,
+                     const char *name)
+{
+    PEP_REQUIRE_ORELSE(session && span && name, { return; });
+
+    span->name = name;
+    span->depth = session->trace_depth ++;
+    span->begin_time_us = pEp_monotonic_time_us();
+    span->end_time_us = 0;
+    span->status = PEP_STATUS_OK;
+    span->size = 0;
+    span->count = 0;
+    span->rolled_back = false;
+    if (session->trace_begin != NULL)
+        session->trace_begin(session->trace_context, span);
+}
+
+void pEp_trace_end(PEP_SESSION session, pEp_trace_span *span,
+                   PEP_STATUS status)
+{
+    PEP_REQUIRE_ORELSE(session && span && span->name, { return; });
+
+    span->end_time_us = pEp_monotonic_time_us();
+    span->status = status;
+    PEP_ASSERT(session->trace_depth > 0);
+    if (session->trace_depth > 0)
+        session->trace_depth --;
+    /* The callbacks may have been unregistered while the span was open. */
+    if (session->trace_end != NULL)
+        session->trace_end(session->trace_context, span);
+
+    /* The span is no longer live: ending it again does nothing. */
+    span->name = NULL;
+}
+
+
+/* Attributes
+ * ***************************************************************** */
+
+size_t pEp_trace_message_size(const message *msg)
+{
+    if (msg == NULL)
+        return 0;
+
+    size_t size = 0;
+    if (msg->shortmsg != NULL)
+        size += strlen(msg->shortmsg);
+    if (msg->longmsg != NULL)
+        size += strlen(msg->longmsg);
+    if (msg->longmsg_formatted != NULL)
+        size += strlen(msg->longmsg_formatted);
+    const bloblist_t *b;
+    for (b = msg->attachments; b != NULL; b = b->next)
+        size += b->size;
+    return size;
+}
+
+size_t pEp_trace_recipient_count(const message *msg)
+{
+    if (msg == NULL)
+        return 0;
+
+    return (identity_list_length(msg->to) + identity_list_length(msg->cc)
+            + identity_list_length(msg->bcc));
+}
@@ -0,0 +1,209 @@
+/**
+ * @file    pEp_trace.h
+ * @brief   Tracing hooks: per-session callbacks notified at the beginning and
+ *          at the end of nested spans of Engine activity
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef PEP_TRACE_H
+#define PEP_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pEpEngine.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* A span is a named interval of time during an Engine call, for example the
+   whole encrypt_message call, a MIME encoding operation within it, or a call
+   to the cryptographic library.  Spans nest: a span begun while another is
+   open in the same session is a child of it.  Span names are static strings
+   of the form "category.operation", where the category is one of:
+     api       an instrumented API function: encrypt_message ,
+               decrypt_message_2 , update_identity , myself ;
+     mime      MIME encoding and decoding;
+     crypto    calls to the cryptotech, for example crypto.encrypt_and_sign ;
+     sql       SQL transactions and statements;
+     callback  calls to application callbacks, for example
+               callback.messageToSend .
+
+   An application which wants to attribute latency registers a pair of
+   callbacks with config_trace .  When no callback is registered each
+   instrumentation point costs one test of a session field; defining
+   PEP_TRACE_DISABLED at Engine compile time removes instrumentation
+   altogether. */
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/**
+ *  @struct    pEp_trace_span
+ *
+ *  @brief     One span, as seen by the trace callbacks.  At the beginning only
+ *             name, depth and begin_time_us are meaningful.
+ *
+ */
+typedef struct _pEp_trace_span {
+    const char *name;           ///< static string, never NULL for a live span
+    unsigned int depth;         ///< 0 for outermost spans
+    uint64_t begin_time_us;     ///< from a monotonic clock
+    uint64_t end_time_us;       ///< from the same clock
+    PEP_STATUS status;          ///< the result of the operation
+    size_t size;                ///< bytes processed, or 0 if not applicable
+    size_t count;               ///< recipients or keys, or 0 if not applicable
+    bool rolled_back;           ///< only for sql.transaction: the transaction
+                                ///< was rolled back, and status is the result
+                                ///< of the rollback itself
+} pEp_trace_span;
+
+/**
+ *  @typedef    trace_span_t
+ *
+ *  @brief      Callback notified of a span beginning or ending.
+ *
+ *  @param[in]  context     the pointer supplied to config_trace
+ *  @param[in]  span        the span; ownership remains with the Engine and
+ *                          the pointer is only valid during the call
+ *
+ *  @warning    this is called synchronously on the thread using the session;
+ *              it must not call into the Engine with the same session
+ *
+ */
+typedef void (*trace_span_t)(void *context, const pEp_trace_span *span);
+
+
+/* API
+ * ***************************************************************** */
+
+/**
+ *  <!--       config_trace()       -->
+ *
+ *  @brief Register or unregister tracing callbacks for the given session.
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   begin          called when a span begins; may be NULL
+ *  @param[in]   end            called when a span ends; may be NULL
+ *  @param[in]   context        passed to the callbacks as is; ownership
+ *                              remains with the caller
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *
+ *  @warning tracing is disabled when both callbacks are NULL
+ *
+ */
+DYNAMIC_API PEP_STATUS config_trace(PEP_SESSION session,
+                                    trace_span_t begin,
+                                    trace_span_t end,
+                                    void *context);
+
+
+/* Internal functions and macros
+ * ***************************************************************** */
+
+/* These are not meant for applications.  The macros, like the logging
+   macros, expect a variable named session in scope.  A typical use is:
+      PEP_TRACE_SPAN(span);
+      PEP_TRACE_BEGIN(span, "crypto.encrypt_and_sign");
+      status = ...;
+      PEP_TRACE_ATTRIBUTES(span, csize, stringlist_length(keylist));
+      PEP_TRACE_END(span, status);
+   Arguments to PEP_TRACE_ATTRIBUTES are only evaluated when the span is live,
+   that is when tracing is enabled. */
+
+/**
+ *  @internal
+ *  <!--       pEp_trace_begin()       -->
+ *
+ *  @brief     Begin the pointed span, notifying the begin callback.
+ *
+ *  @param[in]    session       session handle
+ *  @param[out]   span          the span to initialise
+ *  @param[in]    name          static span name
+ */
+void pEp_trace_begin(PEP_SESSION session, pEp_trace_span *span,
+                     const char *name);
+
+/**
+ *  @internal
+ *  <!--       pEp_trace_end()       -->
+ *
+ *  @brief     End the pointed span, notifying the end callback, and make it
+ *             no longer live.
+ *
+ *  @param[in]    session       session handle
+ *  @param[inout] span          the span to end
+ *  @param[in]    status        the result of the operation
+ */
+void pEp_trace_end(PEP_SESSION session, pEp_trace_span *span,
+                   PEP_STATUS status);
+
+/**
+ *  @internal
+ *  <!--       pEp_trace_message_size()       -->
+ *
+ *  @brief     Return an approximate size in bytes for the given message, as
+ *             the sum of its texts and attachments.  Meant for attributes.
+ *
+ *  @param[in]    msg           message, or NULL
+ */
+size_t pEp_trace_message_size(const message *msg);
+
+/**
+ *  @internal
+ *  <!--       pEp_trace_recipient_count()       -->
+ *
+ *  @brief     Return the number of To, Cc and Bcc recipients of the given
+ *             message.  Meant for attributes.
+ *
+ *  @param[in]    msg           message, or NULL
+ */
+size_t pEp_trace_recipient_count(const message *msg);
+
+#if defined (PEP_TRACE_DISABLED)
+#   define PEP_TRACE_SPAN(var)
+#   define PEP_TRACE_BEGIN(var, name)                        \
+        do { } while (false)
+#   define PEP_TRACE_ATTRIBUTES(var, the_size, the_count)    \
+        do { } while (false)
+#   define PEP_TRACE_END(var, the_status)                    \
+        do { } while (false)
+#else
+/* Declare a span variable.  This must come before any jump to the
+   corresponding PEP_TRACE_END . */
+#   define PEP_TRACE_SPAN(var)                                        \
+        pEp_trace_span var = { NULL, 0, 0, 0, PEP_STATUS_OK, 0, 0, false }
+#   define PEP_TRACE_BEGIN(var, the_name)                             \
+        do {                                                          \
+            if (session->trace_enabled)                               \
+                pEp_trace_begin(session, & (var), (the_name));        \
+        } while (false)
+#   define PEP_TRACE_ATTRIBUTES(var, the_size, the_count)             \
+        do {                                                          \
+            if ((var).name != NULL) {                                 \
+                (var).size = (the_size);                              \
+                (var).count = (the_count);                            \
+            }                                                         \
+        } while (false)
+#   define PEP_TRACE_END(var, the_status)                             \
+        do {                                                          \
+            if ((var).name != NULL)                                   \
+                pEp_trace_end(session, & (var), (the_status));        \
+        } while (false)
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef PEP_TRACE_H */
@@ -1697,6 +1697,80 @@ PEP_STATUS pgp_contains_priv_key(
     return status;
 }
 
+PEP_STATUS pgp_get_key_status(
+        PEP_SESSION session,
+        const char *fprstr,
+        time_t when,
+        PEP_key_status *key_status)
+{
+    pgp_key_t *key;
+    uint8_t *fpr = NULL;
+    unsigned from = 0;
+    size_t length;
+
+    PEP_STATUS status = PEP_STATUS_OK;
+
+    PEP_REQUIRE(session && ! EMPTYSTR(fprstr) && key_status);
+
+    // TODO : take "when" in account, like pgp_key_expired
+
+    memset(key_status, 0, sizeof(PEP_key_status));
+    key_status->comm_type = PEP_ct_unknown;
+
+    if(pthread_mutex_lock(&netpgp_mutex)){
+        return PEP_UNKNOWN_ERROR;
+    }
+
+    if (!string_to_uint(fprstr, &fpr, &length)) {
+        status = PEP_ILLEGAL_VALUE;
+        goto unlock_netpgp;
+    }
+
+    key = pgp_getkeybyfpr(netpgp->io, netpgp->pubring, fpr, length, &from, NULL, 0, 0);
+    if(key == NULL)
+    {
+        status = PEP_KEY_NOT_FOUND;
+        goto unlock_netpgp;
+    }
+
+    // one key, all we need to know about it
+    switch(pgp_key_get_rating(key)){
+    case PGP_VALID:
+        key_status->comm_type = PEP_ct_OpenPGP_unconfirmed;
+        break;
+    case PGP_WEAK:
+        key_status->comm_type = PEP_ct_OpenPGP_weak_unconfirmed;
+        break;
+    case PGP_TOOSHORT:
+        key_status->comm_type = PEP_ct_key_too_short;
+        break;
+    case PGP_INVALID:
+        key_status->comm_type = PEP_ct_key_b0rken;
+        break;
+    case PGP_EXPIRED:
+        key_status->comm_type = PEP_ct_key_expired;
+        key_status->expired = true;
+        break;
+    case PGP_REVOKED:
+        key_status->comm_type = PEP_ct_key_revoked;
+        key_status->revoked = true;
+        break;
+    default:
+        break;
+    }
+    key_status->created = (time_t) key->key.pubkey.birthtime;
+
+    from = 0;
+    key_status->has_private
+        = (pgp_getkeybyfpr(netpgp->io, netpgp->secring, fpr, length, &from, NULL, 0, 0)
+           != NULL);
+
+unlock_netpgp:
+    pthread_mutex_unlock(&netpgp_mutex);
+
+    return status;
+}
+
 PEP_STATUS pgp_import_ultimately_trusted_keypairs(PEP_SESSION session) {
     // Not implemented - netpgp doesn't appear to keep track of trust status in
     // a meaningful way, though there is space for it in the structs.
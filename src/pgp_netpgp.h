@@ -12,6 +12,7 @@
 #define PGP_PEP_NETPGP_H
 
 #include "pEpEngine.h"
+#include "cryptotech.h"
 
 /**
  *  @internal
@@ -436,6 +437,27 @@ PEP_STATUS pgp_find_private_keys(
     PEP_SESSION session, const char *pattern, stringlist_t **keylist
 );
 
+/**
+ *  @internal
+ *  <!--       pgp_get_key_status()       -->
+ *  
+ *  @brief  Find out whether there is a private key, the rating, whether the
+ *          key is revoked or expired and its creation time, looking the key
+ *          up once
+ *  
+ *  @param[in]  session        session handle 
+ *  @param[in]  fpr            const char*
+ *  @param[in]  when           time_t
+ *  @param[out] key_status     PEP_key_status*
+ *  
+ *  @see    get_key_status_t in cryptotech.h
+ */
+PEP_STATUS pgp_get_key_status(
+        PEP_SESSION session,
+        const char *fpr,
+        time_t when,
+        PEP_key_status *key_status);
+
 /**
  *  @internal
  *  <!--       pgp_config_cipher_suite()       -->
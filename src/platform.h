@@ -95,6 +95,144 @@ struct pEp_pid_and_tid {
 void pEp_set_pid_and_tid(struct pEp_pid_and_tid *pid_and_tid);
 
 
+/* Threads and synchronisation
+ * ***************************************************************** */
+
+/* Thin portability wrappers around the native threading facilities: POSIX
+   threads on Unix, the Win32 API on Windows.  The types pEp_thread_t,
+   pEp_mutex_t and pEp_cond_t are defined in the platform-specific headers,
+   along with the static initialiser PEP_MUTEX_INITIALIZER .
+   Functions returning int follow the POSIX convention of returning 0 on
+   success and non-zero on failure.  None of these is part of the Engine API:
+   they are meant for the Engine's own background threads.
+
+   The platform-specific headers also define, as inline functions, relaxed
+   atomic operations on uint64_t objects, for counters updated by many threads
+   without a lock.  They impose no ordering on other memory accesses:
+   - uint64_t pEp_atomic_load_u64(const uint64_t *p)
+   - void pEp_atomic_store_u64(uint64_t *p, uint64_t value)
+   - void pEp_atomic_add_u64(uint64_t *p, uint64_t amount)
+   - void pEp_atomic_max_u64(uint64_t *p, uint64_t value), setting *p to
+     value if value is greater. */
+
+/**
+ *  <!--       pEp_mutex_init()       -->
+ *
+ *  @brief Initialise the pointed non-recursive mutex.
+ *
+ *  @retval 0                     success
+ *  @retval a non-zero value      failure
+ */
+int pEp_mutex_init(pEp_mutex_t *mutex);
+
+/**
+ *  <!--       pEp_mutex_destroy()       -->
+ *
+ *  @brief Finalise a mutex initialised by pEp_mutex_init, which must be
+ *         unlocked.
+ */
+void pEp_mutex_destroy(pEp_mutex_t *mutex);
+
+/**
+ *  <!--       pEp_mutex_lock()       -->
+ *
+ *  @brief Lock the pointed mutex, waiting as long as needed.
+ */
+void pEp_mutex_lock(pEp_mutex_t *mutex);
+
+/**
+ *  <!--       pEp_mutex_unlock()       -->
+ *
+ *  @brief Unlock the pointed mutex, which must be locked by the current
+ *         thread.
+ */
+void pEp_mutex_unlock(pEp_mutex_t *mutex);
+
+/**
+ *  <!--       pEp_cond_init()       -->
+ *
+ *  @brief Initialise the pointed condition variable.
+ *
+ *  @retval 0                     success
+ *  @retval a non-zero value      failure
+ */
+int pEp_cond_init(pEp_cond_t *cond);
+
+/**
+ *  <!--       pEp_cond_destroy()       -->
+ *
+ *  @brief Finalise a condition variable initialised by pEp_cond_init , on
+ *         which no thread is waiting.
+ */
+void pEp_cond_destroy(pEp_cond_t *cond);
+
+/**
+ *  <!--       pEp_cond_wait()       -->
+ *
+ *  @brief Atomically unlock the mutex and wait on the condition variable,
+ *         locking the mutex again before returning.  Like with POSIX, spurious
+ *         wakeups are possible: the caller should check its predicate in a
+ *         loop.
+ */
+void pEp_cond_wait(pEp_cond_t *cond, pEp_mutex_t *mutex);
+
+/**
+ *  <!--       pEp_cond_timedwait_ms()       -->
+ *
+ *  @brief Like pEp_cond_wait , but wait for at most the given number of
+ *         milliseconds.
+ *
+ *  @retval 0                     woken up, possibly spuriously
+ *  @retval a non-zero value      the timeout expired
+ */
+int pEp_cond_timedwait_ms(pEp_cond_t *cond, pEp_mutex_t *mutex,
+                          unsigned long ms);
+
+/**
+ *  <!--       pEp_cond_signal()       -->
+ *
+ *  @brief Wake up at least one of the threads waiting on the condition
+ *         variable, if any.
+ */
+void pEp_cond_signal(pEp_cond_t *cond);
+
+/**
+ *  <!--       pEp_cond_broadcast()       -->
+ *
+ *  @brief Wake up all of the threads waiting on the condition variable.
+ */
+void pEp_cond_broadcast(pEp_cond_t *cond);
+
+/**
+ *  <!--       pEp_thread_create()       -->
+ *
+ *  @brief Start a new joinable thread executing body(argument).  The result
+ *         of body is ignored.
+ *
+ *  @retval 0                     success
+ *  @retval a non-zero value      failure
+ */
+int pEp_thread_create(pEp_thread_t *thread, void *(*body)(void *),
+                      void *argument);
+
+/**
+ *  <!--       pEp_thread_join()       -->
+ *
+ *  @brief Wait for the given thread, started with pEp_thread_create , to
+ *         terminate, and release its resources.
+ */
+void pEp_thread_join(pEp_thread_t thread);
+
+/**
+ *  <!--       pEp_monotonic_time_us()       -->
+ *
+ *  @brief Return the current time in microseconds according to a monotonic
+ *         clock, unaffected by changes to the wall-clock time.  The epoch is
+ *         unspecified: the result is only useful to measure intervals.
+ */
+uint64_t pEp_monotonic_time_us(void);
+
+
 /* Feature macros
  * ***************************************************************** */
 
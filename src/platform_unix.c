@@ -1152,6 +1152,100 @@ void pEp_sleep_ms(unsigned long ms)
     } while (nanosleep_result != 0);
 }
 
+int pEp_mutex_init(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    return pthread_mutex_init(mutex, NULL);
+}
+
+void pEp_mutex_destroy(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    pthread_mutex_destroy(mutex);
+}
+
+void pEp_mutex_lock(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    int result = pthread_mutex_lock(mutex);
+    assert(result == 0);
+}
+
+void pEp_mutex_unlock(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    int result = pthread_mutex_unlock(mutex);
+    assert(result == 0);
+}
+
+int pEp_cond_init(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    return pthread_cond_init(cond, NULL);
+}
+
+void pEp_cond_destroy(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    pthread_cond_destroy(cond);
+}
+
+void pEp_cond_wait(pEp_cond_t *cond, pEp_mutex_t *mutex)
+{
+    assert(cond != NULL && mutex != NULL);
+    pthread_cond_wait(cond, mutex);
+}
+
+int pEp_cond_timedwait_ms(pEp_cond_t *cond, pEp_mutex_t *mutex,
+                          unsigned long ms)
+{
+    assert(cond != NULL && mutex != NULL);
+
+    /* pthread_cond_timedwait wants an absolute deadline, on the real-time
+       clock. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, & deadline);
+    deadline.tv_sec += (time_t) (ms / 1000);
+    deadline.tv_nsec += (long) (ms % 1000L) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return (pthread_cond_timedwait(cond, mutex, & deadline) == ETIMEDOUT);
+}
+
+void pEp_cond_signal(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    pthread_cond_signal(cond);
+}
+
+void pEp_cond_broadcast(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    pthread_cond_broadcast(cond);
+}
+
+int pEp_thread_create(pEp_thread_t *thread, void *(*body)(void *),
+                      void *argument)
+{
+    assert(thread != NULL && body != NULL);
+    return pthread_create(thread, NULL, body, argument);
+}
+
+void pEp_thread_join(pEp_thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+uint64_t pEp_monotonic_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, & now);
+    return ((uint64_t) now.tv_sec * 1000000ULL
+            + (uint64_t) now.tv_nsec / 1000ULL);
+}
+
 void pEp_set_pid_and_tid(struct pEp_pid_and_tid *pid_and_tid)
 {
     assert(pid_and_tid != NULL);
@@ -199,6 +199,49 @@ typedef uuid_t pEpUUID;
 #endif
 
 
+/* Threads and synchronisation
+ * ***************************************************************** */
+
+/* See the "Threads and synchronisation" section in platform.h ; here we only
+   need to supply the concrete types, which are the POSIX ones. */
+#include <pthread.h>
+
+typedef pthread_t pEp_thread_t;
+typedef pthread_mutex_t pEp_mutex_t;
+typedef pthread_cond_t pEp_cond_t;
+
+/* Static initialiser for a pEp_mutex_t with static storage duration, which
+   then needs no call to pEp_mutex_init nor to pEp_mutex_destroy . */
+#define PEP_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+/* Relaxed atomic operations on uint64_t, with the GNU C builtins supported by
+   every compiler we use on these platforms. */
+static inline uint64_t pEp_atomic_load_u64(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline void pEp_atomic_store_u64(uint64_t *p, uint64_t value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+static inline void pEp_atomic_add_u64(uint64_t *p, uint64_t amount)
+{
+    __atomic_fetch_add(p, amount, __ATOMIC_RELAXED);
+}
+
+static inline void pEp_atomic_max_u64(uint64_t *p, uint64_t value)
+{
+    uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (value > old
+           && ! __atomic_compare_exchange_n(p, & old, value, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+        ;
+}
+
+
 /* Feature macros
  * ***************************************************************** */
 
@@ -515,6 +515,127 @@ DYNAMIC_API void clear_path_cache (void)
     /* Like reset_path_cache, do nothing. */
 }
 
+int pEp_mutex_init(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    InitializeSRWLock(mutex);
+    return 0;
+}
+
+void pEp_mutex_destroy(pEp_mutex_t *mutex)
+{
+    /* SRW locks need no finalisation. */
+    assert(mutex != NULL);
+}
+
+void pEp_mutex_lock(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    AcquireSRWLockExclusive(mutex);
+}
+
+void pEp_mutex_unlock(pEp_mutex_t *mutex)
+{
+    assert(mutex != NULL);
+    ReleaseSRWLockExclusive(mutex);
+}
+
+int pEp_cond_init(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+void pEp_cond_destroy(pEp_cond_t *cond)
+{
+    /* Condition variables need no finalisation either. */
+    assert(cond != NULL);
+}
+
+void pEp_cond_wait(pEp_cond_t *cond, pEp_mutex_t *mutex)
+{
+    assert(cond != NULL && mutex != NULL);
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+int pEp_cond_timedwait_ms(pEp_cond_t *cond, pEp_mutex_t *mutex,
+                          unsigned long ms)
+{
+    assert(cond != NULL && mutex != NULL);
+    if (SleepConditionVariableSRW(cond, mutex, (DWORD) ms, 0))
+        return 0;
+    return (GetLastError() == ERROR_TIMEOUT);
+}
+
+void pEp_cond_signal(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    WakeConditionVariable(cond);
+}
+
+void pEp_cond_broadcast(pEp_cond_t *cond)
+{
+    assert(cond != NULL);
+    WakeAllConditionVariable(cond);
+}
+
+/* CreateThread wants a different signature from the POSIX-style body
+   function: we pass the body and its argument through a heap-allocated
+   trampoline. */
+struct _pEp_thread_trampoline {
+    void *(*body)(void *);
+    void *argument;
+};
+
+static DWORD WINAPI _pEp_thread_start(LPVOID parameter)
+{
+    struct _pEp_thread_trampoline *trampoline
+        = (struct _pEp_thread_trampoline *) parameter;
+    void *(*body)(void *) = trampoline->body;
+    void *argument = trampoline->argument;
+    free(trampoline);
+    body(argument);
+    return 0;
+}
+
+int pEp_thread_create(pEp_thread_t *thread, void *(*body)(void *),
+                      void *argument)
+{
+    assert(thread != NULL && body != NULL);
+    struct _pEp_thread_trampoline *trampoline
+        = (struct _pEp_thread_trampoline *)
+          malloc(sizeof(struct _pEp_thread_trampoline));
+    if (trampoline == NULL)
+        return 1;
+    trampoline->body = body;
+    trampoline->argument = argument;
+    *thread = CreateThread(NULL, 0, _pEp_thread_start, trampoline, 0, NULL);
+    if (*thread == NULL) {
+        free(trampoline);
+        return 1;
+    }
+    return 0;
+}
+
+void pEp_thread_join(pEp_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+uint64_t pEp_monotonic_time_us(void)
+{
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(& frequency);
+    QueryPerformanceCounter(& now);
+    return (uint64_t) (now.QuadPart / frequency.QuadPart) * 1000000ULL
+           + (uint64_t) (now.QuadPart % frequency.QuadPart) * 1000000ULL
+             / (uint64_t) frequency.QuadPart;
+}
+
 void pEp_set_pid_and_tid(struct pEp_pid_and_tid *pid_and_tid)
 {
     assert(pid_and_tid != NULL);
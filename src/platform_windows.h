@@ -314,6 +314,50 @@ pid_t getpid(void);
 #endif
 
 
+/* Threads and synchronisation
+ * ***************************************************************** */
+
+/* See the "Threads and synchronisation" section in platform.h ; here we only
+   supply the concrete types.  Slim reader/writer locks are used as mutexes
+   since they work with SleepConditionVariableSRW . */
+typedef HANDLE pEp_thread_t;
+typedef SRWLOCK pEp_mutex_t;
+typedef CONDITION_VARIABLE pEp_cond_t;
+
+/* Static initialiser for a pEp_mutex_t with static storage duration, which
+   then needs no call to pEp_mutex_init nor to pEp_mutex_destroy . */
+#define PEP_MUTEX_INITIALIZER SRWLOCK_INIT
+
+/* Relaxed atomic operations on uint64_t, with the Interlocked functions; a
+   plain load or store of 64 bits is not atomic on 32-bit targets. */
+static inline uint64_t pEp_atomic_load_u64(const uint64_t *p)
+{
+    return (uint64_t) InterlockedCompareExchange64((volatile LONG64 *) p, 0, 0);
+}
+
+static inline void pEp_atomic_store_u64(uint64_t *p, uint64_t value)
+{
+    InterlockedExchange64((volatile LONG64 *) p, (LONG64) value);
+}
+
+static inline void pEp_atomic_add_u64(uint64_t *p, uint64_t amount)
+{
+    InterlockedExchangeAdd64((volatile LONG64 *) p, (LONG64) amount);
+}
+
+static inline void pEp_atomic_max_u64(uint64_t *p, uint64_t value)
+{
+    uint64_t old = pEp_atomic_load_u64(p);
+    while (value > old) {
+        uint64_t seen = (uint64_t) InterlockedCompareExchange64(
+                (volatile LONG64 *) p, (LONG64) value, (LONG64) old);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+}
+
+
 /* Feature macros
  * ***************************************************************** */
 
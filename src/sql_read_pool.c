@@ -0,0 +1,258 @@
+/**
+ * @file    sql_read_pool.c
+ * @brief   Read pool: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#include "sql_read_pool.h"
+
+#include "pEp_internal.h"
+#include "engine_sql.h"
+#include "pEp_metrics.h"
+
+#include <assert.h>
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/* A pooled connection.  Its statements are prepared at their first use. */
+struct _pEp_sql_read_connection {
+    sqlite3 *db;
+    sqlite3_stmt *statements[pEp_sql_read__count];
+};
+
+/* The connections not leased by any session, and the number of connections
+   open, leased or not.  Protected by the mutex. */
+static pEp_mutex_t read_pool_mutex = PEP_MUTEX_INITIALIZER;
+static struct _pEp_sql_read_connection *read_pool_idle[PEP_SQL_READ_POOL_SIZE];
+static size_t read_pool_idle_no = 0;
+static size_t read_pool_open_no = 0;
+
+
+/* Connections
+ * ***************************************************************** */
+
+static void close_read_connection(struct _pEp_sql_read_connection *connection)
+{
+    if (connection == NULL)
+        return;
+
+    int i;
+    for (i = 0; i < pEp_sql_read__count; i ++)
+        sqlite3_finalize(connection->statements[i]);
+    sqlite3_close_v2(connection->db);
+    free(connection);
+}
+
+/* Open a new pooled connection, or return NULL on error. */
+static struct _pEp_sql_read_connection *open_read_connection(
+        PEP_SESSION session)
+{
+    struct _pEp_sql_read_connection *connection
+        = calloc(1, sizeof(struct _pEp_sql_read_connection));
+    if (connection == NULL)
+        return NULL;
+
+    /* Each connection is only used by one thread at a time, the one of the
+       session leasing it. */
+    int result = sqlite3_open_v2(LOCAL_DB,
+                                 & connection->db,
+                                 SQLITE_OPEN_READONLY
+                                 | SQLITE_OPEN_NOMUTEX
+                                 | SQLITE_OPEN_PRIVATECACHE,
+                                 NULL);
+    if (result == SQLITE_OK)
+        result = pEp_sql_create_functions(connection->db);
+    if (result != SQLITE_OK) {
+        LOG_NONOK("cannot open a pooled read connection: %s",
+                  pEp_sql_status_to_status_text(session, result));
+        close_read_connection(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+/* Take an idle connection, or open a new one if the pool is not full.  Return
+   NULL if no connection is available. */
+static struct _pEp_sql_read_connection *lease_read_connection(
+        PEP_SESSION session)
+{
+    struct _pEp_sql_read_connection *connection = NULL;
+    bool open_new = false;
+    pEp_mutex_lock(& read_pool_mutex);
+    if (read_pool_idle_no > 0)
+        connection = read_pool_idle[-- read_pool_idle_no];
+    else if (read_pool_open_no < PEP_SQL_READ_POOL_SIZE) {
+        read_pool_open_no ++;
+        open_new = true;
+    }
+    pEp_mutex_unlock(& read_pool_mutex);
+
+    /* Open the new connection without holding the mutex. */
+    if (open_new) {
+        connection = open_read_connection(session);
+        if (connection == NULL) {
+            pEp_mutex_lock(& read_pool_mutex);
+            read_pool_open_no --;
+            pEp_mutex_unlock(& read_pool_mutex);
+        }
+    }
+    return connection;
+}
+
+static void return_read_connection(struct _pEp_sql_read_connection *connection)
+{
+    pEp_mutex_lock(& read_pool_mutex);
+    assert(read_pool_idle_no < PEP_SQL_READ_POOL_SIZE);
+    read_pool_idle[read_pool_idle_no ++] = connection;
+    pEp_mutex_unlock(& read_pool_mutex);
+}
+
+/* Execute a transaction control statement on a pooled connection, retrying
+   while busy.  Return the SQLite status. */
+static int read_connection_exec(PEP_SESSION session,
+                                struct _pEp_sql_read_connection *connection,
+                                const char *sql)
+{
+    int result;
+    PEP_SQL_BEGIN_LOOP(result);
+        result = sqlite3_exec(connection->db, sql, NULL, NULL, NULL);
+    PEP_SQL_END_LOOP();
+    return result;
+}
+
+
+/* Statements
+ * ***************************************************************** */
+
+static const char *read_query_sql(pEp_sql_read_query query)
+{
+    switch (query) {
+    case pEp_sql_read_get_identity:
+        return sql_get_identity;
+    case pEp_sql_read_get_identities_by_userid:
+        return sql_get_identities_by_userid;
+    case pEp_sql_read_get_trust:
+        return sql_get_trust;
+    case pEp_sql_read_least_trust:
+        return sql_least_trust;
+    case pEp_sql_read_own_identities_retrieve:
+        return sql_own_identities_retrieve;
+    default:
+        return NULL;
+    }
+}
+
+sqlite3_stmt *pEp_sql_read_statement(PEP_SESSION session,
+                                     pEp_sql_read_query query,
+                                     sqlite3_stmt *session_statement)
+{
+    PEP_REQUIRE_ORELSE(session && query >= 0 && query < pEp_sql_read__count,
+                       { return session_statement; });
+
+    /* A transaction begun within the read sees its own changes only through
+       the session connection. */
+    struct _pEp_sql_read_connection *connection = session->read_connection;
+    if (connection == NULL || session->transaction_in_progress_no > 0)
+        return session_statement;
+
+    if (connection->statements[query] == NULL) {
+        int result = pEp_sqlite3_prepare_v3_nonbusy_nonlocked(
+                        session, connection->db, read_query_sql(query), -1,
+                        SQLITE_PREPARE_PERSISTENT,
+                        & connection->statements[query], NULL);
+        if (result != SQLITE_OK) {
+            LOG_NONOK("cannot prepare pooled statement %i: %s", (int) query,
+                      pEp_sql_status_to_status_text(session, result));
+            connection->statements[query] = NULL;
+            return session_statement;
+        }
+    }
+    return connection->statements[query];
+}
+
+int pEp_sql_read_step(PEP_SESSION session, sqlite3_stmt *statement)
+{
+    PEP_REQUIRE_ORELSE_RETURN(session && statement, SQLITE_ERROR);
+
+    if (sqlite3_db_handle(statement) == session->db)
+        return pEp_sqlite3_step_nonbusy(session, statement);
+
+    /* A pooled statement, within the read transaction: a WAL reader only
+       waits in rare cases, such as recovery after a crash. */
+    int result;
+    PEP_SQL_BEGIN_LOOP(result);
+        result = sqlite3_step(statement);
+    PEP_SQL_END_LOOP();
+    pEp_metrics_count_sql_step(session);
+    return result;
+}
+
+
+/* Reads
+ * ***************************************************************** */
+
+void pEp_sql_read_begin(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    if (session->read_depth ++ > 0)
+        return;
+    PEP_ASSERT(session->read_connection == NULL);
+    if (session->read_pool_disabled
+        || session->transaction_in_progress_no > 0)
+        return;
+
+    struct _pEp_sql_read_connection *connection
+        = lease_read_connection(session);
+    if (connection == NULL)
+        return;
+    /* A deferred transaction: the snapshot is taken at the first read. */
+    if (read_connection_exec(session, connection, "BEGIN;") != SQLITE_OK) {
+        return_read_connection(connection);
+        return;
+    }
+    session->read_connection = connection;
+}
+
+void pEp_sql_read_end(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session && session->read_depth > 0, { return; });
+
+    if (-- session->read_depth > 0)
+        return;
+    struct _pEp_sql_read_connection *connection = session->read_connection;
+    if (connection == NULL)
+        return;
+    session->read_connection = NULL;
+
+    /* Release the snapshot, even if a caller left a statement unfinished. */
+    int i;
+    for (i = 0; i < pEp_sql_read__count; i ++)
+        if (connection->statements[i] != NULL)
+            sql_reset_and_clear_bindings(connection->statements[i]);
+    if (read_connection_exec(session, connection, "COMMIT;") != SQLITE_OK) {
+        /* Do not reuse a connection in an unknown state. */
+        close_read_connection(connection);
+        pEp_mutex_lock(& read_pool_mutex);
+        read_pool_open_no --;
+        pEp_mutex_unlock(& read_pool_mutex);
+        return;
+    }
+    return_read_connection(connection);
+}
+
+void pEp_sql_read_pool_drop(void)
+{
+    pEp_mutex_lock(& read_pool_mutex);
+    assert(read_pool_idle_no == read_pool_open_no);
+    size_t i;
+    for (i = 0; i < read_pool_idle_no; i ++) {
+        close_read_connection(read_pool_idle[i]);
+        read_pool_idle[i] = NULL;
+    }
+    read_pool_open_no -= read_pool_idle_no;
+    read_pool_idle_no = 0;
+    pEp_mutex_unlock(& read_pool_mutex);
+}
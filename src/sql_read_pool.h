@@ -0,0 +1,128 @@
+/**
+ * @file    sql_read_pool.h
+ * @brief   Read pool: process-wide read-only connections to the management
+ *          database, letting query-only code paths run without the write
+ *          lock
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef SQL_READ_POOL_H
+#define SQL_READ_POOL_H
+
+#include "pEp_internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* Every statement stepped with pEp_sqlite3_step_nonbusy runs inside an
+   EXCLUSIVE transaction on the session connection, reads included: so reads
+   from every thread of the process wait for each other and for writers.  The
+   management database is in WAL mode, where a reader on another connection
+   needs no lock at all and sees the latest committed state.
+
+   The read pool keeps up to PEP_SQL_READ_POOL_SIZE read-only connections,
+   shared by every session in the process.  A read function brackets its work
+   with pEp_sql_read_begin and pEp_sql_read_end ; in between the session
+   leases a pooled connection with a read transaction open on it, so that
+   every statement in the read sees the same snapshot.  Reads nest, sharing
+   the outermost lease.
+
+   The session connection is used as before when the session has a
+   transaction in progress, whose uncommitted changes only that connection can
+   see; when the pool is disabled by config_read_pool ; and when every pooled
+   connection is in use: a read never waits for a connection.
+
+   A read must not write: its later statements would not see the change. */
+
+/* The queries run through the pool.  Each pooled connection prepares its own
+   copy of a statement at its first use. */
+typedef enum _pEp_sql_read_query {
+    pEp_sql_read_get_identity,
+    pEp_sql_read_get_identities_by_userid,
+    pEp_sql_read_get_trust,
+    pEp_sql_read_least_trust,
+    pEp_sql_read_own_identities_retrieve,
+    pEp_sql_read__count
+} pEp_sql_read_query;
+
+/* The maximum number of pooled connections in the process. */
+#ifndef PEP_SQL_READ_POOL_SIZE
+#define PEP_SQL_READ_POOL_SIZE 8
+#endif
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_read_begin()       -->
+ *
+ *  @brief     Begin a read, leasing a pooled connection if possible.
+ *
+ *  @param[in]   session        session handle
+ */
+void pEp_sql_read_begin(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_read_end()       -->
+ *
+ *  @brief     End the read begun by the matching pEp_sql_read_begin ,
+ *             resetting its statements and, for the outermost read, returning
+ *             the connection to the pool.
+ *
+ *  @param[in]   session        session handle
+ */
+void pEp_sql_read_end(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_read_statement()       -->
+ *
+ *  @brief     Return the prepared statement to use for the given query within
+ *             the current read: the copy on the leased connection, or the
+ *             given session statement.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   query              the query
+ *  @param[in]   session_statement  the session statement for the same query
+ */
+sqlite3_stmt *pEp_sql_read_statement(PEP_SESSION session,
+                                     pEp_sql_read_query query,
+                                     sqlite3_stmt *session_statement);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_read_step()       -->
+ *
+ *  @brief     Step a statement returned by pEp_sql_read_statement , like
+ *             pEp_sqlite3_step_nonbusy : the result is never SQLITE_BUSY .
+ *
+ *  @param[in]   session        session handle
+ *  @param[in]   statement      the statement
+ *
+ *  @retval      the SQLite status
+ */
+int pEp_sql_read_step(PEP_SESSION session, sqlite3_stmt *statement);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_read_pool_drop()       -->
+ *
+ *  @brief     Close every pooled connection; none may be leased.  Called when
+ *             the last session is released.
+ */
+void pEp_sql_read_pool_drop(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef SQL_READ_POOL_H */
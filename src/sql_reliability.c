@@ -18,6 +18,7 @@
 #include "engine_sql.h"
 
 #include "pEpEngine.h"
+#include "pEp_metrics.h"
 
 #include <errno.h>
 
@@ -101,6 +102,7 @@ PEP_STATUS pEp_back_off(PEP_SESSION session,
     if (sleep_time_in_ms != 0)
         pEp_sleep_ms(sleep_time_in_ms);
     pEp_backoff_bump(session, s, sleep_time_in_ms);
+    pEp_metrics_count_backoff(session, sleep_time_in_ms);
 
 #if 0
     if ((s->failure_no % PEP_BACKOFF_TIMES_BEFORE_CHECKPOINTING) == 0)
@@ -135,12 +137,42 @@ int _pEp_sqlite3_step_nonbusy(PEP_SESSION session,
                               /* Something generic is acceptable: this will only
                                  happen because of Engine bugs */ SQLITE_ERROR);
     int sqlite_status;
+    PEP_TRACE_SPAN(span);
+
+    /* Within a deferred non-blocking call, see
+       pEp_sql_begin_deferred_nonblocking_call , a read needs no lock: the
+       database is in WAL mode.  The lock is only taken, without waiting, for
+       the first write; once it could not be taken writes fail as if another
+       connection held it. */
+    if (session->sql_deferred_call
+        && ! sqlite3_stmt_readonly(* prepared_statement_p)) {
+        if (session->sql_would_block) {
+            LOG_TRACE("not executing %s: the call will fail with"
+                      " PEP_WOULD_BLOCK",
+                      sqlite3_sql(* prepared_statement_p));
+            return SQLITE_BUSY;
+        }
+    }
+    else if (session->sql_deferred_call
+             && session->transaction_in_progress_no == 0) {
+        sqlite_status = sqlite3_step(* prepared_statement_p);
+        pEp_metrics_count_sql_step(session);
+        if (sqlite_status != SQLITE_BUSY)
+            return sqlite_status;
+        /* Very unlikely in WAL mode: read as usual. */
+        sqlite3_reset(* prepared_statement_p);
+    }
 
     bool transaction_in_progress_at_entry
         = session->transaction_in_progress_no > 0;
     if (! transaction_in_progress_at_entry)
         PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    PEP_TRACE_BEGIN(span, "sql.step");
     sqlite_status = sqlite3_step(* prepared_statement_p);
+    PEP_TRACE_END(span, ((sqlite_status == SQLITE_ROW
+                          || sqlite_status == SQLITE_DONE)
+                         ? PEP_STATUS_OK : PEP_UNKNOWN_DB_ERROR));
+    pEp_metrics_count_sql_step(session);
     if (sqlite_status != SQLITE_OK && sqlite_status != SQLITE_ROW
         && sqlite_status != SQLITE_DONE)
         LOG_NONOK("sqlite_status is %s from executing %s",
@@ -196,3 +228,290 @@ int pEp_sqlite3_prepare_v2_nonbusy_nonlocked(PEP_SESSION session,
                                                     /* the missing argument */ 0,
                                                     ppStmt, pzTail);
 }
+
+
+/* Batch transactions
+ * ***************************************************************** */
+
+PEP_STATUS pEp_sql_begin_batch_transaction(PEP_SESSION session)
+{
+    PEP_REQUIRE(session && session->transaction_in_progress_no == 0);
+
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    session->batch_transaction_open = true;
+    return PEP_STATUS_OK;
+}
+
+PEP_STATUS pEp_sql_end_batch_transaction(PEP_SESSION session, bool commit)
+{
+    PEP_REQUIRE(session && session->batch_transaction_open
+                && session->transaction_in_progress_no == 1);
+
+    session->batch_transaction_open = false;
+    PEP_SQL_COMMIT_OR_ROLLBACK_TRANSACTION(commit);
+    return PEP_STATUS_OK;
+}
+
+/* Execute one of the savepoint statements.  We already hold the exclusive
+   lock, so SQLITE_BUSY is not expected here. */
+static void pEp_sql_execute_savepoint_statement(PEP_SESSION session,
+                                                sqlite3_stmt *statement)
+{
+    sqlite3_reset(statement);
+    int sqlite_status = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if (sqlite_status != SQLITE_DONE)
+        LOG_ERROR("UNEXPECTED error on %s: %s", sqlite3_sql(statement),
+                  pEp_sql_status_to_status_text(session, sqlite_status));
+    PEP_ASSERT(sqlite_status == SQLITE_DONE);
+}
+
+void pEp_sql_begin_savepoint(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session && session->batch_transaction_open,
+                       { return; });
+
+    pEp_sql_execute_savepoint_statement(session, session->begin_savepoint);
+    session->transaction_rollback_only = false;
+    outbound_queue_savepoint_begun(session);
+}
+
+void pEp_sql_end_savepoint(PEP_SESSION session, bool commit)
+{
+    PEP_REQUIRE_ORELSE(session && session->batch_transaction_open,
+                       { return; });
+
+    if (commit && session->transaction_rollback_only) {
+        LOG_WARNING("a nested transaction was rolled back: ROLLBACK TO"
+                    " SAVEPOINT instead of RELEASE");
+        commit = false;
+    }
+    session->transaction_rollback_only = false;
+
+    /* Rolling back to a savepoint does not remove it: release it as well. */
+    if (! commit) {
+        pEp_sql_execute_savepoint_statement(session,
+                                            session->rollback_to_savepoint);
+        /* Unlike a whole transaction this does not call the rollback hook. */
+        pEp_sql_note_change(session);
+    }
+    pEp_sql_execute_savepoint_statement(session, session->release_savepoint);
+    outbound_queue_savepoint_ended(session, commit);
+}
+
+
+/* Non-blocking mode
+ * ***************************************************************** */
+
+/* The sessions waiting for a readiness notification, linked through their
+   sql_ready_next field.  Sessions are added at the beginning. */
+static pEp_mutex_t sql_ready_mutex = PEP_MUTEX_INITIALIZER;
+static PEP_SESSION sql_ready_waiting_first = NULL;
+
+/* Add the given session to the waiting list, unless it is there already. */
+static void pEp_sql_arm_ready_notification(PEP_SESSION session)
+{
+    if (session->sql_ready == NULL)
+        return;
+
+    pEp_mutex_lock(& sql_ready_mutex);
+    if (! session->sql_ready_armed) {
+        session->sql_ready_armed = true;
+        session->sql_ready_next = sql_ready_waiting_first;
+        sql_ready_waiting_first = session;
+    }
+    pEp_mutex_unlock(& sql_ready_mutex);
+}
+
+void pEp_sql_cancel_ready_notification(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    pEp_mutex_lock(& sql_ready_mutex);
+    if (session->sql_ready_armed) {
+        PEP_SESSION *p;
+        for (p = & sql_ready_waiting_first; * p != NULL;
+             p = & (* p)->sql_ready_next)
+            if (* p == session) {
+                * p = session->sql_ready_next;
+                break;
+            }
+        session->sql_ready_armed = false;
+        session->sql_ready_next = NULL;
+    }
+    pEp_mutex_unlock(& sql_ready_mutex);
+}
+
+void pEp_sql_notify_ready(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    /* Ending the read transaction of a call which could not take the lock
+       releases nothing; notifying would only make the waiting sessions,
+       possibly including this one, retry in vain. */
+    if (session->sql_would_block)
+        return;
+
+    /* Detach one waiting session at a time while holding the mutex, then run
+       its callback without holding it.  We copy the callback and its context
+       before disarming, since the waiting session may be released by another
+       thread as soon as it is disarmed. */
+    while (true) {
+        sql_ready_t ready = NULL;
+        void *context = NULL;
+        pEp_mutex_lock(& sql_ready_mutex);
+        PEP_SESSION waiting = sql_ready_waiting_first;
+        if (waiting != NULL) {
+            sql_ready_waiting_first = waiting->sql_ready_next;
+            ready = waiting->sql_ready;
+            context = waiting->sql_ready_context;
+            waiting->sql_ready_armed = false;
+            waiting->sql_ready_next = NULL;
+        }
+        pEp_mutex_unlock(& sql_ready_mutex);
+
+        if (waiting == NULL)
+            break;
+        ready(context);
+    }
+}
+
+/* Try to begin the outermost exclusive transaction exactly once, with the
+   same logic as PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION without the loop.  The
+   readiness notification is armed before the attempt and cancelled again on
+   success: arming it only after a failure would lose a notification sent by
+   a lock holder ending its transaction in between.  Return the SQLite
+   status. */
+static int pEp_sql_try_begin_exclusive_transaction(PEP_SESSION session)
+{
+    pEp_sql_arm_ready_notification(session);
+    sqlite3_reset(session->begin_exclusive_transaction);
+    int sqlite_status = sqlite3_step(session->begin_exclusive_transaction);
+    sqlite3_reset(session->begin_exclusive_transaction);
+    if (sqlite_status == SQLITE_BUSY || sqlite_status == SQLITE_LOCKED) {
+        LOG_TRACE("the management database is locked: PEP_WOULD_BLOCK");
+        pEp_metrics_count_would_block(session);
+    }
+    else
+        pEp_sql_cancel_ready_notification(session);
+    return sqlite_status;
+}
+
+/* Record that the outermost transaction of a non-blocking call has just
+   begun: from now on behave as if pEp_sql_begin_batch_transaction had
+   succeeded, so that each transaction within the call becomes a savepoint and
+   can still roll back on its own. */
+static void pEp_sql_enter_call_transaction(PEP_SESSION session)
+{
+    session->transaction_in_progress_no = 1;
+    session->transaction_begin_time_us = pEp_monotonic_time_us();
+    PEP_TRACE_BEGIN(session->trace_transaction_span, "sql.transaction");
+    session->transaction_rollback_only = false;
+    session->can_refresh_database_connections = false;
+    session->batch_transaction_open = true;
+}
+
+PEP_STATUS pEp_sql_begin_nonblocking_call(PEP_SESSION session,
+                                          bool *transaction_begun)
+{
+    PEP_REQUIRE(session && transaction_begun);
+    * transaction_begun = false;
+
+    /* Nothing to do in blocking mode, if we are already protected by an
+       outer transaction, or within a deferred call, which takes the lock at
+       its first transaction. */
+    if (! session->nonblocking_sql || session->transaction_in_progress_no > 0
+        || session->sql_deferred_call)
+        return PEP_STATUS_OK;
+
+    int sqlite_status = pEp_sql_try_begin_exclusive_transaction(session);
+    if (sqlite_status == SQLITE_BUSY || sqlite_status == SQLITE_LOCKED)
+        return PEP_WOULD_BLOCK;
+    else if (sqlite_status != SQLITE_DONE) {
+        LOG_ERROR("UNEXPECTED error on BEGIN EXCLUSIVE TRANSACTION: %s",
+                  pEp_sql_status_to_status_text(session, sqlite_status));
+        return PEP_UNKNOWN_DB_ERROR;
+    }
+
+    pEp_sql_enter_call_transaction(session);
+    * transaction_begun = true;
+    return PEP_STATUS_OK;
+}
+
+void pEp_sql_end_nonblocking_call(PEP_SESSION session,
+                                  bool transaction_begun)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    if (transaction_begun)
+        pEp_sql_end_batch_transaction(session, true);
+}
+
+void pEp_sql_begin_deferred_nonblocking_call(PEP_SESSION session,
+                                             bool *deferred)
+{
+    PEP_REQUIRE_ORELSE(session && deferred, { return; });
+    * deferred = false;
+
+    if (! session->nonblocking_sql || session->transaction_in_progress_no > 0
+        || session->sql_deferred_call)
+        return;
+
+    session->sql_deferred_call = true;
+    session->sql_would_block = false;
+    * deferred = true;
+}
+
+void pEp_sql_begin_deferred_call_transaction(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session && session->sql_deferred_call
+                       && session->transaction_in_progress_no == 0,
+                       { return; });
+
+    int sqlite_status = pEp_sql_try_begin_exclusive_transaction(session);
+    if (sqlite_status != SQLITE_DONE) {
+        if (sqlite_status != SQLITE_BUSY && sqlite_status != SQLITE_LOCKED)
+            LOG_ERROR("UNEXPECTED error on BEGIN EXCLUSIVE TRANSACTION: %s",
+                      pEp_sql_status_to_status_text(session, sqlite_status));
+
+        /* Go on within a read transaction, which never waits: reads still
+           work, writes fail, and the whole call is rolled back at its end. */
+        session->sql_would_block = true;
+        sqlite_status = sqlite3_exec(session->db, "BEGIN DEFERRED TRANSACTION;",
+                                     NULL, NULL, NULL);
+        if (sqlite_status != SQLITE_OK)
+            LOG_ERROR("UNEXPECTED error on BEGIN DEFERRED TRANSACTION: %s",
+                      pEp_sql_status_to_status_text(session, sqlite_status));
+        PEP_ASSERT(sqlite_status == SQLITE_OK);
+    }
+    pEp_sql_enter_call_transaction(session);
+}
+
+PEP_STATUS pEp_sql_end_deferred_nonblocking_call(PEP_SESSION session,
+                                                 bool deferred,
+                                                 PEP_STATUS status)
+{
+    PEP_REQUIRE(session);
+
+    if (! deferred)
+        return status;
+
+    session->sql_deferred_call = false;
+    bool would_block = session->sql_would_block;
+    /* A read transaction releases no lock when it ends, and
+       pEp_sql_notify_ready skips it while sql_would_block is set; but a write
+       stepped directly, bypassing pEp_sqlite3_step_nonbusy , may have taken
+       the lock after all. */
+    if (would_block
+        && sqlite3_txn_state(session->db, "main") == SQLITE_TXN_WRITE)
+        session->sql_would_block = false;
+    if (session->transaction_in_progress_no > 0)
+        pEp_sql_end_batch_transaction(session, ! would_block);
+    session->sql_would_block = false;
+
+    if (would_block) {
+        LOG_TRACE("the management database was locked: PEP_WOULD_BLOCK");
+        return PEP_WOULD_BLOCK;
+    }
+    return status;
+}
@@ -320,10 +320,22 @@ PEP_STATUS pEp_backoff_state_finalize(
            engine_sql.h . */                                                    \
         session->can_refresh_database_connections = true;                       \
         PEP_ASSERT(session->transaction_in_progress_no >= 0);                   \
+        /* Within a deferred non-blocking call the outermost transaction is     \
+           begun without waiting, and only ends with the call: what follows     \
+           is then nested in it.  See                                           \
+           pEp_sql_begin_deferred_nonblocking_call . */                         \
+        if (session->transaction_in_progress_no == 0                            \
+            && session->sql_deferred_call)                                      \
+            pEp_sql_begin_deferred_call_transaction(session);                   \
         /* Do nothing other than bumping the counter if this is a transaction   \
            nested inside another transaction already in progress. */            \
         if (session->transaction_in_progress_no > 0) {                          \
             session->transaction_in_progress_no ++;                             \
+            /* Within a batch transaction what would have been the outermost    \
+               transaction becomes a savepoint. */                              \
+            if (session->batch_transaction_open                                 \
+                && session->transaction_in_progress_no == 2)                    \
+                pEp_sql_begin_savepoint(session);                               \
             LOG_TRACE("PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION: open nested"        \
                       " transaction: there are now %i",                         \
                       (int) session->transaction_in_progress_no);               \
@@ -361,6 +373,8 @@ PEP_STATUS pEp_backoff_state_finalize(
         /* We are now in a transaction.  This will change the behaviour of      \
            pEp_sqlite3_step_nonbusy . */                                        \
         session->transaction_in_progress_no = 1;                                \
+        session->transaction_begin_time_us = pEp_monotonic_time_us();           \
+        PEP_TRACE_BEGIN(session->trace_transaction_span, "sql.transaction");    \
         LOG_TRACE("PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION (innermost, success)");  \
         /* From now on it is no longer possible to refresh the database         \
            connection. */                                                       \
@@ -381,8 +395,21 @@ PEP_STATUS pEp_backoff_state_finalize(
            transaction nested inside another transaction already in             \
            progress... */                                                       \
         if (session->transaction_in_progress_no > 1) {                          \
-            /* ...However in that case we support COMMIT but not ROLLBACK. */   \
-            if (! _pEp_bool_commit) {                                           \
+            /* ...Unless this ends a savepoint within a batch transaction,      \
+               which is released or rolled back now... */                       \
+            if (session->batch_transaction_open                                 \
+                && session->transaction_in_progress_no == 2)                    \
+                pEp_sql_end_savepoint(session, _pEp_bool_commit);               \
+            /* ...Within a batch transaction a ROLLBACK deeper than the         \
+               savepoint cannot happen immediately: we mark the savepoint so    \
+               that it will be rolled back instead of released... */            \
+            else if (! _pEp_bool_commit && session->batch_transaction_open) {   \
+                LOG_WARNING("ROLLBACK of a nested transaction: the enclosing"   \
+                            " savepoint will be rolled back");                  \
+                session->transaction_rollback_only = true;                      \
+            }                                                                   \
+            /* ...And otherwise we support COMMIT but not ROLLBACK. */          \
+            else if (! _pEp_bool_commit) {                                      \
                 LOG_CRITICAL("cannot ROLLBACK a nested transaction");           \
                 PEP_IMPOSSIBLE;                                                 \
             }                                                                   \
@@ -392,6 +419,13 @@ PEP_STATUS pEp_backoff_state_finalize(
             break;                                                              \
         }                                                                       \
         PEP_ASSERT(session->transaction_in_progress_no == 1);                   \
+        if (_pEp_bool_commit && session->transaction_rollback_only) {           \
+            LOG_WARNING("a nested transaction was rolled back: ROLLBACK"        \
+                        " instead of COMMIT");                                  \
+            _pEp_bool_commit = false;                                           \
+            _pEp_action_name = "ROLLBACK";                                      \
+        }                                                                       \
+        session->transaction_rollback_only = false;                             \
         /* Here thre is no need to loop using PEP_SQL_BEGIN_LOOP and            \
            PEP_SQL_END_LOOP: if we first began the transaction with             \
            PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION then it is *impossbile* to fail  \
@@ -426,6 +460,18 @@ PEP_STATUS pEp_backoff_state_finalize(
         sqlite3_reset(_pEp_statement);                                          \
         /* The current transaction has ended. */                                \
         session->transaction_in_progress_no = 0;                                \
+        pEp_metrics_count_transaction(session, _pEp_bool_commit,                \
+                                      (pEp_monotonic_time_us()                  \
+                                       - session->transaction_begin_time_us));  \
+        /* A rollback is not a failure of the transaction span: it is a         \
+           different outcome, which succeeded. */                               \
+        session->trace_transaction_span.rolled_back = ! _pEp_bool_commit;       \
+        PEP_TRACE_END(session->trace_transaction_span, PEP_STATUS_OK);          \
+        /* Now that the lock is released hand over any message generated        \
+           within the transaction. */                                           \
+        outbound_queue_transaction_ended(session, _pEp_bool_commit);            \
+        /* Wake up any session which failed with PEP_WOULD_BLOCK . */           \
+        pEp_sql_notify_ready(session);                                          \
     } while (false)
 
 /**
@@ -445,6 +491,74 @@ PEP_STATUS pEp_backoff_state_finalize(
     PEP_SQL_COMMIT_OR_ROLLBACK_TRANSACTION(false)
 
 
+/* Batch transactions
+ * ***************************************************************** */
+
+/* A batch transaction is an outermost exclusive transaction kept open across
+   many API calls, for example while ingesting a mailbox (see
+   config_ingestion_mode in pEpEngine.h).  Within it each transaction begun by
+   PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION which would otherwise have been the
+   outermost one runs as an SQL savepoint: rolling it back undoes its own
+   changes, and discards the messages it queued, without affecting the rest of
+   the batch.  Nothing is visible to other connections until the batch
+   transaction ends. */
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_begin_batch_transaction()       -->
+ *
+ *  @brief     Begin a batch transaction, waiting for the lock if needed.
+ *
+ *  @param[in]   session              session handle
+ *
+ *  @retval     PEP_STATUS_OK         success
+ *  @retval     PEP_ILLEGAL_VALUE     NULL session, or a transaction is already
+ *                                    in progress
+ */
+PEP_STATUS pEp_sql_begin_batch_transaction(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_end_batch_transaction()       -->
+ *
+ *  @brief     End the batch transaction in progress, committing it or rolling
+ *             it back as a whole.
+ *
+ *  @param[in]   session              session handle
+ *  @param[in]   commit               true to commit, false to roll back
+ *
+ *  @retval     PEP_STATUS_OK         success
+ *  @retval     PEP_ILLEGAL_VALUE     NULL session, or no batch transaction is
+ *                                    in progress
+ */
+PEP_STATUS pEp_sql_end_batch_transaction(PEP_SESSION session, bool commit);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_begin_savepoint()       -->
+ *
+ *  @brief     Begin the savepoint for a transaction within a batch
+ *             transaction.  Only called by PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION .
+ *
+ *  @param[in]   session              session handle
+ */
+void pEp_sql_begin_savepoint(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_end_savepoint()       -->
+ *
+ *  @brief     Release the current savepoint, or roll it back if commit is
+ *             false or a transaction nested within it was rolled back.  Only
+ *             called by PEP_SQL_COMMIT_TRANSACTION and
+ *             PEP_SQL_ROLLBACK_TRANSACTION .
+ *
+ *  @param[in]   session              session handle
+ *  @param[in]   commit               true to release, false to roll back
+ */
+void pEp_sql_end_savepoint(PEP_SESSION session, bool commit);
+
+
 /* Convenience wrapper for "automatic" one-statement transactions
  * ***************************************************************** */
 
@@ -460,7 +574,10 @@ PEP_STATUS pEp_backoff_state_finalize(
    simply be a function taking a pointer to an SQLite prepared statement;
    instead we need a pointer-to-pointer, since it is possible that a prepared
    statement stored in the session *changes* during the execution of this
-   function.  However...*/
+   function.
+   The one exception to SQLITE_BUSY is a write within a deferred non-blocking
+   call which could not take the lock, see
+   pEp_sql_begin_deferred_nonblocking_call .  However...*/
 int _pEp_sqlite3_step_nonbusy(PEP_SESSION session,
                               sqlite3_stmt **statement_p);
 /* ...This macro provides a more intuitive interface for
@@ -488,6 +605,160 @@ int pEp_sqlite3_prepare_v3_nonbusy_nonlocked(PEP_SESSION session,
                                              const char **pzTail);
 
 
+/* Non-blocking mode
+ * ***************************************************************** */
+
+/* In non-blocking mode (see config_nonblocking_sql in pEpEngine.h) some API
+   functions do not spinlock in PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION : they
+   instead open the outermost exclusive transaction themselves with a single
+   attempt, at entry, and fail with PEP_WOULD_BLOCK if the lock is held by
+   someone else.  Every transaction opened within the call is then nested, and
+   never waits.
+   Such API functions are written as:
+      bool transaction_begun;
+      PEP_STATUS status = pEp_sql_begin_nonblocking_call(session,
+                                                         & transaction_begun);
+      if (status != PEP_STATUS_OK)
+          return status;
+      status = the_actual_work(session, ...);
+      pEp_sql_end_nonblocking_call(session, transaction_begun);
+      return status;
+   When the session is not in non-blocking mode, or a transaction is already
+   in progress, the two calls do nothing.
+   The transaction begun for the call is a batch transaction, as per
+   pEp_sql_begin_batch_transaction : a transaction rolled back within the call
+   rolls back its own changes only.
+   API functions doing long work between database accesses, such as
+   decrypt_message_2 , instead use a deferred non-blocking call:
+      bool deferred;
+      pEp_sql_begin_deferred_nonblocking_call(session, & deferred);
+      status = the_actual_work(session, ...);
+      status = pEp_sql_end_deferred_nonblocking_call(session, deferred,
+                                                     status);
+   Within it statements read outside a transaction need no lock.  The first
+   transaction, or the first write, takes the lock with a single attempt and
+   keeps it until the call ends, so that the call commits or rolls back as a
+   whole; pEp_sql_begin_nonblocking_call does nothing within the call.  If the attempt fails the work
+   goes on in a read transaction where every write stepped with
+   pEp_sqlite3_step_nonbusy fails with SQLITE_BUSY ; then the whole call is
+   rolled back, and fails with PEP_WOULD_BLOCK .  Code after a write failure
+   should avoid side effects outside the database when sql_would_block is
+   set in the session, since the call will be repeated.
+   A lock held by another process never triggers the readiness notification:
+   only commits and rollbacks by sessions of this process do. */
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_begin_nonblocking_call()       -->
+ *
+ *  @brief     Try to begin the outermost exclusive transaction for an API call
+ *             in non-blocking mode, without waiting.  The session readiness
+ *             notification is armed before the attempt, and cancelled if it
+ *             succeeds; a lock held by another process never triggers it.
+ *
+ *  @param[in]   session              session handle
+ *  @param[out]  transaction_begun    set to true iff a transaction was begun,
+ *                                    to be ended by
+ *                                    pEp_sql_end_nonblocking_call
+ *
+ *  @retval     PEP_STATUS_OK         success, or nothing to do
+ *  @retval     PEP_WOULD_BLOCK       the write lock is held by someone else
+ *  @retval     PEP_UNKNOWN_DB_ERROR  unexpected SQLite error
+ *  @retval     PEP_ILLEGAL_VALUE     NULL arguments
+ */
+PEP_STATUS pEp_sql_begin_nonblocking_call(PEP_SESSION session,
+                                          bool *transaction_begun);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_end_nonblocking_call()       -->
+ *
+ *  @brief     End the transaction begun by pEp_sql_begin_nonblocking_call ,
+ *             if any.  The transaction is committed, unless a nested
+ *             transaction was rolled back in the meantime.
+ *
+ *  @param[in]   session              session handle
+ *  @param[in]   transaction_begun    as returned by
+ *                                    pEp_sql_begin_nonblocking_call
+ */
+void pEp_sql_end_nonblocking_call(PEP_SESSION session,
+                                  bool transaction_begun);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_begin_deferred_nonblocking_call()       -->
+ *
+ *  @brief     Begin a deferred non-blocking call, whose lock is only taken by
+ *             its first transaction.  Nothing is done in blocking mode, or if
+ *             a transaction or a deferred call is already in progress.
+ *
+ *  @param[in]   session              session handle
+ *  @param[out]  deferred             set to true iff a deferred call was
+ *                                    begun, to be ended by
+ *                                    pEp_sql_end_deferred_nonblocking_call
+ */
+void pEp_sql_begin_deferred_nonblocking_call(PEP_SESSION session,
+                                             bool *deferred);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_begin_deferred_call_transaction()       -->
+ *
+ *  @brief     Begin the outermost transaction of a deferred non-blocking
+ *             call, with a single attempt to take the lock; on failure begin
+ *             a read transaction instead and set sql_would_block .  Only
+ *             called by PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION .
+ *
+ *  @param[in]   session              session handle
+ */
+void pEp_sql_begin_deferred_call_transaction(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_end_deferred_nonblocking_call()       -->
+ *
+ *  @brief     End the deferred call begun by
+ *             pEp_sql_begin_deferred_nonblocking_call , if any: commit its
+ *             transaction, or roll it back if the lock could not be taken.
+ *
+ *  @param[in]   session              session handle
+ *  @param[in]   deferred             as returned by
+ *                                    pEp_sql_begin_deferred_nonblocking_call
+ *  @param[in]   status               the result of the work within the call
+ *
+ *  @retval     PEP_WOULD_BLOCK       the lock could not be taken: nothing was
+ *                                    written
+ *  @retval     status                otherwise
+ */
+PEP_STATUS pEp_sql_end_deferred_nonblocking_call(PEP_SESSION session,
+                                                 bool deferred,
+                                                 PEP_STATUS status);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_notify_ready()       -->
+ *
+ *  @brief     Call the readiness callback of every session which failed with
+ *             PEP_WOULD_BLOCK since the last notification, disarming it.
+ *             This is called by PEP_SQL_COMMIT_TRANSACTION and
+ *             PEP_SQL_ROLLBACK_TRANSACTION after releasing the lock.
+ *
+ *  @param[in]   session              the session which released the lock
+ */
+void pEp_sql_notify_ready(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_sql_cancel_ready_notification()       -->
+ *
+ *  @brief     Disarm the readiness notification for the given session, if
+ *             armed.  This must be called before the session is released.
+ *
+ *  @param[in]   session              session handle
+ */
+void pEp_sql_cancel_ready_notification(PEP_SESSION session);
+
+
 /* Debugging
  * ***************************************************************** */
 
@@ -44,6 +44,7 @@ static inline const char *pEp_status_to_string(PEP_STATUS status) {
     case PEP_INIT_CANNOT_OPEN_DB: return "PEP_INIT_CANNOT_OPEN_DB";
     case PEP_INIT_CANNOT_OPEN_SYSTEM_DB: return "PEP_INIT_CANNOT_OPEN_SYSTEM_DB";
     case PEP_INIT_DB_DOWNGRADE_VIOLATION: return "PEP_INIT_DB_DOWNGRADE_VIOLATION";
+    case PEP_WOULD_BLOCK: return "PEP_WOULD_BLOCK";
     case PEP_UNKNOWN_DB_ERROR: return "PEP_UNKNOWN_DB_ERROR";
     case PEP_KEY_NOT_FOUND: return "PEP_KEY_NOT_FOUND";
     case PEP_KEY_HAS_AMBIG_NAME: return "PEP_KEY_HAS_AMBIG_NAME";
@@ -1,4 +1,4 @@
-/** 
+/**
  * @file transport.c
  * @brief File description for doxygen missing. FIXME
  * @license This file is under GNU General Public License 3.0 - see LICENSE.txt
@@ -10,7 +10,371 @@
 #include <memory.h>
 
 PEP_transport_t transports[PEP_trans__count];
-    
+
+
+/* Outbound message queue
+ * ***************************************************************** */
+
+/* One message waiting to be handed to the application, either in the
+   process-wide queue or staged in a session until the current transaction
+   ends. */
+struct _outbound_queue_entry {
+    message *msg;
+    messageToSend_t messageToSend;
+    uint64_t enqueued_at_us;
+    struct _outbound_queue_entry *next;
+};
+typedef struct _outbound_queue_entry outbound_queue_entry;
+
+/* The process-wide queue.  Every field except mutex is protected by mutex;
+   mutex itself is initialised by the first session and finalised by the last
+   one, like the other global state handled in init_transport_system and
+   release_transport_system . */
+static struct {
+    pEp_mutex_t mutex;
+    pEp_cond_t not_empty;   /* signalled when a message is enqueued, or at
+                               shutdown */
+    pEp_cond_t not_full;    /* signalled when the dispatcher takes messages */
+    pEp_cond_t idle;        /* signalled when a batch has been delivered */
+
+    bool running;
+    bool stopping;
+    pEp_thread_t dispatcher;
+
+    outbound_queue_entry *first;
+    outbound_queue_entry *last;
+
+    PEP_outbound_queue_stats stats;
+} outbound_queue;
+
+static void free_outbound_queue_entries(outbound_queue_entry *entry)
+{
+    while (entry != NULL) {
+        outbound_queue_entry *next = entry->next;
+        free_message(entry->msg);
+        free(entry);
+        entry = next;
+    }
+}
+
+/* Update the statistics after delivering one message.  The queue mutex must be
+   held. */
+static void outbound_queue_record_delivery(uint64_t enqueued_at_us,
+                                           PEP_STATUS status)
+{
+    uint64_t latency = pEp_monotonic_time_us() - enqueued_at_us;
+    outbound_queue.stats.last_latency_us = latency;
+    outbound_queue.stats.total_latency_us += latency;
+    if (latency > outbound_queue.stats.max_latency_us)
+        outbound_queue.stats.max_latency_us = latency;
+    if (status == PEP_STATUS_OK)
+        outbound_queue.stats.delivered ++;
+    else {
+        outbound_queue.stats.failed ++;
+        outbound_queue.stats.last_failure_status = status;
+    }
+}
+
+/* Hand one entry to the application, consuming it.  The queue mutex must *not*
+   be held. */
+static PEP_STATUS outbound_queue_deliver(outbound_queue_entry *entry)
+{
+    PEP_STATUS status = entry->messageToSend(entry->msg);
+
+    /* On success ownership of the message passed to the callee. */
+    if (status != PEP_STATUS_OK)
+        free_message(entry->msg);
+    return status;
+}
+
+/* The dispatcher thread body.  Take up to batch_size messages at a time out of
+   the queue, so that producers blocked on a full queue can proceed at once,
+   then call messageToSend on each of them without holding the lock. */
+static void *outbound_queue_dispatcher(void *unused)
+{
+    pEp_mutex_lock(& outbound_queue.mutex);
+    while (true) {
+        while (outbound_queue.first == NULL && ! outbound_queue.stopping)
+            pEp_cond_wait(& outbound_queue.not_empty, & outbound_queue.mutex);
+        /* When stopping we still drain the queue before exiting. */
+        if (outbound_queue.first == NULL)
+            break;
+
+        outbound_queue_entry *batch = outbound_queue.first;
+        outbound_queue_entry *batch_last = batch;
+        size_t batch_length = 1;
+        while (batch_last->next != NULL
+               && batch_length < outbound_queue.stats.batch_size) {
+            batch_last = batch_last->next;
+            batch_length ++;
+        }
+        outbound_queue.first = batch_last->next;
+        if (outbound_queue.first == NULL)
+            outbound_queue.last = NULL;
+        batch_last->next = NULL;
+        outbound_queue.stats.depth -= batch_length;
+        outbound_queue.stats.in_flight = batch_length;
+        outbound_queue.stats.batches ++;
+        pEp_cond_broadcast(& outbound_queue.not_full);
+        pEp_mutex_unlock(& outbound_queue.mutex);
+
+        while (batch != NULL) {
+            outbound_queue_entry *next = batch->next;
+            uint64_t enqueued_at_us = batch->enqueued_at_us;
+            PEP_STATUS status = outbound_queue_deliver(batch);
+            free(batch);
+
+            pEp_mutex_lock(& outbound_queue.mutex);
+            outbound_queue_record_delivery(enqueued_at_us, status);
+            outbound_queue.stats.in_flight --;
+            pEp_mutex_unlock(& outbound_queue.mutex);
+            batch = next;
+        }
+
+        pEp_mutex_lock(& outbound_queue.mutex);
+        pEp_cond_broadcast(& outbound_queue.idle);
+    }
+    outbound_queue.running = false;
+    pEp_cond_broadcast(& outbound_queue.idle);
+    pEp_mutex_unlock(& outbound_queue.mutex);
+    return NULL;
+}
+
+/* Move the given list of entries into the process-wide queue, waiting for
+   space as needed.  If the queue stays full for longer than
+   PEP_OUTBOUND_QUEUE_BACKPRESSURE_TIMEOUT_IN_MS deliver the message in the
+   current thread instead: this keeps the memory bounded and guarantees
+   progress even if messageToSend itself generates messages. */
+static void outbound_queue_push(outbound_queue_entry *entries)
+{
+    while (entries != NULL) {
+        outbound_queue_entry *entry = entries;
+        entries = entries->next;
+        entry->next = NULL;
+
+        pEp_mutex_lock(& outbound_queue.mutex);
+        bool timed_out = false;
+        while (outbound_queue.running
+               && outbound_queue.stats.depth >= outbound_queue.stats.capacity
+               && ! timed_out)
+            timed_out = pEp_cond_timedwait_ms(
+                           & outbound_queue.not_full, & outbound_queue.mutex,
+                           PEP_OUTBOUND_QUEUE_BACKPRESSURE_TIMEOUT_IN_MS);
+        if (outbound_queue.running
+            && outbound_queue.stats.depth < outbound_queue.stats.capacity) {
+            if (outbound_queue.last == NULL)
+                outbound_queue.first = entry;
+            else
+                outbound_queue.last->next = entry;
+            outbound_queue.last = entry;
+            outbound_queue.stats.depth ++;
+            outbound_queue.stats.enqueued ++;
+            pEp_cond_signal(& outbound_queue.not_empty);
+            pEp_mutex_unlock(& outbound_queue.mutex);
+            continue;
+        }
+
+        /* Either the queue is still full, or the dispatcher is gone. */
+        outbound_queue.stats.delivered_synchronously ++;
+        pEp_mutex_unlock(& outbound_queue.mutex);
+        uint64_t enqueued_at_us = entry->enqueued_at_us;
+        PEP_STATUS status = outbound_queue_deliver(entry);
+        free(entry);
+        pEp_mutex_lock(& outbound_queue.mutex);
+        outbound_queue_record_delivery(enqueued_at_us, status);
+        pEp_mutex_unlock(& outbound_queue.mutex);
+    }
+}
+
+PEP_STATUS queue_message_to_send(PEP_SESSION session, message *msg)
+{
+    PEP_REQUIRE(session && msg);
+    if (session->messageToSend == NULL)
+        return PEP_SEND_FUNCTION_NOT_REGISTERED;
+
+    /* The default: deliver synchronously. */
+    if (! session->use_outbound_queue) {
+        PEP_TRACE_SPAN(span);
+        PEP_TRACE_BEGIN(span, "callback.messageToSend");
+        PEP_TRACE_ATTRIBUTES(span, pEp_trace_message_size(msg),
+                             pEp_trace_recipient_count(msg));
+        PEP_STATUS status = session->messageToSend(msg);
+        PEP_TRACE_END(span, status);
+        return status;
+    }
+
+    outbound_queue_entry *entry = calloc(1, sizeof(outbound_queue_entry));
+    if (entry == NULL)
+        return PEP_OUT_OF_MEMORY;
+    entry->msg = msg;
+    entry->messageToSend = session->messageToSend;
+    entry->enqueued_at_us = pEp_monotonic_time_us();
+
+    /* Within a transaction only stage the message: it will be pushed by
+       outbound_queue_transaction_ended . */
+    if (session->transaction_in_progress_no > 0) {
+        if (session->staged_outbound_last == NULL)
+            session->staged_outbound_first = entry;
+        else
+            session->staged_outbound_last->next = entry;
+        session->staged_outbound_last = entry;
+        LOG_TRACE("staged an outbound message until the transaction ends");
+        return PEP_STATUS_OK;
+    }
+
+    outbound_queue_push(entry);
+    return PEP_STATUS_OK;
+}
+
+/* Free the given staged entries, generated within a transaction or savepoint
+   which was rolled back, counting them as discarded. */
+static void discard_staged_entries(PEP_SESSION session,
+                                   outbound_queue_entry *staged)
+{
+    size_t discarded_no = 0;
+    outbound_queue_entry *entry;
+    for (entry = staged; entry != NULL; entry = entry->next)
+        discarded_no ++;
+    LOG_WARNING("transaction rolled back: discarding %i outbound messages",
+                (int) discarded_no);
+    free_outbound_queue_entries(staged);
+    pEp_mutex_lock(& outbound_queue.mutex);
+    outbound_queue.stats.discarded += discarded_no;
+    pEp_mutex_unlock(& outbound_queue.mutex);
+}
+
+void outbound_queue_transaction_ended(PEP_SESSION session, bool committed)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    outbound_queue_entry *staged = session->staged_outbound_first;
+    session->staged_outbound_savepoint_mark = NULL;
+    if (staged == NULL)
+        return;
+    session->staged_outbound_first = NULL;
+    session->staged_outbound_last = NULL;
+
+    if (committed)
+        outbound_queue_push(staged);
+    else
+        discard_staged_entries(session, staged);
+}
+
+void outbound_queue_savepoint_begun(PEP_SESSION session)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    session->staged_outbound_savepoint_mark = session->staged_outbound_last;
+}
+
+void outbound_queue_savepoint_ended(PEP_SESSION session, bool committed)
+{
+    PEP_REQUIRE_ORELSE(session, { return; });
+
+    /* On commit keep everything staged until the whole transaction ends. */
+    outbound_queue_entry *mark = session->staged_outbound_savepoint_mark;
+    session->staged_outbound_savepoint_mark = NULL;
+    if (committed)
+        return;
+
+    /* Discard what was staged after the savepoint began. */
+    outbound_queue_entry *staged;
+    if (mark == NULL) {
+        staged = session->staged_outbound_first;
+        session->staged_outbound_first = NULL;
+        session->staged_outbound_last = NULL;
+    }
+    else {
+        staged = mark->next;
+        mark->next = NULL;
+        session->staged_outbound_last = mark;
+    }
+    if (staged != NULL)
+        discard_staged_entries(session, staged);
+}
+
+DYNAMIC_API PEP_STATUS config_outbound_queue(PEP_SESSION session, bool enable,
+                                             size_t capacity,
+                                             size_t batch_size)
+{
+    PEP_REQUIRE(session);
+
+    if (! enable) {
+        session->use_outbound_queue = false;
+        return PEP_STATUS_OK;
+    }
+    if (session->messageToSend == NULL)
+        return PEP_SEND_FUNCTION_NOT_REGISTERED;
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    pEp_mutex_lock(& outbound_queue.mutex);
+    outbound_queue.stats.capacity
+        = (capacity > 0 ? capacity : PEP_OUTBOUND_QUEUE_DEFAULT_CAPACITY);
+    outbound_queue.stats.batch_size
+        = (batch_size > 0 ? batch_size : PEP_OUTBOUND_QUEUE_DEFAULT_BATCH_SIZE);
+    if (! outbound_queue.running) {
+        outbound_queue.stopping = false;
+        if (pEp_thread_create(& outbound_queue.dispatcher,
+                              outbound_queue_dispatcher, NULL) == 0)
+            outbound_queue.running = true;
+        else
+            status = PEP_TRANSPORT_CANNOT_INIT_SEND;
+    }
+    pEp_mutex_unlock(& outbound_queue.mutex);
+
+    if (status == PEP_STATUS_OK) {
+        LOG_EVENT("outbound queue enabled: capacity %i, batch size %i",
+                  (int) outbound_queue.stats.capacity,
+                  (int) outbound_queue.stats.batch_size);
+        session->use_outbound_queue = true;
+    }
+    else
+        LOG_ERROR("cannot start the outbound queue dispatcher");
+    return status;
+}
+
+DYNAMIC_API PEP_STATUS flush_outbound_queue(PEP_SESSION session)
+{
+    PEP_REQUIRE(session);
+
+    pEp_mutex_lock(& outbound_queue.mutex);
+    while (outbound_queue.running
+           && (outbound_queue.first != NULL
+               || outbound_queue.stats.in_flight > 0))
+        pEp_cond_wait(& outbound_queue.idle, & outbound_queue.mutex);
+    pEp_mutex_unlock(& outbound_queue.mutex);
+    return PEP_STATUS_OK;
+}
+
+DYNAMIC_API PEP_STATUS get_outbound_queue_stats(PEP_SESSION session,
+                                                PEP_outbound_queue_stats *stats)
+{
+    PEP_REQUIRE(session && stats);
+
+    pEp_mutex_lock(& outbound_queue.mutex);
+    * stats = outbound_queue.stats;
+    stats->running = outbound_queue.running;
+    pEp_mutex_unlock(& outbound_queue.mutex);
+    return PEP_STATUS_OK;
+}
+
+/* Stop the dispatcher after it has drained the queue, and wait for it. */
+static void outbound_queue_stop(void)
+{
+    pEp_mutex_lock(& outbound_queue.mutex);
+    bool was_running = outbound_queue.running;
+    outbound_queue.stopping = true;
+    pEp_cond_broadcast(& outbound_queue.not_empty);
+    pEp_mutex_unlock(& outbound_queue.mutex);
+
+    if (was_running)
+        pEp_thread_join(outbound_queue.dispatcher);
+}
+
+
+/* Initialisation and finalisation
+ * ***************************************************************** */
+
 PEP_STATUS init_transport_system(PEP_SESSION session, bool in_first)
 {
     PEP_REQUIRE(session);
@@ -31,6 +395,15 @@ PEP_STATUS init_transport_system(PEP_SESSION session, bool in_first)
         transports[PEP_trans_auto].recvnext = auto_recvnext;
 
         transports[PEP_trans_auto].notify = auto_notify;
+
+        memset(& outbound_queue, 0, sizeof(outbound_queue));
+        if (pEp_mutex_init(& outbound_queue.mutex) != 0
+            || pEp_cond_init(& outbound_queue.not_empty) != 0
+            || pEp_cond_init(& outbound_queue.not_full) != 0
+            || pEp_cond_init(& outbound_queue.idle) != 0)
+            return PEP_TRANSPORT_CANNOT_INIT;
+        outbound_queue.stats.capacity = PEP_OUTBOUND_QUEUE_DEFAULT_CAPACITY;
+        outbound_queue.stats.batch_size = PEP_OUTBOUND_QUEUE_DEFAULT_BATCH_SIZE;
     }
 
     return PEP_STATUS_OK;
@@ -39,6 +412,18 @@ PEP_STATUS init_transport_system(PEP_SESSION session, bool in_first)
 void release_transport_system(PEP_SESSION session, bool out_last)
 {
     PEP_REQUIRE_ORELSE(session, { return; });
-    // nothing yet
-}
 
+    /* Messages staged in a transaction which was never closed cannot be
+       sent. */
+    free_outbound_queue_entries(session->staged_outbound_first);
+    session->staged_outbound_first = NULL;
+    session->staged_outbound_last = NULL;
+
+    if (out_last) {
+        outbound_queue_stop();
+        pEp_cond_destroy(& outbound_queue.idle);
+        pEp_cond_destroy(& outbound_queue.not_full);
+        pEp_cond_destroy(& outbound_queue.not_empty);
+        pEp_mutex_destroy(& outbound_queue.mutex);
+    }
+}
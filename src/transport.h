@@ -130,6 +130,126 @@ extern PEP_transport_t transports[PEP_trans__count];
 
 typedef uint64_t transports_mask;
 
+
+/* Outbound message queue
+ * ***************************************************************** */
+
+/* By default the Engine hands every message it generates on its own (Sync,
+   Distribution.Echo, group management, key reset) to the application by
+   calling messageToSend synchronously, possibly while holding the management
+   database lock.  When the outbound queue is enabled for a session the Engine
+   instead enqueues such messages, and a dispatcher thread owned by the Engine
+   calls messageToSend on them.  Messages generated within a database
+   transaction are only enqueued after the transaction commits, and discarded
+   if it is rolled back.
+   There is one queue and one dispatcher thread per process, shared by all the
+   sessions which enabled the queue; each message remembers the messageToSend
+   callback of the session which generated it. */
+
+/// default maximum number of messages waiting in the outbound queue
+#define PEP_OUTBOUND_QUEUE_DEFAULT_CAPACITY    1024
+
+/// default maximum number of messages the dispatcher takes out of the queue at
+/// once, before calling messageToSend on each of them
+#define PEP_OUTBOUND_QUEUE_DEFAULT_BATCH_SIZE  32
+
+/// how long a producer waits for space when the outbound queue is full, before
+/// delivering its message synchronously instead
+#define PEP_OUTBOUND_QUEUE_BACKPRESSURE_TIMEOUT_IN_MS  1000
+
+/**
+ *  @struct    PEP_outbound_queue_stats
+ *
+ *  @brief     A snapshot of the outbound queue state and counters.  Counters
+ *             are cumulative since the dispatcher thread was started;
+ *             latencies are measured from the time a message is enqueued to
+ *             the time messageToSend returns on it.
+ */
+typedef struct _PEP_outbound_queue_stats {
+    bool running;                       ///< true iff the dispatcher is running
+    size_t depth;                       ///< messages currently waiting
+    size_t in_flight;                   ///< messages taken by the dispatcher
+                                        ///< and not yet delivered
+    size_t capacity;                    ///< maximum number of waiting messages
+    size_t batch_size;                  ///< maximum dispatcher batch size
+
+    uint64_t enqueued;                  ///< messages accepted by the queue
+    uint64_t delivered;                 ///< messages messageToSend accepted
+    uint64_t failed;                    ///< messages messageToSend rejected
+    uint64_t delivered_synchronously;   ///< messages the producer delivered
+                                        ///< itself after the queue remained
+                                        ///< full for too long
+    uint64_t discarded;                 ///< messages dropped because their
+                                        ///< transaction was rolled back
+    uint64_t batches;                   ///< dispatcher batches processed
+    PEP_STATUS last_failure_status;     ///< latest messageToSend failure status
+
+    uint64_t last_latency_us;           ///< latency of the latest delivery
+    uint64_t max_latency_us;            ///< maximum delivery latency
+    uint64_t total_latency_us;          ///< sum of all delivery latencies, to be
+                                        ///< divided by delivered + failed
+} PEP_outbound_queue_stats;
+
+/**
+ *  <!--       config_outbound_queue()       -->
+ *
+ *  @brief Enable or disable the outbound message queue for the given session.
+ *         The dispatcher thread is started when the queue is first enabled by
+ *         any session, and stopped when the last session is released.
+ *
+ *  @param[in]   session      session handle
+ *  @param[in]   enable       true to enqueue the messages this session
+ *                            generates, false to call messageToSend
+ *                            synchronously as by default
+ *  @param[in]   capacity     maximum number of waiting messages, or 0 for
+ *                            PEP_OUTBOUND_QUEUE_DEFAULT_CAPACITY.  This and
+ *                            batch_size are process-wide: the latest
+ *                            configuration wins
+ *  @param[in]   batch_size   maximum dispatcher batch size, or 0 for
+ *                            PEP_OUTBOUND_QUEUE_DEFAULT_BATCH_SIZE
+ *
+ *  @retval PEP_STATUS_OK                      success
+ *  @retval PEP_ILLEGAL_VALUE                  NULL session
+ *  @retval PEP_SEND_FUNCTION_NOT_REGISTERED   the session has no messageToSend
+ *  @retval PEP_TRANSPORT_CANNOT_INIT_SEND     the dispatcher could not start
+ *
+ */
+DYNAMIC_API PEP_STATUS config_outbound_queue(PEP_SESSION session, bool enable,
+                                             size_t capacity,
+                                             size_t batch_size);
+
+/**
+ *  <!--       flush_outbound_queue()       -->
+ *
+ *  @brief Wait until every message enqueued so far has been handed to
+ *         messageToSend.  This must not be called from within messageToSend.
+ *
+ *  @param[in]   session      session handle
+ *
+ *  @retval PEP_STATUS_OK          success, including when the queue is not
+ *                                 running
+ *  @retval PEP_ILLEGAL_VALUE      NULL session
+ *
+ */
+DYNAMIC_API PEP_STATUS flush_outbound_queue(PEP_SESSION session);
+
+/**
+ *  <!--       get_outbound_queue_stats()       -->
+ *
+ *  @brief Fill the pointed struct with a consistent snapshot of the outbound
+ *         queue depth and counters.  This is cheap and never blocks for long.
+ *
+ *  @param[in]   session      session handle
+ *  @param[out]  stats        the struct to fill; ownership remains with the
+ *                            caller
+ *
+ *  @retval PEP_STATUS_OK          success
+ *  @retval PEP_ILLEGAL_VALUE      NULL arguments
+ *
+ */
+DYNAMIC_API PEP_STATUS get_outbound_queue_stats(PEP_SESSION session,
+                                                PEP_outbound_queue_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,310 @@
+/**
+ * @file    wal_checkpoint.c
+ * @brief   WAL checkpointer: implementation
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#define _EXPORT_PEP_ENGINE_DLL
+#include "wal_checkpoint.h"
+
+#include "pEp_internal.h"
+#include "engine_sql.h"
+#include "pEp_metrics.h"
+
+
+/* Data structures
+ * ***************************************************************** */
+
+/* The process-wide checkpointer state.  Every field is protected by mutex;
+   wake is initialised when the thread starts and finalised after it stops,
+   and db is only used by the thread. */
+static struct {
+    pEp_mutex_t mutex;
+    pEp_cond_t wake;        /* signalled when a commit makes the log exceed
+                               the size threshold, on reconfiguration and at
+                               shutdown */
+
+    bool running;
+    bool stopping;
+    pEp_thread_t thread;
+    sqlite3 *db;
+
+    size_t size_threshold;
+    unsigned int interval_in_ms;
+
+    /* The database page size, read when attaching the first connection. */
+    int page_size;
+
+    /* The log length in pages as of the latest commit or complete
+       checkpoint, and the time of the latest commit and checkpoint. */
+    int wal_pages;
+    uint64_t last_commit_us;
+    uint64_t last_checkpoint_us;
+} checkpointer = { PEP_MUTEX_INITIALIZER };
+
+/* Held by whoever starts or stops the thread, so that configuration calls and
+   the release of the last session do not overlap. */
+static pEp_mutex_t checkpointer_control_mutex = PEP_MUTEX_INITIALIZER;
+
+/* Return the size of a log of the given length: a header, then one frame per
+   page.  The mutex must be held. */
+static uint64_t wal_size_in_bytes(int pages)
+{
+    if (pages <= 0)
+        return 0;
+    return 32 + (uint64_t) pages * (uint64_t) (checkpointer.page_size + 24);
+}
+
+
+/* Commits
+ * ***************************************************************** */
+
+/* The sqlite3_wal_hook callback, run after every commit on a session
+   connection with the length of the log in pages.  Installing it disables the
+   SQLite automatic checkpoint on the connection, which we replace. */
+static int wal_hook(void *unused, sqlite3 *db, const char *db_name, int pages)
+{
+    pEp_mutex_lock(& checkpointer.mutex);
+    checkpointer.wal_pages = pages;
+    checkpointer.last_commit_us = pEp_monotonic_time_us();
+    uint64_t size = wal_size_in_bytes(pages);
+    bool running = checkpointer.running;
+    if (running && size >= checkpointer.size_threshold)
+        pEp_cond_signal(& checkpointer.wake);
+    pEp_mutex_unlock(& checkpointer.mutex);
+    pEp_metrics_set_wal_size(size);
+
+    if (! running && pages >= PEP_WAL_AUTOCHECKPOINT_PAGES)
+        sqlite3_wal_checkpoint_v2(db, db_name, SQLITE_CHECKPOINT_PASSIVE,
+                                  NULL, NULL);
+    return SQLITE_OK;
+}
+
+PEP_STATUS pEp_wal_checkpoint_attach(PEP_SESSION session)
+{
+    PEP_REQUIRE(session && session->db);
+
+    pEp_mutex_lock(& checkpointer.mutex);
+    bool page_size_known = (checkpointer.page_size > 0);
+    pEp_mutex_unlock(& checkpointer.mutex);
+    if (! page_size_known) {
+        sqlite3_stmt *statement = NULL;
+        int result = sqlite3_prepare_v2(session->db, "PRAGMA page_size;", -1,
+                                        & statement, NULL);
+        if (result == SQLITE_OK) {
+            PEP_SQL_BEGIN_LOOP(result);
+                result = sqlite3_step(statement);
+            PEP_SQL_END_LOOP();
+        }
+        if (result != SQLITE_ROW) {
+            LOG_ERROR("cannot read the page size: %s",
+                      pEp_sql_status_to_status_text(session, result));
+            sqlite3_finalize(statement);
+            return PEP_UNKNOWN_DB_ERROR;
+        }
+        int page_size = sqlite3_column_int(statement, 0);
+        sqlite3_finalize(statement);
+
+        pEp_mutex_lock(& checkpointer.mutex);
+        checkpointer.page_size = page_size;
+        pEp_mutex_unlock(& checkpointer.mutex);
+    }
+
+    sqlite3_wal_hook(session->db, wal_hook, NULL);
+    return PEP_STATUS_OK;
+}
+
+
+/* Checkpointer thread
+ * ***************************************************************** */
+
+/* The checkpointer thread body.  Decide what to do from the log state
+   reported by commits, run the checkpoint without holding the mutex, and
+   then wait for the next commit over the threshold or for the next
+   deadline. */
+static void *wal_checkpointer_body(void *unused)
+{
+    unsigned long backoff_in_ms = 0;
+    uint64_t not_before_us = 0;
+
+    pEp_mutex_lock(& checkpointer.mutex);
+    while (! checkpointer.stopping) {
+        uint64_t now_us = pEp_monotonic_time_us();
+        uint64_t interval_us = checkpointer.interval_in_ms * (uint64_t) 1000;
+        uint64_t size = wal_size_in_bytes(checkpointer.wal_pages);
+        bool size_due = (size >= checkpointer.size_threshold);
+        bool time_due = (checkpointer.wal_pages > 0
+                         && (now_us - checkpointer.last_checkpoint_us
+                             >= interval_us));
+        bool restart_due
+            = (size >= (checkpointer.size_threshold
+                        * (uint64_t) PEP_WAL_CHECKPOINT_RESTART_FACTOR));
+        bool writers_active
+            = (now_us - checkpointer.last_commit_us
+               < PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS * (uint64_t) 1000);
+
+        unsigned long wait_ms = checkpointer.interval_in_ms;
+        if (now_us < not_before_us)
+            /* Backing off after a busy or incomplete checkpoint. */
+            wait_ms = (unsigned long) ((not_before_us - now_us) / 1000) + 1;
+        else if (! size_due && ! time_due) {
+            if (checkpointer.wal_pages > 0)
+                wait_ms = (unsigned long)
+                          ((checkpointer.last_checkpoint_us + interval_us
+                            - now_us) / 1000) + 1;
+        }
+        else if (writers_active && ! restart_due) {
+            pEp_metrics_count_wal_checkpoint_deferred();
+            wait_ms = PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS;
+        }
+        else {
+            /* Only restart when nobody is writing: a RESTART checkpoint waits
+               for writers, and with no busy handler on our connection it
+               fails at once in that case. */
+            int mode = ((restart_due && ! writers_active)
+                        ? SQLITE_CHECKPOINT_RESTART
+                        : SQLITE_CHECKPOINT_PASSIVE);
+            sqlite3 *db = checkpointer.db;
+            pEp_mutex_unlock(& checkpointer.mutex);
+
+            int log_pages = -1;
+            int checkpointed_pages = -1;
+            int result = sqlite3_wal_checkpoint_v2(db, NULL, mode,
+                                                   & log_pages,
+                                                   & checkpointed_pages);
+            uint64_t end_us = pEp_monotonic_time_us();
+            bool complete = (result == SQLITE_OK
+                             && checkpointed_pages == log_pages);
+            pEp_metrics_count_wal_checkpoint(
+               complete,
+               (checkpointed_pages > 0) ? (uint64_t) checkpointed_pages : 0,
+               end_us - now_us);
+
+            pEp_mutex_lock(& checkpointer.mutex);
+            checkpointer.last_checkpoint_us = end_us;
+            if (complete) {
+                backoff_in_ms = 0;
+                /* Nothing is left to copy, unless a commit came meanwhile:
+                   the next writer starts the log over. */
+                if (checkpointer.last_commit_us <= now_us) {
+                    checkpointer.wal_pages = 0;
+                    pEp_metrics_set_wal_size(0);
+                }
+            }
+            else {
+                if (backoff_in_ms == 0)
+                    backoff_in_ms = PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS;
+                else if (backoff_in_ms * 2 <= checkpointer.interval_in_ms)
+                    backoff_in_ms *= 2;
+                not_before_us = end_us + backoff_in_ms * (uint64_t) 1000;
+            }
+            /* Decide again, without waiting. */
+            continue;
+        }
+
+        pEp_cond_timedwait_ms(& checkpointer.wake, & checkpointer.mutex,
+                              wait_ms);
+    }
+    checkpointer.running = false;
+    pEp_mutex_unlock(& checkpointer.mutex);
+    return NULL;
+}
+
+/* Open the checkpointer connection and start the thread.  Both mutexes must
+   be held, and the thread must not be running. */
+static PEP_STATUS wal_checkpointer_start(PEP_SESSION session)
+{
+    sqlite3 *db = NULL;
+    int result = sqlite3_open_v2(LOCAL_DB, & db,
+                                 SQLITE_OPEN_READWRITE
+                                 | SQLITE_OPEN_NOMUTEX
+                                 | SQLITE_OPEN_PRIVATECACHE,
+                                 NULL);
+    if (result != SQLITE_OK) {
+        LOG_ERROR("cannot open the checkpointer connection: %s",
+                  pEp_sql_status_to_status_text(session, result));
+        sqlite3_close_v2(db);
+        return PEP_INIT_CANNOT_OPEN_DB;
+    }
+    /* Never wait within SQLite: busy checkpoints are retried later. */
+    sqlite3_busy_timeout(db, 0);
+
+    if (pEp_cond_init(& checkpointer.wake) != 0) {
+        sqlite3_close_v2(db);
+        return PEP_UNKNOWN_ERROR;
+    }
+    checkpointer.db = db;
+    checkpointer.stopping = false;
+    checkpointer.last_checkpoint_us = pEp_monotonic_time_us();
+    if (pEp_thread_create(& checkpointer.thread, wal_checkpointer_body,
+                          NULL) != 0) {
+        LOG_ERROR("cannot start the checkpointer thread");
+        pEp_cond_destroy(& checkpointer.wake);
+        sqlite3_close_v2(db);
+        checkpointer.db = NULL;
+        return PEP_UNKNOWN_ERROR;
+    }
+    checkpointer.running = true;
+    return PEP_STATUS_OK;
+}
+
+void pEp_wal_checkpointer_stop(void)
+{
+    pEp_mutex_lock(& checkpointer_control_mutex);
+    pEp_mutex_lock(& checkpointer.mutex);
+    bool was_running = checkpointer.running;
+    checkpointer.stopping = true;
+    if (was_running)
+        pEp_cond_signal(& checkpointer.wake);
+    pEp_mutex_unlock(& checkpointer.mutex);
+
+    if (was_running) {
+        pEp_thread_join(checkpointer.thread);
+        pEp_cond_destroy(& checkpointer.wake);
+        sqlite3_close_v2(checkpointer.db);
+        checkpointer.db = NULL;
+    }
+    pEp_mutex_unlock(& checkpointer_control_mutex);
+}
+
+
+/* API
+ * ***************************************************************** */
+
+DYNAMIC_API PEP_STATUS config_wal_checkpointer(PEP_SESSION session,
+                                               bool enable,
+                                               size_t size_threshold,
+                                               unsigned int interval_in_ms)
+{
+    PEP_REQUIRE(session);
+
+    if (! enable) {
+        pEp_wal_checkpointer_stop();
+        LOG_EVENT("WAL checkpointer disabled");
+        return PEP_STATUS_OK;
+    }
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    pEp_mutex_lock(& checkpointer_control_mutex);
+    pEp_mutex_lock(& checkpointer.mutex);
+    checkpointer.size_threshold
+        = ((size_threshold > 0)
+           ? size_threshold : PEP_WAL_CHECKPOINT_DEFAULT_SIZE_THRESHOLD);
+    checkpointer.interval_in_ms
+        = ((interval_in_ms > 0)
+           ? interval_in_ms : PEP_WAL_CHECKPOINT_DEFAULT_INTERVAL_IN_MS);
+    if (checkpointer.running)
+        pEp_cond_signal(& checkpointer.wake);
+    else
+        status = wal_checkpointer_start(session);
+    size_threshold = checkpointer.size_threshold;
+    interval_in_ms = checkpointer.interval_in_ms;
+    pEp_mutex_unlock(& checkpointer.mutex);
+    pEp_mutex_unlock(& checkpointer_control_mutex);
+
+    if (status == PEP_STATUS_OK)
+        LOG_EVENT("WAL checkpointer enabled: size threshold %li bytes,"
+                  " interval %li ms",
+                  (long) size_threshold, (long) interval_in_ms);
+    return status;
+}
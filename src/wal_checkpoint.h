@@ -0,0 +1,137 @@
+/**
+ * @file    wal_checkpoint.h
+ * @brief   WAL checkpointer: a background thread moving the content of the
+ *          management database write-ahead log into the database file
+ * @license GNU General Public License 3.0 - see LICENSE.txt
+ */
+
+#ifndef WAL_CHECKPOINT_H
+#define WAL_CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pEpEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* Introduction
+ * ***************************************************************** */
+
+/* The management database is in WAL mode: every commit appends pages to the
+   write-ahead log, which a checkpoint copies back into the database file.  By
+   default SQLite checkpoints at the commit making the log longer than 1000
+   pages, in the thread of whatever session happens to commit; under heavy
+   writes the log grows faster than such checkpoints can catch up, reads have
+   to search a longer log, and the cost of checkpointing lands on unlucky
+   foreground writers.
+
+   When enabled, the WAL checkpointer is one thread per process, with its own
+   database connection, which takes over checkpointing for every session:
+
+   - when the log exceeds a size threshold, or when it is not empty and no
+     checkpoint ran for a time interval, the checkpointer runs a PASSIVE
+     checkpoint, which never waits for readers or writers;
+
+   - when the log exceeds PEP_WAL_CHECKPOINT_RESTART_FACTOR times the size
+     threshold it runs a RESTART checkpoint, which also lets the next writer
+     start over at the beginning of the log;
+
+   - while writers are active, meaning that some session committed in the
+     last PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS milliseconds, checkpoints are
+     deferred, and a RESTART checkpoint becomes PASSIVE; a checkpoint which
+     is busy or cannot complete is retried after an exponential backoff.
+
+   The checkpointer is disabled by default, and then the Engine checkpoints
+   like SQLite does by default.  The size of the log and the number and
+   duration of checkpoints are available as metrics, see pEp_metrics.h . */
+
+/// default log size in bytes over which the checkpointer runs a checkpoint;
+/// this is about the default threshold of SQLite, 1000 pages of 4 KiB
+#define PEP_WAL_CHECKPOINT_DEFAULT_SIZE_THRESHOLD  (4 * 1024 * 1024)
+
+/// default longest time in milliseconds between checkpoints of a non-empty log
+#define PEP_WAL_CHECKPOINT_DEFAULT_INTERVAL_IN_MS  10000
+
+/// how many times the size threshold the log must be for a RESTART checkpoint
+#define PEP_WAL_CHECKPOINT_RESTART_FACTOR          4
+
+/// how long in milliseconds since the latest commit before writers are
+/// considered inactive
+#define PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS        100
+
+/// the log length in pages over which a commit checkpoints when the
+/// checkpointer is not running, as SQLite does by default
+#define PEP_WAL_AUTOCHECKPOINT_PAGES               1000
+
+
+/* API
+ * ***************************************************************** */
+
+/**
+ *  <!--       config_wal_checkpointer()       -->
+ *
+ *  @brief Start, reconfigure or stop the WAL checkpointer for the whole
+ *         process.  The checkpointer is also stopped when the last session
+ *         is released.
+ *
+ *  @param[in]   session            session handle
+ *  @param[in]   enable             true to run the checkpointer, false to
+ *                                  go back to checkpointing at commit time
+ *  @param[in]   size_threshold     log size in bytes over which to
+ *                                  checkpoint, or 0 for
+ *                                  PEP_WAL_CHECKPOINT_DEFAULT_SIZE_THRESHOLD
+ *  @param[in]   interval_in_ms     longest time between checkpoints of a
+ *                                  non-empty log, or 0 for
+ *                                  PEP_WAL_CHECKPOINT_DEFAULT_INTERVAL_IN_MS
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_INIT_CANNOT_OPEN_DB the checkpointer connection could not be
+ *                                  opened
+ *  @retval PEP_UNKNOWN_ERROR       the checkpointer thread could not start
+ *
+ */
+DYNAMIC_API PEP_STATUS config_wal_checkpointer(PEP_SESSION session,
+                                               bool enable,
+                                               size_t size_threshold,
+                                               unsigned int interval_in_ms);
+
+
+/* Internal functions
+ * ***************************************************************** */
+
+/**
+ *  @internal
+ *  <!--       pEp_wal_checkpoint_attach()       -->
+ *
+ *  @brief     Make the session management database connection report its
+ *             commits to the checkpointer, in place of the SQLite automatic
+ *             checkpoint.  Called for every new connection.
+ *
+ *  @param[in]   session        session handle
+ *
+ *  @retval PEP_STATUS_OK           success
+ *  @retval PEP_ILLEGAL_VALUE       illegal parameter values
+ *  @retval PEP_UNKNOWN_DB_ERROR    the page size could not be read
+ */
+PEP_STATUS pEp_wal_checkpoint_attach(PEP_SESSION session);
+
+/**
+ *  @internal
+ *  <!--       pEp_wal_checkpointer_stop()       -->
+ *
+ *  @brief     Stop the checkpointer if it is running, and wait for it.
+ *             Called when the last session is released.
+ */
+void pEp_wal_checkpointer_stop(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef WAL_CHECKPOINT_H */
@@ -0,0 +1,220 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for BatchTest
+    class BatchTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            BatchTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~BatchTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the BatchTest suite.
+
+    };
+
+}  // namespace
+
+// The identity of the i-th contact with the given prefix.
+static pEp_identity* batch_contact(const char* prefix, int i) {
+    std::string address = std::string(prefix) + std::to_string(i)
+                          + "@batch.pEp";
+    std::string user_id = std::string(prefix) + "_" + std::to_string(i);
+    return new_identity(address.c_str(), NULL, user_id.c_str(),
+                        "Batch Contact");
+}
+
+static PEP_STATUS set_contacts(PEP_SESSION session, const char* prefix,
+                               int n) {
+    for (int i = 0; i < n; i++) {
+        pEp_identity* contact = batch_contact(prefix, i);
+        PEP_STATUS status = set_identity(session, contact);
+        free_identity(contact);
+        if (status != PEP_STATUS_OK)
+            return status;
+    }
+    return PEP_STATUS_OK;
+}
+
+static bool has_contact(PEP_SESSION session, const char* prefix, int i) {
+    pEp_identity* contact = batch_contact(prefix, i);
+    pEp_identity* found = NULL;
+    PEP_STATUS status = get_identity(session, contact->address,
+                                     contact->user_id, &found);
+    free_identity(contact);
+    free_identity(found);
+    return status == PEP_STATUS_OK;
+}
+
+TEST_F(BatchTest, check_commit) {
+    PEP_STATUS status = pEp_begin_batch(session);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 1);
+    status = set_contacts(session, "commit", 10);
+    ASSERT_OK;
+    ASSERT_TRUE(has_contact(session, "commit", 9));
+
+    // Other sessions read the state before the batch, without waiting.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    ASSERT_FALSE(has_contact(other, "commit", 9));
+
+    status = pEp_end_batch(session, true);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+    ASSERT_TRUE(has_contact(other, "commit", 0));
+    ASSERT_TRUE(has_contact(other, "commit", 9));
+    release(other);
+}
+
+TEST_F(BatchTest, check_rollback) {
+    PEP_STATUS status = set_contacts(session, "before", 1);
+    ASSERT_OK;
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = set_contacts(session, "rollback", 10);
+    ASSERT_OK;
+    status = pEp_end_batch(session, false);
+    ASSERT_OK;
+    ASSERT_TRUE(has_contact(session, "before", 0));
+    ASSERT_FALSE(has_contact(session, "rollback", 0));
+    ASSERT_FALSE(has_contact(session, "rollback", 9));
+}
+
+TEST_F(BatchTest, check_illegal_calls) {
+    PEP_STATUS status = pEp_end_batch(session, true);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = pEp_begin_batch(session);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+    status = config_ingestion_mode(session, true, 0);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+    status = pEp_end_batch(session, true);
+    ASSERT_OK;
+    status = pEp_end_batch(session, true);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+
+    // A batch is not ingestion mode, and ingestion mode is not a batch.
+    status = config_ingestion_mode(session, true, 0);
+    ASSERT_OK;
+    status = pEp_begin_batch(session);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+    status = pEp_end_batch(session, true);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+}
+
+TEST_F(BatchTest, check_release_rolls_back) {
+    PEP_SESSION other = NULL;
+    PEP_STATUS status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = pEp_begin_batch(other);
+    ASSERT_OK;
+    status = set_contacts(other, "released", 1);
+    ASSERT_OK;
+    release(other);
+    ASSERT_FALSE(has_contact(session, "released", 0));
+}
+
+// Write n contacts one call at a time, then the same number within a batch,
+// reporting the throughput of each.
+TEST_F(BatchTest, check_batch_throughput) {
+    const int n = 500;
+    auto begin = std::chrono::steady_clock::now();
+    PEP_STATUS status = set_contacts(session, "single", n);
+    ASSERT_OK;
+    std::chrono::duration<double> single_time
+        = std::chrono::steady_clock::now() - begin;
+
+    begin = std::chrono::steady_clock::now();
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = set_contacts(session, "batched", n);
+    ASSERT_OK;
+    status = pEp_end_batch(session, true);
+    ASSERT_OK;
+    std::chrono::duration<double> batch_time
+        = std::chrono::steady_clock::now() - begin;
+
+    output_stream << "set_identity one at a time: "
+                  << n / single_time.count() << " calls/s\n"
+                  << "set_identity in a batch: "
+                  << n / batch_time.count() << " calls/s\n";
+    for (int i = 0; i < n; i += 50)
+        ASSERT_TRUE(has_contact(session, "batched", i));
+}
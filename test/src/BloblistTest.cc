@@ -7,8 +7,13 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 
 #include "bloblist.h"
+#include "message.h"
 #include "TestConstants.h"
 
 #include "TestUtilities.h"
@@ -133,3 +138,214 @@ TEST_F(BloblistTest, check_bloblists) {
     free(text4);
     output_stream << "done.\n";
 }
+
+TEST_F(BloblistTest, check_shared_blobs) {
+    const char *text = "shared attachment data";
+    size_t size = strlen(text);
+    char *data = new_shared_blob(size);
+    ASSERT_NOTNULL(data);
+    memcpy(data, text, size);
+    ASSERT_EQ(data[size], '\0');
+    ASSERT_EQ(shared_blob_reference_count(data), 1);
+
+    bloblist_t *bl = new_bloblist(data, size, "text/plain", "file://shared.txt");
+    ASSERT_NOTNULL(bl);
+    bl->release_value = release_shared_blob;
+    ASSERT_TRUE(bloblist_is_shared(bl));
+
+    // duplicating takes a reference instead of copying
+    bloblist_t *dup = bloblist_dup(bl);
+    ASSERT_NOTNULL(dup);
+    ASSERT_EQ(dup->value, bl->value);
+    ASSERT_TRUE(bloblist_is_shared(dup));
+    ASSERT_EQ(shared_blob_reference_count(data), 2);
+    ASSERT_STREQ(dup->mime_type, "text/plain");
+
+    // an unshared blob added to a list of shared ones stays unshared
+    char *plain = strdup("plain");
+    bloblist_t *last = bloblist_add(dup, plain, strlen(plain), "text/plain", NULL);
+    ASSERT_NOTNULL(last);
+    ASSERT_FALSE(bloblist_is_shared(last));
+
+    // copy on write: the writer gets a private copy, the others keep theirs
+    char *writable = bloblist_writable_value(dup);
+    ASSERT_NOTNULL(writable);
+    ASSERT_NE(writable, bl->value);
+    ASSERT_FALSE(bloblist_is_shared(dup));
+    ASSERT_EQ(shared_blob_reference_count(data), 1);
+    writable[0] = 'S';
+    ASSERT_EQ(bl->value[0], 's');
+
+    // the last reference is written in place
+    ASSERT_EQ(bloblist_writable_value(bl), data);
+
+    free_bloblist(dup);
+    free_bloblist(bl);
+}
+
+TEST_F(BloblistTest, check_bloblist_share) {
+    bloblist_t *bl = new_bloblist(strdup("one"), 3, NULL, NULL);
+    ASSERT_NOTNULL(bl);
+    ASSERT_NOTNULL(bloblist_add(bl, strdup("two"), 3, NULL, NULL));
+    ASSERT_FALSE(bloblist_is_shared(bl));
+
+    ASSERT_EQ(bloblist_share(bl), PEP_STATUS_OK);
+    for (bloblist_t *p = bl; p; p = p->next)
+        ASSERT_TRUE(bloblist_is_shared(p));
+    char *first = bl->value;
+
+    // sharing again changes nothing
+    ASSERT_EQ(bloblist_share(bl), PEP_STATUS_OK);
+    ASSERT_EQ(bl->value, first);
+
+    bloblist_t *dup = bloblist_dup(bl);
+    ASSERT_NOTNULL(dup);
+    ASSERT_EQ(dup->value, bl->value);
+    ASSERT_EQ(dup->next->value, bl->next->value);
+    ASSERT_STREQ(dup->next->value, "two");
+
+    // the copy outlives the original
+    free_bloblist(bl);
+    ASSERT_EQ(shared_blob_reference_count(dup->value), 1);
+    ASSERT_STREQ(dup->value, "one");
+    free_bloblist(dup);
+}
+
+#ifndef WIN32
+TEST_F(BloblistTest, check_shared_blob_peak_rss) {
+    // A large attachment going into several messages, like a group message
+    // sent to every member, is held in memory once.
+    const size_t size = 25 * 1024 * 1024;
+    const int copies = 8;
+
+    char *data = new_shared_blob(size);
+    ASSERT_NOTNULL(data);
+    memset(data, 'x', size);
+    message *msg = new_message(PEP_dir_outgoing);
+    ASSERT_NOTNULL(msg);
+    msg->attachments = new_bloblist(data, size, "application/octet-stream",
+                                    "file://large.bin");
+    ASSERT_NOTNULL(msg->attachments);
+    msg->attachments->release_value = release_shared_blob;
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+
+    message *dups[copies];
+    for (int i = 0; i < copies; i++) {
+        dups[i] = message_dup(msg);
+        ASSERT_NOTNULL(dups[i]);
+        ASSERT_EQ(dups[i]->attachments->value, data);
+    }
+    ASSERT_EQ(shared_blob_reference_count(data), copies + 1);
+
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    // ru_maxrss is in kilobytes on Linux
+    long growth = (after.ru_maxrss - before.ru_maxrss) * 1024L;
+    output_stream << copies << " duplicates of a " << size / (1024 * 1024)
+                  << " MB attachment raised peak RSS by " << growth / 1024
+                  << " kB; copying would have added "
+                  << copies * size / (1024 * 1024) << " MB" << std::endl;
+    ASSERT_LT(growth, (long) size);
+
+    for (int i = 0; i < copies; i++)
+        free_message(dups[i]);
+    ASSERT_EQ(shared_blob_reference_count(data), 1);
+    free_message(msg);
+}
+#endif
+
+#ifndef WIN32
+TEST_F(BloblistTest, check_file_backed_blobs) {
+    char dir_template[] = "/tmp/pEp_blob_XXXXXX";
+    char *dir = mkdtemp(dir_template);
+    ASSERT_NOTNULL(dir);
+
+    const char *text = "file-backed attachment\n";
+    size_t size = strlen(text);
+    std::string path = std::string(dir) + "/attachment.txt";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << text;
+    }
+
+    char *data = NULL;
+    size_t data_size = 0;
+    ASSERT_EQ(map_file_blob(path.c_str(), &data, &data_size), PEP_STATUS_OK);
+    ASSERT_EQ(data_size, size);
+    ASSERT_EQ(memcmp(data, text, size), 0);
+    ASSERT_EQ(data[size], '\0');
+
+    bloblist_t *bl = new_bloblist(data, data_size, "text/plain", "file://attachment.txt");
+    ASSERT_NOTNULL(bl);
+    bl->release_value = release_shared_blob;
+    ASSERT_STREQ(blob_file_path(bl), path.c_str());
+
+    // duplicates share the mapping
+    bloblist_t *dup = bloblist_dup(bl);
+    ASSERT_NOTNULL(dup);
+    ASSERT_EQ(dup->value, bl->value);
+    ASSERT_STREQ(blob_file_path(dup), path.c_str());
+
+    // the mapping is read-only: even the last reference is copied on write
+    free_bloblist(dup);
+    char *writable = bloblist_writable_value(bl);
+    ASSERT_NOTNULL(writable);
+    ASSERT_NE(writable, data);
+    ASSERT_NULL(blob_file_path(bl));
+    writable[0] = 'F';
+    free_bloblist(bl);
+
+    // the file is left alone
+    std::ifstream in(path, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(content, text);
+    unlink(path.c_str());
+
+    ASSERT_NE(map_file_blob(path.c_str(), &data, &data_size), PEP_STATUS_OK);
+
+    // an empty file makes an empty blob
+    { std::ofstream out(path, std::ios::binary); }
+    ASSERT_EQ(map_file_blob(path.c_str(), &data, &data_size), PEP_STATUS_OK);
+    ASSERT_EQ(data_size, 0);
+    release_shared_blob(data);
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+TEST_F(BloblistTest, check_bloblist_store_in_directory) {
+    char dir_template[] = "/tmp/pEp_blob_XXXXXX";
+    char *dir = mkdtemp(dir_template);
+    ASSERT_NOTNULL(dir);
+
+    const size_t large_size = 100000;
+    char *large = (char *) malloc(large_size);
+    ASSERT_NOTNULL(large);
+    for (size_t i = 0; i < large_size; i++)
+        large[i] = (char) (i % 251);
+    bloblist_t *bl = new_bloblist(strdup("small"), 5, "text/plain", NULL);
+    ASSERT_NOTNULL(bl);
+    bloblist_t *last = bloblist_add(bl, large, large_size, "application/octet-stream", "file://../../etc/large.bin");
+    ASSERT_NOTNULL(last);
+
+    ASSERT_EQ(bloblist_store_in_directory(bl, dir, 1024), PEP_STATUS_OK);
+    ASSERT_NULL(blob_file_path(bl));
+    ASSERT_STREQ(bl->value, "small");
+
+    // the file name comes from the engine, not from the attachment
+    const char *path = blob_file_path(last);
+    ASSERT_NOTNULL(path);
+    ASSERT_EQ(strncmp(path, dir, strlen(dir)), 0);
+    ASSERT_EQ(strstr(path, ".."), (char *) NULL);
+    ASSERT_EQ(last->size, large_size);
+    for (size_t i = 0; i < large_size; i++)
+        ASSERT_EQ(last->value[i], (char) (i % 251));
+
+    std::string stored_path = path;
+    free_bloblist(bl);
+    ASSERT_EQ(access(stored_path.c_str(), R_OK), 0);
+    unlink(stored_path.c_str());
+    rmdir(dir);
+}
+#endif
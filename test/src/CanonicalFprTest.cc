@@ -0,0 +1,222 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+#include "engine_sql.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for CanonicalFprTest
+    class CanonicalFprTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            CanonicalFprTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~CanonicalFprTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the CanonicalFprTest suite.
+
+    };
+
+}  // namespace
+
+static const char* const canonical_fpr = "0123456789ABCDEF0123456789ABCDEF01234567";
+static const char* const spaced_fpr = "01234567 89abcdef 01234567 89abcdef 01234567";
+static const char* const other_canonical_fpr = "89ABCDEF0123456789ABCDEF0123456789ABCDEF";
+static const char* const other_spaced_fpr = "89abcdef 01234567 89abcdef 01234567 89abcdef";
+
+// Return the only value selected by the given query on the management
+// database, or the empty string.
+static string select_text(PEP_SESSION session, const char* query) {
+    sqlite3_stmt* statement = NULL;
+    string result;
+    if (sqlite3_prepare_v2(session->db, query, -1, &statement, NULL) != SQLITE_OK)
+        return result;
+    if (sqlite3_step(statement) == SQLITE_ROW
+        && sqlite3_column_text(statement, 0) != NULL)
+        result = (const char*) sqlite3_column_text(statement, 0);
+    sqlite3_finalize(statement);
+    return result;
+}
+
+TEST_F(CanonicalFprTest, check_canonical_fpr) {
+    char* canonical = pEp_sql_canonical_fpr(spaced_fpr);
+    ASSERT_NOTNULL(canonical);
+    EXPECT_STREQ(canonical, canonical_fpr);
+    free(canonical);
+
+    canonical = pEp_sql_canonical_fpr("");
+    ASSERT_NOTNULL(canonical);
+    EXPECT_STREQ(canonical, "");
+    free(canonical);
+
+    ASSERT_NULL(pEp_sql_canonical_fpr(NULL));
+}
+
+TEST_F(CanonicalFprTest, check_trust_is_stored_canonical) {
+    pEp_identity* ident = new_identity("canon@example.org", spaced_fpr, "CANON", "Canon");
+    ASSERT_NOTNULL(ident);
+    PEP_STATUS status = set_person(session, ident, true);
+    ASSERT_OK;
+    ident->comm_type = PEP_ct_OpenPGP_unconfirmed;
+    status = set_trust(session, ident);
+    ASSERT_OK;
+
+    EXPECT_EQ(select_text(session, "select pgp_keypair_fpr from trust where user_id = 'CANON';"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select fpr from pgp_keypair;"), canonical_fpr);
+    // The flags of both spellings are kept.
+    EXPECT_EQ(select_text(session, "select flags from pgp_keypair;"), "3");
+    EXPECT_EQ(select_text(session, "select main_key_id from person where id = 'CANON';"), canonical_fpr);
+
+    // Any spelling finds the same row.
+    free(ident->fpr);
+    ident->fpr = strdup(canonical_fpr);
+    ident->comm_type = PEP_ct_unknown;
+    status = get_trust(session, ident);
+    ASSERT_OK;
+    EXPECT_EQ(ident->comm_type, PEP_ct_OpenPGP_unconfirmed);
+
+    PEP_comm_type comm_type = PEP_ct_unknown;
+    status = least_trust(session, spaced_fpr, &comm_type);
+    ASSERT_OK;
+    EXPECT_EQ(comm_type, PEP_ct_OpenPGP_unconfirmed);
+
+    free_identity(ident);
+}
+
+TEST_F(CanonicalFprTest, check_replace_main_user_fpr_if_equal) {
+    pEp_identity* ident = new_identity("canon@example.org", canonical_fpr, "CANON", "Canon");
+    ASSERT_NOTNULL(ident);
+    PEP_STATUS status = set_person(session, ident, true);
+    ASSERT_OK;
+    status = set_pgp_keypair(session, other_canonical_fpr);
+    ASSERT_OK;
+
+    status = replace_main_user_fpr_if_equal(session, "CANON", other_spaced_fpr, spaced_fpr);
+    ASSERT_OK;
+    char* main_fpr = NULL;
+    status = get_main_user_fpr(session, "CANON", &main_fpr);
+    ASSERT_OK;
+    ASSERT_NOTNULL(main_fpr);
+    EXPECT_STREQ(main_fpr, other_canonical_fpr);
+    free(main_fpr);
+
+    free_identity(ident);
+}
+
+TEST_F(CanonicalFprTest, check_revoked_keys) {
+    PEP_STATUS status = set_revoked(session, spaced_fpr, other_spaced_fpr, 1234567);
+    ASSERT_OK;
+    EXPECT_EQ(select_text(session, "select revoked_fpr from revoked_keys;"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select replacement_fpr from revoked_keys;"), other_canonical_fpr);
+
+    char* revoked_fpr = NULL;
+    uint64_t revocation_date = 0;
+    status = get_revoked(session, other_canonical_fpr, &revoked_fpr, &revocation_date);
+    ASSERT_OK;
+    ASSERT_NOTNULL(revoked_fpr);
+    EXPECT_STREQ(revoked_fpr, canonical_fpr);
+    EXPECT_EQ(revocation_date, 1234567);
+    free(revoked_fpr);
+}
+
+TEST_F(CanonicalFprTest, check_upgrade) {
+    // Store fingerprints the way older versions could, then reopen the
+    // database as version 21.
+    const char* old_rows =
+        "PRAGMA foreign_keys=off;\n"
+        "insert into pgp_keypair (fpr, flags) values ('0123456789abcdef0123456789abcdef01234567', 1);\n"
+        "insert into pgp_keypair (fpr, flags) values ('0123456789ABCDEF0123456789ABCDEF01234567', 2);\n"
+        "insert into person (id, username, main_key_id) values ('CANON', 'Canon', '01234567 89abcdef 01234567 89abcdef 01234567');\n"
+        "insert into identity (address, user_id, main_key_id) values ('canon@example.org', 'CANON', '0123456789abcdef0123456789abcdef01234567');\n"
+        "insert into trust (user_id, pgp_keypair_fpr, comm_type) values ('CANON', '0123456789abcdef0123456789abcdef01234567', 56);\n"
+        "insert into mistrusted_keys (fpr) values ('89abcdef 01234567 89abcdef 01234567 89abcdef');\n"
+        "PRAGMA foreign_keys=on;\n"
+        "PRAGMA user_version = 21;\n";
+    ASSERT_EQ(sqlite3_exec(session->db, old_rows, NULL, NULL, NULL), SQLITE_OK);
+    release(session);
+    session = NULL;
+    engine->session = NULL;
+    PEP_STATUS status = init(&session, NULL, NULL, NULL);
+    ASSERT_OK;
+    engine->session = session;
+
+    EXPECT_EQ(select_text(session, "select count(*) from pgp_keypair;"), "1");
+    EXPECT_EQ(select_text(session, "select fpr from pgp_keypair;"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select main_key_id from person;"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select main_key_id from identity;"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select pgp_keypair_fpr from trust;"), canonical_fpr);
+    EXPECT_EQ(select_text(session, "select fpr from mistrusted_keys;"), other_canonical_fpr);
+    EXPECT_EQ(select_text(session, "pragma user_version;"), _DDL_USER_VERSION);
+
+    bool mistrusted = false;
+    status = is_mistrusted_key(session, other_canonical_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_TRUE(mistrusted);
+}
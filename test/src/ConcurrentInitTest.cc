@@ -0,0 +1,146 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "pEpEngine.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for ConcurrentInitTest
+    class ConcurrentInitTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            ConcurrentInitTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~ConcurrentInitTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the ConcurrentInitTest suite.
+
+    };
+
+}  // namespace
+
+/* Each thread creates a session, uses the management database with it, and
+   releases it, a few times in a row.  Failures are counted rather than
+   asserted, since gtest assertions are not meant for secondary threads. */
+static void init_use_release(int rounds, std::atomic<int>* failures)
+{
+    for (int i = 0; i < rounds; i++) {
+        PEP_SESSION s = NULL;
+        PEP_STATUS status = init(&s, NULL, NULL, NULL);
+        if (status != PEP_STATUS_OK || s == NULL) {
+            (*failures) ++;
+            continue;
+        }
+        int32_t value = 0;
+        status = sequence_value(s, "concurrent_init", &value);
+        if (status != PEP_STATUS_OK || value <= 0)
+            (*failures) ++;
+        release(s);
+    }
+}
+
+static void run_threads(int thread_no, int rounds, std::atomic<int>* failures)
+{
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_no; i++)
+        threads.push_back(std::thread(init_use_release, rounds, failures));
+    for (auto& t : threads)
+        t.join();
+}
+
+TEST_F(ConcurrentInitTest, check_concurrent_non_first_sessions) {
+    // The fixture session stays alive: no thread is ever first or last.
+    std::atomic<int> failures(0);
+    run_threads(16, 8, &failures);
+    ASSERT_EQ(failures, 0);
+
+    int32_t value = 0;
+    PEP_STATUS status = sequence_value(session, "concurrent_init", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 16 * 8 + 1);
+}
+
+TEST_F(ConcurrentInitTest, check_concurrent_first_and_last_sessions) {
+    // Release the fixture session so that threads race to be the first and
+    // the last session, many times over.
+    release(engine->session);
+    engine->session = session = NULL;
+
+    std::atomic<int> failures(0);
+    for (int round = 0; round < 4; round++)
+        run_threads(16, 4, &failures);
+    ASSERT_EQ(failures, 0);
+
+    // Give the fixture its session back, for TearDown .
+    PEP_STATUS status = init(&session, NULL, NULL, NULL);
+    ASSERT_OK;
+    engine->session = session;
+
+    int32_t value = 0;
+    status = sequence_value(session, "concurrent_init", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 4 * 16 * 4 + 1);
+}
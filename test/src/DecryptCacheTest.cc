@@ -0,0 +1,338 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "mime.h"
+#include "keymanagement.h"
+#include "decrypt_cache.h"
+#include "pEp_metrics.h"
+
+#ifndef WIN32
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for DecryptCacheTest
+    class DecryptCacheTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            DecryptCacheTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~DecryptCacheTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                // The cache is per-process: leave it as other tests expect.
+                config_decrypt_cache(session, 0, 0);
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the DecryptCacheTest suite.
+
+    };
+
+}  // namespace
+
+// Encrypt one message from Alice, who is own, to Bob, as MIME text.
+static std::string make_encrypted(PEP_SESSION session, pEp_identity** bob,
+                                  bloblist_t* attachments = NULL) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, bob);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->id = strdup("decrypt-cache-test@darthmama.org");
+    msg->from = identity_dup(alice);
+    msg->to = new_identity_list(identity_dup(*bob));
+    msg->shortmsg = strdup("duplicate delivery");
+    msg->longmsg = strdup("Delivered more than once.");
+    msg->attachments = attachments;
+    message* enc = NULL;
+    status = encrypt_message(session, msg, NULL, &enc, PEP_enc_PGP_MIME, 0);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    char* text = NULL;
+    status = mime_encode_message(enc, false, &text, false);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    std::string result = text;
+    free(text);
+    free_message(enc);
+    free_message(msg);
+    free_identity(alice);
+    return result;
+}
+
+struct decryption {
+    PEP_STATUS status;
+    std::string longmsg;
+    std::string first_key;
+    PEP_rating rating;
+};
+
+// Decrypt a freshly parsed copy of the given text, as a mail store would.
+static decryption decrypt_copy(PEP_SESSION session, const std::string& text) {
+    message* src = NULL;
+    PEP_STATUS status = mime_decode_message(text.c_str(), text.size(), &src, NULL);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    src->dir = PEP_dir_incoming;
+    message* dst = NULL;
+    stringlist_t* keylist = NULL;
+    PEP_decrypt_flags_t flags = 0;
+    decryption result;
+    result.status = decrypt_message_2(session, src, &dst, &keylist, &flags);
+    EXPECT_NE(dst, nullptr);
+    if (dst != NULL) {
+        result.longmsg = dst->longmsg ? dst->longmsg : "";
+        result.rating = dst->rating;
+    }
+    result.first_key = (keylist && keylist->value) ? keylist->value : "";
+    free_message(dst);
+    free_stringlist(keylist);
+    free_message(src);
+    return result;
+}
+
+static PEP_metrics metrics(PEP_SESSION session) {
+    PEP_metrics result;
+    PEP_STATUS status = pEp_get_metrics(session, &result, NULL);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    return result;
+}
+
+TEST_F(DecryptCacheTest, check_duplicate_hit) {
+    pEp_identity* bob = NULL;
+    std::string text = make_encrypted(session, &bob);
+
+    // Disabled by default.
+    decryption plain = decrypt_copy(session, text);
+    ASSERT_EQ(plain.status, PEP_STATUS_OK);
+    ASSERT_EQ(metrics(session).decrypt_cache_misses, 0);
+
+    PEP_STATUS status = config_decrypt_cache(session, 1 << 20, 600);
+    ASSERT_OK;
+    decryption first = decrypt_copy(session, text);
+    PEP_metrics before = metrics(session);
+    decryption second = decrypt_copy(session, text);
+    PEP_metrics after = metrics(session);
+
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits + 1);
+    ASSERT_EQ(second.status, first.status);
+    ASSERT_EQ(second.longmsg, first.longmsg);
+    ASSERT_EQ(second.first_key, first.first_key);
+    ASSERT_EQ(second.rating, first.rating);
+    ASSERT_EQ(second.longmsg, plain.longmsg);
+    ASSERT_EQ(second.rating, plain.rating);
+    // A hit costs one SQL step, to check that nothing changed.
+    ASSERT_LE(after.sql_steps - before.sql_steps, 1);
+
+    free_identity(bob);
+}
+
+TEST_F(DecryptCacheTest, check_trust_change_invalidates) {
+    pEp_identity* bob = NULL;
+    std::string text = make_encrypted(session, &bob);
+    PEP_STATUS status = config_decrypt_cache(session, 1 << 20, 600);
+    ASSERT_OK;
+    decrypt_copy(session, text);
+
+    status = update_identity(session, bob);
+    ASSERT_OK;
+    status = trust_personal_key(session, bob);
+    ASSERT_OK;
+
+    PEP_metrics before = metrics(session);
+    decryption third = decrypt_copy(session, text);
+    PEP_metrics after = metrics(session);
+    ASSERT_EQ(third.status, PEP_STATUS_OK);
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits);
+    ASSERT_EQ(after.decrypt_cache_misses, before.decrypt_cache_misses + 1);
+
+    free_identity(bob);
+}
+
+TEST_F(DecryptCacheTest, check_purge_and_budget) {
+    pEp_identity* bob = NULL;
+    std::string text = make_encrypted(session, &bob);
+    PEP_STATUS status = config_decrypt_cache(session, 1 << 20, 600);
+    ASSERT_OK;
+    decrypt_copy(session, text);
+
+    status = purge_decrypt_cache(session);
+    ASSERT_OK;
+    PEP_metrics before = metrics(session);
+    decrypt_copy(session, text);
+    PEP_metrics after = metrics(session);
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits);
+
+    // A budget too small for any entry keeps nothing.
+    status = config_decrypt_cache(session, 16, 600);
+    ASSERT_OK;
+    decrypt_copy(session, text);
+    before = metrics(session);
+    decrypt_copy(session, text);
+    after = metrics(session);
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits);
+
+    free_identity(bob);
+}
+
+TEST_F(DecryptCacheTest, check_config_and_key_store_invalidate) {
+    pEp_identity* bob = NULL;
+    std::string text = make_encrypted(session, &bob);
+    PEP_STATUS status = config_decrypt_cache(session, 1 << 20, 600);
+    ASSERT_OK;
+    decrypt_copy(session, text);
+
+    // The cache is shared: a session decrypting with a different
+    // configuration must not get the result made with this one.
+    config_unencrypted_subject(session, true);
+    PEP_metrics before = metrics(session);
+    decrypt_copy(session, text);
+    PEP_metrics after = metrics(session);
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits);
+    config_unencrypted_subject(session, false);
+
+    // Importing a key leaves the management database alone, but may change
+    // the result.
+    std::string pubkey = slurp("test_keys/pub/pep-test-carol-0x42A85A42_pub.asc");
+    status = import_key(session, pubkey.c_str(), pubkey.size(), NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    before = metrics(session);
+    decryption result = decrypt_copy(session, text);
+    after = metrics(session);
+    ASSERT_EQ(result.status, PEP_STATUS_OK);
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits);
+
+    free_identity(bob);
+}
+
+#ifndef WIN32
+// Decrypt a freshly parsed copy of the given text, and return the path of the
+// file backing its large.bin attachment.
+static std::string decrypt_attachment_path(PEP_SESSION session,
+                                           const std::string& text) {
+    message* src = NULL;
+    PEP_STATUS status = mime_decode_message(text.c_str(), text.size(), &src, NULL);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    src->dir = PEP_dir_incoming;
+    message* dst = NULL;
+    stringlist_t* keylist = NULL;
+    PEP_decrypt_flags_t flags = 0;
+    status = decrypt_message_2(session, src, &dst, &keylist, &flags);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    std::string result;
+    for (bloblist_t* b = dst ? dst->attachments : NULL; b != NULL; b = b->next)
+        if (b->filename && strcmp(b->filename, "file://large.bin") == 0
+            && blob_file_path(b) != NULL)
+            result = blob_file_path(b);
+    free_message(dst);
+    free_stringlist(keylist);
+    free_message(src);
+    return result;
+}
+
+TEST_F(DecryptCacheTest, check_hit_reuses_attachment_file) {
+    char dir_template[] = "/tmp/pEp_cache_XXXXXX";
+    char* dir = mkdtemp(dir_template);
+    ASSERT_NOTNULL(dir);
+
+    const size_t size = 10000;
+    char* data = (char*) malloc(size);
+    ASSERT_NOTNULL(data);
+    memset(data, 'x', size);
+    pEp_identity* bob = NULL;
+    std::string text = make_encrypted(session, &bob,
+            new_bloblist(data, size, "application/octet-stream", "file://large.bin"));
+
+    PEP_STATUS status = config_decrypt_cache(session, 1 << 20, 600);
+    ASSERT_OK;
+    // Large enough to keep the attached sender key in memory.
+    status = config_decrypted_attachment_directory(session, dir, 8192);
+    ASSERT_OK;
+    std::string first = decrypt_attachment_path(session, text);
+    PEP_metrics before = metrics(session);
+    std::string second = decrypt_attachment_path(session, text);
+    PEP_metrics after = metrics(session);
+
+    // The hit shares the file written for the first decryption.
+    ASSERT_EQ(after.decrypt_cache_hits, before.decrypt_cache_hits + 1);
+    ASSERT_FALSE(first.empty());
+    ASSERT_EQ(second, first);
+    int file_no = 0;
+    DIR* d = opendir(dir);
+    ASSERT_NOTNULL(d);
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL)
+        if (e->d_name[0] != '.')
+            file_no++;
+    closedir(d);
+    ASSERT_EQ(file_no, 1);
+
+    config_decrypted_attachment_directory(session, NULL, 0);
+    purge_decrypt_cache(session);
+    unlink(first.c_str());
+    rmdir(dir);
+    free_identity(bob);
+}
+#endif
@@ -0,0 +1,255 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "mime.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for DecryptMessagesTest
+    class DecryptMessagesTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            DecryptMessagesTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~DecryptMessagesTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the DecryptMessagesTest suite.
+
+    };
+
+}  // namespace
+
+// Encrypt n messages from Alice, who is own, to Bob, as MIME texts.
+static void make_mailbox(PEP_SESSION session, int n,
+                         std::vector<std::string>& texts) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    for (int i = 0; i < n; i++) {
+        message* msg = new_message(PEP_dir_outgoing);
+        msg->from = identity_dup(alice);
+        msg->to = new_identity_list(identity_dup(bob));
+        msg->shortmsg = strdup("batch decryption");
+        msg->longmsg = strdup(("Message number " + std::to_string(i)).c_str());
+        message* enc = NULL;
+        status = encrypt_message(session, msg, NULL, &enc, PEP_enc_PGP_MIME, 0);
+        ASSERT_OK;
+        char* text = NULL;
+        status = mime_encode_message(enc, false, &text, false);
+        ASSERT_OK;
+        texts.push_back(text);
+        free(text);
+        free_message(enc);
+        free_message(msg);
+    }
+    free_identity(alice);
+    free_identity(bob);
+}
+
+struct delivery_log {
+    std::vector<size_t> indices;
+};
+
+static void log_delivery(void* context, size_t index,
+                         PEP_decrypt_batch_item* item) {
+    ((delivery_log*) context)->indices.push_back(index);
+}
+
+static void free_items(std::vector<PEP_decrypt_batch_item>& items) {
+    for (auto& item : items) {
+        if (item.mimetext != NULL)
+            free_message(item.src);
+        free_message(item.dst);
+        free(item.dst_mimetext);
+        free_stringlist(item.keylist);
+    }
+}
+
+TEST_F(DecryptMessagesTest, check_same_as_sequential) {
+    const int n = 24;
+    std::vector<std::string> texts;
+    make_mailbox(session, n, texts);
+    ASSERT_EQ(texts.size(), n);
+
+    std::vector<PEP_decrypt_batch_item> items(n);
+    for (int i = 0; i < n; i++) {
+        memset(&items[i], 0, sizeof(PEP_decrypt_batch_item));
+        items[i].mimetext = texts[i].c_str();
+        items[i].size = texts[i].size();
+    }
+    delivery_log log;
+    PEP_STATUS status = decrypt_messages(session, items.data(), n, 4,
+                                         log_delivery, &log);
+    ASSERT_OK;
+
+    // Delivered once each, in input order.
+    ASSERT_EQ(log.indices.size(), n);
+    for (int i = 0; i < n; i++)
+        ASSERT_EQ(log.indices[i], i);
+
+    for (int i = 0; i < n; i++) {
+        message* src = NULL;
+        status = mime_decode_message(texts[i].c_str(), texts[i].size(), &src, NULL);
+        ASSERT_OK;
+        message* dst = NULL;
+        stringlist_t* keylist = NULL;
+        PEP_decrypt_flags_t flags = 0;
+        status = decrypt_message_2(session, src, &dst, &keylist, &flags);
+
+        ASSERT_EQ(items[i].status, status);
+        ASSERT_NOTNULL(items[i].dst);
+        ASSERT_NOTNULL(dst);
+        ASSERT_EQ(items[i].rating, dst->rating);
+        ASSERT_STREQ(items[i].dst->longmsg, dst->longmsg);
+        ASSERT_EQ(stringlist_length(items[i].keylist), stringlist_length(keylist));
+        ASSERT_NOTNULL(items[i].dst_mimetext);
+        ASSERT_NOTNULL(strstr(items[i].dst_mimetext, "Message number"));
+        free_message(dst);
+        free_message(src);
+        free_stringlist(keylist);
+    }
+    free_items(items);
+}
+
+TEST_F(DecryptMessagesTest, check_failures_do_not_stop_the_batch) {
+    const int n = 3;
+    std::vector<std::string> texts;
+    make_mailbox(session, n, texts);
+
+    std::vector<PEP_decrypt_batch_item> items(n);
+    for (int i = 0; i < n; i++) {
+        memset(&items[i], 0, sizeof(PEP_decrypt_batch_item));
+        items[i].mimetext = texts[i].c_str();
+        items[i].size = texts[i].size();
+    }
+    // Neither MIME text nor a message.
+    items[1].mimetext = NULL;
+
+    delivery_log log;
+    PEP_STATUS status = decrypt_messages(session, items.data(), n, 2,
+                                         log_delivery, &log);
+    ASSERT_OK;
+    ASSERT_EQ(log.indices.size(), n);
+    ASSERT_EQ(items[1].status, PEP_ILLEGAL_VALUE);
+    ASSERT_NULL(items[1].dst);
+    ASSERT_NOTNULL(items[0].dst);
+    ASSERT_NOTNULL(items[2].dst);
+    free_items(items);
+}
+
+TEST_F(DecryptMessagesTest, check_ingestion_mode) {
+    const int n = 8;
+    std::vector<std::string> texts;
+    make_mailbox(session, n, texts);
+
+    PEP_STATUS status = config_ingestion_mode(session, true, 3);
+    ASSERT_OK;
+    std::vector<PEP_decrypt_batch_item> items(n);
+    for (int i = 0; i < n; i++) {
+        memset(&items[i], 0, sizeof(PEP_decrypt_batch_item));
+        items[i].mimetext = texts[i].c_str();
+        items[i].size = texts[i].size();
+    }
+    status = decrypt_messages(session, items.data(), n, 4, NULL, NULL);
+    ASSERT_OK;
+    for (int i = 0; i < n; i++) {
+        ASSERT_NOTNULL(items[i].dst);
+        ASSERT_FALSE(PEP_STATUS_is_error(items[i].status));
+    }
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    free_items(items);
+}
+
+TEST_F(DecryptMessagesTest, check_worker_session_config) {
+    int management = 0;
+    config_passive_mode(session, true);
+    config_unencrypted_subject(session, true);
+    PEP_STATUS status = config_passphrase_for_new_keys(session, true, "new key passphrase");
+    ASSERT_OK;
+    status = config_passphrase(session, "current passphrase");
+    ASSERT_OK;
+    session->sync_management = &management;
+
+    PEP_SESSION worker = pEp_new_worker_session(session);
+    ASSERT_NOTNULL(worker);
+    ASSERT_TRUE(worker->passive_mode);
+    ASSERT_TRUE(worker->unencrypted_subject);
+    ASSERT_TRUE(worker->new_key_pass_enable);
+    ASSERT_STREQ(worker->generation_passphrase, "new key passphrase");
+    ASSERT_STREQ(worker->curr_passphrase, "current passphrase");
+    ASSERT_EQ(worker->sync_management, (void*) &management);
+    ASSERT_EQ(worker->inject_sync_event, session->inject_sync_event);
+    release(worker);
+
+    session->sync_management = NULL;
+}
@@ -0,0 +1,246 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for EncryptMessagesTest
+    class EncryptMessagesTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            EncryptMessagesTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~EncryptMessagesTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the EncryptMessagesTest suite.
+
+    };
+
+}  // namespace
+
+static const TestUtilsPreset::ident_preset recipients[] = {
+    TestUtilsPreset::BOB, TestUtilsPreset::CAROL, TestUtilsPreset::DAVE
+};
+
+// Set up Alice as own identity and public keys for the recipients.
+static void set_up_identities(PEP_SESSION session, pEp_identity** alice,
+                              std::vector<pEp_identity*>& others) {
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, alice);
+    ASSERT_OK;
+    for (auto preset : recipients) {
+        pEp_identity* ident = NULL;
+        status = TestUtilsPreset::set_up_preset(session, preset, true, true, true, false, false, false, &ident);
+        ASSERT_OK;
+        others.push_back(ident);
+    }
+}
+
+// Message i goes to an overlapping subset of the recipients.
+static message* new_outgoing(const pEp_identity* alice,
+                             const std::vector<pEp_identity*>& others,
+                             int i) {
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->from = new_identity(alice->address, NULL, alice->user_id, alice->username);
+    msg->to = new_identity_list(new_identity(others[i % others.size()]->address, NULL, NULL, NULL));
+    if (i % 2 == 0)
+        msg->cc = new_identity_list(new_identity(others[(i + 1) % others.size()]->address, NULL, NULL, NULL));
+    msg->shortmsg = strdup("batch encryption");
+    msg->longmsg = strdup(("Message number " + std::to_string(i)).c_str());
+    return msg;
+}
+
+TEST_F(EncryptMessagesTest, check_same_as_sequential) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+
+    const int n = 60;
+    std::vector<message*> src(n), dst(n, nullptr);
+    std::vector<PEP_STATUS> statuses(n);
+    std::vector<message*> sequential_dst(n, nullptr);
+    std::vector<PEP_STATUS> sequential_statuses(n);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+        message* msg = new_outgoing(alice, others, i);
+        sequential_statuses[i] = encrypt_message(session, msg, NULL, &sequential_dst[i], PEP_enc_PGP_MIME, 0);
+        free_message(msg);
+    }
+    std::chrono::duration<double> sequential_seconds
+        = std::chrono::steady_clock::now() - begin;
+
+    for (int i = 0; i < n; i++)
+        src[i] = new_outgoing(alice, others, i);
+    begin = std::chrono::steady_clock::now();
+    PEP_STATUS status = encrypt_messages(session, src.data(), n, NULL,
+                                         dst.data(), statuses.data(),
+                                         PEP_enc_PGP_MIME, 0, 4);
+    ASSERT_OK;
+    std::chrono::duration<double> batch_seconds
+        = std::chrono::steady_clock::now() - begin;
+    output_stream << "sequential: " << n / sequential_seconds.count()
+                  << " messages/s\n"
+                  << "encrypt_messages: " << n / batch_seconds.count()
+                  << " messages/s\n";
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(statuses[i], sequential_statuses[i]);
+        ASSERT_NOTNULL(dst[i]);
+        ASSERT_NOTNULL(sequential_dst[i]);
+        ASSERT_EQ(dst[i]->rating, sequential_dst[i]->rating);
+        ASSERT_EQ(dst[i]->enc_format, sequential_dst[i]->enc_format);
+        ASSERT_EQ(identity_list_length(dst[i]->to), identity_list_length(sequential_dst[i]->to));
+        ASSERT_STREQ(src[i]->from->fpr, alice->fpr);
+
+        // Decrypting gives back the original text.
+        message* decrypted = NULL;
+        stringlist_t* keylist = NULL;
+        PEP_decrypt_flags_t flags = 0;
+        status = decrypt_message_2(session, dst[i], &decrypted, &keylist, &flags);
+        ASSERT_OK;
+        ASSERT_NOTNULL(decrypted);
+        ASSERT_STREQ(decrypted->longmsg, src[i]->longmsg);
+        ASSERT_NOTNULL(keylist);
+        free_message(decrypted);
+        free_stringlist(keylist);
+    }
+
+    for (int i = 0; i < n; i++) {
+        free_message(src[i]);
+        free_message(dst[i]);
+        free_message(sequential_dst[i]);
+    }
+    for (auto ident : others)
+        free_identity(ident);
+    free_identity(alice);
+}
+
+TEST_F(EncryptMessagesTest, check_unencrypted_and_null) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+
+    message* to_stranger = new_message(PEP_dir_outgoing);
+    to_stranger->from = new_identity(alice->address, NULL, alice->user_id, alice->username);
+    to_stranger->to = new_identity_list(new_identity("stranger@darthmama.org", NULL, NULL, "Stranger"));
+    to_stranger->shortmsg = strdup("no key");
+    to_stranger->longmsg = strdup("There is no key for you.");
+
+    message* src[3] = { new_outgoing(alice, others, 0), NULL, to_stranger };
+    message* dst[3] = { NULL, NULL, NULL };
+    PEP_STATUS statuses[3];
+    PEP_STATUS status = encrypt_messages(session, src, 3, NULL, dst, statuses,
+                                         PEP_enc_PGP_MIME, 0, 2);
+    ASSERT_OK;
+    ASSERT_EQ(statuses[0], PEP_STATUS_OK);
+    ASSERT_NOTNULL(dst[0]);
+    ASSERT_EQ(statuses[1], PEP_ILLEGAL_VALUE);
+    ASSERT_NULL(dst[1]);
+    ASSERT_EQ(statuses[2], PEP_UNENCRYPTED);
+    ASSERT_NULL(dst[2]);
+
+    free_message(src[0]);
+    free_message(src[2]);
+    free_message(dst[0]);
+    for (auto ident : others)
+        free_identity(ident);
+    free_identity(alice);
+}
+
+TEST_F(EncryptMessagesTest, check_session_config_applies_to_workers) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+
+    // Not the default: worker threads must encrypt the same way.
+    config_unencrypted_subject(session, true);
+
+    const int n = 8;
+    std::vector<message*> src(n), dst(n, nullptr);
+    std::vector<PEP_STATUS> statuses(n);
+    for (int i = 0; i < n; i++)
+        src[i] = new_outgoing(alice, others, i);
+    PEP_STATUS status = encrypt_messages(session, src.data(), n, NULL,
+                                         dst.data(), statuses.data(),
+                                         PEP_enc_PGP_MIME, 0, 4);
+    ASSERT_OK;
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(statuses[i], PEP_STATUS_OK);
+        ASSERT_NOTNULL(dst[i]);
+        ASSERT_STREQ(dst[i]->shortmsg, "batch encryption");
+    }
+
+    for (int i = 0; i < n; i++) {
+        free_message(src[i]);
+        free_message(dst[i]);
+    }
+    for (auto ident : others)
+        free_identity(ident);
+    free_identity(alice);
+}
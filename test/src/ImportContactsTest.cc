@@ -0,0 +1,304 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "import_contacts.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for ImportContactsTest
+    class ImportContactsTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            ImportContactsTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~ImportContactsTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the ImportContactsTest suite.
+
+    };
+
+}  // namespace
+
+// Records for import_contacts_bulk: an address and key text for each, where
+// either may be empty.
+struct contact_source {
+    std::vector<std::string> addresses;
+    std::vector<std::string> keys;
+    size_t next = 0;
+    size_t fail_at = SIZE_MAX;
+    size_t progress_no = 0;
+    PEP_import_contacts_stats last_progress = { 0, 0, 0 };
+
+    void add(const std::string& address, const std::string& key) {
+        addresses.push_back(address);
+        keys.push_back(key);
+    }
+};
+
+static PEP_STATUS next_contact(void* context, pEp_identity** identity,
+                               char** key_data, size_t* key_size) {
+    contact_source* source = (contact_source*) context;
+    *identity = NULL;
+    *key_data = NULL;
+    *key_size = 0;
+    if (source->next == source->fail_at)
+        return PEP_UNKNOWN_ERROR;
+    if (source->next == source->addresses.size())
+        return PEP_STATUS_OK;
+    size_t i = source->next++;
+    *identity = new_identity(source->addresses[i].c_str(), NULL, NULL, NULL);
+    if (!*identity)
+        return PEP_OUT_OF_MEMORY;
+    if (!source->keys[i].empty()) {
+        *key_data = strdup(source->keys[i].c_str());
+        *key_size = source->keys[i].size();
+    }
+    return PEP_STATUS_OK;
+}
+
+static void count_progress(void* context,
+                           const PEP_import_contacts_stats* stats) {
+    contact_source* source = (contact_source*) context;
+    source->progress_no++;
+    source->last_progress = *stats;
+}
+
+static std::string import_address(size_t i) {
+    return "contact" + std::to_string(i) + "@import.pEp";
+}
+
+static bool has_contact(PEP_SESSION session, const std::string& address) {
+    pEp_identity* found = NULL;
+    std::string user_id = "TOFU_" + address;
+    PEP_STATUS status = get_identity(session, address.c_str(),
+                                     user_id.c_str(), &found);
+    free_identity(found);
+    return status == PEP_STATUS_OK;
+}
+
+TEST_F(ImportContactsTest, check_import) {
+    const char* alice = "pep.test.alice@pep-project.org";
+    const char* bob = "pep.test.bob@pep-project.org";
+    contact_source source;
+    source.add(alice, slurp("test_keys/pub/alice-0x2A649B9F_pub.asc"));
+    source.add(bob, slurp("test_keys/pub/pep-test-bob-0xC9C2EE39_pub.asc"));
+    source.add("nokey@import.pEp", "");
+    source.add("", "");
+    source.add("broken@import.pEp", "this is not a key");
+
+    PEP_import_contacts_stats stats;
+    PEP_STATUS status = import_contacts_bulk(session, next_contact, NULL,
+                                             &source, 2, &stats);
+    ASSERT_OK;
+    ASSERT_EQ(stats.record_no, 5);
+    ASSERT_EQ(stats.imported_key_no, 2);
+    ASSERT_EQ(stats.failed_no, 2);
+
+    // Defaults come from the address and from the imported key.
+    pEp_identity* found = NULL;
+    status = get_identity(session, alice,
+                          "TOFU_pep.test.alice@pep-project.org", &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->fpr, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97");
+    ASSERT_STREQ(found->username, alice);
+    ASSERT_NE(found->comm_type, PEP_ct_unknown);
+    free_identity(found);
+    found = NULL;
+    status = get_identity(session, bob, "TOFU_pep.test.bob@pep-project.org",
+                          &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->fpr, "BFCDB7F301DEEEBBF947F29659BFF488C9C2EE39");
+    free_identity(found);
+
+    ASSERT_TRUE(has_contact(session, "nokey@import.pEp"));
+    ASSERT_FALSE(has_contact(session, "broken@import.pEp"));
+}
+
+TEST_F(ImportContactsTest, check_progress) {
+    const size_t n = 2 * PEP_IMPORT_CONTACTS_CHUNK_SIZE + 1;
+    contact_source source;
+    for (size_t i = 0; i < n; i++)
+        source.add(import_address(i), "");
+
+    PEP_STATUS status = import_contacts_bulk(session, next_contact,
+                                             count_progress, &source, 1,
+                                             NULL);
+    ASSERT_OK;
+    ASSERT_EQ(source.progress_no, 3);
+    ASSERT_EQ(source.last_progress.record_no, n);
+    ASSERT_EQ(source.last_progress.failed_no, 0);
+    ASSERT_TRUE(has_contact(session, import_address(0)));
+    ASSERT_TRUE(has_contact(session, import_address(n - 1)));
+}
+
+TEST_F(ImportContactsTest, check_callback_failure) {
+    contact_source source;
+    for (size_t i = 0; i < 10; i++)
+        source.add(import_address(i), "");
+    source.fail_at = 5;
+
+    PEP_import_contacts_stats stats;
+    PEP_STATUS status = import_contacts_bulk(session, next_contact, NULL,
+                                             &source, 1, &stats);
+    ASSERT_EQ(status, PEP_UNKNOWN_ERROR);
+    ASSERT_EQ(stats.record_no, 0);
+    ASSERT_FALSE(has_contact(session, import_address(0)));
+}
+
+TEST_F(ImportContactsTest, check_within_batch) {
+    contact_source source;
+    source.add(import_address(0), "");
+
+    PEP_STATUS status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = import_contacts_bulk(session, next_contact, NULL, &source, 4,
+                                  NULL);
+    ASSERT_OK;
+    // The batch is still open, and its owner decides.
+    status = pEp_end_batch(session, false);
+    ASSERT_OK;
+    ASSERT_FALSE(has_contact(session, import_address(0)));
+}
+
+// Import many contacts, each with a key, one at a time and then in bulk,
+// reporting the throughput of each, and then as many contacts without keys
+// in bulk: this is the cost of writing the rows of each record through
+// set_identity alone.  It only runs when the number of contacts imported in
+// bulk is given through the environment, 100000 for example.
+TEST_F(ImportContactsTest, check_import_benchmark) {
+    const char* n_text = getenv("PEP_IMPORT_CONTACTS_BENCHMARK_SIZE");
+    if (n_text == NULL || atol(n_text) <= 0) {
+        output_stream << "set PEP_IMPORT_CONTACTS_BENCHMARK_SIZE to run this benchmark\n";
+        return;
+    }
+    const size_t n = (size_t) atol(n_text);
+    const size_t single_n = (n / 100 > 0) ? n / 100 : 1;
+    const std::string keys[] = {
+        slurp("test_keys/pub/alice-0x2A649B9F_pub.asc"),
+        slurp("test_keys/pub/pep-test-bob-0xC9C2EE39_pub.asc"),
+        slurp("test_keys/pub/carol-0xCD8BAC06_pub.asc"),
+        slurp("test_keys/pub/pep-test-dave-0xBB5BCCF6_pub.asc")
+    };
+    const size_t key_no = sizeof(keys) / sizeof(keys[0]);
+
+    PEP_STATUS status = PEP_STATUS_OK;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < single_n; i++) {
+        const std::string& key = keys[i % key_no];
+        stringlist_t* imported = NULL;
+        status = import_key_with_fpr_return(session, key.c_str(), key.size(),
+                                            NULL, &imported, NULL);
+        ASSERT_TRUE(status == PEP_STATUS_OK || status == PEP_KEY_IMPORTED);
+        std::string address = "single" + import_address(i);
+        std::string user_id = "TOFU_" + address;
+        pEp_identity* contact = new_identity(address.c_str(),
+                                             imported->value,
+                                             user_id.c_str(),
+                                             address.c_str());
+        status = set_identity(session, contact);
+        free_identity(contact);
+        free_stringlist(imported);
+        ASSERT_OK;
+    }
+    std::chrono::duration<double> single_time
+        = std::chrono::steady_clock::now() - begin;
+
+    contact_source source;
+    for (size_t i = 0; i < n; i++)
+        source.add(import_address(i), keys[i % key_no]);
+    PEP_import_contacts_stats stats;
+    begin = std::chrono::steady_clock::now();
+    status = import_contacts_bulk(session, next_contact, NULL, &source, 4,
+                                  &stats);
+    ASSERT_OK;
+    std::chrono::duration<double> bulk_time
+        = std::chrono::steady_clock::now() - begin;
+    ASSERT_EQ(stats.record_no, n);
+    ASSERT_EQ(stats.failed_no, 0);
+
+    contact_source keyless_source;
+    for (size_t i = 0; i < n; i++)
+        keyless_source.add("keyless" + import_address(i), "");
+    begin = std::chrono::steady_clock::now();
+    status = import_contacts_bulk(session, next_contact, NULL, &keyless_source,
+                                  4, &stats);
+    ASSERT_OK;
+    std::chrono::duration<double> keyless_time
+        = std::chrono::steady_clock::now() - begin;
+    ASSERT_EQ(stats.record_no, n);
+
+    output_stream << "one contact at a time: "
+                  << single_n / single_time.count() << " contacts/s\n"
+                  << "import_contacts_bulk, " << n << " contacts: "
+                  << n / bulk_time.count() << " contacts/s\n"
+                  << "import_contacts_bulk, " << n << " contacts without keys: "
+                  << n / keyless_time.count() << " contacts/s\n";
+    ASSERT_TRUE(has_contact(session, import_address(0)));
+    ASSERT_TRUE(has_contact(session, import_address(n - 1)));
+}
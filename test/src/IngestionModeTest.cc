@@ -0,0 +1,292 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "engine_sql.h"
+#include "message_api.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for IngestionModeTest
+    class IngestionModeTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            IngestionModeTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~IngestionModeTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the IngestionModeTest suite.
+
+    };
+
+}  // namespace
+
+static pEp_identity* ingestion_sender(const char* prefix, int i) {
+    std::string address = std::string(prefix) + "-" + std::to_string(i)
+                          + "@darthmama.org";
+    std::string name = std::string("Sender ") + std::to_string(i);
+    return new_identity(address.c_str(), NULL, NULL, name.c_str());
+}
+
+// Decrypt one unencrypted incoming message from the given sender: this updates
+// the sender identity and person in the management database.
+static PEP_STATUS decrypt_from(PEP_SESSION session, pEp_identity* me,
+                               pEp_identity* from) {
+    message* msg = new_message(PEP_dir_incoming);
+    msg->from = from;
+    msg->to = new_identity_list(identity_dup(me));
+    msg->shortmsg = strdup("ingestion test");
+    msg->longmsg = strdup("Hello.");
+    message* dst = NULL;
+    stringlist_t* keylist = NULL;
+    PEP_decrypt_flags_t flags = 0;
+    PEP_STATUS status = decrypt_message_2(session, msg, &dst, &keylist, &flags);
+    free_message(dst);
+    free_stringlist(keylist);
+    free_message(msg);
+    return status;
+}
+
+// Decrypt n messages from distinct senders, returning messages per second.
+static double decrypt_many(PEP_SESSION session, pEp_identity* me,
+                           const char* prefix, int n) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+        PEP_STATUS status = decrypt_from(session, me, ingestion_sender(prefix, i));
+        EXPECT_EQ(status, PEP_UNENCRYPTED);
+    }
+    std::chrono::duration<double> seconds
+        = std::chrono::steady_clock::now() - begin;
+    return n / seconds.count();
+}
+
+TEST_F(IngestionModeTest, check_same_state_as_sequential) {
+    pEp_identity* me = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &me);
+    ASSERT_OK;
+
+    const int n = 200;
+    double sequential_rate = decrypt_many(session, me, "sequential", n);
+
+    status = config_ingestion_mode(session, true, 64);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 1);
+    double ingestion_rate = decrypt_many(session, me, "ingestion", n);
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+
+    output_stream << "sequential: " << sequential_rate << " messages/s\n"
+                  << "ingestion mode: " << ingestion_rate << " messages/s\n";
+
+    for (int i = 0; i < n; i++) {
+        pEp_identity* sequential = ingestion_sender("sequential", i);
+        pEp_identity* ingested = ingestion_sender("ingestion", i);
+        status = update_identity(session, sequential);
+        ASSERT_OK;
+        status = update_identity(session, ingested);
+        ASSERT_OK;
+        ASSERT_STREQ(sequential->username, ingested->username);
+        ASSERT_NOTNULL(ingested->user_id);
+        ASSERT_EQ(sequential->comm_type, ingested->comm_type);
+        ASSERT_EQ(sequential->major_ver, ingested->major_ver);
+        ASSERT_EQ(sequential->minor_ver, ingested->minor_ver);
+        ASSERT_EQ(sequential->flags, ingested->flags);
+        free_identity(sequential);
+        free_identity(ingested);
+    }
+    free_identity(me);
+}
+
+TEST_F(IngestionModeTest, check_checkpoints) {
+    // Entering ingestion mode from within a transaction is not allowed.
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    PEP_STATUS status = config_ingestion_mode(session, true, 0);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+    PEP_SQL_COMMIT_TRANSACTION();
+    ASSERT_FALSE(session->ingestion_mode);
+
+    // Initialise the other session first: it does not need to wait for the
+    // lock afterwards, since it only reads.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+
+    status = config_ingestion_mode(session, true, 0);
+    ASSERT_OK;
+    ASSERT_EQ(session->ingestion_checkpoint_interval,
+              PEP_INGESTION_DEFAULT_CHECKPOINT_INTERVAL);
+
+    // Other sessions see accumulated writes only after a checkpoint.
+    pEp_identity* carol = new_identity("carol@darthmama.org", NULL,
+                                       "CAROL", "Carol Cathode");
+    status = set_identity(session, carol);
+    ASSERT_OK;
+    pEp_identity* found = NULL;
+    status = get_identity(other, "carol@darthmama.org", "CAROL", &found);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+
+    status = ingestion_checkpoint(session);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 1);
+    status = get_identity(other, "carol@darthmama.org", "CAROL", &found);
+    ASSERT_OK;
+    ASSERT_NOTNULL(found);
+    ASSERT_STREQ(found->username, "Carol Cathode");
+    free_identity(found);
+
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    ASSERT_FALSE(session->ingestion_mode);
+    release(other);
+    free_identity(carol);
+}
+
+TEST_F(IngestionModeTest, check_rollback_keeps_other_writes) {
+    PEP_STATUS status = config_ingestion_mode(session, true, 0);
+    ASSERT_OK;
+
+    pEp_identity* bob = new_identity("bob@darthmama.org", NULL,
+                                     "BOB", "Bob the Builder");
+    status = set_identity(session, bob);
+    ASSERT_OK;
+
+    // A transaction rolled back within the batch only undoes its own writes.
+    pEp_identity* dave = new_identity("dave@darthmama.org", NULL,
+                                      "DAVE", "Dave Dynamo");
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    ASSERT_EQ(session->transaction_in_progress_no, 2);
+    status = set_identity(session, dave);
+    ASSERT_OK;
+    PEP_SQL_ROLLBACK_TRANSACTION();
+    ASSERT_EQ(session->transaction_in_progress_no, 1);
+    ASSERT_FALSE(session->transaction_rollback_only);
+
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+
+    pEp_identity* found = NULL;
+    status = get_identity(session, "bob@darthmama.org", "BOB", &found);
+    ASSERT_OK;
+    ASSERT_NOTNULL(found);
+    free_identity(found);
+    found = NULL;
+    status = get_identity(session, "dave@darthmama.org", "DAVE", &found);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    ASSERT_NULL(found);
+    free_identity(bob);
+    free_identity(dave);
+}
+
+// While the ingesting session keeps decrypting, a writer on another session
+// gets the lock within the maximum hold time, plus the longest backoff of a
+// waiting writer, plus some slack for a slow machine.
+TEST_F(IngestionModeTest, check_other_writer_gets_the_lock) {
+    pEp_identity* me = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &me);
+    ASSERT_OK;
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+
+    // Never checkpoint by count.
+    status = config_ingestion_mode(session, true, 1000000);
+    ASSERT_OK;
+    session->ingestion_max_hold_time_us = 200 * 1000;
+
+    auto begin = std::chrono::steady_clock::now();
+    std::atomic<bool> written(false);
+    PEP_STATUS write_status = PEP_UNKNOWN_ERROR;
+    std::chrono::duration<double> write_time(0);
+    std::thread writer([&] {
+        pEp_identity* erin = new_identity("erin@darthmama.org", NULL,
+                                          "ERIN", "Erin Electron");
+        write_status = set_identity(other, erin);
+        write_time = std::chrono::steady_clock::now() - begin;
+        free_identity(erin);
+        written = true;
+    });
+    int i = 0;
+    while (! written
+           && std::chrono::steady_clock::now() - begin < std::chrono::seconds(30)) {
+        status = decrypt_from(session, me, ingestion_sender("held", i++));
+        EXPECT_EQ(status, PEP_UNENCRYPTED);
+    }
+    writer.join();
+    ASSERT_TRUE(written);
+    ASSERT_EQ(write_status, PEP_STATUS_OK);
+    output_stream << "other writer waited " << write_time.count()
+                  << " s while " << i << " messages were ingested\n";
+    ASSERT_LT(write_time.count(), 0.2 + PEP_MAXIMUM_BACKOFF_IN_MS / 1000.0 + 2);
+
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+    release(other);
+    free_identity(me);
+}
@@ -0,0 +1,222 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "pEp_trace.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for KeyImportDigestTest
+    class KeyImportDigestTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            KeyImportDigestTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~KeyImportDigestTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the KeyImportDigestTest suite.
+
+    };
+
+}  // namespace
+
+/* Count calls into the cryptotech import function, as seen by tracing. */
+static void count_imports(void* context, const pEp_trace_span* span) {
+    if (strcmp(span->name, "crypto.import_key") == 0)
+        (* (int*) context) ++;
+}
+
+static PEP_STATUS import_deduplicated(PEP_SESSION session,
+                                      const std::string& key,
+                                      stringlist_t** keylist,
+                                      uint64_t* changes) {
+    return import_key_with_fpr_return_deduplicated(session, key.c_str(),
+                                                   key.size(), NULL, keylist,
+                                                   changes);
+}
+
+TEST_F(KeyImportDigestTest, check_reimport_skipped) {
+    int import_no = 0;
+    PEP_STATUS status = config_trace(session, NULL, count_imports, &import_no);
+    ASSERT_OK;
+
+    string pubkey = slurp("test_keys/pub/pep-test-alice-0x6FF00E97_pub.asc");
+    stringlist_t* keylist = NULL;
+    uint64_t changes = 0;
+    status = import_deduplicated(session, pubkey, &keylist, &changes);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 1);
+    ASSERT_NOTNULL(keylist);
+    ASSERT_STREQ(keylist->value, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97");
+    ASSERT_EQ(changes, 1);
+    free_stringlist(keylist);
+
+    // Identical data: same result, nothing changed, no actual import.
+    keylist = NULL;
+    changes = 0;
+    status = import_deduplicated(session, pubkey, &keylist, &changes);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 1);
+    ASSERT_NOTNULL(keylist);
+    ASSERT_STREQ(keylist->value, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97");
+    ASSERT_NULL(keylist->next);
+    ASSERT_EQ(changes, 0);
+
+    // Fingerprints are appended to a non-empty list, as the import would do.
+    status = import_deduplicated(session, pubkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 1);
+    ASSERT_EQ(stringlist_length(keylist), 2);
+    free_stringlist(keylist);
+}
+
+TEST_F(KeyImportDigestTest, check_different_data_imported) {
+    int import_no = 0;
+    PEP_STATUS status = config_trace(session, NULL, count_imports, &import_no);
+    ASSERT_OK;
+
+    string pubkey = slurp("test_keys/pub/pep-test-alice-0x6FF00E97_pub.asc");
+    stringlist_t* keylist = NULL;
+    status = import_deduplicated(session, pubkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    free_stringlist(keylist);
+
+    // Any different bytes go through the actual import, even for the same
+    // key.
+    string privkey = slurp("test_keys/priv/pep-test-alice-0x6FF00E97_priv.asc");
+    keylist = NULL;
+    status = import_deduplicated(session, privkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 2);
+    free_stringlist(keylist);
+
+    // Private key data is never short-circuited.
+    keylist = NULL;
+    identity_list* private_keys = NULL;
+    status = import_key_with_fpr_return_deduplicated(session, privkey.c_str(),
+                                                     privkey.size(),
+                                                     &private_keys, &keylist,
+                                                     NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 3);
+    ASSERT_NOTNULL(private_keys);
+    free_identity_list(private_keys);
+    free_stringlist(keylist);
+}
+
+TEST_F(KeyImportDigestTest, check_forgotten_after_delete) {
+    int import_no = 0;
+    PEP_STATUS status = config_trace(session, NULL, count_imports, &import_no);
+    ASSERT_OK;
+
+    string pubkey = slurp("test_keys/pub/pep-test-alice-0x6FF00E97_pub.asc");
+    stringlist_t* keylist = NULL;
+    status = import_deduplicated(session, pubkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    free_stringlist(keylist);
+
+    status = delete_keypair(session, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97");
+    ASSERT_OK;
+
+    keylist = NULL;
+    uint64_t changes = 0;
+    status = import_deduplicated(session, pubkey, &keylist, &changes);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 2);
+    ASSERT_NOTNULL(keylist);
+    free_stringlist(keylist);
+}
+
+TEST_F(KeyImportDigestTest, check_reimported_when_key_gone) {
+    int import_no = 0;
+    PEP_STATUS status = config_trace(session, NULL, count_imports, &import_no);
+    ASSERT_OK;
+
+    string pubkey = slurp("test_keys/pub/pep-test-alice-0x6FF00E97_pub.asc");
+    stringlist_t* keylist = NULL;
+    status = import_deduplicated(session, pubkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    free_stringlist(keylist);
+
+    // Remove the key from the key store behind the Engine's back, without
+    // delete_keypair: the digest is still recorded, but must not be trusted.
+    status = session->cryptotech[PEP_crypt_OpenPGP].delete_keypair(
+                 session, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97");
+    ASSERT_OK;
+
+    keylist = NULL;
+    status = import_deduplicated(session, pubkey, &keylist, NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    ASSERT_EQ(import_no, 2);
+    ASSERT_NOTNULL(keylist);
+    free_stringlist(keylist);
+
+    keylist = NULL;
+    status = find_keys(session, "4ABE3AAF59AC32CFE4F86500A9411D176FF00E97",
+                       &keylist);
+    ASSERT_OK;
+    ASSERT_NOTNULL(keylist);
+    free_stringlist(keylist);
+}
@@ -0,0 +1,267 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+#include "key_sets.h"
+#include "engine_sql.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for KeySetsTest
+    class KeySetsTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            KeySetsTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~KeySetsTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the KeySetsTest suite.
+
+    };
+
+}  // namespace
+
+static const char* const unknown_fpr = "0123456789ABCDEF0123456789ABCDEF01234567";
+
+TEST_F(KeySetsTest, check_mistrusted_keys) {
+    bool mistrusted = true;
+    PEP_STATUS status = is_mistrusted_key(session, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+
+    // Writes are seen at once, whatever the spelling of the fingerprint.
+    status = add_mistrusted_key(session, unknown_fpr);
+    ASSERT_OK;
+    status = is_mistrusted_key(session, "01234567 89abcdef 01234567 89abcdef 01234567", &mistrusted);
+    ASSERT_OK;
+    EXPECT_TRUE(mistrusted);
+    ASSERT_TRUE(pEp_key_sets_is_mistrusted(session, unknown_fpr, &mistrusted));
+    EXPECT_TRUE(mistrusted);
+
+    status = delete_mistrusted_key(session, unknown_fpr);
+    ASSERT_OK;
+    status = is_mistrusted_key(session, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+}
+
+TEST_F(KeySetsTest, check_replacement_fpr) {
+    const char* replacement = "89ABCDEF0123456789ABCDEF0123456789ABCDEF";
+    char* revoked_fpr = NULL;
+    uint64_t revocation_date = 0;
+    PEP_STATUS status = get_replacement_fpr(session, unknown_fpr, &revoked_fpr, &revocation_date);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    ASSERT_NULL(revoked_fpr);
+
+    status = set_revoked(session, unknown_fpr, replacement, 1234567);
+    ASSERT_OK;
+    status = get_replacement_fpr(session, unknown_fpr, &revoked_fpr, &revocation_date);
+    ASSERT_OK;
+    ASSERT_NOTNULL(revoked_fpr);
+    EXPECT_STREQ(revoked_fpr, replacement);
+    EXPECT_EQ(revocation_date, 1234567);
+    free(revoked_fpr);
+    revoked_fpr = NULL;
+
+    // The replacement itself is not revoked.
+    status = get_replacement_fpr(session, replacement, &revoked_fpr, &revocation_date);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    ASSERT_NULL(revoked_fpr);
+}
+
+TEST_F(KeySetsTest, check_own_keys) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    bool listed = false;
+    status = own_key_is_listed(session, alice->fpr, &listed);
+    ASSERT_OK;
+    EXPECT_TRUE(listed);
+    status = own_key_is_listed(session, bob->fpr, &listed);
+    ASSERT_OK;
+    EXPECT_FALSE(listed);
+
+    bool own_key = false;
+    status = is_own_key(session, alice->fpr, &own_key);
+    ASSERT_OK;
+    EXPECT_TRUE(own_key);
+    status = is_own_key(session, bob->fpr, &own_key);
+    ASSERT_OK;
+    EXPECT_FALSE(own_key);
+    status = is_own_key(session, unknown_fpr, &own_key);
+    ASSERT_OK;
+    EXPECT_FALSE(own_key);
+
+    free_identity(alice);
+    free_identity(bob);
+}
+
+TEST_F(KeySetsTest, check_own_key_set_generation) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    uint64_t before = 0;
+    status = pEp_sql_get_key_set_generation(session, pEp_sql_key_set_own, &before);
+    ASSERT_OK;
+
+    // Partners and their trust are not part of the own key set.
+    free(bob->username);
+    bob->username = strdup("Bob the Renamed");
+    status = set_identity(session, bob);
+    ASSERT_OK;
+    status = trust_personal_key(session, bob);
+    ASSERT_OK;
+    uint64_t after = 0;
+    status = pEp_sql_get_key_set_generation(session, pEp_sql_key_set_own, &after);
+    ASSERT_OK;
+    EXPECT_EQ(after, before);
+
+    // A new own identity is.
+    pEp_identity* carol = new_identity("pep.test.carol@pep-project.org", NULL, PEP_OWN_USERID, "Carol");
+    status = myself(session, carol);
+    ASSERT_OK;
+    status = pEp_sql_get_key_set_generation(session, pEp_sql_key_set_own, &after);
+    ASSERT_OK;
+    EXPECT_GT(after, before);
+    bool listed = false;
+    status = own_key_is_listed(session, carol->fpr, &listed);
+    ASSERT_OK;
+    EXPECT_TRUE(listed);
+
+    free_identity(alice);
+    free_identity(bob);
+    free_identity(carol);
+}
+
+TEST_F(KeySetsTest, check_other_sessions) {
+    PEP_SESSION other = NULL;
+    PEP_STATUS status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+
+    // Load the set in both sessions, then change it from one.
+    bool mistrusted = true;
+    status = is_mistrusted_key(other, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+    status = add_mistrusted_key(session, unknown_fpr);
+    ASSERT_OK;
+    status = is_mistrusted_key(other, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_TRUE(mistrusted);
+
+    // Uncommitted changes are only seen by the session making them.
+    status = config_ingestion_mode(session, true, 0);
+    ASSERT_OK;
+    status = delete_mistrusted_key(session, unknown_fpr);
+    ASSERT_OK;
+    status = is_mistrusted_key(session, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+    status = is_mistrusted_key(other, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_TRUE(mistrusted);
+
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    status = is_mistrusted_key(other, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+    status = is_mistrusted_key(session, unknown_fpr, &mistrusted);
+    ASSERT_OK;
+    EXPECT_FALSE(mistrusted);
+
+    release(other);
+}
+
+TEST_F(KeySetsTest, check_many_keys) {
+    // Enough keys to grow the table and fill the Bloom filter in part.
+    char fpr[41];
+    int i;
+    for (i = 0; i < 1000; i ++) {
+        snprintf(fpr, sizeof(fpr), "%040X", i * 7919);
+        PEP_STATUS status = add_mistrusted_key(session, fpr);
+        ASSERT_OK;
+    }
+    for (i = 0; i < 2000; i ++) {
+        snprintf(fpr, sizeof(fpr), "%040X", i * 7919);
+        bool mistrusted = false;
+        PEP_STATUS status = is_mistrusted_key(session, fpr, &mistrusted);
+        ASSERT_OK;
+        EXPECT_EQ(mistrusted, i < 1000);
+    }
+}
@@ -0,0 +1,235 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for KeyStatusTest
+    class KeyStatusTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            KeyStatusTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~KeyStatusTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the KeyStatusTest suite.
+
+    };
+
+}  // namespace
+
+// The answers of get_key_status must be those of the single-field functions.
+static void check_against_single_calls(PEP_SESSION session, const char* fpr,
+                                       time_t when) {
+    PEP_key_status key_status;
+    PEP_STATUS status = get_key_status(session, fpr, when, PEP_key_status_all, &key_status);
+    ASSERT_OK;
+
+    bool has_private = false;
+    status = contains_priv_key(session, fpr, &has_private);
+    ASSERT_OK;
+    EXPECT_EQ(key_status.has_private, has_private);
+
+    PEP_comm_type ct = PEP_ct_unknown;
+    status = get_key_rating(session, fpr, &ct);
+    ASSERT_OK;
+    EXPECT_EQ(key_status.comm_type, ct);
+
+    bool revoked = false;
+    status = key_revoked(session, fpr, &revoked);
+    ASSERT_OK;
+    EXPECT_EQ(key_status.revoked, revoked);
+
+    if (!revoked) {
+        bool expired = false;
+        status = key_expired(session, fpr, when, &expired);
+        ASSERT_OK;
+        EXPECT_EQ(key_status.expired, expired);
+    }
+
+    time_t created = 0;
+    status = key_created(session, fpr, &created);
+    ASSERT_OK;
+    EXPECT_EQ(key_status.created, created);
+}
+
+TEST_F(KeyStatusTest, check_own_and_partner_keys) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    check_against_single_calls(session, alice->fpr, time(NULL));
+    check_against_single_calls(session, bob->fpr, time(NULL));
+
+    PEP_key_status key_status;
+    status = get_key_status(session, alice->fpr, time(NULL), PEP_key_status_all, &key_status);
+    ASSERT_OK;
+    EXPECT_TRUE(key_status.has_private);
+    EXPECT_GE(key_status.comm_type, PEP_ct_strong_but_unconfirmed);
+    EXPECT_FALSE(key_status.revoked);
+    EXPECT_FALSE(key_status.expired);
+    EXPECT_GT(key_status.created, 0);
+
+    status = get_key_status(session, bob->fpr, time(NULL), PEP_key_status_all, &key_status);
+    ASSERT_OK;
+    EXPECT_FALSE(key_status.has_private);
+
+    free_identity(alice);
+    free_identity(bob);
+}
+
+TEST_F(KeyStatusTest, check_revoked_key) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    status = revoke_key(session, alice->fpr, NULL);
+    ASSERT_OK;
+
+    check_against_single_calls(session, alice->fpr, time(NULL));
+
+    PEP_key_status key_status;
+    status = get_key_status(session, alice->fpr, time(NULL), PEP_key_status_all, &key_status);
+    ASSERT_OK;
+    EXPECT_TRUE(key_status.revoked);
+    EXPECT_FALSE(key_status.expired);
+    free_identity(alice);
+}
+
+TEST_F(KeyStatusTest, check_missing_key) {
+    const char* fpr = "0123456789ABCDEF0123456789ABCDEF01234567";
+    PEP_key_status key_status;
+
+    // Like contains_priv_key and get_key_rating, no error for these
+    PEP_STATUS status = get_key_status(session, fpr, time(NULL),
+                                       PEP_key_status_private | PEP_key_status_rating,
+                                       &key_status);
+    ASSERT_OK;
+    EXPECT_FALSE(key_status.has_private);
+    EXPECT_EQ(key_status.comm_type, PEP_ct_unknown);
+
+    status = get_key_status(session, fpr, time(NULL), PEP_key_status_all, &key_status);
+    EXPECT_EQ(status, PEP_KEY_NOT_FOUND);
+}
+
+TEST_F(KeyStatusTest, check_update_identity_timing) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    std::vector<pEp_identity*> partners;
+    for (auto preset : { TestUtilsPreset::BOB, TestUtilsPreset::CAROL, TestUtilsPreset::DAVE }) {
+        pEp_identity* ident = NULL;
+        status = TestUtilsPreset::set_up_preset(session, preset, true, true, true, false, false, false, &ident);
+        ASSERT_OK;
+        partners.push_back(ident);
+    }
+
+    // update_identity and myself validate every candidate key with
+    // get_key_status ; without a get_key_status driver function the engine
+    // asks the driver once per field instead.
+    const int rounds = 200;
+    auto time_rounds = [&]() {
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            for (auto partner : partners) {
+                pEp_identity* ident = new_identity(partner->address, NULL, partner->user_id, NULL);
+                PEP_STATUS status = update_identity(session, ident);
+                EXPECT_EQ(status, PEP_STATUS_OK);
+                EXPECT_STREQ(ident->fpr, partner->fpr);
+                free_identity(ident);
+            }
+            pEp_identity* me = new_identity(alice->address, NULL, alice->user_id, NULL);
+            PEP_STATUS status = myself(session, me);
+            EXPECT_EQ(status, PEP_STATUS_OK);
+            free_identity(me);
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - begin).count();
+    };
+
+    get_key_status_t driver_function = session->cryptotech[PEP_crypt_OpenPGP].get_key_status;
+    session->cryptotech[PEP_crypt_OpenPGP].get_key_status = NULL;
+    auto per_field_us = time_rounds();
+    session->cryptotech[PEP_crypt_OpenPGP].get_key_status = driver_function;
+    auto one_pass_us = time_rounds();
+
+    output_stream << rounds << " rounds of update_identity x " << partners.size()
+                  << " + myself: " << per_field_us << " us asking per field, "
+                  << one_pass_us << " us with "
+                  << (driver_function ? "the driver's get_key_status" : "no driver get_key_status either")
+                  << std::endl;
+
+    free_identity(alice);
+    for (auto partner : partners)
+        free_identity(partner);
+}
@@ -0,0 +1,276 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "mime.h"
+#include "pEp_arena.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for MessageArenaTest
+    class MessageArenaTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            MessageArenaTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~MessageArenaTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the MessageArenaTest suite.
+
+    };
+
+}  // namespace
+
+// Count the heap blocks of a message tree, as free_message would free them.
+static size_t count_allocations(const message* msg) {
+    size_t n = 1;
+    const char* strings[] = { msg->id, msg->shortmsg, msg->longmsg,
+                              msg->longmsg_formatted, msg->comments,
+                              msg->_sender_fpr };
+    for (auto s : strings)
+        n += (s != NULL);
+    auto count_identity = [](const pEp_identity* ident) -> size_t {
+        if (ident == NULL)
+            return 0;
+        return 1 + (ident->address != NULL) + (ident->fpr != NULL)
+               + (ident->user_id != NULL) + (ident->username != NULL);
+    };
+    n += count_identity(msg->from) + count_identity(msg->recv_by);
+    for (auto list : { msg->to, msg->cc, msg->bcc, msg->reply_to })
+        for (const identity_list* il = list; il != NULL; il = il->next)
+            n += 1 + count_identity(il->ident);
+    for (auto list : { msg->in_reply_to, msg->references, msg->keywords })
+        for (const stringlist_t* sl = list; sl != NULL; sl = sl->next)
+            n += 1 + (sl->value != NULL);
+    for (const stringpair_list_t* spl = msg->opt_fields; spl != NULL; spl = spl->next)
+        n += 1 + (spl->value ? 3 : 0);
+    for (const bloblist_t* b = msg->attachments; b != NULL; b = b->next)
+        n += 1 + (b->value != NULL) + (b->mime_type != NULL) + (b->filename != NULL);
+    n += (msg->sent != NULL) + (msg->recv != NULL);
+    return n;
+}
+
+static message* make_rich_message() {
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->id = strdup("arena-test@darthmama.org");
+    msg->shortmsg = strdup("Arena");
+    msg->longmsg = strdup("A message with many small parts.");
+    msg->from = new_identity("alice@darthmama.org", NULL, "ALICE", "Alice");
+    msg->to = new_identity_list(new_identity("bob@darthmama.org", NULL, NULL, "Bob"));
+    identity_list_add(msg->to, new_identity("carol@darthmama.org", NULL, NULL, "Carol"));
+    msg->cc = new_identity_list(new_identity("dave@darthmama.org", NULL, NULL, "Dave"));
+    msg->keywords = new_stringlist("one");
+    stringlist_add(msg->keywords, "two");
+    msg->opt_fields = new_stringpair_list(new_stringpair("X-Arena", "yes"));
+    msg->sent = new_timestamp(1700000000);
+    for (int i = 0; i < 5; i++) {
+        std::string name = "file" + std::to_string(i) + ".txt";
+        char* value = strdup(("attachment " + std::to_string(i)).c_str());
+        if (msg->attachments == NULL)
+            msg->attachments = new_bloblist(value, strlen(value), "text/plain", name.c_str());
+        else
+            bloblist_add(msg->attachments, value, strlen(value), "text/plain", name.c_str());
+    }
+    return msg;
+}
+
+static std::string encode(const message* msg) {
+    char* text = NULL;
+    PEP_STATUS status = mime_encode_message(msg, false, &text, false);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    std::string result = text ? text : "";
+    free(text);
+    return result;
+}
+
+TEST_F(MessageArenaTest, check_dup_same_as_heap) {
+    message* msg = make_rich_message();
+    message* heap_copy = message_dup(msg);
+    pEp_arena* arena = pEp_arena_new(0);
+    ASSERT_NOTNULL(arena);
+    message* arena_copy = message_dup_in_arena(arena, msg);
+    ASSERT_NOTNULL(heap_copy);
+    ASSERT_NOTNULL(arena_copy);
+
+    // Reading an arena message works like reading a heap message, and the
+    // MIME encoder generates its own boundaries: compare everything else.
+    ASSERT_STREQ(arena_copy->shortmsg, msg->shortmsg);
+    ASSERT_STREQ(arena_copy->to->next->ident->address, "carol@darthmama.org");
+    ASSERT_STREQ(arena_copy->opt_fields->value->value, "yes");
+    ASSERT_EQ(arena_copy->sent->tm_year, msg->sent->tm_year);
+    ASSERT_EQ(arena_copy->attachments->size, msg->attachments->size);
+    ASSERT_EQ(memcmp(arena_copy->attachments->value, msg->attachments->value,
+                     msg->attachments->size), 0);
+    std::string arena_text = encode(arena_copy);
+    std::string heap_text = encode(heap_copy);
+    ASSERT_EQ(arena_text.size(), heap_text.size());
+
+    // A heap copy of an arena message is an ordinary message.
+    message* back = message_dup(arena_copy);
+    pEp_arena_free(arena);
+    ASSERT_STREQ(back->shortmsg, msg->shortmsg);
+    free(back->shortmsg);
+    back->shortmsg = strdup("Changed");
+
+    free_message(back);
+    free_message(heap_copy);
+    free_message(msg);
+}
+
+TEST_F(MessageArenaTest, check_construction) {
+    pEp_arena* arena = pEp_arena_new(0);
+    ASSERT_NOTNULL(arena);
+    message* msg = new_message_in_arena(arena, PEP_dir_outgoing);
+    ASSERT_NOTNULL(msg);
+    msg->shortmsg = pEp_arena_strdup(arena, "Built in an arena");
+    msg->longmsg = pEp_arena_strdup(arena, "Hello.");
+    pEp_identity* alice = new_identity("alice@darthmama.org", NULL, "ALICE", "Alice");
+    msg->from = pEp_arena_identity_dup(arena, alice);
+    identity_list* to = new_identity_list(new_identity("bob@darthmama.org", NULL, NULL, "Bob"));
+    msg->to = pEp_arena_identity_list_dup(arena, to);
+    ASSERT_STREQ(msg->from->username, "Alice");
+    ASSERT_STREQ(msg->to->ident->address, "bob@darthmama.org");
+    ASSERT_NE(encode(msg).find("Built in an arena"), std::string::npos);
+    free_identity_list(to);
+    free_identity(alice);
+    pEp_arena_free(arena);
+}
+
+// The decrypt cache keeps each decryption result in an arena: compare the
+// allocations of a decrypted message pair with the chunks of its arenas.
+TEST_F(MessageArenaTest, check_allocations_per_cached_decrypt) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    message* msg = make_rich_message();
+    free_identity(msg->from);
+    msg->from = identity_dup(alice);
+    free_identity_list(msg->to);
+    msg->to = new_identity_list(identity_dup(bob));
+    message* enc = NULL;
+    status = encrypt_message(session, msg, NULL, &enc, PEP_enc_PGP_MIME, 0);
+    ASSERT_OK;
+    char* text = NULL;
+    status = mime_encode_message(enc, false, &text, false);
+    ASSERT_OK;
+
+    message* src = NULL;
+    status = mime_decode_message(text, strlen(text), &src, NULL);
+    ASSERT_OK;
+    src->dir = PEP_dir_incoming;
+    message* dst = NULL;
+    stringlist_t* keylist = NULL;
+    PEP_decrypt_flags_t flags = 0;
+    status = decrypt_message_2(session, src, &dst, &keylist, &flags);
+    ASSERT_OK;
+    ASSERT_NOTNULL(dst);
+
+    size_t heap_allocations = count_allocations(src) + count_allocations(dst);
+    pEp_arena* src_arena = pEp_arena_new(0);
+    pEp_arena* dst_arena = pEp_arena_new(0);
+    ASSERT_NOTNULL(message_dup_in_arena(src_arena, src));
+    ASSERT_NOTNULL(message_dup_in_arena(dst_arena, dst));
+    size_t arena_allocations
+        = 2 + pEp_arena_chunk_no(src_arena) + pEp_arena_chunk_no(dst_arena);
+
+    const int n = 1000;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        free_message(message_dup(dst));
+    std::chrono::duration<double> heap_seconds
+        = std::chrono::steady_clock::now() - begin;
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+        pEp_arena* arena = pEp_arena_new(0);
+        message_dup_in_arena(arena, dst);
+        pEp_arena_free(arena);
+    }
+    std::chrono::duration<double> arena_seconds
+        = std::chrono::steady_clock::now() - begin;
+
+    output_stream << "decrypted message trees: " << heap_allocations
+                  << " heap allocations, " << arena_allocations
+                  << " in arenas\n"
+                  << "copy and free: heap " << n / heap_seconds.count()
+                  << "/s, arena " << n / arena_seconds.count() << "/s\n";
+    ASSERT_LT(arena_allocations * 4, heap_allocations);
+
+    pEp_arena_free(dst_arena);
+    pEp_arena_free(src_arena);
+    free_message(dst);
+    free_message(src);
+    free_stringlist(keylist);
+    free(text);
+    free_message(enc);
+    free_message(msg);
+    free_identity(alice);
+    free_identity(bob);
+}
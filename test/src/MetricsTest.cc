@@ -0,0 +1,143 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "pEp_metrics.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for MetricsTest
+    class MetricsTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            MetricsTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~MetricsTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the MetricsTest suite.
+
+    };
+
+}  // namespace
+
+TEST_F(MetricsTest, check_counters_grow) {
+    PEP_metrics before;
+    PEP_STATUS status = pEp_get_metrics(session, &before, NULL);
+    ASSERT_OK;
+
+    pEp_identity* alice = new_identity("alice@darthmama.org", NULL,
+                                       "ALICE", "Alice in Wonderland");
+    status = set_identity(session, alice);
+    ASSERT_OK;
+    int32_t value = 0;
+    status = sequence_value(session, "metrics", &value);
+    ASSERT_OK;
+
+    PEP_metrics after, process;
+    status = pEp_get_metrics(session, &after, &process);
+    ASSERT_OK;
+    ASSERT_GE(after.sql_transactions, before.sql_transactions + 2);
+    ASSERT_GT(after.sql_steps, before.sql_steps);
+    ASSERT_GE(after.sql_transaction_time_us, after.sql_transaction_max_time_us);
+    ASSERT_EQ(after.sql_rollbacks, before.sql_rollbacks);
+
+    // The process counters include every session.
+    ASSERT_GE(process.sql_transactions, after.sql_transactions);
+    ASSERT_GE(process.sql_steps, after.sql_steps);
+    ASSERT_GE(process.sql_transaction_max_time_us,
+              after.sql_transaction_max_time_us);
+    free_identity(alice);
+}
+
+TEST_F(MetricsTest, check_text) {
+    int32_t value = 0;
+    PEP_STATUS status = sequence_value(session, "metrics", &value);
+    ASSERT_OK;
+
+    char* text = NULL;
+    status = pEp_get_metrics_text(session, &text);
+    ASSERT_OK;
+    ASSERT_NE(text, nullptr);
+    output_stream << text;
+
+    std::string t = text;
+    ASSERT_NE(t.find("# TYPE pep_sql_transactions_total counter\n"),
+              std::string::npos);
+    ASSERT_NE(t.find("pep_sql_transactions_total{scope=\"session\"} "),
+              std::string::npos);
+    ASSERT_NE(t.find("pep_sql_transactions_total{scope=\"process\"} "),
+              std::string::npos);
+    ASSERT_NE(t.find("pep_sql_statement_runs_total{statement=\""),
+              std::string::npos);
+    // Label values never span lines.
+    for (std::string::size_type i = t.find("{statement=\"");
+         i != std::string::npos; i = t.find("{statement=\"", i + 1))
+        ASSERT_LT(t.find("\"} ", i), t.find('\n', i));
+    free(text);
+}
+
+TEST_F(MetricsTest, check_null_outputs) {
+    PEP_STATUS status = pEp_get_metrics(session, NULL, NULL);
+    ASSERT_OK;
+}
@@ -0,0 +1,308 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "engine_sql.h"
+#include "pEp_trace.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for NonblockingSQLTest
+    class NonblockingSQLTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            NonblockingSQLTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~NonblockingSQLTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the NonblockingSQLTest suite.
+
+    };
+
+}  // namespace
+
+static int ready_no = 0;
+
+static void count_ready(void *context) {
+    int *counter = (int *) context;
+    (* counter) ++;
+}
+
+/* Hold the management database write lock from a second session, so that the
+   fixture session sees it as locked by someone else. */
+static void lock_from(PEP_SESSION session) {
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+}
+
+static void unlock_from(PEP_SESSION session) {
+    PEP_SQL_COMMIT_TRANSACTION();
+}
+
+TEST_F(NonblockingSQLTest, check_would_block_and_ready) {
+    PEP_SESSION other = NULL;
+    PEP_STATUS status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+
+    ready_no = 0;
+    status = config_nonblocking_sql(session, true, count_ready, & ready_no);
+    ASSERT_OK;
+
+    pEp_identity* alice = new_identity("alice@darthmama.org", NULL,
+                                       "ALICE", "Alice in Wonderland");
+    lock_from(other);
+
+    status = set_identity(session, alice);
+    ASSERT_EQ(status, PEP_WOULD_BLOCK);
+    ASSERT_FALSE(PEP_STATUS_is_error(status));
+    status = update_identity(session, alice);
+    ASSERT_EQ(status, PEP_WOULD_BLOCK);
+    ASSERT_EQ(ready_no, 0);
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+
+    unlock_from(other);
+    ASSERT_EQ(ready_no, 1);
+
+    status = set_identity(session, alice);
+    ASSERT_OK;
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+
+    status = update_identity(session, alice);
+    ASSERT_OK;
+
+    // No more notifications once nobody is waiting.
+    lock_from(other);
+    unlock_from(other);
+    ASSERT_EQ(ready_no, 1);
+
+    free_identity(alice);
+    release(other);
+}
+
+TEST_F(NonblockingSQLTest, check_blocking_by_default) {
+    pEp_identity* bob = new_identity("bob@darthmama.org", NULL,
+                                     "BOB", "Bob the Builder");
+    PEP_STATUS status = set_identity(session, bob);
+    ASSERT_OK;
+
+    status = config_nonblocking_sql(session, true, NULL, NULL);
+    ASSERT_OK;
+    status = set_identity(session, bob);
+    ASSERT_OK;
+
+    status = config_nonblocking_sql(session, false, NULL, NULL);
+    ASSERT_OK;
+    ASSERT_FALSE(session->nonblocking_sql);
+    free_identity(bob);
+}
+
+TEST_F(NonblockingSQLTest, check_nested_rollback) {
+    PEP_STATUS status = config_nonblocking_sql(session, true, NULL, NULL);
+    ASSERT_OK;
+    pEp_identity* alice = new_identity("alice@darthmama.org", NULL,
+                                       "ALICE", "Alice in Wonderland");
+    pEp_identity* bob = new_identity("bob@darthmama.org", NULL,
+                                     "BOB", "Bob the Builder");
+
+    bool transaction_begun = false;
+    status = pEp_sql_begin_nonblocking_call(session, & transaction_begun);
+    ASSERT_OK;
+    ASSERT_TRUE(transaction_begun);
+
+    status = set_identity(session, alice);
+    ASSERT_OK;
+
+    // A nested transaction rolls back its own changes only.
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    ASSERT_EQ(session->transaction_in_progress_no, 2);
+    status = set_identity(session, bob);
+    ASSERT_OK;
+    PEP_SQL_ROLLBACK_TRANSACTION();
+    ASSERT_FALSE(session->transaction_rollback_only);
+
+    pEp_sql_end_nonblocking_call(session, transaction_begun);
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+
+    pEp_identity* found = NULL;
+    status = get_identity(session, alice->address, alice->user_id, &found);
+    ASSERT_OK;
+    free_identity(found);
+    found = NULL;
+    status = get_identity(session, bob->address, bob->user_id, &found);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    free_identity(alice);
+    free_identity(bob);
+}
+
+// Decrypt one unencrypted incoming message from a pEp user, which makes the
+// Engine update the sender identity.  On PEP_WOULD_BLOCK check that the
+// output parameters are untouched.
+static PEP_STATUS decrypt_plain(PEP_SESSION session) {
+    message* msg = new_message(PEP_dir_incoming);
+    msg->from = new_identity("carol@darthmama.org", NULL, NULL, "Carol");
+    msg->to = new_identity_list(new_identity("dave@darthmama.org", NULL,
+                                             NULL, "Dave"));
+    msg->shortmsg = strdup("non-blocking test");
+    msg->longmsg = strdup("Hello.");
+    msg->opt_fields = new_stringpair_list(new_stringpair("X-pEp-Version",
+                                                         "2.1"));
+    message* dst = NULL;
+    stringlist_t* keylist = NULL;
+    PEP_decrypt_flags_t flags = 0;
+    PEP_STATUS status = decrypt_message_2(session, msg, &dst, &keylist, &flags);
+    if (status == PEP_WOULD_BLOCK) {
+        EXPECT_EQ(dst, nullptr);
+        EXPECT_EQ(keylist, nullptr);
+        EXPECT_EQ(flags, 0);
+        EXPECT_EQ(msg->rating, PEP_rating_undefined);
+    }
+    free_message(dst);
+    free_stringlist(keylist);
+    free_message(msg);
+    return status;
+}
+
+// Whether the sender of decrypt_plain is known as a pEp user.
+static bool carol_is_pEp_user(PEP_SESSION session) {
+    pEp_identity* carol = new_identity("carol@darthmama.org", NULL, NULL,
+                                       NULL);
+    bool is_pEp = false;
+    if (update_identity(session, carol) != PEP_STATUS_OK
+        || is_pEp_user(session, carol, &is_pEp) != PEP_STATUS_OK)
+        is_pEp = false;
+    free_identity(carol);
+    return is_pEp;
+}
+
+TEST_F(NonblockingSQLTest, check_decrypt_would_block_at_entry) {
+    PEP_SESSION other = NULL;
+    PEP_STATUS status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    ready_no = 0;
+    status = config_nonblocking_sql(session, true, count_ready, & ready_no);
+    ASSERT_OK;
+
+    lock_from(other);
+    status = decrypt_plain(session);
+    ASSERT_EQ(status, PEP_WOULD_BLOCK);
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+    ASSERT_EQ(ready_no, 0);
+    unlock_from(other);
+    ASSERT_EQ(ready_no, 1);
+
+    status = decrypt_plain(session);
+    ASSERT_EQ(status, PEP_UNENCRYPTED);
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+    ASSERT_TRUE(carol_is_pEp_user(session));
+    release(other);
+}
+
+/* Take the lock from another session, without waiting, as soon as
+   decrypt_message_2 begins updating the sender identity. */
+struct lock_during_call {
+    PEP_SESSION other;
+    bool transaction_begun;
+    PEP_STATUS status;
+};
+
+static void lock_at_update_identity(void *context, const pEp_trace_span *span) {
+    lock_during_call* l = (lock_during_call*) context;
+    if (strcmp(span->name, "api.update_identity") == 0
+        && ! l->transaction_begun && l->status == PEP_STATUS_OK)
+        l->status = pEp_sql_begin_nonblocking_call(l->other,
+                                                   & l->transaction_begun);
+}
+
+TEST_F(NonblockingSQLTest, check_decrypt_would_block_during_call) {
+    lock_during_call l = { NULL, false, PEP_STATUS_OK };
+    PEP_STATUS status = init(&l.other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = config_nonblocking_sql(l.other, true, NULL, NULL);
+    ASSERT_OK;
+    ready_no = 0;
+    status = config_nonblocking_sql(session, true, count_ready, & ready_no);
+    ASSERT_OK;
+    status = config_trace(session, lock_at_update_identity, NULL, &l);
+    ASSERT_OK;
+
+    // The lock was free at entry, and decrypt_message_2 had not taken it to
+    // read; once another session holds it the call fails without waiting,
+    // and rolls back what it did.
+    status = decrypt_plain(session);
+    ASSERT_EQ(l.status, PEP_STATUS_OK);
+    ASSERT_TRUE(l.transaction_begun);
+    ASSERT_EQ(status, PEP_WOULD_BLOCK);
+    ASSERT_EQ(session->transaction_in_progress_no, 0);
+    ASSERT_EQ(ready_no, 0);
+
+    status = config_trace(session, NULL, NULL, NULL);
+    ASSERT_OK;
+    pEp_sql_end_nonblocking_call(l.other, l.transaction_begun);
+    ASSERT_EQ(ready_no, 1);
+    ASSERT_FALSE(carol_is_pEp_user(session));
+
+    status = decrypt_plain(session);
+    ASSERT_EQ(status, PEP_UNENCRYPTED);
+    ASSERT_TRUE(carol_is_pEp_user(session));
+    release(l.other);
+}
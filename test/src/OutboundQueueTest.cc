@@ -0,0 +1,222 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "transport.h"
+#include "engine_sql.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for OutboundQueueTest
+    class OutboundQueueTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            OutboundQueueTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~OutboundQueueTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the OutboundQueueTest suite.
+
+    };
+
+}  // namespace
+
+static std::atomic<int> delivered_no(0);
+
+static PEP_STATUS countingMessageToSend(message* msg) {
+    if (msg == nullptr)
+        return PEP_UNKNOWN_ERROR;
+    delivered_no ++;
+    free_message(msg);
+    return PEP_STATUS_OK;
+}
+
+static PEP_STATUS slowMessageToSend(message* msg) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return countingMessageToSend(msg);
+}
+
+static message* new_test_message() {
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->shortmsg = strdup("outbound queue test");
+    return msg;
+}
+
+TEST_F(OutboundQueueTest, check_synchronous_by_default) {
+    delivered_no = 0;
+    session->messageToSend = countingMessageToSend;
+
+    PEP_STATUS status = queue_message_to_send(session, new_test_message());
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, 1);
+
+    PEP_outbound_queue_stats stats;
+    status = get_outbound_queue_stats(session, &stats);
+    ASSERT_OK;
+    ASSERT_EQ(stats.enqueued, 0);
+}
+
+TEST_F(OutboundQueueTest, check_no_send_function) {
+    session->messageToSend = NULL;
+    PEP_STATUS status = config_outbound_queue(session, true, 0, 0);
+    ASSERT_EQ(status, PEP_SEND_FUNCTION_NOT_REGISTERED);
+}
+
+TEST_F(OutboundQueueTest, check_queued_delivery) {
+    delivered_no = 0;
+    session->messageToSend = countingMessageToSend;
+    PEP_STATUS status = config_outbound_queue(session, true, 0, 4);
+    ASSERT_OK;
+
+    const int n = 50;
+    for (int i = 0; i < n; i++) {
+        status = queue_message_to_send(session, new_test_message());
+        ASSERT_OK;
+    }
+    status = flush_outbound_queue(session);
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, n);
+
+    PEP_outbound_queue_stats stats;
+    status = get_outbound_queue_stats(session, &stats);
+    ASSERT_OK;
+    ASSERT_TRUE(stats.running);
+    ASSERT_EQ(stats.depth, 0);
+    ASSERT_EQ(stats.in_flight, 0);
+    ASSERT_EQ(stats.batch_size, 4);
+    ASSERT_EQ(stats.enqueued + stats.delivered_synchronously, n);
+    ASSERT_EQ(stats.delivered, n);
+    ASSERT_EQ(stats.failed, 0);
+    ASSERT_GE(stats.batches, (uint64_t) (stats.enqueued + 3) / 4);
+    ASSERT_GE(stats.max_latency_us, stats.last_latency_us);
+    output_stream << "average latency: "
+                  << (stats.total_latency_us / stats.delivered) << " us\n";
+}
+
+TEST_F(OutboundQueueTest, check_backpressure) {
+    delivered_no = 0;
+    session->messageToSend = slowMessageToSend;
+    PEP_STATUS status = config_outbound_queue(session, true, 2, 1);
+    ASSERT_OK;
+
+    const int n = 8;
+    for (int i = 0; i < n; i++) {
+        status = queue_message_to_send(session, new_test_message());
+        ASSERT_OK;
+        PEP_outbound_queue_stats stats;
+        status = get_outbound_queue_stats(session, &stats);
+        ASSERT_OK;
+        ASSERT_LE(stats.depth, 2);
+    }
+    status = flush_outbound_queue(session);
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, n);
+}
+
+TEST_F(OutboundQueueTest, check_staged_until_commit) {
+    delivered_no = 0;
+    session->messageToSend = countingMessageToSend;
+    PEP_STATUS status = config_outbound_queue(session, true, 0, 0);
+    ASSERT_OK;
+
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    status = queue_message_to_send(session, new_test_message());
+    ASSERT_OK;
+    status = flush_outbound_queue(session);
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, 0);
+    PEP_SQL_COMMIT_TRANSACTION();
+
+    status = flush_outbound_queue(session);
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, 1);
+}
+
+TEST_F(OutboundQueueTest, check_discarded_on_rollback) {
+    delivered_no = 0;
+    session->messageToSend = countingMessageToSend;
+    PEP_STATUS status = config_outbound_queue(session, true, 0, 0);
+    ASSERT_OK;
+
+    PEP_outbound_queue_stats before;
+    status = get_outbound_queue_stats(session, &before);
+    ASSERT_OK;
+
+    PEP_SQL_BEGIN_EXCLUSIVE_TRANSACTION();
+    status = queue_message_to_send(session, new_test_message());
+    ASSERT_OK;
+    PEP_SQL_ROLLBACK_TRANSACTION();
+
+    status = flush_outbound_queue(session);
+    ASSERT_OK;
+    ASSERT_EQ(delivered_no, 0);
+
+    PEP_outbound_queue_stats after;
+    status = get_outbound_queue_stats(session, &after);
+    ASSERT_OK;
+    ASSERT_EQ(after.discarded, before.discarded + 1);
+}
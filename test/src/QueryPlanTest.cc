@@ -0,0 +1,418 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <cstdlib>
+#include <strings.h>
+#include <cctype>
+#include <cstdio>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+#include "engine_sql.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for QueryPlanTest
+    class QueryPlanTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            QueryPlanTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~QueryPlanTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the QueryPlanTest suite.
+
+    };
+
+}  // namespace
+
+// The database is seeded at this scale, so that the statements are timed on
+// tables as large as those of heavy users.
+#define QUERY_PLAN_IDENTITY_NO 100000
+#define QUERY_PLAN_KEY_NO 200000
+
+// If set, the path of a file of per-statement times in microseconds.  A
+// missing file is written as the baseline; an existing one is compared to.
+#define QUERY_PLAN_BASELINE_ENV "PEP_QUERY_PLAN_BASELINE"
+
+// A statement is slower than its baseline when it takes more than this many
+// times as long, and more than this many microseconds longer.
+#define QUERY_PLAN_SLOWDOWN_FACTOR 4
+#define QUERY_PLAN_SLOWDOWN_MINIMUM 2000
+
+// Statements which may read a whole table, each with the reason.  Do not add
+// to this list without a reason: add an index or fix the query instead.
+static const std::vector<std::pair<const char*, const char*>> scan_allowlist = {
+    // They read every row by design.
+    { sql_all_mistrusted_keys, "loads the whole key set" },
+    { sql_all_revoked_keys, "loads the whole key set" },
+    { sql_get_all_groups, "lists every group" },
+    { sql_get_active_groups, "lists every active group" },
+    { sql_languagelist, "lists every language, in the system database" },
+
+    // identity.is_own has no index.
+    { sql_get_default_own_userid, "no index on identity.is_own" },
+    { sql_own_key_is_listed, "no index on identity.is_own" },
+    { sql_is_own_address, "no index on identity.is_own" },
+    { sql_own_identities_retrieve, "no index on identity.is_own" },
+    { sql_own_keys_retrieve, "no index on identity.is_own" },
+    { sql_all_own_key_fprs, "no index on identity.is_own" },
+
+    // The address matching CASE cannot use the primary key.
+    { sql_get_identities_by_address, "address CASE match" },
+
+    // Key fingerprints are only indexed where they come first in a key.
+    { sql_get_identities_by_main_key_id, "no index on identity.main_key_id" },
+    { sql_replace_identities_fpr, "no index on identity.main_key_id" },
+    { sql_remove_fpr_as_identity_default, "no index on identity.main_key_id" },
+    { sql_remove_fpr_as_user_default, "no index on person.main_key_id" },
+    { sql_update_trust_for_fpr, "no index on trust.pgp_keypair_fpr" },
+    { sql_mark_compromised, "no index on trust.pgp_keypair_fpr" },
+    { sql_get_revoked, "no index on revoked_keys.replacement_fpr" },
+
+    // social_graph has no key at all.
+    { sql_get_own_address_binding_from_contact, "no index on social_graph" },
+    { sql_has_id_contacted_address, "no index on social_graph" },
+};
+
+static const char* scan_allowed(const char* sql) {
+    for (auto& entry : scan_allowlist)
+        if (strcmp(entry.first, sql) == 0)
+            return entry.second;
+    return NULL;
+}
+
+// Transaction control statements cannot run in the timing transaction, and
+// have no plan anyway.
+static bool is_transaction_control(const char* sql) {
+    while (*sql == ' ')
+        sql++;
+    for (const char* prefix : { "begin", "commit", "rollback", "savepoint", "release", "end" })
+        if (strncasecmp(sql, prefix, strlen(prefix)) == 0)
+            return true;
+    return false;
+}
+
+static void seed_database(sqlite3* db) {
+    std::string sql =
+        "begin;\n"
+        "with recursive n(i) as (select 1 union all select i + 1 from n where i < "
+            + std::to_string(QUERY_PLAN_KEY_NO) + ")\n"
+        "   insert into pgp_keypair (fpr, created, expires)\n"
+        "       select printf('%040X', i), 1600000000 + i, 1900000000 + i from n;\n"
+        "with recursive n(i) as (select 1 union all select i + 1 from n where i < "
+            + std::to_string(QUERY_PLAN_IDENTITY_NO) + ")\n"
+        "   insert into person (id, username, main_key_id)\n"
+        "       select 'SEED' || i, 'Seed ' || i, printf('%040X', 2 * i) from n;\n"
+        "with recursive n(i) as (select 1 union all select i + 1 from n where i < "
+            + std::to_string(QUERY_PLAN_IDENTITY_NO) + ")\n"
+        "   insert into identity (address, user_id, main_key_id, username, last_contact)\n"
+        "       select 'seed' || i || '@example.org', 'SEED' || i, printf('%040X', 2 * i),\n"
+        "              'Seed ' || i, 1600000000 + i from n;\n"
+        "with recursive n(i) as (select 1 union all select i + 1 from n where i < "
+            + std::to_string(QUERY_PLAN_IDENTITY_NO) + ")\n"
+        "   insert into trust (user_id, pgp_keypair_fpr, comm_type)\n"
+        "       select 'SEED' || i, printf('%040X', 2 * i), 56 from n\n"
+        "       union all select 'SEED' || i, printf('%040X', 2 * i - 1), 48 from n;\n"
+        "commit;\n";
+    char* error = NULL;
+    int int_result = sqlite3_exec(db, sql.c_str(), NULL, NULL, &error);
+    ASSERT_EQ(int_result, SQLITE_OK) << (error ? error : "");
+}
+
+// Return the tables read in full by the given statement.
+static std::vector<std::string> full_scans(sqlite3* db, const char* sql) {
+    std::vector<std::string> result;
+    std::string query = std::string("EXPLAIN QUERY PLAN ") + sql;
+    sqlite3_stmt* plan = NULL;
+    int int_result = sqlite3_prepare_v2(db, query.c_str(), -1, &plan, NULL);
+    EXPECT_EQ(int_result, SQLITE_OK) << sql;
+    if (int_result != SQLITE_OK)
+        return result;
+    while (sqlite3_step(plan) == SQLITE_ROW) {
+        // Like "SCAN identity", or "SCAN TABLE identity" in older SQLite.
+        std::string detail = (const char*) sqlite3_column_text(plan, 3);
+        if (detail.compare(0, 5, "SCAN ") != 0
+            || detail.compare(0, 18, "SCAN CONSTANT ROW") == 0)
+            continue;
+        result.push_back(detail);
+    }
+    sqlite3_finalize(plan);
+    return result;
+}
+
+// The seeded row whose values are bound to the parameters of timed
+// statements, in the middle of the tables.
+#define QUERY_PLAN_PROBE (QUERY_PLAN_IDENTITY_NO / 2)
+
+static bool is_identifier_char(char c) {
+    return isalnum((unsigned char) c) || c == '_' || c == '.';
+}
+
+// Return the name of the column which the given parameter is inserted into or
+// compared to, as far as can be told from the SQL text, or "".
+static std::string parameter_column(const std::string& sql, int index) {
+    std::string token = "?" + std::to_string(index);
+    size_t at = sql.find(token);
+    while (at != std::string::npos && at + token.size() < sql.size()
+           && isdigit((unsigned char) sql[at + token.size()]))
+        at = sql.find(token, at + 1);
+    if (at == std::string::npos)
+        return "";
+
+    // In "insert into t (a, b) values (?1, ?2)" the column at the same
+    // position.
+    size_t values = sql.rfind("values", at);
+    size_t close = sql.find(')', values == std::string::npos ? 0 : values);
+    if (values != std::string::npos && close != std::string::npos && close > at) {
+        int position = 0;
+        for (size_t i = sql.find('(', values) + 1; i < at; i++)
+            if (sql[i] == ',')
+                position++;
+        size_t columns_end = sql.rfind(')', values);
+        size_t columns_start = (columns_end == std::string::npos)
+                               ? std::string::npos : sql.rfind('(', columns_end);
+        if (columns_start == std::string::npos)
+            return "";
+        std::string columns = sql.substr(columns_start + 1, columns_end - columns_start - 1);
+        size_t start = 0;
+        for (; position > 0 && start != std::string::npos; position--)
+            start = columns.find(',', start) == std::string::npos
+                    ? std::string::npos : columns.find(',', start) + 1;
+        if (start == std::string::npos)
+            return "";
+        while (start < columns.size() && !is_identifier_char(columns[start]))
+            start++;
+        size_t end = start;
+        while (end < columns.size() && is_identifier_char(columns[end]))
+            end++;
+        return columns.substr(start, end - start);
+    }
+
+    // Otherwise the nearest identifier before it, skipping operators and
+    // functions such as upper( .
+    size_t end = at;
+    while (end > 0) {
+        while (end > 0 && !is_identifier_char(sql[end - 1]))
+            end--;
+        size_t start = end;
+        while (start > 0 && is_identifier_char(sql[start - 1]))
+            start--;
+        std::string word = sql.substr(start, end - start);
+        for (auto& c : word)
+            c = tolower((unsigned char) c);
+        if (word != "upper" && word != "lower" && word != "like" && word != "in"
+            && word != "is" && word != "not" && word != "and" && word != "or") {
+            size_t dot = word.rfind('.');
+            return (dot == std::string::npos) ? word : word.substr(dot + 1);
+        }
+        end = start;
+    }
+    return "";
+}
+
+// Bind to every parameter the value of the probe row for its column, as found
+// in the seeded tables, so that lookups find a row as they do in use.
+static void bind_probe_values(sqlite3_stmt* statement) {
+    std::string sql = sqlite3_sql(statement);
+    for (auto& c : sql)
+        c = tolower((unsigned char) c);
+    char fpr[41];
+    snprintf(fpr, sizeof(fpr), "%040X", 2 * QUERY_PLAN_PROBE);
+    std::string user_id = "SEED" + std::to_string(QUERY_PLAN_PROBE);
+    std::string address = "seed" + std::to_string(QUERY_PLAN_PROBE) + "@example.org";
+    std::string username = "Seed " + std::to_string(QUERY_PLAN_PROBE);
+
+    int parameter_no = sqlite3_bind_parameter_count(statement);
+    for (int i = 1; i <= parameter_no; i++) {
+        std::string column = parameter_column(sql, i);
+        if (column.find("fpr") != std::string::npos
+            || column.find("key_id") != std::string::npos)
+            sqlite3_bind_text(statement, i, fpr, -1, SQLITE_TRANSIENT);
+        else if (column.find("address") != std::string::npos)
+            sqlite3_bind_text(statement, i, address.c_str(), -1, SQLITE_TRANSIENT);
+        else if (column == "username")
+            sqlite3_bind_text(statement, i, username.c_str(), -1, SQLITE_TRANSIENT);
+        else if (column == "id" || column.find("userid") != std::string::npos
+                 || (column.size() > 3
+                     && column.compare(column.size() - 3, 3, "_id") == 0))
+            sqlite3_bind_text(statement, i, user_id.c_str(), -1, SQLITE_TRANSIENT);
+        else if (column == "comm_type")
+            sqlite3_bind_int(statement, i, 56);
+        else if (column == "rowid")
+            sqlite3_bind_int(statement, i, QUERY_PLAN_PROBE);
+        else if (column == "limit")
+            sqlite3_bind_int(statement, i, 100);
+        else if (column == "created" || column == "expires"
+                 || column == "last_contact" || column == "timestamp"
+                 || column == "revocation_date")
+            sqlite3_bind_int64(statement, i, 1600000000 + QUERY_PLAN_PROBE);
+        else
+            // Flags, versions, names of other things: values matching no
+            // seeded row, as most such lookups in use.
+            sqlite3_bind_int(statement, i, 0);
+    }
+}
+
+// Run the statement once with the probe values bound and return how long it
+// took, in microseconds.  The caller rolls its effects back.
+static long long time_statement(sqlite3_stmt* statement) {
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    bind_probe_values(statement);
+    auto start = std::chrono::steady_clock::now();
+    while (sqlite3_step(statement) == SQLITE_ROW)
+        ;
+    auto end = std::chrono::steady_clock::now();
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+static std::map<std::string, long long> read_baseline(const char* path) {
+    std::map<std::string, long long> baseline;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos)
+            baseline[line.substr(tab + 1)] = std::atoll(line.substr(0, tab).c_str());
+    }
+    return baseline;
+}
+
+TEST_F(QueryPlanTest, check_no_full_scans) {
+    seed_database(session->db);
+
+    // Every statement prepared on the session, including those of
+    // _prepare_sql_stmts .
+    std::vector<std::pair<sqlite3*, sqlite3_stmt*>> statements;
+    for (sqlite3* db : { session->db, session->system_db })
+        for (sqlite3_stmt* s = sqlite3_next_stmt(db, NULL); s; s = sqlite3_next_stmt(db, s))
+            if (sqlite3_sql(s) && !is_transaction_control(sqlite3_sql(s)))
+                statements.push_back(std::make_pair(db, s));
+    ASSERT_GT(statements.size(), 100u);
+
+    for (auto& entry : statements) {
+        const char* sql = sqlite3_sql(entry.second);
+        std::vector<std::string> scans = full_scans(entry.first, sql);
+        const char* reason = scan_allowed(sql);
+        if (reason) {
+            output_stream << "allowed (" << reason << "): " << sql << std::endl;
+            continue;
+        }
+        for (auto& scan : scans)
+            ADD_FAILURE() << scan << " in: " << sql;
+    }
+}
+
+TEST_F(QueryPlanTest, check_timing) {
+    seed_database(session->db);
+
+    std::map<std::string, long long> times;
+    for (sqlite3* db : { session->db, session->system_db }) {
+        std::vector<sqlite3_stmt*> statements;
+        for (sqlite3_stmt* s = sqlite3_next_stmt(db, NULL); s; s = sqlite3_next_stmt(db, s))
+            if (sqlite3_sql(s) && !is_transaction_control(sqlite3_sql(s)))
+                statements.push_back(s);
+
+        // Run writes too, and undo them.
+        bool writable = (db == session->db);
+        if (writable)
+            ASSERT_EQ(sqlite3_exec(db, "begin;", NULL, NULL, NULL), SQLITE_OK);
+        for (sqlite3_stmt* s : statements)
+            times[sqlite3_sql(s)] = time_statement(s);
+        if (writable)
+            ASSERT_EQ(sqlite3_exec(db, "rollback;", NULL, NULL, NULL), SQLITE_OK);
+    }
+
+    for (auto& entry : times)
+        output_stream << entry.second << " us: " << entry.first << std::endl;
+
+    const char* baseline_path = getenv(QUERY_PLAN_BASELINE_ENV);
+    if (!baseline_path)
+        return;
+    std::map<std::string, long long> baseline = read_baseline(baseline_path);
+    if (baseline.empty()) {
+        std::ofstream out(baseline_path);
+        for (auto& entry : times)
+            out << entry.second << "\t" << entry.first << "\n";
+        return;
+    }
+    for (auto& entry : times) {
+        auto old = baseline.find(entry.first);
+        if (old == baseline.end())
+            continue;
+        if (entry.second > old->second * QUERY_PLAN_SLOWDOWN_FACTOR
+            && entry.second - old->second > QUERY_PLAN_SLOWDOWN_MINIMUM)
+            ADD_FAILURE() << entry.second << " us instead of " << old->second
+                          << " us: " << entry.first;
+    }
+}
@@ -0,0 +1,290 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement.h"
+#include "pEp_metrics.h"
+#include "engine_sql.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for RatingPreviewTest
+    class RatingPreviewTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            RatingPreviewTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~RatingPreviewTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the RatingPreviewTest suite.
+
+    };
+
+}  // namespace
+
+// Set up Alice as own identity and public keys for the recipients.
+static void set_up_identities(PEP_SESSION session, pEp_identity** alice,
+                              std::vector<pEp_identity*>& others) {
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, alice);
+    ASSERT_OK;
+    const TestUtilsPreset::ident_preset presets[] = {
+        TestUtilsPreset::BOB, TestUtilsPreset::CAROL, TestUtilsPreset::DAVE
+    };
+    for (auto preset : presets) {
+        pEp_identity* ident = NULL;
+        status = TestUtilsPreset::set_up_preset(session, preset, true, true, true, false, false, false, &ident);
+        ASSERT_OK;
+        others.push_back(ident);
+    }
+}
+
+// The rating outgoing_message_rating_preview gives for the same recipients.
+static PEP_rating full_preview(PEP_SESSION session, const pEp_identity* alice,
+                               const std::vector<pEp_identity*>& to) {
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->from = identity_dup(alice);
+    for (auto ident : to) {
+        if (msg->to == NULL)
+            msg->to = new_identity_list(identity_dup(ident));
+        else
+            identity_list_add(msg->to, identity_dup(ident));
+    }
+    PEP_rating rating = PEP_rating_undefined;
+    PEP_STATUS status = outgoing_message_rating_preview(session, msg, &rating);
+    free_message(msg);
+    EXPECT_EQ(status, PEP_STATUS_OK);
+    return rating;
+}
+
+TEST_F(RatingPreviewTest, check_same_as_full_preview) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+    pEp_identity* stranger = new_identity("stranger@darthmama.org", NULL, "STRANGER", "Stranger");
+
+    PEP_rating_preview* preview = NULL;
+    PEP_STATUS status = new_rating_preview(session, alice, &preview);
+    ASSERT_OK;
+
+    std::vector<pEp_identity*> current;
+    PEP_rating rating;
+    status = rating_preview_get_rating(session, preview, &rating);
+    ASSERT_OK;
+    ASSERT_EQ(rating, full_preview(session, alice, current));
+
+    for (auto ident : others) {
+        status = rating_preview_add_recipient(session, preview, ident, false);
+        ASSERT_OK;
+        current.push_back(ident);
+        status = rating_preview_get_rating(session, preview, &rating);
+        ASSERT_OK;
+        ASSERT_EQ(rating, full_preview(session, alice, current));
+    }
+
+    status = rating_preview_add_recipient(session, preview, stranger, true);
+    ASSERT_OK;
+    current.push_back(stranger);
+    status = rating_preview_get_rating(session, preview, &rating);
+    ASSERT_OK;
+    ASSERT_EQ(rating, full_preview(session, alice, current));
+
+    status = rating_preview_remove_recipient(session, preview, stranger);
+    ASSERT_OK;
+    current.pop_back();
+    status = rating_preview_get_rating(session, preview, &rating);
+    ASSERT_OK;
+    ASSERT_EQ(rating, full_preview(session, alice, current));
+
+    status = rating_preview_remove_recipient(session, preview, stranger);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+
+    free_rating_preview(preview);
+    free_identity(stranger);
+    free_identity(alice);
+    for (auto ident : others)
+        free_identity(ident);
+}
+
+TEST_F(RatingPreviewTest, check_trust_change_invalidates) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+
+    PEP_rating_preview* preview = NULL;
+    PEP_STATUS status = new_rating_preview(session, alice, &preview);
+    ASSERT_OK;
+    for (auto ident : others) {
+        status = rating_preview_add_recipient(session, preview, ident, false);
+        ASSERT_OK;
+    }
+    PEP_rating before;
+    status = rating_preview_get_rating(session, preview, &before);
+    ASSERT_OK;
+
+    // Mistrusting one recipient key must be seen without touching the
+    // preview.
+    pEp_identity* carol = identity_dup(others[1]);
+    status = update_identity(session, carol);
+    ASSERT_OK;
+    status = key_mistrusted(session, carol);
+    ASSERT_OK;
+
+    PEP_rating after;
+    status = rating_preview_get_rating(session, preview, &after);
+    ASSERT_OK;
+    ASSERT_NE(before, after);
+    ASSERT_EQ(after, full_preview(session, alice, others));
+
+    free_identity(carol);
+    free_rating_preview(preview);
+    free_identity(alice);
+    for (auto ident : others)
+        free_identity(ident);
+}
+
+TEST_F(RatingPreviewTest, check_incremental_cost) {
+    pEp_identity* alice = NULL;
+    std::vector<pEp_identity*> others;
+    set_up_identities(session, &alice, others);
+
+    // A draft with many recipients, one added at a time.
+    const int n = 50;
+    std::vector<pEp_identity*> to;
+    for (int i = 0; i < n; i++)
+        to.push_back(others[i % others.size()]);
+
+    PEP_rating_preview* preview = NULL;
+    PEP_STATUS status = new_rating_preview(session, alice, &preview);
+    ASSERT_OK;
+    for (auto ident : to) {
+        status = rating_preview_add_recipient(session, preview, ident, false);
+        ASSERT_OK;
+    }
+    PEP_rating rating;
+    status = rating_preview_get_rating(session, preview, &rating);
+    ASSERT_OK;
+
+    PEP_metrics before, after;
+    status = pEp_get_metrics(session, &before, NULL);
+    ASSERT_OK;
+    PEP_rating full = full_preview(session, alice, to);
+    status = pEp_get_metrics(session, &after, NULL);
+    ASSERT_OK;
+    uint64_t full_steps = after.sql_steps - before.sql_steps;
+
+    status = pEp_get_metrics(session, &before, NULL);
+    ASSERT_OK;
+    status = rating_preview_remove_recipient(session, preview, to.back());
+    ASSERT_OK;
+    status = rating_preview_add_recipient(session, preview, to.back(), false);
+    ASSERT_OK;
+    status = rating_preview_get_rating(session, preview, &rating);
+    ASSERT_OK;
+    status = pEp_get_metrics(session, &after, NULL);
+    ASSERT_OK;
+    uint64_t incremental_steps = after.sql_steps - before.sql_steps;
+
+    output_stream << "full preview: " << full_steps << " SQL steps\n"
+                  << "incremental preview: " << incremental_steps
+                  << " SQL steps\n";
+    ASSERT_EQ(rating, full);
+    ASSERT_LT(incremental_steps * 10, full_steps);
+
+    free_rating_preview(preview);
+    free_identity(alice);
+    for (auto ident : others)
+        free_identity(ident);
+}
+
+TEST_F(RatingPreviewTest, check_key_store_change_changes_stamp) {
+    pEp_sql_change_stamp first, second;
+    PEP_STATUS status = pEp_sql_get_change_stamp(session, &first);
+    ASSERT_OK;
+    status = pEp_sql_get_change_stamp(session, &second);
+    ASSERT_OK;
+    if (first.expiry_period == second.expiry_period)
+        ASSERT_TRUE(pEp_sql_change_stamps_equal(&first, &second));
+
+    // A key imported through another session of the process leaves the
+    // management database alone, but may change ratings seen by this one.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    string pubkey = slurp("test_keys/pub/pep-test-bob-0xC9C2EE39_pub.asc");
+    status = import_key(other, pubkey.c_str(), pubkey.size(), NULL);
+    ASSERT_EQ(status, PEP_KEY_IMPORTED);
+    release(other);
+
+    status = pEp_sql_get_change_stamp(session, &second);
+    ASSERT_OK;
+    ASSERT_FALSE(pEp_sql_change_stamps_equal(&first, &second));
+
+    // Time passing far enough to make keys expire also changes it.
+    first = second;
+    second.expiry_period ++;
+    ASSERT_FALSE(pEp_sql_change_stamps_equal(&first, &second));
+}
@@ -0,0 +1,220 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "keymanagement.h"
+#include "message_api.h"
+#include "mime.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for ReEvaluateRatingsTest
+    class ReEvaluateRatingsTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            ReEvaluateRatingsTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~ReEvaluateRatingsTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the ReEvaluateRatingsTest suite.
+
+    };
+
+}  // namespace
+
+/* Set up the same scenario as LeastCommonDenomColorTest : a message from a
+   known sender, encrypted to two recipients. */
+static void set_up_scenario(PEP_SESSION session, message** dest_msg,
+                            stringlist_t** keylist, pEp_identity** recip2) {
+    const string keytextkey1 = slurp("test_keys/pub/banmeonce-0x07B29090_pub.asc");
+    const string keytextkey2 = slurp("test_keys/pub/banmetwice-0x4080C3E7_pub.asc");
+    const string keytextkey3 = slurp("test_keys/pub/pep.never.me.test-0x79C11D1D_pub.asc");
+    const string keytextkey4 = slurp("test_keys/priv/pep.never.me.test-0x79C11D1D_priv.asc");
+    import_key(session, keytextkey1.c_str(), keytextkey1.length(), NULL);
+    import_key(session, keytextkey2.c_str(), keytextkey2.length(), NULL);
+    import_key(session, keytextkey3.c_str(), keytextkey3.length(), NULL);
+    import_key(session, keytextkey4.c_str(), keytextkey4.length(), NULL);
+
+    pEp_identity* sender = new_identity("pep.never.me.test@kgrothoff.org", NULL, "TOFU_pep.never.me.test@kgrothoff.org", "pEp Never Me Test");
+    PEP_STATUS status = update_identity(session, sender);
+    ASSERT_OK;
+    free(sender->fpr);
+    sender->fpr = strdup("8314EF2E19278F9800527EA887601BD579C11D1D");
+    status = set_identity(session, sender);
+    ASSERT_OK;
+    free_identity(sender);
+
+    pEp_identity* recip1 = new_identity("banmeonce@kgrothoff.org", NULL, "TOFU_banmeonce@kgrothoff.org", "Ban Me Once");
+    status = update_identity(session, recip1);
+    free(recip1->fpr);
+    recip1->fpr = strdup("9F371BACD583EE26347899F21CCE13DE07B29090");
+    status = set_identity(session, recip1);
+    ASSERT_OK;
+    key_reset_trust(session, recip1);
+    free_identity(recip1);
+
+    *recip2 = new_identity("banmetwice@kgrothoff.org", NULL, "TOFU_banmetwice@kgrothoff.org", "Ban Me Twice");
+    status = update_identity(session, *recip2);
+    free((*recip2)->fpr);
+    (*recip2)->fpr = strdup("84A33862CC664EA1086B7E94ADF10A134080C3E7");
+    status = set_identity(session, *recip2);
+    ASSERT_OK;
+    key_reset_trust(session, *recip2);
+
+    const string mailtext = slurp("test_mails/Test_Message_JSON-21_Color_Problems.eml");
+    message* msg_ptr = nullptr;
+    status = mime_decode_message(mailtext.c_str(), mailtext.length(), &msg_ptr, NULL);
+    ASSERT_OK;
+    PEP_decrypt_flags_t flags = 0;
+    status = decrypt_message_2(session, msg_ptr, dest_msg, keylist, &flags);
+    ASSERT_OK;
+    ASSERT_NOTNULL(*dest_msg);
+    free_message(msg_ptr);
+}
+
+/* Re-evaluate n copies of the message in one batch, and check that every
+   result agrees with re_evaluate_message_rating . */
+static void check_batch_agrees(PEP_SESSION session, message* dest_msg,
+                               stringlist_t* keylist, PEP_rating decrypt_rating,
+                               unsigned int thread_no, PEP_color expected) {
+    PEP_rating single_rating = PEP_rating_undefined;
+    PEP_STATUS status = re_evaluate_message_rating(session, dest_msg, keylist,
+                                                   decrypt_rating,
+                                                   &single_rating);
+    ASSERT_OK;
+    ASSERT_EQ(color_from_rating(single_rating), expected);
+
+    const size_t n = 100;
+    std::vector<PEP_rating_reevaluation> items(n + 2);
+    for (size_t i = 0; i < n; i++) {
+        items[i].from = dest_msg->from;
+        items[i].keylist = keylist;
+        items[i].x_enc_status = decrypt_rating;
+    }
+    // An unencrypted message, and an invalid one.
+    items[n].from = dest_msg->from;
+    items[n].keylist = NULL;
+    items[n].x_enc_status = PEP_rating_unencrypted;
+    items[n + 1].from = dest_msg->from;
+    items[n + 1].keylist = NULL;
+    items[n + 1].x_enc_status = PEP_rating_reliable;
+
+    status = re_evaluate_message_ratings(session, items.data(), items.size(),
+                                         thread_no);
+    ASSERT_OK;
+    for (size_t i = 0; i < n; i++) {
+        ASSERT_EQ(items[i].status, PEP_STATUS_OK);
+        ASSERT_EQ(items[i].rating, single_rating);
+    }
+    ASSERT_EQ(items[n].status, PEP_STATUS_OK);
+    ASSERT_EQ(items[n].rating, PEP_rating_unencrypted);
+    ASSERT_EQ(items[n + 1].status, PEP_ILLEGAL_VALUE);
+}
+
+TEST_F(ReEvaluateRatingsTest, check_batch_agrees_with_single) {
+    message* dest_msg = nullptr;
+    stringlist_t* keylist = nullptr;
+    pEp_identity* recip2 = nullptr;
+    set_up_scenario(session, &dest_msg, &keylist, &recip2);
+    ASSERT_NOTNULL(dest_msg);
+    PEP_rating decrypt_rating = dest_msg->rating;
+
+    check_batch_agrees(session, dest_msg, keylist, decrypt_rating, 1,
+                       PEP_color_yellow);
+
+    // The new trust state is seen by the batch as well.
+    key_mistrusted(session, recip2);
+    check_batch_agrees(session, dest_msg, keylist, decrypt_rating, 1,
+                       PEP_color_red);
+
+    free_identity(recip2);
+    free_stringlist(keylist);
+    free_message(dest_msg);
+}
+
+TEST_F(ReEvaluateRatingsTest, check_batch_parallel) {
+    message* dest_msg = nullptr;
+    stringlist_t* keylist = nullptr;
+    pEp_identity* recip2 = nullptr;
+    set_up_scenario(session, &dest_msg, &keylist, &recip2);
+    ASSERT_NOTNULL(dest_msg);
+    PEP_rating decrypt_rating = dest_msg->rating;
+
+    check_batch_agrees(session, dest_msg, keylist, decrypt_rating, 4,
+                       PEP_color_yellow);
+    key_mistrusted(session, recip2);
+    check_batch_agrees(session, dest_msg, keylist, decrypt_rating, 4,
+                       PEP_color_red);
+
+    free_identity(recip2);
+    free_stringlist(keylist);
+    free_message(dest_msg);
+}
+
+TEST_F(ReEvaluateRatingsTest, check_empty_batch) {
+    PEP_STATUS status = re_evaluate_message_ratings(session, NULL, 0, 4);
+    ASSERT_OK;
+}
@@ -0,0 +1,330 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+#include "sql_read_pool.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for ReadPoolTest
+    class ReadPoolTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            ReadPoolTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~ReadPoolTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the ReadPoolTest suite.
+
+    };
+
+}  // namespace
+
+// The identity of the i-th contact of the tests.
+static pEp_identity* read_pool_contact(int i, const char* username) {
+    std::string address = std::string("contact") + std::to_string(i)
+                          + "@read-pool.pEp";
+    std::string user_id = std::string("CONTACT_") + std::to_string(i);
+    return new_identity(address.c_str(), NULL, user_id.c_str(), username);
+}
+
+static PEP_STATUS set_contact(PEP_SESSION session, int i, const char* username) {
+    pEp_identity* contact = read_pool_contact(i, username);
+    PEP_STATUS status = set_identity(session, contact);
+    free_identity(contact);
+    return status;
+}
+
+static PEP_STATUS get_contact(PEP_SESSION session, int i, pEp_identity** found) {
+    pEp_identity* contact = read_pool_contact(i, NULL);
+    PEP_STATUS status = get_identity(session, contact->address,
+                                     contact->user_id, found);
+    free_identity(contact);
+    return status;
+}
+
+TEST_F(ReadPoolTest, check_read_nesting) {
+    pEp_sql_read_begin(session);
+    sqlite3_stmt* statement
+        = pEp_sql_read_statement(session, pEp_sql_read_get_identity,
+                                 session->get_identity);
+    ASSERT_NOTNULL(session->read_connection);
+    ASSERT_NE(statement, session->get_identity);
+    ASSERT_NE(sqlite3_db_handle(statement), session->db);
+
+    pEp_sql_read_begin(session);
+    ASSERT_EQ(pEp_sql_read_statement(session, pEp_sql_read_get_identity,
+                                     session->get_identity),
+              statement);
+    pEp_sql_read_end(session);
+    ASSERT_NOTNULL(session->read_connection);
+    pEp_sql_read_end(session);
+    ASSERT_NULL(session->read_connection);
+    ASSERT_EQ(session->read_depth, 0);
+
+    PEP_STATUS status = config_read_pool(session, false);
+    ASSERT_OK;
+    pEp_sql_read_begin(session);
+    ASSERT_NULL(session->read_connection);
+    ASSERT_EQ(pEp_sql_read_statement(session, pEp_sql_read_get_identity,
+                                     session->get_identity),
+              session->get_identity);
+    pEp_sql_read_end(session);
+}
+
+TEST_F(ReadPoolTest, check_reads_see_committed_writes) {
+    PEP_STATUS status = set_contact(session, 1, "Contact One");
+    ASSERT_OK;
+    pEp_identity* found = NULL;
+    status = get_contact(session, 1, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact One");
+    free_identity(found);
+    found = NULL;
+
+    // A write from another session is seen by the next read.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = set_contact(other, 1, "Contact One Renamed");
+    ASSERT_OK;
+    status = set_contact(other, 2, "Contact Two");
+    ASSERT_OK;
+    status = get_contact(session, 1, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact One Renamed");
+    free_identity(found);
+    found = NULL;
+    status = get_contact(session, 2, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact Two");
+    free_identity(found);
+    release(other);
+
+    // The same results without the pool.
+    status = config_read_pool(session, false);
+    ASSERT_OK;
+    found = NULL;
+    status = get_contact(session, 1, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact One Renamed");
+    free_identity(found);
+}
+
+TEST_F(ReadPoolTest, check_own_identities) {
+    pEp_identity* me = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &me);
+    ASSERT_OK;
+
+    identity_list* own_identities = NULL;
+    status = own_identities_retrieve(session, &own_identities);
+    ASSERT_OK;
+    ASSERT_NOTNULL(own_identities);
+    ASSERT_NOTNULL(own_identities->ident);
+    ASSERT_STREQ(own_identities->ident->address, me->address);
+    ASSERT_NULL(own_identities->next);
+    free_identity_list(own_identities);
+
+    // The trust of our own key, as stored by myself.
+    pEp_identity* trusted = identity_dup(me);
+    status = get_trust(session, trusted);
+    ASSERT_OK;
+    ASSERT_EQ(trusted->comm_type, PEP_ct_pEp);
+    PEP_comm_type least = PEP_ct_unknown;
+    status = least_trust(session, me->fpr, &least);
+    ASSERT_OK;
+    ASSERT_EQ(least, PEP_ct_pEp);
+    free_identity(trusted);
+    free_identity(me);
+}
+
+TEST_F(ReadPoolTest, check_ingestion_mode) {
+    PEP_STATUS status = config_ingestion_mode(session, true, 0);
+    ASSERT_OK;
+    status = set_contact(session, 3, "Contact Three");
+    ASSERT_OK;
+
+    // The session sees its own uncommitted write...
+    pEp_identity* found = NULL;
+    status = get_contact(session, 3, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact Three");
+    free_identity(found);
+    found = NULL;
+
+    // ...while another session reads the committed state, without waiting
+    // for the write lock held by ingestion mode.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = get_contact(other, 3, &found);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    ASSERT_NULL(found);
+
+    status = config_ingestion_mode(session, false, 0);
+    ASSERT_OK;
+    status = get_contact(other, 3, &found);
+    ASSERT_OK;
+    ASSERT_STREQ(found->username, "Contact Three");
+    free_identity(found);
+    release(other);
+}
+
+// Mixed read/write concurrency benchmark: reader threads, each with its own
+// session, call get_identity while one writer thread renames contacts, for a
+// fixed time, first with the read pool and then without.  The throughput is
+// only reported; only its sanity is checked.  It only runs when the time in
+// seconds of each run is given through the environment.
+static void read_write_run(bool pool, int readers, int contact_no,
+                           double seconds, long* reads, long* writes) {
+    std::atomic<bool> stop(false);
+    std::atomic<long> read_no(0);
+    std::atomic<long> write_no(0);
+    std::atomic<long> errors(0);
+    std::vector<std::thread> threads;
+
+    for (int r = 0; r < readers; r++)
+        threads.emplace_back([&, r]() {
+            PEP_SESSION reader = NULL;
+            if (init(&reader, NULL, NULL, NULL) != PEP_STATUS_OK) {
+                errors++;
+                return;
+            }
+            config_read_pool(reader, pool);
+            long n = 0;
+            for (int i = r; ! stop; i = (i + 1) % contact_no) {
+                pEp_identity* found = NULL;
+                if (get_contact(reader, i, &found) != PEP_STATUS_OK)
+                    errors++;
+                free_identity(found);
+                n++;
+            }
+            read_no += n;
+            release(reader);
+        });
+    threads.emplace_back([&]() {
+        PEP_SESSION writer = NULL;
+        if (init(&writer, NULL, NULL, NULL) != PEP_STATUS_OK) {
+            errors++;
+            return;
+        }
+        long n = 0;
+        for (int i = 0; ! stop; i = (i + 1) % contact_no) {
+            std::string username = std::string("Contact ") + std::to_string(n);
+            if (set_contact(writer, i, username.c_str()) != PEP_STATUS_OK)
+                errors++;
+            n++;
+        }
+        write_no += n;
+        release(writer);
+    });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(errors, 0);
+    *reads = read_no;
+    *writes = write_no;
+}
+
+TEST_F(ReadPoolTest, check_mixed_read_write_benchmark) {
+    const char* seconds_text = getenv("PEP_READ_POOL_BENCHMARK_SECONDS");
+    if (seconds_text == NULL || atof(seconds_text) <= 0) {
+        output_stream << "set PEP_READ_POOL_BENCHMARK_SECONDS to run this benchmark\n";
+        return;
+    }
+    const int contact_no = 200;
+    const int readers = 4;
+    const double seconds = atof(seconds_text);
+    for (int i = 0; i < contact_no; i++) {
+        PEP_STATUS status = set_contact(session, i, "Contact");
+        ASSERT_OK;
+    }
+
+    long pooled_reads, pooled_writes, locked_reads, locked_writes;
+    read_write_run(true, readers, contact_no, seconds,
+                   &pooled_reads, &pooled_writes);
+    read_write_run(false, readers, contact_no, seconds,
+                   &locked_reads, &locked_writes);
+
+    output_stream << readers << " readers and 1 writer, " << seconds << " s:\n"
+                  << "read pool: " << pooled_reads / seconds << " reads/s, "
+                  << pooled_writes / seconds << " writes/s\n"
+                  << "no read pool: " << locked_reads / seconds << " reads/s, "
+                  << locked_writes / seconds << " writes/s\n";
+    ASSERT_GT(pooled_reads, 0);
+    ASSERT_GT(pooled_writes, 0);
+    ASSERT_GT(locked_reads, 0);
+    ASSERT_GT(locked_writes, 0);
+}
@@ -0,0 +1,188 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <set>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for RecentContactsTest
+    class RecentContactsTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            RecentContactsTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~RecentContactsTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the RecentContactsTest suite.
+
+    };
+
+}  // namespace
+
+static void add_contacts(PEP_SESSION session, int n) {
+    for (int i = 0; i < n; i++) {
+        std::string address = "contact" + std::to_string(i) + "@darthmama.org";
+        std::string user_id = "CONTACT" + std::to_string(i);
+        pEp_identity* ident = new_identity(address.c_str(), NULL, user_id.c_str(), "Contact");
+        ASSERT_NOTNULL(ident);
+        PEP_STATUS status = set_identity(session, ident);
+        ASSERT_OK;
+        free_identity(ident);
+    }
+}
+
+static int identity_list_count(const identity_list* il) {
+    int count = 0;
+    for ( ; il && il->ident; il = il->next)
+        count++;
+    return count;
+}
+
+TEST_F(RecentContactsTest, check_paging) {
+    add_contacts(session, 10);
+
+    pEp_recent_contacts_cursor cursor;
+    start_recent_contacts(session, PEP_RECENT_CONTACTS_DEFAULT_WINDOW, &cursor);
+    std::set<std::string> seen;
+    int pages = 0;
+    while (true) {
+        identity_list* page = NULL;
+        PEP_STATUS status = get_recent_contacts(session, &cursor, 3, &page);
+        ASSERT_OK;
+        if (!page)
+            break;
+        pages++;
+        EXPECT_LE(identity_list_count(page), 3);
+        for (identity_list* il = page; il; il = il->next) {
+            ASSERT_NOTNULL(il->ident->address);
+            ASSERT_NOTNULL(il->ident->user_id);
+            EXPECT_TRUE(seen.insert(il->ident->address).second);
+        }
+        free_identity_list(page);
+    }
+    EXPECT_EQ(pages, 4);
+    EXPECT_EQ(seen.size(), 10);
+
+    identity_list* all = NULL;
+    PEP_STATUS status = get_last_contacted(session, &all);
+    ASSERT_OK;
+    EXPECT_EQ(identity_list_count(all), 10);
+    free_identity_list(all);
+}
+
+TEST_F(RecentContactsTest, check_window) {
+    add_contacts(session, 4);
+
+    // Push two contacts back in time.
+    int int_result = sqlite3_exec(session->db,
+            "update identity set last_contact = last_contact - 30 * 24 * 60 * 60"
+            "   where user_id in ('CONTACT0', 'CONTACT1') ;",
+            NULL, NULL, NULL);
+    ASSERT_EQ(int_result, SQLITE_OK);
+
+    identity_list* recent = NULL;
+    PEP_STATUS status = get_last_contacted(session, &recent);
+    ASSERT_OK;
+    EXPECT_EQ(identity_list_count(recent), 2);
+    for (identity_list* il = recent; il; il = il->next)
+        EXPECT_TRUE(strcmp(il->ident->user_id, "CONTACT2") == 0
+                    || strcmp(il->ident->user_id, "CONTACT3") == 0);
+    free_identity_list(recent);
+
+    // A larger window reaches them.
+    pEp_recent_contacts_cursor cursor;
+    start_recent_contacts(session, 60 * 24 * 60 * 60, &cursor);
+    status = get_recent_contacts(session, &cursor, 0, &recent);
+    ASSERT_OK;
+    EXPECT_EQ(identity_list_count(recent), 4);
+    free_identity_list(recent);
+
+    // Storing an identity again counts as a contact.
+    pEp_identity* ident = new_identity("contact0@darthmama.org", NULL, "CONTACT0", "Contact");
+    status = set_identity(session, ident);
+    ASSERT_OK;
+    free_identity(ident);
+    status = get_last_contacted(session, &recent);
+    ASSERT_OK;
+    EXPECT_EQ(identity_list_count(recent), 3);
+    free_identity_list(recent);
+}
+
+TEST_F(RecentContactsTest, check_no_contacts) {
+    int int_result = sqlite3_exec(session->db,
+            "update identity set last_contact = 0 ;", NULL, NULL, NULL);
+    ASSERT_EQ(int_result, SQLITE_OK);
+
+    identity_list* recent = NULL;
+    PEP_STATUS status = get_last_contacted(session, &recent);
+    ASSERT_EQ(status, PEP_CANNOT_FIND_IDENTITY);
+    ASSERT_NULL(recent);
+}
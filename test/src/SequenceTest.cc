@@ -5,6 +5,11 @@
 #include <iostream>
 #include <string>
 #include <cstring> // for std::strdup()
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
 #include "pEpEngine.h"
 #include "pEp_internal.h"
@@ -101,3 +106,149 @@ TEST_F(SequenceTest, check_sequences) {
     output_stream << "test sequence: " << value2 << "\n";
     ASSERT_EQ(value2, value1 + 1);
 }
+
+TEST_F(SequenceTest, check_sequence_blocks) {
+    PEP_STATUS status = config_sequence_block_size(session, 10);
+    ASSERT_OK;
+
+    // A single session receives consecutive values, across blocks.
+    int32_t value = 0;
+    for (int32_t i = 1; i <= 12; i++) {
+        status = sequence_value(session, "blocks", &value);
+        ASSERT_OK;
+        ASSERT_EQ(value, i);
+    }
+
+    // Another session reserves after our second block.
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = config_sequence_block_size(other, 10);
+    ASSERT_OK;
+    status = sequence_value(other, "blocks", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 21);
+
+    // We go on with our block, then reserve after the other one.
+    for (int32_t i = 13; i <= 20; i++) {
+        status = sequence_value(session, "blocks", &value);
+        ASSERT_OK;
+        ASSERT_EQ(value, i);
+    }
+    status = sequence_value(session, "blocks", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 31);
+
+    // The other session cannot give its values back, since ours come after
+    // them; we can.
+    release(other);
+    status = config_sequence_block_size(session, 1);
+    ASSERT_OK;
+    status = sequence_value(session, "blocks", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 32);
+
+    // A block larger than any value of a sequence is refused.
+    status = config_sequence_block_size(session, (unsigned int) INT32_MAX + 1);
+    ASSERT_EQ(status, PEP_ILLEGAL_VALUE);
+}
+
+TEST_F(SequenceTest, check_sequence_blocks_in_batch) {
+    PEP_STATUS status = config_sequence_block_size(session, 10);
+    ASSERT_OK;
+
+    // No block is reserved within a transaction which may be rolled back.
+    int32_t value = 0;
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = sequence_value(session, "batch", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 1);
+    status = pEp_end_batch(session, false);
+    ASSERT_OK;
+
+    PEP_SESSION other = NULL;
+    status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    status = sequence_value(other, "batch", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 1);
+    release(other);
+
+    // A block reserved before the batch is used within it.
+    status = sequence_value(session, "batch", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 2);
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    status = sequence_value(session, "batch", &value);
+    ASSERT_OK;
+    ASSERT_EQ(value, 3);
+    status = pEp_end_batch(session, true);
+    ASSERT_OK;
+}
+
+/* Take values from the given sequence on a new session, recording them in
+   order.  Failures are counted rather than asserted, since gtest assertions
+   are not meant for secondary threads. */
+static void take_values(unsigned int block_size, int n,
+                        std::vector<int32_t>* values, int* failures)
+{
+    PEP_SESSION s = NULL;
+    if (init(&s, NULL, NULL, NULL) != PEP_STATUS_OK) {
+        (*failures)++;
+        return;
+    }
+    config_sequence_block_size(s, block_size);
+    for (int i = 0; i < n; i++) {
+        int32_t value = 0;
+        if (sequence_value(s, "throughput", &value) == PEP_STATUS_OK)
+            values->push_back(value);
+        else
+            (*failures)++;
+    }
+    release(s);
+}
+
+// Take values from several sessions at once, one transaction at a time and
+// then in blocks, checking that values stay unique and increasing for each
+// session, and reporting the throughput of each.  It only runs when the
+// number of values each session takes is given through the environment, 2000
+// for example.
+TEST_F(SequenceTest, check_sequence_throughput) {
+    const char* n_text = getenv("PEP_SEQUENCE_BENCHMARK_SIZE");
+    if (n_text == NULL || atoi(n_text) <= 0) {
+        output_stream << "set PEP_SEQUENCE_BENCHMARK_SIZE to run this benchmark\n";
+        return;
+    }
+    const int thread_no = 4;
+    const int n = atoi(n_text);
+    const unsigned int block_sizes[] = { 1, 100 };
+    for (unsigned int block_size : block_sizes) {
+        std::vector<std::vector<int32_t>> values(thread_no);
+        std::vector<int> failures(thread_no, 0);
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < thread_no; i++)
+            threads.push_back(std::thread(take_values, block_size, n,
+                                          &values[i], &failures[i]));
+        for (auto& t : threads)
+            t.join();
+        std::chrono::duration<double> time
+            = std::chrono::steady_clock::now() - begin;
+
+        std::vector<int32_t> all;
+        for (int i = 0; i < thread_no; i++) {
+            ASSERT_EQ(failures[i], 0);
+            ASSERT_EQ(values[i].size(), n);
+            ASSERT_TRUE(std::is_sorted(values[i].begin(), values[i].end()));
+            all.insert(all.end(), values[i].begin(), values[i].end());
+        }
+        std::sort(all.begin(), all.end());
+        ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+
+        output_stream << thread_no << " sessions, block size " << block_size
+                      << ": " << thread_no * n / time.count()
+                      << " values/s\n";
+    }
+}
@@ -0,0 +1,238 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "pEp_trace.h"
+#include "message_api.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for TraceTest
+    class TraceTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            TraceTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~TraceTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the TraceTest suite.
+
+    };
+
+}  // namespace
+
+namespace {
+    struct trace_record {
+        bool begin;
+        std::string name;
+        unsigned int depth;
+        PEP_STATUS status;
+        size_t size;
+        size_t count;
+        uint64_t duration_us;
+        bool rolled_back;
+    };
+}
+
+static void record_begin(void* context, const pEp_trace_span* span) {
+    std::vector<trace_record>* records = (std::vector<trace_record>*) context;
+    records->push_back({true, span->name, span->depth, span->status, 0, 0, 0,
+                        false});
+}
+
+static void record_end(void* context, const pEp_trace_span* span) {
+    std::vector<trace_record>* records = (std::vector<trace_record>*) context;
+    records->push_back({false, span->name, span->depth, span->status,
+                        span->size, span->count,
+                        span->end_time_us - span->begin_time_us,
+                        span->rolled_back});
+}
+
+static const trace_record* find_end(const std::vector<trace_record>& records,
+                                    const std::string& name) {
+    for (const trace_record& r : records)
+        if (! r.begin && r.name == name)
+            return &r;
+    return nullptr;
+}
+
+TEST_F(TraceTest, check_spans_nest) {
+    pEp_identity* alice = NULL;
+    PEP_STATUS status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::ALICE, true, true, true, true, true, true, &alice);
+    ASSERT_OK;
+    pEp_identity* bob = NULL;
+    status = TestUtilsPreset::set_up_preset(session, TestUtilsPreset::BOB, true, true, true, false, false, false, &bob);
+    ASSERT_OK;
+
+    std::vector<trace_record> records;
+    status = config_trace(session, record_begin, record_end, &records);
+    ASSERT_OK;
+
+    status = myself(session, alice);
+    ASSERT_OK;
+
+    message* msg = new_message(PEP_dir_outgoing);
+    msg->from = identity_dup(alice);
+    msg->to = new_identity_list(identity_dup(bob));
+    msg->shortmsg = strdup("Tracing");
+    msg->longmsg = strdup("Where does the time go?");
+    message* enc_msg = NULL;
+    status = encrypt_message(session, msg, NULL, &enc_msg, PEP_enc_PGP_MIME, 0);
+    ASSERT_OK;
+    ASSERT_NE(enc_msg, nullptr);
+
+    status = config_trace(session, NULL, NULL, NULL);
+    ASSERT_OK;
+    ASSERT_EQ(session->trace_depth, 0);
+
+    // Every span ends, in the reverse order of beginning.
+    std::vector<const trace_record*> open;
+    for (const trace_record& r : records) {
+        if (r.begin) {
+            ASSERT_EQ(r.depth, open.size());
+            open.push_back(&r);
+        }
+        else {
+            ASSERT_FALSE(open.empty());
+            ASSERT_EQ(open.back()->name, r.name);
+            ASSERT_EQ(r.depth, open.size() - 1);
+            open.pop_back();
+        }
+    }
+    ASSERT_TRUE(open.empty());
+
+    const trace_record* api = find_end(records, "api.myself");
+    ASSERT_NE(api, nullptr);
+    ASSERT_EQ(api->depth, 0);
+    ASSERT_EQ(api->status, PEP_STATUS_OK);
+
+    api = find_end(records, "api.encrypt_message");
+    ASSERT_NE(api, nullptr);
+    ASSERT_EQ(api->depth, 0);
+    ASSERT_EQ(api->count, 1);
+    ASSERT_GT(api->size, 0);
+
+    const trace_record* mime = find_end(records, "mime.encode");
+    ASSERT_NE(mime, nullptr);
+    ASSERT_GT(mime->depth, 0);
+    const trace_record* crypto = find_end(records, "crypto.encrypt_and_sign");
+    ASSERT_NE(crypto, nullptr);
+    ASSERT_GT(crypto->depth, 0);
+    ASSERT_GE(crypto->count, 2);
+    ASSERT_LE(crypto->duration_us, api->duration_us);
+    ASSERT_NE(find_end(records, "sql.transaction"), nullptr);
+
+    for (const trace_record& r : records)
+        if (! r.begin)
+            output_stream << std::string(r.depth * 2, ' ') << r.name << " "
+                          << r.duration_us << " us\n";
+
+    free_message(msg);
+    free_message(enc_msg);
+    free_identity(alice);
+    free_identity(bob);
+}
+
+TEST_F(TraceTest, check_rollback) {
+    std::vector<trace_record> records;
+    PEP_STATUS status = config_trace(session, NULL, record_end, &records);
+    ASSERT_OK;
+
+    status = pEp_begin_batch(session);
+    ASSERT_OK;
+    int32_t value = 0;
+    status = sequence_value(session, "trace", &value);
+    ASSERT_OK;
+    status = pEp_end_batch(session, false);
+    ASSERT_OK;
+
+    const trace_record* transaction = find_end(records, "sql.transaction");
+    ASSERT_NE(transaction, nullptr);
+    ASSERT_TRUE(transaction->rolled_back);
+    ASSERT_EQ(transaction->status, PEP_STATUS_OK);
+
+    records.clear();
+    status = sequence_value(session, "trace", &value);
+    ASSERT_OK;
+    transaction = find_end(records, "sql.transaction");
+    ASSERT_NE(transaction, nullptr);
+    ASSERT_FALSE(transaction->rolled_back);
+
+    status = config_trace(session, NULL, NULL, NULL);
+    ASSERT_OK;
+}
+
+TEST_F(TraceTest, check_disabled) {
+    std::vector<trace_record> records;
+    PEP_STATUS status = config_trace(session, NULL, record_end, &records);
+    ASSERT_OK;
+    status = config_trace(session, NULL, NULL, &records);
+    ASSERT_OK;
+
+    int32_t value = 0;
+    status = sequence_value(session, "trace", &value);
+    ASSERT_OK;
+    ASSERT_TRUE(records.empty());
+}
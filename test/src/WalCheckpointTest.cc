@@ -0,0 +1,199 @@
+// This file is under GNU General Public License 3.0
+// see LICENSE.txt
+
+#include "TestConstants.h"
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include "pEpEngine.h"
+#include "pEp_internal.h"
+#include "message_api.h"
+#include "keymanagement_internal.h"
+#include "pEpEngine_internal.h"
+#include "wal_checkpoint.h"
+#include "pEp_metrics.h"
+
+#include "TestUtilities.h"
+
+#include "Engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+	//The fixture for WalCheckpointTest
+    class WalCheckpointTest : public ::testing::Test {
+        public:
+            Engine* engine;
+            PEP_SESSION session;
+
+        protected:
+            // You can remove any or all of the following functions if its body
+            // is empty.
+            WalCheckpointTest() {
+                // You can do set-up work for each test here.
+                test_suite_name = ::testing::UnitTest::GetInstance()->current_test_info()->GTEST_SUITE_SYM();
+                test_name = ::testing::UnitTest::GetInstance()->current_test_info()->name();
+                test_path = get_main_test_home_dir() + "/" + test_suite_name + "/" + test_name;
+            }
+
+            ~WalCheckpointTest() override {
+                // You can do clean-up work that doesn't throw exceptions here.
+            }
+
+            // If the constructor and destructor are not enough for setting up
+            // and cleaning up each test, you can define the following methods:
+
+            void SetUp() override {
+                // Code here will be called immediately after the constructor (right
+                // before each test).
+
+                // Leave this empty if there are no files to copy to the home directory path
+                std::vector<std::pair<std::string, std::string>> init_files = std::vector<std::pair<std::string, std::string>>();
+
+                // Get a new test Engine.
+                engine = new Engine(test_path);
+                ASSERT_NOTNULL(engine);
+
+                // Ok, let's initialize test directories etc.
+                engine->prep(NULL, NULL, NULL, init_files);
+
+                // Ok, try to start this bugger.
+                engine->start();
+                ASSERT_NOTNULL(engine->session);
+                session = engine->session;
+
+                // Engine is up. Keep on truckin'
+            }
+
+            void TearDown() override {
+                // Code here will be called immediately after each test (right
+                // before the destructor).
+                engine->shut_down();
+                delete engine;
+                engine = NULL;
+                session = NULL;
+            }
+
+        private:
+            const char* test_suite_name;
+            const char* test_name;
+            string test_path;
+            // Objects declared here can be used by all tests in the WalCheckpointTest suite.
+
+    };
+
+}  // namespace
+
+// Write n identities, each in its own transaction, making the log grow.
+static void write_identities(PEP_SESSION session, const char* prefix, int n) {
+    for (int i = 0; i < n; i++) {
+        std::string address = std::string(prefix) + std::to_string(i)
+                              + "@wal-checkpoint.pEp";
+        std::string user_id = std::string(prefix) + "_" + std::to_string(i);
+        pEp_identity* ident = new_identity(address.c_str(), NULL,
+                                           user_id.c_str(),
+                                           "WAL Checkpoint Contact");
+        PEP_STATUS status = set_identity(session, ident);
+        EXPECT_EQ(status, PEP_STATUS_OK);
+        free_identity(ident);
+    }
+}
+
+TEST_F(WalCheckpointTest, check_wal_size_metric) {
+    write_identities(session, "size", 20);
+    PEP_metrics process;
+    PEP_STATUS status = pEp_get_metrics(session, NULL, &process);
+    ASSERT_OK;
+    ASSERT_GT(process.wal_size, 0);
+
+    char* text = NULL;
+    status = pEp_get_metrics_text(session, &text);
+    ASSERT_OK;
+    ASSERT_NOTNULL(strstr(text, "pep_wal_size_bytes{scope=\"process\"}"));
+    ASSERT_NOTNULL(strstr(text, "pep_wal_checkpoints_total{scope=\"process\"}"));
+    free(text);
+}
+
+TEST_F(WalCheckpointTest, check_checkpointer) {
+    PEP_metrics before;
+    PEP_STATUS status = pEp_get_metrics(session, NULL, &before);
+    ASSERT_OK;
+
+    // A small threshold and a short interval, so that the checkpointer runs
+    // soon after writers stop.
+    status = config_wal_checkpointer(session, true, 16 * 1024, 200);
+    ASSERT_OK;
+    write_identities(session, "checkpoint", 200);
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        10 * PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS + 200));
+
+    PEP_metrics after;
+    status = pEp_get_metrics(session, NULL, &after);
+    ASSERT_OK;
+    output_stream << "checkpoints: "
+                  << after.wal_checkpoints - before.wal_checkpoints
+                  << ", incomplete: "
+                  << after.wal_checkpoints_incomplete
+                     - before.wal_checkpoints_incomplete
+                  << ", deferred: "
+                  << after.wal_checkpoints_deferred
+                     - before.wal_checkpoints_deferred
+                  << ", pages: "
+                  << after.wal_checkpointed_pages
+                     - before.wal_checkpointed_pages
+                  << ", time: "
+                  << after.wal_checkpoint_time_us
+                     - before.wal_checkpoint_time_us << " us\n";
+    ASSERT_GT(after.wal_checkpoints, before.wal_checkpoints);
+    ASSERT_GT(after.wal_checkpointed_pages, before.wal_checkpointed_pages);
+    ASSERT_GE(after.wal_checkpoint_max_time_us,
+              before.wal_checkpoint_max_time_us);
+    // The checkpointer belongs to no session.
+    PEP_metrics mine;
+    status = pEp_get_metrics(session, &mine, NULL);
+    ASSERT_OK;
+    ASSERT_EQ(mine.wal_checkpoints, 0);
+
+    // Reconfiguring a running checkpointer, and stopping it.
+    status = config_wal_checkpointer(session, true, 0, 0);
+    ASSERT_OK;
+    status = config_wal_checkpointer(session, false, 0, 0);
+    ASSERT_OK;
+    status = pEp_get_metrics(session, NULL, &before);
+    ASSERT_OK;
+    write_identities(session, "stopped", 20);
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        2 * PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS));
+    status = pEp_get_metrics(session, NULL, &after);
+    ASSERT_OK;
+    ASSERT_EQ(after.wal_checkpoints, before.wal_checkpoints);
+}
+
+TEST_F(WalCheckpointTest, check_other_sessions) {
+    // Commits from a session opened before the checkpointer started are
+    // reported as well.
+    PEP_SESSION other = NULL;
+    PEP_STATUS status = init(&other, NULL, NULL, NULL);
+    ASSERT_OK;
+    PEP_metrics before;
+    status = pEp_get_metrics(session, NULL, &before);
+    ASSERT_OK;
+    status = config_wal_checkpointer(session, true, 16 * 1024, 200);
+    ASSERT_OK;
+    write_identities(other, "other", 200);
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        10 * PEP_WAL_CHECKPOINT_QUIET_TIME_IN_MS + 200));
+    PEP_metrics after;
+    status = pEp_get_metrics(session, NULL, &after);
+    ASSERT_OK;
+    ASSERT_GT(after.wal_checkpoints, before.wal_checkpoints);
+    release(other);
+
+    // The checkpointer is left running: releasing the last session in
+    // TearDown stops it.
+}